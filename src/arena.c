@@ -0,0 +1,135 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+/* First block, later ones are twice as large up to ARENA_BLOCK_MAX */
+#define ARENA_BLOCK_MIN 4096
+#define ARENA_BLOCK_MAX (256 * 1024)
+/* Larger blocks aren't kept over arena_reset */
+#define ARENA_KEEP_MAX ARENA_BLOCK_MAX
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  /* Offset of the latest allocation, for arena_realloc */
+  size_t last;
+  uintptr_t data[];
+} arena_block_t;
+
+#define ALIGN(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_block_t *new_block(arena_t *arena, size_t size)
+{
+  arena_block_t *block;
+  size_t block_size = arena->blocks ? arena->blocks->size * 2
+                                    : ARENA_BLOCK_MIN;
+
+  if (block_size > ARENA_BLOCK_MAX) {
+    block_size = ARENA_BLOCK_MAX;
+  }
+  if (block_size < size) {
+    block_size = size;
+  }
+
+  block = malloc(sizeof(arena_block_t) + block_size);
+  block->size = block_size;
+  block->used = block->last = 0;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  return block;
+}
+
+void arena_init(arena_t *arena)
+{
+  arena->blocks = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+  arena_block_t *block = arena->blocks;
+
+  size = ALIGN(size ? size : 1);
+  if (!block || block->size - block->used < size) {
+    block = new_block(arena, size);
+  }
+
+  block->last = block->used;
+  block->used += size;
+  return (char *)block->data + block->last;
+}
+
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size,
+                    size_t new_size)
+{
+  arena_block_t *block = arena->blocks;
+  void *result;
+
+  if (!ptr) {
+    return arena_alloc(arena, new_size);
+  }
+
+  if (block && (char *)block->data + block->last == ptr
+   && block->size - block->last >= ALIGN(new_size)) {
+    block->used = block->last + ALIGN(new_size);
+    return ptr;
+  }
+
+  result = arena_alloc(arena, new_size);
+  memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+  return result;
+}
+
+void arena_reset(arena_t *arena)
+{
+  arena_block_t *block, *next;
+  arena_block_t *keep = arena->blocks;
+
+  if (keep && keep->size > ARENA_KEEP_MAX) {
+    keep = NULL;
+  }
+
+  for (block = arena->blocks; block; block = next) {
+    next = block->next;
+    if (block != keep) {
+      free(block);
+    }
+  }
+
+  arena->blocks = keep;
+  if (keep) {
+    keep->next = NULL;
+    keep->used = keep->last = 0;
+  }
+}
+
+void arena_free(arena_t *arena)
+{
+  arena_block_t *block, *next;
+
+  for (block = arena->blocks; block; block = next) {
+    next = block->next;
+    free(block);
+  }
+  arena->blocks = NULL;
+}
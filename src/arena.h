@@ -0,0 +1,53 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_ARENA_H
+#define MUSICD_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Bump allocator for memory that lives as long as one request. Allocations
+ * are never freed one by one, everything is released at once with
+ * arena_reset, which keeps a block around for the next request.
+ */
+typedef struct arena {
+  struct arena_block *blocks;
+} arena_t;
+
+void arena_init(arena_t *arena);
+
+/**
+ * @returns @p size bytes aligned for any type
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * Grows @p ptr of @p old_size bytes to @p new_size, in place if it was the
+ * latest allocation.
+ */
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size,
+                    size_t new_size);
+
+/**
+ * Makes all allocations invalid and the memory available again.
+ */
+void arena_reset(arena_t *arena);
+
+void arena_free(arena_t *arena);
+
+#endif
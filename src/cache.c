@@ -19,23 +19,310 @@
 
 #include "config.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#define MEMORY_SHARDS 16
+#define MEMORY_BUCKETS 256 /* Per shard */
+#define TOUCH_INTERVAL 3600 /* Seconds between marking an entry as used */
 
+/**
+ * Part of the in-memory cache with its own lock, so that network threads
+ * reading different entries don't contend.
+ */
+struct memory_shard {
+  pthread_mutex_t mutex;
+  cache_blob_t *buckets[MEMORY_BUCKETS];
+  /** Least recently used first */
+  cache_blob_t *first, *last;
+  size_t size;
+};
+
+static struct memory_shard shards[MEMORY_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+/** Total size of cache-dir, -1 until the evictor has walked it */
+static int64_t total_size = -1;
+static pthread_mutex_t evict_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t evict_cond = PTHREAD_COND_INITIALIZER;
+static bool evict_pending;
+
+/**
+ * Entries are spread over 256 subdirectories by the hash of their name, next
+ * to the directory part of the name, so that no directory grows huge.
+ */
 static char *build_path(const char *name)
 {
   const char *directory = config_to_path("cache-dir");
-  return stringf("%s/%s", directory, name);
+  const char *base = strrchr(name, '/');
+
+  base = base ? base + 1 : name;
+  return stringf("%s/%.*s%02x/%s", directory, (int)(base - name), name,
+                 strhash(name) & 0xff, base);
+}
+
+static void shards_init()
+{
+  int i;
+  for (i = 0; i < MEMORY_SHARDS; ++i) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+}
+
+static struct memory_shard *shard_of(const char *name, cache_blob_t ***bucket)
+{
+  unsigned hash = strhash(name);
+  struct memory_shard *shard;
+
+  pthread_once(&shards_once, shards_init);
+  shard = &shards[hash % MEMORY_SHARDS];
+  *bucket = &shard->buckets[(hash / MEMORY_SHARDS) % MEMORY_BUCKETS];
+  return shard;
+}
+
+/** @returns bytes each shard may hold */
+static size_t shard_limit()
+{
+  return ((size_t)config_to_int("cache-memory-size") << 20) / MEMORY_SHARDS;
+}
+
+void cache_blob_put(cache_blob_t *blob)
+{
+  if (__sync_sub_and_fetch(&blob->refs, 1) > 0) {
+    return;
+  }
+  munmap((void *)blob->data, blob->size);
+  free(blob->name);
+  free(blob);
+}
+
+static void shard_unlink(struct memory_shard *shard, cache_blob_t **bucket,
+                         cache_blob_t *blob)
+{
+  cache_blob_t **p;
+
+  for (p = bucket; *p != blob; p = &(*p)->hash_next) { }
+  *p = blob->hash_next;
+
+  if (blob->prev) {
+    blob->prev->next = blob->next;
+  } else {
+    shard->first = blob->next;
+  }
+  if (blob->next) {
+    blob->next->prev = blob->prev;
+  } else {
+    shard->last = blob->prev;
+  }
+
+  shard->size -= blob->size;
+  metrics_gauge_add(METRICS_CACHE_MEMORY_BYTES, -(int64_t)blob->size);
+  cache_blob_put(blob);
+}
+
+static void shard_append(struct memory_shard *shard, cache_blob_t *blob)
+{
+  blob->next = NULL;
+  blob->prev = shard->last;
+  if (shard->last) {
+    shard->last->next = blob;
+  } else {
+    shard->first = blob;
+  }
+  shard->last = blob;
+}
+
+/** @returns entry @p name in @p bucket, called with the shard locked */
+static cache_blob_t *bucket_find(cache_blob_t **bucket, const char *name)
+{
+  cache_blob_t *blob;
+  for (blob = *bucket; blob && strcmp(blob->name, name);
+       blob = blob->hash_next) { }
+  return blob;
+}
+
+/**
+ * Drops @p name from memory, it has changed on disk.
+ */
+static void memory_remove(const char *name)
+{
+  cache_blob_t **bucket, *blob;
+  struct memory_shard *shard = shard_of(name, &bucket);
+
+  pthread_mutex_lock(&shard->mutex);
+  blob = bucket_find(bucket, name);
+  if (blob) {
+    shard_unlink(shard, bucket, blob);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * Maps file @p name to memory, which stays valid even if the entry is
+ * replaced or evicted since files are only ever renamed over or unlinked.
+ * @returns the mapping, or NULL if the file is not at most @p limit bytes
+ */
+static char *map_file(const char *name, size_t limit, size_t *size)
+{
+  int64_t file_size;
+  void *data;
+  int fd;
+
+  fd = cache_open_file(name, &file_size);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (file_size <= 0 || (size_t)file_size > limit) {
+    close(fd);
+    return NULL;
+  }
+
+  data = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    musicd_perror(LOG_WARNING, "cache", "could not map %s", name);
+    return NULL;
+  }
+  *size = file_size;
+  return data;
+}
+
+cache_blob_t *cache_blob_get(const char *name)
+{
+  cache_blob_t **bucket, *blob, *old;
+  struct memory_shard *shard;
+  size_t limit = shard_limit(), size;
+  char *data;
+
+  if (limit == 0) {
+    return NULL;
+  }
+
+  shard = shard_of(name, &bucket);
+  pthread_mutex_lock(&shard->mutex);
+  blob = bucket_find(bucket, name);
+  if (blob) {
+    /* Most recently used */
+    if (blob != shard->last) {
+      if (blob->prev) {
+        blob->prev->next = blob->next;
+      } else {
+        shard->first = blob->next;
+      }
+      blob->next->prev = blob->prev;
+      shard_append(shard, blob);
+    }
+    __sync_add_and_fetch(&blob->refs, 1);
+    pthread_mutex_unlock(&shard->mutex);
+    metrics_count(METRICS_CACHE_MEMORY_HITS, 1);
+    return blob;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  metrics_count(METRICS_CACHE_MEMORY_MISSES, 1);
+
+  /* Large entries would just push out many small ones */
+  data = map_file(name, limit / 4, &size);
+  if (!data) {
+    return NULL;
+  }
+
+  blob = malloc(sizeof(cache_blob_t));
+  blob->data = data;
+  blob->size = size;
+  blob->name = strcopy(name);
+  /* One for the cache, one for the caller */
+  blob->refs = 2;
+
+  pthread_mutex_lock(&shard->mutex);
+  old = bucket_find(bucket, name);
+  if (old) {
+    /* Read concurrently, this one is as recent */
+    shard_unlink(shard, bucket, old);
+  }
+  blob->hash_next = *bucket;
+  *bucket = blob;
+  shard_append(shard, blob);
+  shard->size += size;
+  metrics_gauge_add(METRICS_CACHE_MEMORY_BYTES, size);
+
+  while (shard->size > limit) {
+    old = shard->first;
+    shard_of(old->name, &bucket);
+    shard_unlink(shard, bucket, old);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return blob;
+}
+
+static int64_t trim(const char *path, int64_t limit);
+
+/**
+ * Keeps cache-dir under cache-size: walks it once to learn its size, and
+ * again every time writes have grown it over the limit.
+ */
+static void *evict_thread_func(void *data)
+{
+  const char *directory = config_to_path("cache-dir");
+  int64_t limit = (int64_t)config_to_int("cache-size") << 20, size;
+  bool over = false;
+
+  (void)data;
+
+  while (1) {
+    /* Evict some more than needed so that this doesn't run on every write */
+    size = trim(directory, over ? limit - limit / 10 : limit);
+    musicd_log(LOG_DEBUG, "cache", "cache size %" PRId64 " bytes", size);
+
+    pthread_mutex_lock(&evict_mutex);
+    __sync_lock_test_and_set(&total_size, size);
+    evict_pending = false;
+    while (!evict_pending) {
+      pthread_cond_wait(&evict_cond, &evict_mutex);
+    }
+    pthread_mutex_unlock(&evict_mutex);
+    over = true;
+  }
+  return NULL;
+}
+
+/** Accounts @p size bytes more in cache-dir, waking the evictor if needed */
+static void grow(int64_t size)
+{
+  int64_t limit = (int64_t)config_to_int("cache-size") << 20, total;
+
+  if (limit <= 0 || total_size < 0) {
+    return;
+  }
+  total = __sync_add_and_fetch(&total_size, size);
+  if (total > limit) {
+    pthread_mutex_lock(&evict_mutex);
+    if (!evict_pending) {
+      evict_pending = true;
+      pthread_cond_signal(&evict_cond);
+    }
+    pthread_mutex_unlock(&evict_mutex);
+  }
 }
 
 int cache_open()
 {
   const char *directory = config_to_path("cache-dir");
   struct stat status;
+  pthread_t thread;
+
   if (stat(directory, &status)) {            
     if (mkdir(directory, 0777)) {
       musicd_perror(LOG_ERROR, "cache", "could not create directory %s",
@@ -43,6 +330,14 @@ int cache_open()
       return -1;
     }
   }
+
+  if (config_to_int("cache-size") > 0) {
+    if (pthread_create(&thread, NULL, evict_thread_func, NULL)) {
+      musicd_perror(LOG_ERROR, "cache", "could not create evict thread");
+      return -1;
+    }
+    pthread_detach(thread);
+  }
   return 0;
 }
 
@@ -50,14 +345,30 @@ bool cache_exists(const char* name)
 {
   char *path;
   struct stat status;
+  cache_blob_t **bucket;
+  struct memory_shard *shard;
+  bool found;
+
+  if (shard_limit() > 0) {
+    shard = shard_of(name, &bucket);
+    pthread_mutex_lock(&shard->mutex);
+    found = bucket_find(bucket, name) != NULL;
+    pthread_mutex_unlock(&shard->mutex);
+    if (found) {
+      metrics_count(METRICS_CACHE_HITS, 1);
+      return true;
+    }
+  }
 
   path = build_path(name);
   
   if (stat(path, &status)) {
     free(path);
+    metrics_count(METRICS_CACHE_MISSES, 1);
     return false;
   }
   free(path);
+  metrics_count(METRICS_CACHE_HITS, 1);
   return true;
 }
 
@@ -94,23 +405,226 @@ char *cache_get(const char *name, int *size)
   return data;
 }
 
-void cache_set(const char *name, const char *data, int size)
+int cache_open_file(const char *name, int64_t *size)
 {
   char *path;
-  FILE *file;
-  
+  struct stat status;
+  int fd;
+
   path = build_path(name);
-  
-  file = fopen(path, "wb");
+  fd = open(path, O_RDONLY);
   free(path);
-  if (!file) {
-    /* What? */
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &status) || !S_ISREG(status.st_mode)) {
+    close(fd);
+    return -1;
+  }
+
+  /* Eviction goes by modification time, keep used entries fresh */
+  if (status.st_mtime < time(NULL) - TOUCH_INTERVAL) {
+    futimens(fd, NULL);
+  }
+
+  *size = status.st_size;
+  return fd;
+}
+
+void cache_set(const char *name, const char *data, int size)
+{
+  char *tmp;
+  int fd;
+  ssize_t n;
+  bool ok = true;
+
+  /* Written aside and renamed, so that readers never see a partial entry */
+  fd = cache_begin_file(name, &tmp);
+  if (fd < 0) {
     return;
   }
-  
-  fwrite(data, 1, size, file);
-  
-  fclose(file);
+
+  while (size > 0) {
+    n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      musicd_perror(LOG_ERROR, "cache", "could not write %s", tmp);
+      ok = false;
+      break;
+    }
+    data += n;
+    size -= n;
+  }
+
+  cache_end_file(name, fd, tmp, ok);
+}
+
+void cache_touch(const char *name)
+{
+  char *path = build_path(name);
+  utimensat(AT_FDCWD, path, NULL, 0);
+  free(path);
+}
+
+int cache_begin_file(const char *name, char **tmp)
+{
+  char *path, *slash;
+  size_t root = strlen(config_to_path("cache-dir"));
+  int fd;
+
+  /* Hidden until renamed in place, so that cache_trim skips it */
+  slash = build_path(name);
+  path = strrchr(slash, '/');
+  path = stringf("%.*s/.%s.XXXXXX", (int)(path - slash), slash, path + 1);
+  free(slash);
+
+  /* Create the directories of the name and the hash */
+  for (slash = strchr(path + root + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(path, 0777) && errno != EEXIST) {
+      musicd_perror(LOG_ERROR, "cache", "could not create directory %s",
+                    path);
+      free(path);
+      return -1;
+    }
+    *slash = '/';
+  }
+
+  fd = mkstemp(path);
+  if (fd < 0) {
+    musicd_perror(LOG_ERROR, "cache", "could not create %s", path);
+    free(path);
+    return -1;
+  }
+
+  *tmp = path;
+  return fd;
+}
+
+void cache_end_file(const char *name, int fd, char *tmp, bool commit)
+{
+  char *path;
+  struct stat status;
+
+  if (commit && !fstat(fd, &status)) {
+    grow(status.st_size);
+  }
+  close(fd);
+
+  if (commit) {
+    path = build_path(name);
+    if (rename(tmp, path)) {
+      musicd_perror(LOG_ERROR, "cache", "could not rename %s", tmp);
+      unlink(tmp);
+    }
+    free(path);
+    memory_remove(name);
+  } else {
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+struct cache_entry {
+  char *path;
+  time_t mtime;
+  int64_t size;
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+  const struct cache_entry *x = a, *y = b;
+  return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
 }
 
+/** Entries found by list_entries */
+struct entry_list {
+  struct cache_entry *entries;
+  size_t nb_entries, max_entries;
+  int64_t total;
+};
+
+/**
+ * Lists entries under @p path and its subdirectories to @p list. Hidden
+ * files are temporary files still being written.
+ */
+static void list_entries(const char *path, struct entry_list *list)
+{
+  DIR *dir;
+  struct dirent *ent;
+  struct stat status;
+  char *entry;
 
+  dir = opendir(path);
+  if (!dir) {
+    return;
+  }
+
+  while ((ent = readdir(dir))) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    entry = stringf("%s/%s", path, ent->d_name);
+    if (stat(entry, &status)) {
+      free(entry);
+      continue;
+    }
+    if (S_ISDIR(status.st_mode)) {
+      list_entries(entry, list);
+      free(entry);
+      continue;
+    }
+
+    if (list->nb_entries == list->max_entries) {
+      list->max_entries = list->max_entries ? list->max_entries * 2 : 64;
+      list->entries = realloc(list->entries,
+                              list->max_entries * sizeof(struct cache_entry));
+    }
+    list->entries[list->nb_entries].path = entry;
+    list->entries[list->nb_entries].mtime = status.st_mtime;
+    list->entries[list->nb_entries].size = status.st_size;
+    list->total += status.st_size;
+    ++list->nb_entries;
+  }
+  closedir(dir);
+}
+
+/**
+ * Removes least recently used entries under @p path until their total size
+ * is at most @p limit bytes.
+ * @returns the remaining size
+ */
+static int64_t trim(const char *path, int64_t limit)
+{
+  struct entry_list list = { NULL, 0, 0, 0 };
+  size_t i;
+
+  list_entries(path, &list);
+
+  if (list.total > limit) {
+    qsort(list.entries, list.nb_entries, sizeof(struct cache_entry),
+          entry_cmp);
+  }
+
+  for (i = 0; i < list.nb_entries; ++i) {
+    if (list.total > limit) {
+      musicd_log(LOG_DEBUG, "cache", "evicting %s", list.entries[i].path);
+      unlink(list.entries[i].path);
+      list.total -= list.entries[i].size;
+    }
+    free(list.entries[i].path);
+  }
+  free(list.entries);
+  return list.total;
+}
+
+void cache_trim(const char *directory, int64_t limit)
+{
+  char *path = stringf("%s/%s", config_to_path("cache-dir"), directory);
+  trim(path, limit);
+  free(path);
+}
@@ -19,9 +19,18 @@
 #define MUSICD_CACHE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Files in cache-dir, named by relative paths like "streams/123-1-0-0". Each
+ * is stored in a subdirectory by the hash of its name, written aside and
+ * renamed in place, and evicted least recently used first once cache-dir
+ * grows over cache-size.
+ */
 
 /**
- * Ensures cache-dir exists.
+ * Ensures cache-dir exists, and starts evicting if cache-size is set.
  */
 int cache_open();
 
@@ -32,7 +41,60 @@ bool cache_exists(const char *name);
  */
 char *cache_get(const char *name, int *size);
 
+/**
+ * Opens @p name from cache for reading.
+ * @returns file descriptor and stores its size to @p size, or -1 if it
+ * doesn't exist
+ */
+int cache_open_file(const char *name, int64_t *size);
+
 void cache_set(const char *name, const char *data, int size);
 
+/**
+ * Cache entry held in memory, shared by everyone reading it. The data stays
+ * valid until the reference is released, even if the entry is replaced.
+ */
+typedef struct cache_blob {
+  const char *data;
+  size_t size;
+
+  /* Private */
+  char *name;
+  int refs;
+  struct cache_blob *prev, *next, *hash_next;
+} cache_blob_t;
+
+/**
+ * @returns reference to @p name in memory, read from disk if it isn't there
+ * yet, or NULL if it doesn't exist or is too large to keep in memory.
+ * Release with cache_blob_put.
+ */
+cache_blob_t *cache_blob_get(const char *name);
+void cache_blob_put(cache_blob_t *blob);
+
+/**
+ * Marks @p name as recently used for cache_trim.
+ */
+void cache_touch(const char *name);
+
+/**
+ * Creates a temporary file for writing @p name incrementally. The directory
+ * part of @p name is created if needed.
+ * @returns file descriptor and stores the temporary path to @p tmp, or -1
+ */
+int cache_begin_file(const char *name, char **tmp);
+
+/**
+ * Closes @p fd opened with cache_begin_file and either moves @p tmp in place
+ * as @p name if @p commit is true, or removes it. Frees @p tmp.
+ */
+void cache_end_file(const char *name, int fd, char *tmp, bool commit);
+
+/**
+ * Removes least recently used files from cache subdirectory @p directory and
+ * below until their total size is at most @p limit bytes.
+ */
+void cache_trim(const char *directory, int64_t limit);
+
 
 #endif
@@ -0,0 +1,533 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "catalog.h"
+
+#include "config.h"
+#include "db.h"
+#include "library.h"
+#include "log.h"
+#include "metrics.h"
+#include "strings.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+/** Orders presorted for each catalog, the ones clients browse with */
+struct order_spec {
+  catalog_table_t table;
+  int nb_fields;
+  query_field_t fields[4];
+  bool descending[4];
+};
+
+static const struct order_spec order_specs[] = {
+  { CATALOG_TRACKS, 3,
+    { QUERY_FIELD_ALBUM, QUERY_FIELD_TRACK, QUERY_FIELD_TITLE },
+    { false, false, false } },
+  { CATALOG_TRACKS, 4,
+    { QUERY_FIELD_ARTIST, QUERY_FIELD_ALBUM, QUERY_FIELD_TRACK,
+      QUERY_FIELD_TITLE },
+    { false, false, false, false } },
+  { CATALOG_TRACKS, 1, { QUERY_FIELD_TITLE }, { false } },
+  { CATALOG_ARTISTS, 1, { QUERY_FIELD_ARTIST }, { false } },
+  { CATALOG_ALBUMS, 1, { QUERY_FIELD_ALBUM }, { false } },
+};
+
+#define NB_ORDERS (sizeof(order_specs) / sizeof(struct order_spec))
+
+/** Columns loaded into a table, following the row id selected first */
+struct column_spec {
+  query_field_t field;
+  int type;
+};
+
+struct table_spec {
+  const char *sql;
+  query_field_t id_field;
+  int nb_columns;
+  struct column_spec columns[7];
+  bool images; /**< Image id is selected after the columns */
+};
+
+static const struct table_spec table_specs[CATALOG_TABLES] = {
+  { "SELECT rowid, title, artistid, artist, albumid, album, track, duration FROM tracks ORDER BY rowid",
+    QUERY_FIELD_TRACKID, 7,
+    { { QUERY_FIELD_TITLE, SQLITE_TEXT },
+      { QUERY_FIELD_ARTISTID, SQLITE_INTEGER },
+      { QUERY_FIELD_ARTIST, SQLITE_TEXT },
+      { QUERY_FIELD_ALBUMID, SQLITE_INTEGER },
+      { QUERY_FIELD_ALBUM, SQLITE_TEXT },
+      { QUERY_FIELD_TRACK, SQLITE_INTEGER },
+      { QUERY_FIELD_DURATION, SQLITE_FLOAT } },
+    false },
+  { "SELECT rowid, name FROM artists ORDER BY rowid",
+    QUERY_FIELD_ARTISTID, 1,
+    { { QUERY_FIELD_ARTIST, SQLITE_TEXT } },
+    false },
+  { "SELECT rowid, name, tracks, imageid FROM albums ORDER BY rowid",
+    QUERY_FIELD_ALBUMID, 2,
+    { { QUERY_FIELD_ALBUM, SQLITE_TEXT },
+      { QUERY_FIELD_TRACKS, SQLITE_INTEGER } },
+    true },
+};
+
+#define CHUNK_SIZE (64 * 1024)
+
+/** Storage of interned strings */
+struct chunk {
+  struct chunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+struct catalog {
+  int refs;
+
+  catalog_columns_t tables[CATALOG_TABLES];
+  uint32_t *orders[NB_ORDERS];
+
+  struct chunk *chunks;
+};
+
+/** Strings seen while building, for storing each only once */
+struct intern {
+  const char **slots;
+  size_t size; /**< Power of two */
+  size_t used;
+};
+
+static pthread_mutex_t catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static catalog_t *current = NULL;
+
+/** Only one catalog is built and swapped in at a time, which also guards the
+ * sort state */
+static pthread_mutex_t update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const catalog_columns_t *sort_columns;
+static const struct order_spec *sort_spec;
+
+
+static int nocase_compare(const char *a, const char *b)
+{
+  unsigned char ca, cb;
+  for (;; ++a, ++b) {
+    ca = (unsigned char)*a;
+    cb = (unsigned char)*b;
+    /* Like SQLite NOCASE, only ASCII is folded */
+    if (ca >= 'A' && ca <= 'Z') {
+      ca += 'a' - 'A';
+    }
+    if (cb >= 'A' && cb <= 'Z') {
+      cb += 'a' - 'A';
+    }
+    if (ca != cb || ca == '\0') {
+      return ca - cb;
+    }
+  }
+}
+
+int catalog_value_compare(const catalog_value_t *a, const catalog_value_t *b)
+{
+  double ra, rb;
+  /* SQLITE_INTEGER and SQLITE_FLOAT sort together, then SQLITE_TEXT */
+  int class_a = a->type == SQLITE_NULL ? 0 : a->type == SQLITE_TEXT ? 2 : 1,
+      class_b = b->type == SQLITE_NULL ? 0 : b->type == SQLITE_TEXT ? 2 : 1;
+
+  if (class_a != class_b) {
+    return class_a - class_b;
+  }
+  if (class_a == 0) {
+    return 0;
+  }
+  if (class_a == 2) {
+    return nocase_compare(a->text, b->text);
+  }
+  if (a->type == SQLITE_INTEGER && b->type == SQLITE_INTEGER) {
+    return a->integer < b->integer ? -1 : a->integer > b->integer;
+  }
+  ra = a->type == SQLITE_INTEGER ? (double)a->integer : a->real;
+  rb = b->type == SQLITE_INTEGER ? (double)b->integer : b->real;
+  return ra < rb ? -1 : ra > rb;
+}
+
+void catalog_value(const catalog_columns_t *columns, query_field_t field,
+                   uint32_t row, catalog_value_t *value)
+{
+  memset(value, 0, sizeof(catalog_value_t));
+  if (field == QUERY_FIELD_NONE) {
+    value->type = SQLITE_INTEGER;
+    value->integer = columns->ids[row];
+  } else if (columns->text[field]) {
+    value->text = columns->text[field][row];
+    value->type = value->text ? SQLITE_TEXT : SQLITE_NULL;
+  } else if (columns->nulls[field]
+          && columns->nulls[field][row / 8] & (1 << row % 8)) {
+    value->type = SQLITE_NULL;
+  } else if (columns->integer[field]) {
+    value->type = SQLITE_INTEGER;
+    value->integer = columns->integer[field][row];
+  } else if (columns->real[field]) {
+    value->type = SQLITE_FLOAT;
+    value->real = columns->real[field][row];
+  } else {
+    value->type = SQLITE_NULL;
+  }
+}
+
+static const char *intern(catalog_t *catalog, struct intern *table,
+                          const char *string)
+{
+  const char **slots;
+  size_t i, j, len, size;
+  struct chunk *chunk;
+  char *copy;
+
+  if (table->used * 2 >= table->size) {
+    /* Grow and rehash */
+    size = table->size ? table->size * 2 : 4096;
+    slots = calloc(size, sizeof(const char *));
+    for (i = 0; i < table->size; ++i) {
+      if (!table->slots[i]) {
+        continue;
+      }
+      for (j = strhash(table->slots[i]) & (size - 1); slots[j];
+           j = (j + 1) & (size - 1)) { }
+      slots[j] = table->slots[i];
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->size = size;
+  }
+
+  for (i = strhash(string) & (table->size - 1); table->slots[i];
+       i = (i + 1) & (table->size - 1)) {
+    if (!strcmp(table->slots[i], string)) {
+      return table->slots[i];
+    }
+  }
+
+  len = strlen(string) + 1;
+  chunk = catalog->chunks;
+  if (!chunk || chunk->used + len > chunk->size) {
+    size = len > CHUNK_SIZE ? len : CHUNK_SIZE;
+    chunk = malloc(sizeof(struct chunk) + size);
+    chunk->used = 0;
+    chunk->size = size;
+    chunk->next = catalog->chunks;
+    catalog->chunks = chunk;
+  }
+  copy = chunk->data + chunk->used;
+  memcpy(copy, string, len);
+  chunk->used += len;
+
+  table->slots[i] = copy;
+  ++table->used;
+  return copy;
+}
+
+static void columns_free(catalog_columns_t *columns)
+{
+  int i;
+  for (i = 0; i < QUERY_FIELD_ALL; ++i) {
+    free(columns->text[i]);
+    if (columns->integer[i] != columns->ids) {
+      free(columns->integer[i]);
+    }
+    free(columns->real[i]);
+    free(columns->nulls[i]);
+  }
+  free(columns->ids);
+  free(columns->images);
+}
+
+/* Resizes every column of @p table to hold @p size rows. */
+static void columns_resize(catalog_columns_t *columns,
+                           const struct table_spec *spec, uint32_t size)
+{
+  const struct column_spec *column;
+  int i;
+
+  columns->ids = realloc(columns->ids, sizeof(int64_t) * size);
+  for (i = 0; i < spec->nb_columns; ++i) {
+    column = &spec->columns[i];
+    if (column->type == SQLITE_TEXT) {
+      columns->text[column->field] =
+        realloc(columns->text[column->field], sizeof(const char *) * size);
+      continue;
+    }
+
+    if (column->type == SQLITE_INTEGER) {
+      columns->integer[column->field] =
+        realloc(columns->integer[column->field], sizeof(int64_t) * size);
+    } else {
+      columns->real[column->field] =
+        realloc(columns->real[column->field], sizeof(double) * size);
+    }
+    columns->nulls[column->field] =
+      realloc(columns->nulls[column->field], (size + 7) / 8);
+  }
+  if (spec->images) {
+    columns->images = realloc(columns->images, sizeof(int64_t) * size);
+  }
+}
+
+static int load_table(catalog_t *catalog, struct intern *strings,
+                      catalog_table_t table)
+{
+  const struct table_spec *spec = &table_specs[table];
+  catalog_columns_t *columns = &catalog->tables[table];
+  const struct column_spec *column;
+  uint32_t capacity = 0, row;
+  sqlite3_stmt *stmt;
+  const char *text;
+  uint8_t *nulls;
+  int result, i;
+
+  if (sqlite3_prepare_v2(db_reader(), spec->sql, -1, &stmt, NULL)
+      != SQLITE_OK) {
+    musicd_log(LOG_ERROR, "catalog", "can't prepare '%s': %s", spec->sql,
+               sqlite3_errmsg(db_reader()));
+    return -1;
+  }
+
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (columns->size == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      columns_resize(columns, spec, capacity);
+    }
+
+    row = columns->size;
+    columns->ids[row] = sqlite3_column_int64(stmt, 0);
+    for (i = 0; i < spec->nb_columns; ++i) {
+      column = &spec->columns[i];
+      if (column->type == SQLITE_TEXT) {
+        text = (const char *)sqlite3_column_text(stmt, i + 1);
+        columns->text[column->field][row] =
+          text ? intern(catalog, strings, text) : NULL;
+        continue;
+      }
+
+      if (column->type == SQLITE_INTEGER) {
+        columns->integer[column->field][row] =
+          sqlite3_column_int64(stmt, i + 1);
+      } else {
+        columns->real[column->field][row] =
+          sqlite3_column_double(stmt, i + 1);
+      }
+      /* NULL sorts and seeks apart from 0, like in SQLite */
+      nulls = columns->nulls[column->field];
+      if (sqlite3_column_type(stmt, i + 1) == SQLITE_NULL) {
+        nulls[row / 8] |= 1 << row % 8;
+      } else {
+        nulls[row / 8] &= ~(1 << row % 8);
+      }
+    }
+    if (spec->images) {
+      columns->images[columns->size] =
+        sqlite3_column_int64(stmt, spec->nb_columns + 1);
+    }
+    ++columns->size;
+  }
+  sqlite3_finalize(stmt);
+
+  if (result != SQLITE_DONE) {
+    musicd_log(LOG_ERROR, "catalog", "sqlite3_step failed: %s",
+               sqlite3_errmsg(db_reader()));
+    return -1;
+  }
+
+  if (capacity == 0) {
+    columns_resize(columns, spec, 1);
+  }
+  columns->integer[spec->id_field] = columns->ids;
+  return 0;
+}
+
+static int compare_rows(const void *a, const void *b)
+{
+  uint32_t row_a = *(const uint32_t *)a, row_b = *(const uint32_t *)b;
+  catalog_value_t value_a, value_b;
+  int i, result;
+
+  for (i = 0; i < sort_spec->nb_fields; ++i) {
+    catalog_value(sort_columns, sort_spec->fields[i], row_a, &value_a);
+    catalog_value(sort_columns, sort_spec->fields[i], row_b, &value_b);
+    result = catalog_value_compare(&value_a, &value_b);
+    if (result) {
+      return sort_spec->descending[i] ? -result : result;
+    }
+  }
+  return sort_columns->ids[row_a] < sort_columns->ids[row_b] ? -1 :
+         sort_columns->ids[row_a] > sort_columns->ids[row_b];
+}
+
+static void catalog_free(catalog_t *catalog)
+{
+  struct chunk *chunk, *next;
+  size_t i;
+
+  for (i = 0; i < CATALOG_TABLES; ++i) {
+    columns_free(&catalog->tables[i]);
+  }
+  for (i = 0; i < NB_ORDERS; ++i) {
+    free(catalog->orders[i]);
+  }
+  for (chunk = catalog->chunks; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  free(catalog);
+}
+
+static catalog_t *catalog_build()
+{
+  catalog_t *catalog = malloc(sizeof(catalog_t));
+  struct intern strings = { NULL, 0, 0 };
+  catalog_columns_t *columns;
+  uint32_t *rows, i;
+  size_t order;
+  int table;
+
+  memset(catalog, 0, sizeof(catalog_t));
+  catalog->refs = 1;
+
+  for (table = 0; table < CATALOG_TABLES; ++table) {
+    if (load_table(catalog, &strings, table)) {
+      free(strings.slots);
+      catalog_free(catalog);
+      return NULL;
+    }
+  }
+  free(strings.slots);
+
+  for (order = 0; order < NB_ORDERS; ++order) {
+    columns = &catalog->tables[order_specs[order].table];
+    rows = malloc(sizeof(uint32_t) * (columns->size + 1));
+    for (i = 0; i < columns->size; ++i) {
+      rows[i] = i;
+    }
+    sort_columns = columns;
+    sort_spec = &order_specs[order];
+    qsort(rows, columns->size, sizeof(uint32_t), compare_rows);
+    catalog->orders[order] = rows;
+  }
+
+  return catalog;
+}
+
+void catalog_update()
+{
+  catalog_t *catalog = NULL, *old;
+  int64_t start = metrics_now();
+
+  /* Held until the swap, so that concurrent updates are installed in the
+   * order they read the database */
+  pthread_mutex_lock(&update_mutex);
+
+  if (config_to_bool("catalog")) {
+    catalog = catalog_build();
+    if (!catalog) {
+      pthread_mutex_unlock(&update_mutex);
+      musicd_log(LOG_ERROR, "catalog", "can't build catalog");
+      return;
+    }
+    musicd_log(LOG_VERBOSE, "catalog",
+               "built catalog of %u tracks in %" PRId64 " ms",
+               catalog->tables[CATALOG_TRACKS].size,
+               (metrics_now() - start) / 1000);
+  }
+
+  pthread_mutex_lock(&catalog_mutex);
+  old = current;
+  current = catalog;
+  pthread_mutex_unlock(&catalog_mutex);
+
+  /* Results counted from the old catalog are stale now */
+  library_changed();
+
+  pthread_mutex_unlock(&update_mutex);
+
+  if (old) {
+    catalog_put(old);
+  }
+}
+
+catalog_t *catalog_get()
+{
+  catalog_t *catalog;
+  pthread_mutex_lock(&catalog_mutex);
+  catalog = current;
+  if (catalog) {
+    ++catalog->refs;
+  }
+  pthread_mutex_unlock(&catalog_mutex);
+  return catalog;
+}
+
+void catalog_put(catalog_t *catalog)
+{
+  bool last;
+  pthread_mutex_lock(&catalog_mutex);
+  last = --catalog->refs == 0;
+  pthread_mutex_unlock(&catalog_mutex);
+  if (last) {
+    catalog_free(catalog);
+  }
+}
+
+const catalog_columns_t *catalog_columns(catalog_t *catalog,
+                                         catalog_table_t table)
+{
+  return &catalog->tables[table];
+}
+
+int catalog_order(catalog_t *catalog, catalog_table_t table,
+                  const query_field_t *fields, const bool *descending,
+                  int nb_fields, const uint32_t **rows)
+{
+  const struct order_spec *spec;
+  size_t order;
+  int i;
+
+  if (nb_fields == 0) {
+    /* Rows are loaded in id order */
+    *rows = NULL;
+    return 0;
+  }
+
+  for (order = 0; order < NB_ORDERS; ++order) {
+    spec = &order_specs[order];
+    if (spec->table != table || spec->nb_fields != nb_fields) {
+      continue;
+    }
+    for (i = 0; i < nb_fields; ++i) {
+      if (spec->fields[i] != fields[i]
+       || spec->descending[i] != descending[i]) {
+        break;
+      }
+    }
+    if (i == nb_fields) {
+      *rows = catalog->orders[order];
+      return 0;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,100 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_CATALOG_H
+#define MUSICD_CATALOG_H
+
+#include "query.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Read-only in-memory copy of the browsable library: tracks, artists and
+ * albums as one array per column with interned strings, plus rows presorted
+ * in the common orders. It is rebuilt after the scanner commits and swapped
+ * in whole, so queries answered from it never touch SQLite.
+ */
+
+typedef struct catalog catalog_t;
+
+typedef enum {
+  CATALOG_TRACKS = 0,
+  CATALOG_ARTISTS,
+  CATALOG_ALBUMS,
+  CATALOG_TABLES,
+} catalog_table_t;
+
+/** Columns of one table, indexed by query field */
+typedef struct {
+  uint32_t size;
+  int64_t *ids;
+  const char **text[QUERY_FIELD_ALL]; /**< NULL if not a text column */
+  int64_t *integer[QUERY_FIELD_ALL]; /**< NULL if not an integer column */
+  double *real[QUERY_FIELD_ALL]; /**< NULL if not a real column */
+  /** Bitmap of NULL values of numeric columns, stored as 0 in the column */
+  uint8_t *nulls[QUERY_FIELD_ALL];
+  int64_t *images; /**< Album images, NULL for other tables */
+} catalog_columns_t;
+
+/** Value of one column in one row, typed like SQLite would return it */
+typedef struct {
+  int type; /**< SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT */
+  int64_t integer;
+  double real;
+  const char *text;
+} catalog_value_t;
+
+/**
+ * Builds a new catalog from the database and swaps it in, if enabled with
+ * config catalog. Called when the library has changed.
+ */
+void catalog_update();
+
+/**
+ * @returns reference to the current catalog or NULL if there is none.
+ * Release with catalog_put().
+ */
+catalog_t *catalog_get();
+void catalog_put(catalog_t *catalog);
+
+const catalog_columns_t *catalog_columns(catalog_t *catalog,
+                                         catalog_table_t table);
+
+/**
+ * Sets @p rows to the rows of @p table ordered by @p fields, each ascending or
+ * descending as told by @p descending, and then by id. Without fields @p rows
+ * is set to NULL, meaning that the rows are in id order as they are.
+ * @returns 0 on success, nonzero if the order has not been presorted
+ */
+int catalog_order(catalog_t *catalog, catalog_table_t table,
+                  const query_field_t *fields, const bool *descending,
+                  int nb_fields, const uint32_t **rows);
+
+/**
+ * Reads value of @p field in @p row, the id if @p field is QUERY_FIELD_NONE.
+ */
+void catalog_value(const catalog_columns_t *columns, query_field_t field,
+                   uint32_t row, catalog_value_t *value);
+
+/**
+ * Compares values the way SQLite orders them with COLLATE NOCASE: NULL
+ * first, then numbers, then text.
+ */
+int catalog_value_compare(const catalog_value_t *a, const catalog_value_t *b);
+
+#endif
@@ -18,6 +18,7 @@
 #include "cache.h"
 #include "client.h"
 #include "config.h"
+#include "event.h"
 #include "image.h"
 #include "library.h"
 #include "log.h"
@@ -33,15 +34,22 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/poll.h>
 
 
+/** Bytes read from the socket at once, directly into inbuf */
+#define READ_SIZE (16 * 1024)
+/** No more is read while this much is unprocessed in inbuf */
+#define INBUF_LIMIT (64 * 1024)
+/** Pipelined requests are not processed while this much is unsent */
+#define PIPELINE_LIMIT (256 * 1024)
+
 static int read_data(client_t *client)
 {
-  char buffer[1025];
+  char *buffer;
   int n;
 
-  n = read(client->fd, buffer, 1024);
+  buffer = string_reserve(client->inbuf, READ_SIZE);
+  n = read(client->fd, buffer, READ_SIZE);
   if (n == 0) {
     musicd_log(LOG_INFO, "client", "%s: exiting", client->address);
     return -1;
@@ -56,7 +64,7 @@ static int read_data(client_t *client)
     return -1;
   }
 
-  string_nappend(client->inbuf, buffer, n);
+  string_commit(client->inbuf, n);
 
   return n;
 }
@@ -64,21 +72,11 @@ static int read_data(client_t *client)
 
 static int write_data(client_t *client)
 {
-  int n;
-  
-  n = write(client->fd, string_string(client->outbuf), string_size(client->outbuf));
-  if (n < 0) {
-    if (errno == EWOULDBLOCK) {
-      /* It would block right now, ignore */
-      return 0;
-    }
-
+  if (outqueue_write(&client->outbuf, client->fd) < 0) {
     musicd_perror(LOG_INFO, "client", "%s: can't write data", client->address);
     return -1;
   }
 
-  string_remove_front(client->outbuf, n);
-
   return 0;
 }
 
@@ -102,28 +100,38 @@ client_t *client_new(int fd)
   memset(result, 0, sizeof(client_t));
 
   result->fd = fd;
+  result->feed_fd = -1;
   result->inbuf = string_new();
-  result->outbuf = string_new();
+  outqueue_init(&result->outbuf);
 
   return result;
 }
 
 void client_close(client_t *client)
 {
+  if (client->state == CLIENT_STATE_WAIT_TASK) {
+    task_abandon(client->wait_task);
+  }
   if (client->protocol) {
     client->protocol->close(client->self);
   }
   close(client->fd);
   free(client->address);
   string_free(client->inbuf);
-  string_free(client->outbuf);
+  outqueue_clear(&client->outbuf);
   free(client);
 }
 
+static bool feed_waiting(client_t *client)
+{
+  return client->state == CLIENT_STATE_FEED && client->feed_fd >= 0
+      && outqueue_size(&client->outbuf) == 0;
+}
+
 int client_poll_fd(client_t *client)
 {
-  if (client->state == CLIENT_STATE_WAIT_TASK) {
-    return task_pollfd(client->wait_task);
+  if (feed_waiting(client)) {
+    return client->feed_fd;
   }
   return client->fd;
 }
@@ -132,35 +140,77 @@ int client_poll_events(client_t *client)
 {
   int events = 0;
 
-  if (client->state == CLIENT_STATE_NORMAL
-   || client->state == CLIENT_STATE_FEED
-   || client->state == CLIENT_STATE_WAIT_TASK) {
-    events |= POLLIN;
+  if (feed_waiting(client)) {
+    return EVENT_IN;
   }
 
-  if (string_size(client->outbuf) > 0
+  /* While waiting for a task, incoming data is left in the socket. So it is
+   * while inbuf is full: requests there wait for the output to drain or the
+   * feed to end, and the level-triggered socket would wake us up in vain. */
+  if ((client->state == CLIENT_STATE_NORMAL
+    || client->state == CLIENT_STATE_FEED)
+   && string_size(client->inbuf) < INBUF_LIMIT) {
+    events |= EVENT_IN;
+  }
+
+  if (outqueue_size(&client->outbuf) > 0
    || client->state == CLIENT_STATE_FEED
    || client->state == CLIENT_STATE_DRAIN) {
-    events |= POLLOUT;
+    events |= EVENT_OUT;
   }
 
   return events;
 }
 
 
+bool client_idle(client_t *client)
+{
+  return client->state == CLIENT_STATE_NORMAL
+      && outqueue_size(&client->outbuf) == 0;
+}
+
 bool client_has_data(client_t *client)
 {
-  if (string_size(client->outbuf) > 0 || client->state == CLIENT_STATE_FEED) {
+  if (outqueue_size(&client->outbuf) > 0 || client->state == CLIENT_STATE_FEED) {
     return true;
   }
   return false;
 }
 
-int client_process(client_t *client)
+/**
+ * Processes requests in the order they arrived. Pipelined requests wait while
+ * an earlier one is waiting for a task or being fed.
+ */
+static int process_requests(client_t *client)
 {
   int result;
 
-  while ((result = read_data(client)) > 0) { }
+  while (client->state == CLIENT_STATE_NORMAL
+      && string_size(client->inbuf) > 0
+      && outqueue_size(&client->outbuf) < PIPELINE_LIMIT) {
+    result = client->protocol->process(client->self,
+                                      string_string(client->inbuf),
+                                      string_size(client->inbuf));
+    if (result < 0) {
+      return result;
+    }
+    if (result == 0) {
+      /* Incomplete request */
+      break;
+    }
+
+    string_remove_front(client->inbuf, result);
+  }
+  return 0;
+}
+
+int client_process(client_t *client)
+{
+  int result = 0;
+
+  /* Leave the rest in the socket if the protocol hasn't consumed enough */
+  while (string_size(client->inbuf) < INBUF_LIMIT
+      && (result = read_data(client)) > 0) { }
   if (result < 0) {
     return result;
   }
@@ -183,11 +233,13 @@ int client_process(client_t *client)
     client->self = client->protocol->open(client);
   }
 
-  if (client->state == CLIENT_STATE_WAIT_TASK) {
-    /* Client was waiting for task to finish and now the task manager signaled
-     * through the pipe. */
+  if (client->state == CLIENT_STATE_WAIT_TASK && client->wait_done) {
+    /* Client was waiting for task to finish and the server collected it from
+     * the completion queue. */
     client->state = CLIENT_STATE_NORMAL;
+    client->wait_done = false;
     task_free(client->wait_task);
+    client->wait_task = NULL;
     if (client->wait_callback(client->self, client->wait_data) < 0) {
       return -1;
     }
@@ -195,7 +247,7 @@ int client_process(client_t *client)
 
   /* (Try to) purge the entire outgoing buffer. */
 
-  if (string_size(client->outbuf) > 0) {
+  if (outqueue_size(&client->outbuf) > 0) {
     /* There is outgoing data in buffer, try to write */
     result = write_data(client);
     if (result < 0) {
@@ -204,33 +256,32 @@ int client_process(client_t *client)
   }
 
   if (client->state == CLIENT_STATE_DRAIN) {
-    if (string_size(client->outbuf) == 0) {
+    if (outqueue_size(&client->outbuf) == 0) {
       /* Client was draining, and now it is done - terminate */
       return -1;
     }
   }
 
-  /* If there was nothing to write but we have unprocessed data, process it. */
-
-  if (string_size(client->inbuf) > 0) {
-    result = client->protocol->process(client->self,
-                                      string_string(client->inbuf),
-                                      string_size(client->inbuf));
-    if (result < 0) {
-      return result;
-    }
+  if (process_requests(client) < 0) {
+    return -1;
+  }
 
-    string_remove_front(client->inbuf, result);
-  } else if (client->state == CLIENT_STATE_FEED
-          && string_size(client->outbuf) == 0) {
+  if (client->state == CLIENT_STATE_FEED
+   && outqueue_size(&client->outbuf) == 0) {
 
-    /* There wasn't anything to process, we can push data to the client and the
-     * outgoing buffer is empty. */
+    /* We can push data to the client and the outgoing buffer is empty. */
 
+    client->feed_fd = -1;
     result = client->protocol->feed(client->self);
     if (result < 0) {
       return result;
     }
+
+    /* Input isn't polled while inbuf is full, so requests waiting behind a
+     * feed that ended without sending more are processed now */
+    if (process_requests(client) < 0) {
+      return -1;
+    }
   }
 
   return 0;
@@ -238,37 +289,52 @@ int client_process(client_t *client)
 
 int client_send(client_t *client, const char *format, ...)
 {
-  int n, size = 128;
+  int n;
+  size_t avail;
   char *buf;
   va_list va_args;
 
-  buf = malloc(size);
-  
-  while (1) {
-    va_start(va_args, format);
-    n = vsnprintf(buf, size, format, va_args);
-    va_end(va_args);
-    
-    if (n > -1 && n < size) {
-      break;
-    }
-    
-    if (n > -1) {
-      size = n + 1;
-    } else {
-      size *= 2;
-    }
-    
-    buf = realloc(buf, size);
+  /* Try formatting straight into the queue first */
+  buf = outqueue_reserve(&client->outbuf, 128, &avail);
+  va_start(va_args, format);
+  n = vsnprintf(buf, avail, format, va_args);
+  va_end(va_args);
+
+  if (n < 0) {
+    return n;
+  }
+
+  if ((size_t)n < avail) {
+    outqueue_commit(&client->outbuf, n);
+    return n;
   }
-  string_append(client->outbuf, buf);
+
+  buf = malloc(n + 1);
+  va_start(va_args, format);
+  vsnprintf(buf, n + 1, format, va_args);
+  va_end(va_args);
+
+  outqueue_append(&client->outbuf, buf, n);
   free(buf);
   return n;
 }
 
 int client_write(client_t *client, const char *data, size_t n)
 {
-  string_nappend(client->outbuf, data, n);
+  outqueue_append(&client->outbuf, data, n);
+  return n;
+}
+
+int client_write_ref(client_t *client, const char *data, size_t n,
+                     outqueue_release_t release, void *opaque)
+{
+  outqueue_append_ref(&client->outbuf, data, n, release, opaque);
+  return n;
+}
+
+int client_write_file(client_t *client, int fd, off_t offset, size_t n)
+{
+  outqueue_append_file(&client->outbuf, fd, offset, n);
   return n;
 }
 
@@ -280,6 +346,12 @@ void client_start_feed(client_t *client)
 void client_stop_feed(client_t *client)
 {
   client->state = CLIENT_STATE_NORMAL;
+  client->feed_fd = -1;
+}
+
+void client_feed_wait(client_t *client, int fd)
+{
+  client->feed_fd = fd;
 }
 
 void client_wait_task(client_t *client, task_t *task,
@@ -288,7 +360,11 @@ void client_wait_task(client_t *client, task_t *task,
   client->wait_task = task;
   client->wait_callback = callback;
   client->wait_data = data;
+  client->wait_done = false;
   client->state = CLIENT_STATE_WAIT_TASK;
+
+  task->owner = client;
+  task_start(task, client->task_notify);
 }
 
 void client_drain(client_t *client)
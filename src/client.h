@@ -19,6 +19,7 @@
 #define MUSICD_CLIENT_H
 
 #include "libav.h"
+#include "outqueue.h"
 #include "protocol.h"
 #include "stream.h"
 #include "strings.h"
@@ -28,6 +29,7 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include <time.h>
 
 /** Client state */
 typedef enum client_state {
@@ -43,13 +45,15 @@ typedef enum client_state {
 
 typedef int (*client_callback_t)(void *self, void *data);
 
+struct reactor;
+
 typedef struct client {
   int fd;
 
   char *address;
 
   string_t *inbuf;
-  string_t *outbuf;
+  outqueue_t outbuf;
 
   protocol_t *protocol;
   void *self;
@@ -59,6 +63,21 @@ typedef struct client {
   task_t *wait_task;
   client_callback_t wait_callback;
   void *wait_data;
+  /** Set by the server once wait_task has been collected from task_notify */
+  bool wait_done;
+
+  /** When feeding, fd to wait for instead of the socket, see client_feed_wait */
+  int feed_fd;
+
+  /* Server private: owning event loop thread and currently registered fd and
+   * events in its event loop */
+  struct reactor *reactor;
+  task_notify_t *task_notify;
+  int poll_fd;
+  int poll_events;
+  bool disconnected;
+  /** Time of last activity, clients list is kept in this order */
+  time_t last_active;
 
   TAILQ_ENTRY(client) clients;
 } client_t;
@@ -73,11 +92,16 @@ void client_close(client_t *client);
  */
 int client_poll_fd(client_t *client);
 /**
- * @returns event types for polling
+ * @returns event types for polling, EVENT_IN and/or EVENT_OUT
  */
 int client_poll_events(client_t *client);
 
 bool client_has_data(client_t *client);
+/**
+ * @returns true if the client is between requests or sending one, and has
+ * nothing pending, so it can be closed when it times out
+ */
+bool client_idle(client_t *client);
 
 int client_process(client_t *client);
 
@@ -86,10 +110,29 @@ int client_process(client_t *client);
 
 int client_send(client_t *client, const char *format, ...);
 int client_write(client_t *client, const char *data, size_t n);
+/**
+ * Queues @p n bytes of @p data without copying, see outqueue_append_ref.
+ */
+int client_write_ref(client_t *client, const char *data, size_t n,
+                     outqueue_release_t release, void *opaque);
+/**
+ * Queues @p n bytes of file @p fd from @p offset, sent with sendfile where
+ * possible. @p fd is closed when done.
+ */
+int client_write_file(client_t *client, int fd, off_t offset, size_t n);
 
 void client_start_feed(client_t *client);
 void client_stop_feed(client_t *client);
+/**
+ * Called from protocol->feed when it has nothing to send yet: feed is called
+ * again once @p fd becomes readable, instead of when the socket is writable.
+ */
+void client_feed_wait(client_t *client, int fd);
 
+/**
+ * Starts @p task and calls @p callback once it has finished. The client does
+ * not process further requests while waiting.
+ */
 void client_wait_task(client_t *client, task_t *task,
                       client_callback_t callback, void *data);
 
@@ -0,0 +1,424 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "codec_pool.h"
+
+#include "config.h"
+#include "log.h"
+#include "task.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum entry_kind {
+  ENTRY_ENCODER = 0,
+  ENTRY_RESAMPLER,
+  ENTRY_FIFO,
+  ENTRY_FRAME,
+  ENTRY_KIND_COUNT
+} entry_kind_t;
+
+typedef struct entry {
+  entry_kind_t kind;
+  /* Encoder and fifo use in, resampler both */
+  codec_params_t in, out;
+  void *ptr;
+  struct entry *next;
+} entry_t;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Idle contexts, most recently released first */
+static entry_t *entries = NULL;
+static int counts[ENTRY_KIND_COUNT];
+
+static void entry_free(entry_t *entry)
+{
+  AVCodecContext *encoder;
+  resampler_t *resampler;
+  AVFrame *frame;
+
+  switch (entry->kind) {
+  case ENTRY_ENCODER:
+    encoder = entry->ptr;
+    avcodec_close(encoder);
+    av_free(encoder);
+    break;
+  case ENTRY_RESAMPLER:
+    resampler = entry->ptr;
+    resampler_free(&resampler);
+    break;
+  case ENTRY_FIFO:
+    av_audio_fifo_free(entry->ptr);
+    break;
+  case ENTRY_FRAME:
+    frame = entry->ptr;
+    av_frame_free(&frame);
+    break;
+  default:
+    break;
+  }
+  free(entry);
+}
+
+/**
+ * Pools @p ptr, freeing the oldest context of the kind if there are too many.
+ */
+static void put(entry_kind_t kind, const codec_params_t *in,
+                const codec_params_t *out, void *ptr)
+{
+  entry_t *entry = malloc(sizeof(entry_t)), **prev, **oldest = NULL;
+  memset(entry, 0, sizeof(entry_t));
+  entry->kind = kind;
+  if (in) {
+    entry->in = *in;
+  }
+  if (out) {
+    entry->out = *out;
+  }
+  entry->ptr = ptr;
+
+  pthread_mutex_lock(&pool_mutex);
+  entry->next = entries;
+  entries = entry;
+  ++counts[kind];
+
+  entry = NULL;
+  if (counts[kind] > config_to_int("codec-pool-size")) {
+    for (prev = &entries; *prev; prev = &(*prev)->next) {
+      if ((*prev)->kind == kind) {
+        oldest = prev;
+      }
+    }
+    entry = *oldest;
+    *oldest = entry->next;
+    --counts[kind];
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (entry) {
+    entry_free(entry);
+  }
+}
+
+/**
+ * Takes a pooled context matching @p in and @p out (if not NULL).
+ * @returns the context or NULL if there is none
+ */
+static void *take(entry_kind_t kind, const codec_params_t *in,
+                  const codec_params_t *out)
+{
+  entry_t *entry, **prev;
+  void *ptr = NULL;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (prev = &entries; *prev; prev = &(*prev)->next) {
+    entry = *prev;
+    if (entry->kind == kind
+     && (!in || !memcmp(&entry->in, in, sizeof(codec_params_t)))
+     && (!out || !memcmp(&entry->out, out, sizeof(codec_params_t)))) {
+      *prev = entry->next;
+      --counts[kind];
+      ptr = entry->ptr;
+      free(entry);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  return ptr;
+}
+
+static bool has(entry_kind_t kind, const codec_params_t *in)
+{
+  entry_t *entry;
+  bool result = false;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (entry = entries; entry && !result; entry = entry->next) {
+    result = entry->kind == kind
+          && !memcmp(&entry->in, in, sizeof(codec_params_t));
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  return result;
+}
+
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+/**
+ * Fills @p params from @p ctx, zeroing the padding so that they can be
+ * compared with memcmp.
+ */
+static void params_from_encoder(codec_params_t *params, AVCodecContext *ctx)
+{
+  memset(params, 0, sizeof(codec_params_t));
+  params->codec_id = ctx->codec_id;
+  params->sample_rate = ctx->sample_rate;
+  params->channels = ctx->channels;
+  params->channel_layout = ctx->channel_layout;
+  params->sample_fmt = ctx->sample_fmt;
+  params->bit_rate = ctx->bit_rate;
+}
+#endif
+
+static AVCodecContext *open_encoder(AVCodec *codec,
+                                    const codec_params_t *params)
+{
+  AVCodecContext *encoder;
+  int result;
+
+  encoder = avcodec_alloc_context3(codec);
+  encoder->sample_rate = params->sample_rate;
+  encoder->channels = params->channels;
+  encoder->sample_fmt = params->sample_fmt;
+  encoder->channel_layout = params->channel_layout;
+  encoder->bit_rate = params->bit_rate;
+
+  result = avcodec_open2(encoder, codec, NULL);
+  if (result < 0) {
+    musicd_log(LOG_ERROR, "codec_pool", "can't open encoder: %s",
+               strerror(AVUNERROR(result)));
+    av_free(encoder);
+    return NULL;
+  }
+  return encoder;
+}
+
+static void *spare_task(void *data)
+{
+  codec_params_t *params = data;
+  AVCodec *codec;
+  AVCodecContext *encoder;
+
+  if (!has(ENTRY_ENCODER, params)) {
+    codec = avcodec_find_encoder(params->codec_id);
+    encoder = codec ? open_encoder(codec, params) : NULL;
+    if (encoder) {
+      musicd_log(LOG_DEBUG, "codec_pool", "spare %s encoder ready",
+                 codec->name);
+      put(ENTRY_ENCODER, params, NULL, encoder);
+    }
+  }
+
+  free(params);
+  return NULL;
+}
+
+/**
+ * Opens a spare encoder for @p params in the background.
+ */
+static void launch_spare(const codec_params_t *params)
+{
+  task_t *task;
+
+  task = task_new();
+  task->func = spare_task;
+  task->data = malloc(sizeof(codec_params_t));
+  memcpy(task->data, params, sizeof(codec_params_t));
+  task->class = TASK_CLASS_CPU;
+  task->priority = TASK_PRIORITY_BACKGROUND;
+  task_launch(task);
+}
+
+
+AVCodecContext *codec_pool_encoder(AVCodec *codec,
+                                   const codec_params_t *params)
+{
+  AVCodecContext *encoder;
+  codec_params_t key;
+
+  /* Callers don't necessarily zero the padding */
+  memset(&key, 0, sizeof(codec_params_t));
+  key.codec_id = codec->id;
+  key.sample_rate = params->sample_rate;
+  key.channels = params->channels;
+  key.channel_layout = params->channel_layout;
+  key.sample_fmt = params->sample_fmt;
+  key.bit_rate = params->bit_rate;
+
+  if (config_to_int("codec-pool-size") <= 0) {
+    return open_encoder(codec, &key);
+  }
+
+  encoder = take(ENTRY_ENCODER, &key, NULL);
+  if (!encoder) {
+    encoder = open_encoder(codec, &key);
+    if (!encoder) {
+      return NULL;
+    }
+  }
+
+  /* Probably needed again soon, see skipping through a playlist */
+  launch_spare(&key);
+  return encoder;
+}
+
+void codec_pool_encoder_release(AVCodecContext *encoder)
+{
+  if (!encoder) {
+    return;
+  }
+
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+  /* Only encoders that can be reset are safe to reuse, others would carry
+   * buffered samples over to the next stream */
+  if (encoder->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH
+   && config_to_int("codec-pool-size") > 0) {
+    codec_params_t params;
+    avcodec_flush_buffers(encoder);
+    params_from_encoder(&params, encoder);
+    put(ENTRY_ENCODER, &params, NULL, encoder);
+    return;
+  }
+#endif
+
+  avcodec_close(encoder);
+  av_free(encoder);
+}
+
+resampler_t *codec_pool_resampler(const codec_params_t *in,
+                                  const codec_params_t *out)
+{
+  resampler_t *resampler;
+  codec_params_t in_key, out_key;
+  int result;
+
+  memset(&in_key, 0, sizeof(codec_params_t));
+  in_key.sample_rate = in->sample_rate;
+  in_key.channel_layout = in->channel_layout;
+  in_key.sample_fmt = in->sample_fmt;
+  memset(&out_key, 0, sizeof(codec_params_t));
+  out_key.sample_rate = out->sample_rate;
+  out_key.channel_layout = out->channel_layout;
+  out_key.sample_fmt = out->sample_fmt;
+
+  resampler = take(ENTRY_RESAMPLER, &in_key, &out_key);
+  if (resampler) {
+    /* Reinitializing drops whatever the previous stream left buffered */
+    resampler_close(resampler);
+  } else {
+    resampler = resampler_alloc();
+    av_opt_set_int(resampler, "in_channel_layout", in->channel_layout, 0);
+    av_opt_set_int(resampler, "out_channel_layout", out->channel_layout, 0);
+    av_opt_set_int(resampler, "in_sample_rate", in->sample_rate, 0);
+    av_opt_set_int(resampler, "out_sample_rate", out->sample_rate, 0);
+    av_opt_set_int(resampler, "in_sample_fmt", in->sample_fmt, 0);
+    av_opt_set_int(resampler, "out_sample_fmt", out->sample_fmt, 0);
+  }
+
+  result = resampler_init(resampler);
+  if (result < 0) {
+    musicd_log(LOG_ERROR, "codec_pool", "can't open resampler: %s",
+               strerror(AVUNERROR(result)));
+    resampler_free(&resampler);
+    return NULL;
+  }
+  return resampler;
+}
+
+void codec_pool_resampler_release(resampler_t *resampler)
+{
+  codec_params_t in, out;
+  int64_t value;
+
+  if (!resampler) {
+    return;
+  }
+
+  if (config_to_int("codec-pool-size") <= 0) {
+    resampler_free(&resampler);
+    return;
+  }
+
+  memset(&in, 0, sizeof(codec_params_t));
+  memset(&out, 0, sizeof(codec_params_t));
+  av_opt_get_int(resampler, "in_channel_layout", 0, &value);
+  in.channel_layout = value;
+  av_opt_get_int(resampler, "out_channel_layout", 0, &value);
+  out.channel_layout = value;
+  av_opt_get_int(resampler, "in_sample_rate", 0, &value);
+  in.sample_rate = value;
+  av_opt_get_int(resampler, "out_sample_rate", 0, &value);
+  out.sample_rate = value;
+  av_opt_get_int(resampler, "in_sample_fmt", 0, &value);
+  in.sample_fmt = value;
+  av_opt_get_int(resampler, "out_sample_fmt", 0, &value);
+  out.sample_fmt = value;
+
+  put(ENTRY_RESAMPLER, &in, &out, resampler);
+}
+
+AVAudioFifo *codec_pool_fifo(enum AVSampleFormat sample_fmt, int channels,
+                             int nb_samples)
+{
+  AVAudioFifo *fifo;
+  codec_params_t key;
+
+  memset(&key, 0, sizeof(codec_params_t));
+  key.sample_fmt = sample_fmt;
+  key.channels = channels;
+
+  fifo = take(ENTRY_FIFO, &key, NULL);
+  if (fifo) {
+    return fifo;
+  }
+  return av_audio_fifo_alloc(sample_fmt, channels, nb_samples);
+}
+
+void codec_pool_fifo_release(AVAudioFifo *fifo,
+                             enum AVSampleFormat sample_fmt, int channels)
+{
+  codec_params_t key;
+
+  if (!fifo) {
+    return;
+  }
+
+  if (config_to_int("codec-pool-size") <= 0) {
+    av_audio_fifo_free(fifo);
+    return;
+  }
+
+  memset(&key, 0, sizeof(codec_params_t));
+  key.sample_fmt = sample_fmt;
+  key.channels = channels;
+
+  av_audio_fifo_reset(fifo);
+  put(ENTRY_FIFO, &key, NULL, fifo);
+}
+
+AVFrame *codec_pool_frame()
+{
+  AVFrame *frame = take(ENTRY_FRAME, NULL, NULL);
+  return frame ? frame : av_frame_alloc();
+}
+
+void codec_pool_frame_release(AVFrame *frame)
+{
+  if (!frame) {
+    return;
+  }
+
+  if (config_to_int("codec-pool-size") <= 0) {
+    av_frame_free(&frame);
+    return;
+  }
+
+  av_frame_unref(frame);
+  put(ENTRY_FRAME, NULL, NULL, frame);
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_CODEC_POOL_H
+#define MUSICD_CODEC_POOL_H
+
+#include "libav.h"
+
+#include <stdint.h>
+
+/**
+ * Pool of libav contexts reused across streams, so that opening a stream
+ * doesn't have to set up everything from scratch.
+ *
+ * Opening an encoder is the expensive part, and a used encoder can't be
+ * reset unless the codec supports flushing. So a spare encoder is opened in
+ * the background whenever one is taken, and the next stream with the same
+ * parameters gets it ready. Resamplers, fifos and frames are recycled as
+ * they are released. At most codec-pool-size contexts of each kind are kept
+ * idle, 0 disables the pool.
+ */
+
+/** Audio parameters of an encoder, or either side of a resampler */
+typedef struct codec_params {
+  enum AVCodecID codec_id;
+  int sample_rate;
+  int channels;
+  uint64_t channel_layout;
+  enum AVSampleFormat sample_fmt;
+  int64_t bit_rate;
+} codec_params_t;
+
+/**
+ * @returns opened encoder of @p codec for @p params, or NULL on failure
+ */
+AVCodecContext *codec_pool_encoder(AVCodec *codec,
+                                   const codec_params_t *params);
+
+/**
+ * Closes or recycles an encoder from codec_pool_encoder.
+ */
+void codec_pool_encoder_release(AVCodecContext *encoder);
+
+/**
+ * @returns initialized resampler from @p in to @p out, or NULL on failure
+ */
+resampler_t *codec_pool_resampler(const codec_params_t *in,
+                                  const codec_params_t *out);
+
+void codec_pool_resampler_release(resampler_t *resampler);
+
+/**
+ * @returns empty fifo for @p sample_fmt and @p channels
+ */
+AVAudioFifo *codec_pool_fifo(enum AVSampleFormat sample_fmt, int channels,
+                             int nb_samples);
+
+void codec_pool_fifo_release(AVAudioFifo *fifo,
+                             enum AVSampleFormat sample_fmt, int channels);
+
+AVFrame *codec_pool_frame();
+
+void codec_pool_frame_release(AVFrame *frame);
+
+#endif
@@ -20,6 +20,7 @@
 #include "log.h"
 #include "strings.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -100,7 +101,7 @@ typedef struct setting {
   char *key;
   char *value;
   
-  /* Stores value returned by config_to_path */
+  /* Stores value returned by config_to_path, valid until value changes */
   char *path_value;
   
   void (*hook)(char *value);
@@ -112,6 +113,9 @@ TAILQ_HEAD(setting_list, setting);
 
 static struct setting_list settings;
 
+/* Protects lazy path_value expansion, which can happen from any thread */
+static pthread_mutex_t path_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 static setting_t *setting_by_key(const char *key)
 {
@@ -245,11 +249,19 @@ char *config_to_path(const char *key)
   if (setting->value[0] != '~') {
     return setting->value;
   }
+
+  pthread_mutex_lock(&path_mutex);
+
+  if (setting->path_value) {
+    pthread_mutex_unlock(&path_mutex);
+    return setting->path_value;
+  }
   
   value = setting->value + 1;
   
   home = getenv("HOME");
   if (!home) {
+    pthread_mutex_unlock(&path_mutex);
     musicd_log(LOG_ERROR, "config", "$HOME not set");
     return NULL;
   }
@@ -264,14 +276,12 @@ char *config_to_path(const char *key)
     ++value;
   }
   
-  if (setting->path_value) {
-    free(setting->path_value);
-  }
-  
   str_len = strlen(home) + strlen(value) + 2;
   
   setting->path_value = calloc(str_len, sizeof(char));
   snprintf(setting->path_value, str_len, "%s/%s", home, value);
+
+  pthread_mutex_unlock(&path_mutex);
   
   return setting->path_value;
 }
@@ -287,6 +297,17 @@ int config_to_int(const char *key)
   return result;
 }
 
+double config_to_double(const char *key)
+{
+  double result = 0;
+  setting_t *setting = setting_by_key(key);
+  if (!setting) {
+    return 0;
+  }
+  sscanf(setting->value, "%lf", &result);
+  return result;
+}
+
 int config_to_bool(const char *key)
 {
   setting_t *setting = setting_by_key(key);
@@ -312,6 +333,11 @@ void config_set(const char *key, const char *value)
   } else {
     musicd_log(LOG_DEBUG, "config", "set setting: %s %s", key, value);
     free(setting->value);
+
+    pthread_mutex_lock(&path_mutex);
+    free(setting->path_value);
+    setting->path_value = NULL;
+    pthread_mutex_unlock(&path_mutex);
   }
   
   setting->value = strcopy(value);
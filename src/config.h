@@ -51,6 +51,11 @@ char *config_to_path(const char *key);
  */
 int config_to_int(const char *key);
 
+/**
+ * Like config_to_int, but converts to double using format %lf.
+ */
+double config_to_double(const char *key);
+
 int config_to_bool(const char *key);
 
 void config_set(const char *key, const char *value);
@@ -19,9 +19,11 @@
 
 #include "config.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,12 +31,132 @@
 #include <unistd.h>
 #include <sqlite3.h>
 
+/** Writer connection, shared by all threads */
 static sqlite3 *db;
+static char *db_file = NULL;
 
 static char *uid;
 
+/*
+ * Read-only connections, one per thread using db_reader so that readers don't
+ * contend for the writer connection. A connection is returned to the idle
+ * list when its thread exits. Threads beyond db-readers, and writer threads,
+ * read through the writer connection.
+ */
+
+typedef struct reader {
+  sqlite3 *handle;
+  struct reader *next;
+} reader_t;
+
+static pthread_mutex_t reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+/** Every reader opened, and the ones not used by any thread */
+static reader_t **readers = NULL, *idle_readers = NULL;
+static int nb_readers = 0;
+/** Marks writer threads, and threads with no reader to use */
+static reader_t writer_reader = { NULL, NULL };
+
+/** Buckets of the statement cache, keyed by SQL text */
+#define STMT_BUCKETS 256
+/** Most idle statements kept, from all connections */
+#define STMT_CACHE_MAX 256
+
+typedef struct cached_stmt {
+  sqlite3_stmt *stmt;
+  unsigned hash;
+  struct cached_stmt *next;
+} cached_stmt_t;
+
+/* Only idle statements are in the cache, a statement is used by one caller at
+ * a time even though the connection is shared */
+static pthread_mutex_t stmt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cached_stmt_t *stmt_buckets[STMT_BUCKETS];
+static int nb_cached = 0;
+
 static int create_schema();
 
+static void pragma_int(sqlite3 *handle, const char *pragma, int64_t value)
+{
+  char *sql = stringf("PRAGMA %s = %" PRId64, pragma, value);
+  if (sqlite3_exec(handle, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    musicd_log(LOG_WARNING, "db", "can't execute '%s': %s", sql,
+               sqlite3_errmsg(handle));
+  }
+  free(sql);
+}
+
+static void set_cache_sizes(sqlite3 *handle)
+{
+  pragma_int(handle, "mmap_size",
+             (int64_t)config_to_int("db-mmap-size") << 20);
+  /* Negative is in KiB rather than pages */
+  pragma_int(handle, "cache_size",
+             -(int64_t)config_to_int("db-cache-size") << 10);
+}
+
+int64_t db_shuffle(int64_t id, int64_t seed)
+{
+  /* splitmix64 finalizer, so that nearby ids and seeds end up far apart */
+  uint64_t x = (uint64_t)id + (uint64_t)seed * 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return (int64_t)(x >> 1);
+}
+
+static void shuffle_func(sqlite3_context *context, int argc,
+                         sqlite3_value **argv)
+{
+  (void)argc;
+  sqlite3_result_int64(context, db_shuffle(sqlite3_value_int64(argv[0]),
+                                           sqlite3_value_int64(argv[1])));
+}
+
+/** Sets up a newly opened connection */
+static void init_handle(sqlite3 *handle)
+{
+  set_cache_sizes(handle);
+  sqlite3_create_function(handle, "shuffle", 2,
+                          SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                          shuffle_func, NULL, NULL);
+}
+
+static int open_db(const char *file)
+{
+  /* The handle is shared by all server threads, the scanner and tasks, so
+   * always use serialized mode regardless of the library default. */
+  if (sqlite3_open_v2(file, &db,
+                      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+                      | SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK) {
+    return -1;
+  }
+
+  /* With write-ahead logging readers aren't blocked by an ongoing scan, and
+   * commits only need to sync at checkpoints. */
+  sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL);
+  sqlite3_exec(db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
+  init_handle(db);
+  return 0;
+}
+
+/**
+ * Removes @p file and its write-ahead log.
+ */
+static void remove_db(const char *file)
+{
+  char *path;
+
+  remove(file);
+  path = stringf("%s-wal", file);
+  remove(path);
+  free(path);
+  path = stringf("%s-shm", file);
+  remove(path);
+  free(path);
+}
+
 int db_open()
 {
   char *file;
@@ -45,7 +167,10 @@ int db_open()
     return -1;
   }
 
-  if (sqlite3_open(file, &db) != SQLITE_OK) {
+  free(db_file);
+  db_file = strcopy(file);
+
+  if (open_db(file)) {
     musicd_log(LOG_ERROR, "db", "can't open '%s': %s", file, db_error());
     return -1;
   }
@@ -55,9 +180,9 @@ int db_open()
     musicd_log(LOG_ERROR, "db", "database corrupted, reseting");
     db_close();
     
-    remove(file);
+    remove_db(file);
     
-    if (sqlite3_open(file, &db) != SQLITE_OK) {
+    if (open_db(file)) {
       musicd_log(LOG_ERROR, "db", "can't open '%s': %s", file, db_error());
       return -1;
     }
@@ -72,8 +197,39 @@ int db_open()
   return 0;
 }
 
+static void clear_stmt_cache()
+{
+  cached_stmt_t *entry;
+  int i;
+
+  pthread_mutex_lock(&stmt_mutex);
+  for (i = 0; i < STMT_BUCKETS; ++i) {
+    while ((entry = stmt_buckets[i])) {
+      stmt_buckets[i] = entry->next;
+      sqlite3_finalize(entry->stmt);
+      free(entry);
+    }
+  }
+  nb_cached = 0;
+  pthread_mutex_unlock(&stmt_mutex);
+}
+
 void db_close()
 {
+  int i;
+
+  /* Open statements would keep the database open */
+  clear_stmt_cache();
+
+  pthread_mutex_lock(&reader_mutex);
+  for (i = 0; i < nb_readers; ++i) {
+    /* Closed once their threads are done with them */
+    sqlite3_close_v2(readers[i]->handle);
+    readers[i]->handle = NULL;
+  }
+  idle_readers = NULL;
+  pthread_mutex_unlock(&reader_mutex);
+
   sqlite3_close(db);
   db = NULL;
 }
@@ -89,6 +245,96 @@ sqlite3 *db_handle()
   return db;
 }
 
+static void reader_exit(void *data)
+{
+  reader_t *reader = data;
+
+  if (reader == &writer_reader) {
+    return;
+  }
+
+  pthread_mutex_lock(&reader_mutex);
+  if (reader->handle) {
+    reader->next = idle_readers;
+    idle_readers = reader;
+  }
+  pthread_mutex_unlock(&reader_mutex);
+}
+
+static void reader_init()
+{
+  pthread_key_create(&reader_key, reader_exit);
+}
+
+/**
+ * @returns idle reader or a new one, or NULL if there are db-readers of them
+ * already or opening fails. reader_mutex must be held.
+ */
+static reader_t *take_reader()
+{
+  reader_t *reader;
+  sqlite3 *handle;
+
+  if (idle_readers) {
+    reader = idle_readers;
+    idle_readers = reader->next;
+    return reader;
+  }
+
+  if (!db_file || nb_readers >= config_to_int("db-readers")) {
+    return NULL;
+  }
+
+  /* Only ever used by one thread */
+  if (sqlite3_open_v2(db_file, &handle,
+                      SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL)
+      != SQLITE_OK) {
+    musicd_log(LOG_WARNING, "db", "can't open reader for '%s': %s", db_file,
+               sqlite3_errmsg(handle));
+    sqlite3_close(handle);
+    return NULL;
+  }
+  /* Readers may briefly wait for a checkpoint, never for the writer */
+  sqlite3_busy_timeout(handle, 1000);
+  init_handle(handle);
+
+  reader = malloc(sizeof(reader_t));
+  reader->handle = handle;
+  reader->next = NULL;
+  readers = realloc(readers, sizeof(reader_t *) * (nb_readers + 1));
+  readers[nb_readers++] = reader;
+  return reader;
+}
+
+sqlite3 *db_reader()
+{
+  reader_t *reader;
+
+  pthread_once(&reader_once, reader_init);
+
+  reader = pthread_getspecific(reader_key);
+  if (!reader) {
+    pthread_mutex_lock(&reader_mutex);
+    reader = take_reader();
+    pthread_mutex_unlock(&reader_mutex);
+    if (!reader) {
+      reader = &writer_reader;
+    }
+    pthread_setspecific(reader_key, reader);
+  }
+
+  if (reader == &writer_reader || !reader->handle) {
+    return db;
+  }
+  return reader->handle;
+}
+
+void db_writer_thread()
+{
+  pthread_once(&reader_once, reader_init);
+  pthread_setspecific(reader_key, &writer_reader);
+}
+
 
 void db_simple_exec(const char *sql, int *error)
 {
@@ -102,6 +348,72 @@ void db_simple_exec(const char *sql, int *error)
   }
 }
 
+static int prepare(sqlite3 *handle, const char *sql, sqlite3_stmt **stmt)
+{
+  cached_stmt_t *entry, **prev;
+  unsigned hash = strhash(sql);
+
+  pthread_mutex_lock(&stmt_mutex);
+  for (prev = &stmt_buckets[hash % STMT_BUCKETS]; *prev;
+       prev = &(*prev)->next) {
+    entry = *prev;
+    if (entry->hash == hash && sqlite3_db_handle(entry->stmt) == handle
+     && !strcmp(sqlite3_sql(entry->stmt), sql)) {
+      *prev = entry->next;
+      --nb_cached;
+      pthread_mutex_unlock(&stmt_mutex);
+
+      *stmt = entry->stmt;
+      free(entry);
+      metrics_count(METRICS_DB_REUSES, 1);
+      return SQLITE_OK;
+    }
+  }
+  pthread_mutex_unlock(&stmt_mutex);
+
+  metrics_count(METRICS_DB_PREPARES, 1);
+  return sqlite3_prepare_v2(handle, sql, -1, stmt, NULL);
+}
+
+int db_prepare(const char *sql, sqlite3_stmt **stmt)
+{
+  return prepare(db, sql, stmt);
+}
+
+int db_prepare_read(const char *sql, sqlite3_stmt **stmt)
+{
+  return prepare(db_reader(), sql, stmt);
+}
+
+void db_release(sqlite3_stmt *stmt)
+{
+  cached_stmt_t *entry;
+  unsigned hash;
+
+  if (!stmt) {
+    return;
+  }
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  pthread_mutex_lock(&stmt_mutex);
+  if (nb_cached >= STMT_CACHE_MAX) {
+    pthread_mutex_unlock(&stmt_mutex);
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  hash = strhash(sqlite3_sql(stmt));
+  entry = malloc(sizeof(cached_stmt_t));
+  entry->stmt = stmt;
+  entry->hash = hash;
+  entry->next = stmt_buckets[hash % STMT_BUCKETS];
+  stmt_buckets[hash % STMT_BUCKETS] = entry;
+  ++nb_cached;
+  pthread_mutex_unlock(&stmt_mutex);
+}
+
 const char *db_uid()
 {
   return uid;
@@ -114,7 +426,7 @@ static sqlite3_stmt *meta_get(const char *key)
   int result;
   static const char *sql = "SELECT value FROM musicd WHERE key = ?";
   
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+  if (db_prepare(sql, &stmt) != SQLITE_OK) {
     musicd_log(LOG_ERROR, "db", "can't query metadata: %s", db_error());
     return 0;
   }
@@ -123,11 +435,11 @@ static sqlite3_stmt *meta_get(const char *key)
   
   result = sqlite3_step(stmt);
   if (result == SQLITE_DONE) {
-    sqlite3_finalize(stmt);
+    db_release(stmt);
     return NULL;
   } else if (result != SQLITE_ROW) {
     musicd_log(LOG_ERROR, "db", "meta_get: sqlite3_step failed");
-    sqlite3_finalize(stmt);
+    db_release(stmt);
     return NULL;
   }
   return stmt;
@@ -137,7 +449,7 @@ static sqlite3_stmt *meta_set(const char *key)
   sqlite3_stmt *stmt;
   static const char *sql = "INSERT OR REPLACE INTO musicd VALUES (?, ?)";
   
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+  if (db_prepare(sql, &stmt) != SQLITE_OK) {
     musicd_log(LOG_ERROR, "db", "can't set metadata: %s", db_error());
     return NULL;
   }
@@ -157,7 +469,7 @@ int db_meta_get_int(const char *key)
   }
 
   result = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
 
   return result;
 }
@@ -172,22 +484,22 @@ void db_meta_set_int(const char *key, int value)
   sqlite3_bind_int(stmt, 2, value);
 
   sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
 }
 
 char *db_meta_get_string(const char *key)
 {
-  const char *result;
+  char *result;
   sqlite3_stmt *stmt = meta_get(key);
 
   if (!stmt) {
     return 0;
   }
 
-  result = (const char *)sqlite3_column_text(stmt, 0);
-  sqlite3_finalize(stmt);
+  result = strcopy((const char *)sqlite3_column_text(stmt, 0));
+  db_release(stmt);
 
-  return strcopy(result);
+  return result;
 }
 void db_meta_set_string(const char *key, const char *value)
 {
@@ -200,7 +512,7 @@ void db_meta_set_string(const char *key, const char *value)
   sqlite3_bind_text(stmt, 2, value, -1, NULL);
 
   sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  db_release(stmt);
 }
 
 static void generate_uid()
@@ -208,6 +520,75 @@ static void generate_uid()
   uid = stringf("%" PRIx64 "%" PRIx64 "", (int64_t)time(NULL), (int64_t)getpid());
 }
 
+/** Oldest schema that is migrated instead of created from scratch */
+#define DB_SCHEMA_MIGRATABLE 5
+
+/** Migration from schema 5 to 6: indexes for the lookups done when scanning
+ * and querying, and the directory of each track for directory filters */
+static const char *migration_6[] = {
+  "ALTER TABLE tracks ADD COLUMN directory TEXT",
+  "UPDATE tracks SET directory = (SELECT directories.path FROM files JOIN directories ON directories.rowid = files.directoryid WHERE files.rowid = tracks.fileid)",
+  "CREATE INDEX IF NOT EXISTS files_directory_index ON files (directoryid, path, mtime)",
+  "CREATE INDEX IF NOT EXISTS directories_parent_index ON directories (parentid, path, mtime)",
+  "CREATE INDEX IF NOT EXISTS tracks_file_index ON tracks (fileid, albumid)",
+  "CREATE INDEX IF NOT EXISTS tracks_album_index ON tracks (albumid, fileid)",
+  "CREATE INDEX IF NOT EXISTS tracks_artist_index ON tracks (artistid)",
+  "CREATE INDEX IF NOT EXISTS tracks_directory_index ON tracks (directory)",
+  "CREATE INDEX IF NOT EXISTS tracks_path_index ON tracks (file)",
+  "CREATE INDEX IF NOT EXISTS images_album_index ON images (albumid, fileid)",
+  "CREATE INDEX IF NOT EXISTS images_file_index ON images (fileid)",
+  NULL
+};
+
+/* Full-text index of track names, kept in sync with tracks by triggers */
+static const char *migration_7[] = {
+  "CREATE VIRTUAL TABLE tracks_fts USING fts5(title, artist, album, content='tracks', content_rowid='rowid', tokenize='unicode61 remove_diacritics 2', prefix='1 2 3')",
+  "CREATE TRIGGER tracks_fts_insert AFTER INSERT ON tracks BEGIN INSERT INTO tracks_fts (rowid, title, artist, album) VALUES (new.rowid, new.title, new.artist, new.album); END",
+  "CREATE TRIGGER tracks_fts_delete AFTER DELETE ON tracks BEGIN INSERT INTO tracks_fts (tracks_fts, rowid, title, artist, album) VALUES ('delete', old.rowid, old.title, old.artist, old.album); END",
+  "CREATE TRIGGER tracks_fts_update AFTER UPDATE OF title, artist, album ON tracks BEGIN INSERT INTO tracks_fts (tracks_fts, rowid, title, artist, album) VALUES ('delete', old.rowid, old.title, old.artist, old.album); INSERT INTO tracks_fts (rowid, title, artist, album) VALUES (new.rowid, new.title, new.artist, new.album); END",
+  "INSERT INTO tracks_fts (tracks_fts) VALUES ('rebuild')",
+  NULL
+};
+
+/** Migrations from DB_SCHEMA_MIGRATABLE on, each to the next version */
+static const char **migrations[MUSICD_DB_SCHEMA - DB_SCHEMA_MIGRATABLE] = {
+  migration_6,
+  migration_7
+};
+
+/**
+ * Migrates schema @p from to MUSICD_DB_SCHEMA, each version in its own
+ * transaction.
+ */
+static int migrate_schema(int from)
+{
+  int error = 0, version;
+  const char **sql;
+
+  for (version = from; version < MUSICD_DB_SCHEMA; ++version) {
+    musicd_log(LOG_INFO, "db", "migrating schema %d to %d", version,
+               version + 1);
+
+    db_simple_exec("BEGIN TRANSACTION", &error);
+    for (sql = migrations[version - DB_SCHEMA_MIGRATABLE]; *sql && !error;
+         ++sql) {
+      db_simple_exec(*sql, &error);
+    }
+    if (error) {
+      db_simple_exec("ROLLBACK TRANSACTION", NULL);
+      musicd_log(LOG_ERROR, "db", "can't migrate schema %d", version);
+      return -1;
+    }
+    db_meta_set_int("schema", version + 1);
+    db_simple_exec("COMMIT TRANSACTION", &error);
+    if (error) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 static int create_schema()
 {
   int error = 0;
@@ -228,7 +609,7 @@ static int create_schema()
     return -1;
   }
 
-  if (schema < MUSICD_DB_SCHEMA) {
+  if (schema < DB_SCHEMA_MIGRATABLE) {
     musicd_log(LOG_INFO, "db", "new database or old schema");
 
     /* Clear meta table */
@@ -242,6 +623,8 @@ static int create_schema()
     db_simple_exec("DROP TABLE IF EXISTS tracks", &error);
     db_simple_exec("DROP TABLE IF EXISTS images", &error);
     db_simple_exec("DROP TABLE IF EXISTS lyrics", &error);
+    db_simple_exec("DROP TABLE IF EXISTS seekindex", &error);
+    db_simple_exec("DROP TABLE IF EXISTS tracks_fts", &error);
     
     db_simple_exec("CREATE TABLE directories (path TEXT UNIQUE, mtime INT64, parentid INT64)", &error);
     db_simple_exec("CREATE TABLE files (path TEXT UNIQUE, mtime INT64, directoryid INT64)", &error);
@@ -250,22 +633,25 @@ static int create_schema()
     db_simple_exec("CREATE TABLE tracks (fileid INT64, file TEXT, cuefileid INT64, cuefile TEXT, track INT, title TEXT, artistid INT64, artist TEXT, albumid INT64, album TEXT, start DOUBLE, duration DOUBLE, trackindex INT64)", &error);
     db_simple_exec("CREATE TABLE images (fileid INT64, albumid INT64)", &error);
     db_simple_exec("CREATE TABLE lyrics (trackid INT64 UNIQUE, lyrics TEXT, provider TEXT, source TEXT, mtime INT64)", &error);
+    db_simple_exec("CREATE TABLE seekindex (fileid INT64 UNIQUE, interval DOUBLE, positions BLOB)", &error);
 
     /* Index for good default sorting */
     db_simple_exec("CREATE INDEX tracks_default_index ON tracks (album COLLATE NOCASE ASC, track COLLATE NOCASE ASC, title COLLATE NOCASE ASC)", &error);
 
     generate_uid();
     db_meta_set_string("uid", uid);
+
+    if (error) {
+      musicd_log(LOG_ERROR, "db", "can't create database tables");
+      return -1;
+    }
+
+    /* The tables created are of the oldest migratable schema */
+    db_meta_set_int("schema", DB_SCHEMA_MIGRATABLE);
+    schema = DB_SCHEMA_MIGRATABLE;
   }
-  
-  if (error) {
-    musicd_log(LOG_ERROR, "db", "can't create database tables");
-    return -1;
-  }
-  
-  db_meta_set_int("schema", MUSICD_DB_SCHEMA);
-  
-  if (error) {
+
+  if (schema < MUSICD_DB_SCHEMA && migrate_schema(schema)) {
     musicd_log(LOG_ERROR, "db", "can't create schema");
     return -1;
   }
@@ -21,19 +21,62 @@
 #include <stdint.h>
 #include <sqlite3.h>
 
-#define MUSICD_DB_SCHEMA 4
+#define MUSICD_DB_SCHEMA 7
 
 int db_open();
 void db_close();
 
 const char *db_error();
 
+/**
+ * @returns the writer connection.
+ */
 sqlite3 *db_handle();
 
+/**
+ * @returns read-only connection of the calling thread, opened on first use.
+ * Writer threads and threads beyond db-readers get the writer connection.
+ * Reads through a reader only see committed changes.
+ */
+sqlite3 *db_reader();
+
+/**
+ * Makes the calling thread read through the writer connection, so that it
+ * sees its own changes before they are committed.
+ */
+void db_writer_thread();
+
 void db_simple_exec(const char *sql, int *error);
 
+/**
+ * Like sqlite3_prepare_v2, but reuses an idle statement of the same SQL if
+ * there is one. Statements must be released with db_release instead of
+ * finalizing.
+ * @returns SQLITE_OK on success
+ */
+int db_prepare(const char *sql, sqlite3_stmt **stmt);
+
+/**
+ * Like db_prepare, but on the connection from db_reader. The statement must
+ * not write.
+ */
+int db_prepare_read(const char *sql, sqlite3_stmt **stmt);
+
+/**
+ * Resets @p stmt and keeps it for reuse by db_prepare, or finalizes it if the
+ * cache is full. NULL is ignored.
+ */
+void db_release(sqlite3_stmt *stmt);
+
 const char *db_uid();
 
+/**
+ * @returns position of row @p id in the pseudorandom order given by @p seed, a
+ * non-negative integer. Every connection has this as SQL function
+ * shuffle(id, seed).
+ */
+int64_t db_shuffle(int64_t id, int64_t seed);
+
 int db_meta_get_int(const char *key);
 void db_meta_set_int(const char *key, int value);
 char *db_meta_get_string(const char *key);
@@ -0,0 +1,515 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "event.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if !defined(USE_EVENT_POLL) && defined(__linux__)
+#define EVENT_EPOLL
+#elif !defined(USE_EVENT_POLL) && (defined(__FreeBSD__) \
+   || defined(__OpenBSD__) || defined(__NetBSD__) \
+   || defined(__DragonFly__) || defined(__APPLE__))
+#define EVENT_KQUEUE
+#else
+#define EVENT_POLL
+#endif
+
+#if defined(EVENT_EPOLL)
+#include <sys/epoll.h>
+#elif defined(EVENT_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#include <sys/poll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include <fcntl.h>
+#include <stdint.h>
+
+/** Initial size of the kernel-side result buffer, grown on demand */
+#define EVENT_BATCH 64
+
+#if defined(EVENT_EPOLL)
+
+struct event_loop {
+  int fd;
+  struct epoll_event *results;
+  int nresults;
+};
+
+static int to_epoll(int events)
+{
+  return (events & EVENT_IN ? EPOLLIN : 0)
+       | (events & EVENT_OUT ? EPOLLOUT : 0);
+}
+
+event_loop_t *event_loop_new()
+{
+  event_loop_t *loop = malloc(sizeof(event_loop_t));
+  memset(loop, 0, sizeof(event_loop_t));
+
+  loop->fd = epoll_create(EVENT_BATCH);
+  if (loop->fd < 0) {
+    musicd_perror(LOG_ERROR, "event", "can't create epoll instance");
+    free(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+void event_loop_free(event_loop_t *loop)
+{
+  if (!loop) {
+    return;
+  }
+  close(loop->fd);
+  free(loop->results);
+  free(loop);
+}
+
+static int epoll_change(event_loop_t *loop, int op, int fd, int events,
+                        void *data)
+{
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = to_epoll(events);
+  event.data.ptr = data;
+
+  if (epoll_ctl(loop->fd, op, fd, &event)) {
+    musicd_perror(LOG_ERROR, "event", "epoll_ctl failed for fd %d", fd);
+    return -1;
+  }
+  return 0;
+}
+
+int event_add(event_loop_t *loop, int fd, int events, void *data)
+{
+  return epoll_change(loop, EPOLL_CTL_ADD, fd, events, data);
+}
+
+int event_mod(event_loop_t *loop, int fd, int events, void *data)
+{
+  return epoll_change(loop, EPOLL_CTL_MOD, fd, events, data);
+}
+
+int event_del(event_loop_t *loop, int fd)
+{
+  return epoll_change(loop, EPOLL_CTL_DEL, fd, 0, NULL);
+}
+
+int event_wait(event_loop_t *loop, event_t *events, int max_events,
+               int timeout)
+{
+  int n, i;
+
+  if (loop->nresults < max_events) {
+    loop->results = realloc(loop->results,
+                            max_events * sizeof(struct epoll_event));
+    loop->nresults = max_events;
+  }
+
+  n = epoll_wait(loop->fd, loop->results, max_events, timeout);
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (i = 0; i < n; ++i) {
+    events[i].data = loop->results[i].data.ptr;
+    events[i].events = 0;
+    if (loop->results[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      events[i].events |= EVENT_IN;
+    }
+    if (loop->results[i].events & EPOLLOUT) {
+      events[i].events |= EVENT_OUT;
+    }
+  }
+
+  return n;
+}
+
+const char *event_backend()
+{
+  return "epoll";
+}
+
+#elif defined(EVENT_KQUEUE)
+
+struct event_loop {
+  int fd;
+  struct kevent *results;
+  int nresults;
+  /* Currently registered filters by fd, needed for deleting */
+  int *masks;
+  int nmasks;
+};
+
+event_loop_t *event_loop_new()
+{
+  event_loop_t *loop = malloc(sizeof(event_loop_t));
+  memset(loop, 0, sizeof(event_loop_t));
+
+  loop->fd = kqueue();
+  if (loop->fd < 0) {
+    musicd_perror(LOG_ERROR, "event", "can't create kqueue");
+    free(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+void event_loop_free(event_loop_t *loop)
+{
+  if (!loop) {
+    return;
+  }
+  close(loop->fd);
+  free(loop->results);
+  free(loop->masks);
+  free(loop);
+}
+
+static int kqueue_change(event_loop_t *loop, int fd, int events, void *data)
+{
+  struct kevent changes[2];
+  int n = 0, old;
+
+  if (fd >= loop->nmasks) {
+    int size = loop->nmasks ? loop->nmasks : EVENT_BATCH;
+    while (size <= fd) {
+      size *= 2;
+    }
+    loop->masks = realloc(loop->masks, size * sizeof(int));
+    memset(loop->masks + loop->nmasks, 0,
+           (size - loop->nmasks) * sizeof(int));
+    loop->nmasks = size;
+  }
+
+  old = loop->masks[fd];
+
+  if (events & EVENT_IN) {
+    EV_SET(&changes[n++], fd, EVFILT_READ, EV_ADD, 0, 0, data);
+  } else if (old & EVENT_IN) {
+    EV_SET(&changes[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  }
+  if (events & EVENT_OUT) {
+    EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, data);
+  } else if (old & EVENT_OUT) {
+    EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+  }
+
+  loop->masks[fd] = events & (EVENT_IN | EVENT_OUT);
+
+  if (n && kevent(loop->fd, changes, n, NULL, 0, NULL) < 0) {
+    musicd_perror(LOG_ERROR, "event", "kevent failed for fd %d", fd);
+    return -1;
+  }
+  return 0;
+}
+
+int event_add(event_loop_t *loop, int fd, int events, void *data)
+{
+  return kqueue_change(loop, fd, events, data);
+}
+
+int event_mod(event_loop_t *loop, int fd, int events, void *data)
+{
+  return kqueue_change(loop, fd, events, data);
+}
+
+int event_del(event_loop_t *loop, int fd)
+{
+  return kqueue_change(loop, fd, 0, NULL);
+}
+
+int event_wait(event_loop_t *loop, event_t *events, int max_events,
+               int timeout)
+{
+  struct timespec ts, *tsp = NULL;
+  int n, i, j;
+
+  if (loop->nresults < max_events) {
+    loop->results = realloc(loop->results, max_events * sizeof(struct kevent));
+    loop->nresults = max_events;
+  }
+
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    tsp = &ts;
+  }
+
+  n = kevent(loop->fd, NULL, 0, loop->results, max_events, tsp);
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  /* Read and write readiness arrive as separate kevents, merge adjacent ones
+   * so that a client is usually processed once per wait. */
+  for (i = 0, j = 0; i < n; ++i) {
+    int type = loop->results[i].filter == EVFILT_WRITE ? EVENT_OUT : EVENT_IN;
+    void *data = (void *)loop->results[i].udata;
+
+    if (loop->results[i].flags & (EV_EOF | EV_ERROR)) {
+      type |= EVENT_IN;
+    }
+
+    if (j > 0 && events[j - 1].data == data) {
+      events[j - 1].events |= type;
+      continue;
+    }
+
+    events[j].data = data;
+    events[j].events = type;
+    ++j;
+  }
+
+  return j;
+}
+
+const char *event_backend()
+{
+  return "kqueue";
+}
+
+#else
+
+struct event_loop {
+  struct pollfd *fds;
+  void **datas;
+  int nfds, size;
+  /* Index in fds by fd, or -1 */
+  int *slots;
+  int nslots;
+};
+
+static int to_poll(int events)
+{
+  return (events & EVENT_IN ? POLLIN : 0)
+       | (events & EVENT_OUT ? POLLOUT : 0);
+}
+
+event_loop_t *event_loop_new()
+{
+  event_loop_t *loop = malloc(sizeof(event_loop_t));
+  memset(loop, 0, sizeof(event_loop_t));
+  return loop;
+}
+
+void event_loop_free(event_loop_t *loop)
+{
+  if (!loop) {
+    return;
+  }
+  free(loop->fds);
+  free(loop->datas);
+  free(loop->slots);
+  free(loop);
+}
+
+static int *poll_slot(event_loop_t *loop, int fd)
+{
+  if (fd >= loop->nslots) {
+    int size = loop->nslots ? loop->nslots : EVENT_BATCH;
+    while (size <= fd) {
+      size *= 2;
+    }
+    loop->slots = realloc(loop->slots, size * sizeof(int));
+    memset(loop->slots + loop->nslots, 0xff,
+           (size - loop->nslots) * sizeof(int));
+    loop->nslots = size;
+  }
+  return &loop->slots[fd];
+}
+
+int event_add(event_loop_t *loop, int fd, int events, void *data)
+{
+  int *slot = poll_slot(loop, fd);
+
+  if (*slot >= 0) {
+    musicd_log(LOG_ERROR, "event", "fd %d already registered", fd);
+    return -1;
+  }
+
+  if (loop->nfds == loop->size) {
+    loop->size = loop->size ? loop->size * 2 : EVENT_BATCH;
+    loop->fds = realloc(loop->fds, loop->size * sizeof(struct pollfd));
+    loop->datas = realloc(loop->datas, loop->size * sizeof(void *));
+  }
+
+  *slot = loop->nfds++;
+  loop->fds[*slot].fd = fd;
+  loop->fds[*slot].events = to_poll(events);
+  loop->fds[*slot].revents = 0;
+  loop->datas[*slot] = data;
+  return 0;
+}
+
+int event_mod(event_loop_t *loop, int fd, int events, void *data)
+{
+  int *slot = poll_slot(loop, fd);
+
+  if (*slot < 0) {
+    musicd_log(LOG_ERROR, "event", "fd %d not registered", fd);
+    return -1;
+  }
+
+  loop->fds[*slot].events = to_poll(events);
+  loop->datas[*slot] = data;
+  return 0;
+}
+
+int event_del(event_loop_t *loop, int fd)
+{
+  int *slot = poll_slot(loop, fd), last;
+
+  if (*slot < 0) {
+    musicd_log(LOG_ERROR, "event", "fd %d not registered", fd);
+    return -1;
+  }
+
+  /* Move the last entry into the hole to keep the array dense */
+  last = --loop->nfds;
+  if (*slot != last) {
+    loop->fds[*slot] = loop->fds[last];
+    loop->datas[*slot] = loop->datas[last];
+    loop->slots[loop->fds[*slot].fd] = *slot;
+  }
+  *slot = -1;
+  return 0;
+}
+
+int event_wait(event_loop_t *loop, event_t *events, int max_events,
+               int timeout)
+{
+  int n, i, j;
+
+  n = poll(loop->fds, loop->nfds, timeout);
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (i = 0, j = 0; i < loop->nfds && j < n && j < max_events; ++i) {
+    short revents = loop->fds[i].revents;
+    if (!revents) {
+      continue;
+    }
+    events[j].data = loop->datas[i];
+    events[j].events = 0;
+    if (revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+      events[j].events |= EVENT_IN;
+    }
+    if (revents & POLLOUT) {
+      events[j].events |= EVENT_OUT;
+    }
+    ++j;
+  }
+
+  return j;
+}
+
+const char *event_backend()
+{
+  return "poll";
+}
+
+#endif
+
+
+#ifdef __linux__
+
+int event_signal_init(event_signal_t *signal)
+{
+  signal->fds[0] = signal->fds[1] = eventfd(0, EFD_NONBLOCK);
+  if (signal->fds[0] < 0) {
+    musicd_perror(LOG_ERROR, "event", "can't create eventfd");
+    return -1;
+  }
+  return 0;
+}
+
+void event_signal_free(event_signal_t *signal)
+{
+  close(signal->fds[0]);
+}
+
+void event_signal_raise(event_signal_t *signal)
+{
+  uint64_t value = 1;
+  if (write(signal->fds[1], &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    musicd_perror(LOG_ERROR, "event", "can't raise signal");
+  }
+}
+
+void event_signal_clear(event_signal_t *signal)
+{
+  uint64_t value;
+  if (read(signal->fds[0], &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    musicd_perror(LOG_ERROR, "event", "can't clear signal");
+  }
+}
+
+#else
+
+int event_signal_init(event_signal_t *signal)
+{
+  if (pipe(signal->fds)) {
+    musicd_perror(LOG_ERROR, "event", "can't create pipe");
+    return -1;
+  }
+  fcntl(signal->fds[0], F_SETFL, fcntl(signal->fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(signal->fds[1], F_SETFL, fcntl(signal->fds[1], F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+void event_signal_free(event_signal_t *signal)
+{
+  close(signal->fds[0]);
+  close(signal->fds[1]);
+}
+
+void event_signal_raise(event_signal_t *signal)
+{
+  /* A full pipe is readable anyway, so EAGAIN is fine */
+  if (write(signal->fds[1], "\0", 1) < 0 && errno != EAGAIN) {
+    musicd_perror(LOG_ERROR, "event", "can't raise signal");
+  }
+}
+
+void event_signal_clear(event_signal_t *signal)
+{
+  char buf[64];
+  while (read(signal->fds[0], buf, sizeof(buf)) > 0) { }
+}
+
+#endif
+
+int event_signal_fd(event_signal_t *signal)
+{
+  return signal->fds[0];
+}
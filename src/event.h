@@ -0,0 +1,84 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_EVENT_H
+#define MUSICD_EVENT_H
+
+/** Readiness event types */
+#define EVENT_IN  0x01
+#define EVENT_OUT 0x02
+
+typedef struct event_loop event_loop_t;
+
+/** Ready event returned by event_wait */
+typedef struct event {
+  /** Opaque pointer given on event_add/event_mod */
+  void *data;
+  /** Ready event types, hang-ups and errors are reported as EVENT_IN */
+  int events;
+} event_t;
+
+/**
+ * Creates a new event loop using the best available backend: epoll on Linux,
+ * kqueue on BSD and poll elsewhere or if built with USE_EVENT_POLL.
+ */
+event_loop_t *event_loop_new();
+void event_loop_free(event_loop_t *loop);
+
+/**
+ * Registers @p fd for @p events. @p data is returned with every event.
+ * @returns 0 on success, -1 on error
+ */
+int event_add(event_loop_t *loop, int fd, int events, void *data);
+/**
+ * Changes the event mask and data of already registered @p fd.
+ */
+int event_mod(event_loop_t *loop, int fd, int events, void *data);
+/**
+ * Unregisters @p fd. Must be called before the fd is closed.
+ */
+int event_del(event_loop_t *loop, int fd);
+
+/**
+ * Waits at most @p timeout milliseconds (-1 for infinite) for events.
+ * @returns number of events written to @p events, or -1 on error
+ */
+int event_wait(event_loop_t *loop, event_t *events, int max_events,
+               int timeout);
+
+/** @returns name of the compiled backend */
+const char *event_backend();
+
+
+/**
+ * Level-triggered cross-thread wakeup, an eventfd on Linux and a pipe
+ * elsewhere. The fd stays readable from event_signal_raise until
+ * event_signal_clear.
+ */
+typedef struct event_signal {
+  int fds[2];
+} event_signal_t;
+
+int event_signal_init(event_signal_t *signal);
+void event_signal_free(event_signal_t *signal);
+
+/** @returns fd to register for EVENT_IN */
+int event_signal_fd(event_signal_t *signal);
+void event_signal_raise(event_signal_t *signal);
+void event_signal_clear(event_signal_t *signal);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "gain.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static inline float limit(float sample)
+{
+  return sample > 1.0f ? 1.0f : sample < -1.0f ? -1.0f : sample;
+}
+
+static inline int16_t saturate(float sample)
+{
+  return sample >= 32767.0f ? 32767
+       : sample <= -32768.0f ? -32768 : (int16_t)sample;
+}
+
+void gain_apply_float(float *samples, int n, float gain)
+{
+  int i = 0;
+
+#if defined(__AVX2__)
+  __m256 g = _mm256_set1_ps(gain);
+  __m256 hi = _mm256_set1_ps(1.0f), lo = _mm256_set1_ps(-1.0f);
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_mul_ps(_mm256_loadu_ps(samples + i), g);
+    _mm256_storeu_ps(samples + i, _mm256_max_ps(_mm256_min_ps(v, hi), lo));
+  }
+#elif defined(__SSE2__)
+  __m128 g = _mm_set1_ps(gain);
+  __m128 hi = _mm_set1_ps(1.0f), lo = _mm_set1_ps(-1.0f);
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(samples + i), g);
+    _mm_storeu_ps(samples + i, _mm_max_ps(_mm_min_ps(v, hi), lo));
+  }
+#elif defined(__ARM_NEON)
+  float32x4_t g = vdupq_n_f32(gain);
+  float32x4_t hi = vdupq_n_f32(1.0f), lo = vdupq_n_f32(-1.0f);
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t v = vmulq_f32(vld1q_f32(samples + i), g);
+    vst1q_f32(samples + i, vmaxq_f32(vminq_f32(v, hi), lo));
+  }
+#endif
+
+  for (; i < n; ++i) {
+    samples[i] = limit(samples[i] * gain);
+  }
+}
+
+void gain_apply_s16(int16_t *samples, int n, float gain)
+{
+  int i = 0;
+
+#if defined(__AVX2__)
+  __m256 g = _mm256_set1_ps(gain);
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(samples + i));
+    __m256i a = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v));
+    __m256i b = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1));
+    a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(a), g));
+    b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(b), g));
+    /* packs works within 128-bit lanes, put them back in order */
+    v = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    _mm256_storeu_si256((__m256i *)(samples + i), v);
+  }
+#elif defined(__SSE2__)
+  __m128 g = _mm_set1_ps(gain);
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(samples + i));
+    /* Sign extend by unpacking into the high halves and shifting back */
+    __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    a = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(a), g));
+    b = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(b), g));
+    _mm_storeu_si128((__m128i *)(samples + i), _mm_packs_epi32(a, b));
+  }
+#elif defined(__ARM_NEON)
+  float32x4_t g = vdupq_n_f32(gain);
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t v = vld1q_s16(samples + i);
+    int32x4_t a = vmovl_s16(vget_low_s16(v));
+    int32x4_t b = vmovl_s16(vget_high_s16(v));
+    a = vcvtq_s32_f32(vmulq_f32(vcvtq_f32_s32(a), g));
+    b = vcvtq_s32_f32(vmulq_f32(vcvtq_f32_s32(b), g));
+    vst1q_s16(samples + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+  }
+#endif
+
+  for (; i < n; ++i) {
+    samples[i] = saturate(samples[i] * gain);
+  }
+}
+
+const char *gain_simd()
+{
+#if defined(__AVX2__)
+  return "avx2";
+#elif defined(__SSE2__)
+  return "sse2";
+#elif defined(__ARM_NEON)
+  return "neon";
+#else
+  return "none";
+#endif
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_GAIN_H
+#define MUSICD_GAIN_H
+
+#include <stdint.h>
+
+/*
+ * Gain stage for normalizing loudness with ReplayGain. Samples are multiplied
+ * and hard limited to full scale, vectorized with SSE2 or NEON when the
+ * compiler targets them (and AVX2 with -mavx2).
+ */
+
+/**
+ * Multiplies @p n float samples by @p gain, limiting them to [-1, 1].
+ */
+void gain_apply_float(float *samples, int n, float gain);
+
+/**
+ * Multiplies @p n 16-bit samples by @p gain, saturating at full scale.
+ */
+void gain_apply_s16(int16_t *samples, int n, float gain);
+
+/**
+ * @returns the vector instruction set in use, for logging
+ */
+const char *gain_simd();
+
+#endif
@@ -0,0 +1,363 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "hls.h"
+
+#include "cache.h"
+#include "config.h"
+#include "library.h"
+#include "log.h"
+#include "stream.h"
+#include "strings.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Shared streams kept at most */
+#define MAX_STREAMS 16
+/** Seconds an unused shared stream is kept */
+#define STREAM_TIMEOUT 60
+
+typedef struct hls_stream {
+  int64_t track;
+  codec_type_t codec;
+  int bitrate;
+
+  stream_t *stream;
+  /** Muxed output not yet stored in a segment */
+  string_t *out;
+  /** Segment the stream is positioned at */
+  int next;
+
+  time_t used;
+  /** Being used by a task, not available to others */
+  bool busy;
+
+  struct hls_stream *prev_stream, *next_stream;
+} hls_stream_t;
+
+static pthread_mutex_t streams_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hls_stream_t *streams = NULL;
+static int nb_streams = 0;
+
+static int segment_duration()
+{
+  int duration = config_to_int("hls-segment-duration");
+  return duration > 0 ? duration : 10;
+}
+
+bool hls_codec_supported(codec_type_t codec)
+{
+  /* Packed audio segments can be cut at any frame boundary, containers like
+   * Ogg can't */
+  return codec == CODEC_TYPE_MP3 || codec == CODEC_TYPE_AAC;
+}
+
+int hls_segments(track_t *track)
+{
+  int segments = ceil(track->duration / segment_duration());
+  return segments > 0 ? segments : 1;
+}
+
+char *hls_segment_cache_name(track_t *track, codec_type_t codec, int bitrate,
+                             int index)
+{
+  return stringf(HLS_CACHE_DIR "/%" PRId64 "-%d-%d-%d-%" PRId64 "-%d",
+                 track->id, codec, bitrate, segment_duration(),
+                 (int64_t)library_file_mtime(track->fileid), index);
+}
+
+char *hls_playlist(track_t *track, const char *segment_uri)
+{
+  string_t *playlist = string_new();
+  int i, segments = hls_segments(track), duration = segment_duration();
+  double length;
+
+  string_appendf(playlist,
+                 "#EXTM3U\n"
+                 "#EXT-X-VERSION:3\n"
+                 "#EXT-X-PLAYLIST-TYPE:VOD\n"
+                 "#EXT-X-TARGETDURATION:%d\n"
+                 "#EXT-X-MEDIA-SEQUENCE:0\n", duration);
+
+  for (i = 0; i < segments; ++i) {
+    length = track->duration - i * duration;
+    if (length > duration || length <= 0) {
+      length = duration;
+    }
+    string_appendf(playlist, "#EXTINF:%.3f,\n%s%d\n", length, segment_uri, i);
+  }
+
+  string_append(playlist, "#EXT-X-ENDLIST\n");
+  return string_release(playlist);
+}
+
+static int stream_write(void *opaque, uint8_t *buf, int buf_size)
+{
+  hls_stream_t *hls = opaque;
+  string_nappend(hls->out, (const char *)buf, buf_size);
+  return buf_size;
+}
+
+static void free_stream(hls_stream_t *hls)
+{
+  stream_close(hls->stream);
+  string_free(hls->out);
+  free(hls);
+}
+
+static void unlink_stream(hls_stream_t *hls)
+{
+  if (hls->prev_stream) {
+    hls->prev_stream->next_stream = hls->next_stream;
+  } else {
+    streams = hls->next_stream;
+  }
+  if (hls->next_stream) {
+    hls->next_stream->prev_stream = hls->prev_stream;
+  }
+  --nb_streams;
+}
+
+static hls_stream_t *open_stream(int64_t id, codec_type_t codec, int bitrate)
+{
+  hls_stream_t *hls;
+  track_t *track;
+
+  track = library_track_by_id(id);
+  if (!track) {
+    return NULL;
+  }
+
+  hls = malloc(sizeof(hls_stream_t));
+  memset(hls, 0, sizeof(hls_stream_t));
+  hls->track = id;
+  hls->codec = codec;
+  hls->bitrate = bitrate;
+  hls->out = string_new();
+  hls->stream = stream_new();
+
+  if (!stream_open(hls->stream, track)) {
+    track_free(track);
+    free_stream(hls);
+    return NULL;
+  }
+  if ((!(config_to_bool("stream-copy")
+         && stream_copy(hls->stream, codec, bitrate))
+       && !stream_transcode(hls->stream, codec, bitrate))
+   || !stream_remux(hls->stream, stream_write, hls)) {
+    free_stream(hls);
+    return NULL;
+  }
+  stream_start(hls->stream);
+  return hls;
+}
+
+/**
+ * Takes a shared stream for producing segment @p index, preferring one that is
+ * already positioned there.
+ */
+static hls_stream_t *acquire_stream(int64_t track, codec_type_t codec,
+                                    int bitrate, int index)
+{
+  hls_stream_t *hls, *next, *found = NULL;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&streams_mutex);
+
+  for (hls = streams; hls; hls = next) {
+    next = hls->next_stream;
+
+    if (hls->busy) {
+      continue;
+    }
+    if (hls->used + STREAM_TIMEOUT < now) {
+      unlink_stream(hls);
+      free_stream(hls);
+      continue;
+    }
+    if (hls->track == track && hls->codec == codec && hls->bitrate == bitrate
+     && (!found || hls->next == index)) {
+      found = hls;
+    }
+  }
+
+  if (found) {
+    found->busy = true;
+  }
+
+  pthread_mutex_unlock(&streams_mutex);
+
+  if (found) {
+    return found;
+  }
+
+  hls = open_stream(track, codec, bitrate);
+  if (hls) {
+    hls->busy = true;
+  }
+  return hls;
+}
+
+static void release_stream(hls_stream_t *hls, bool keep)
+{
+  hls_stream_t *p, *oldest = NULL;
+
+  pthread_mutex_lock(&streams_mutex);
+
+  if (!keep) {
+    if (hls->prev_stream || streams == hls) {
+      unlink_stream(hls);
+    }
+    pthread_mutex_unlock(&streams_mutex);
+    free_stream(hls);
+    return;
+  }
+
+  hls->busy = false;
+  hls->used = time(NULL);
+
+  if (!hls->prev_stream && streams != hls) {
+    /* New stream, make room for it */
+    if (nb_streams >= MAX_STREAMS) {
+      for (p = streams; p; p = p->next_stream) {
+        if (!p->busy && (!oldest || p->used < oldest->used)) {
+          oldest = p;
+        }
+      }
+      if (oldest) {
+        unlink_stream(oldest);
+        free_stream(oldest);
+      }
+    }
+    hls->next_stream = streams;
+    if (streams) {
+      streams->prev_stream = hls;
+    }
+    streams = hls;
+    ++nb_streams;
+  }
+
+  pthread_mutex_unlock(&streams_mutex);
+}
+
+/**
+ * Produces segment @p index from @p hls to the end of hls->out.
+ * @returns false on failure
+ */
+static bool produce(hls_stream_t *hls, int index)
+{
+  int duration = segment_duration(), result;
+  int64_t end = (int64_t)(index + 1) * duration * AV_TIME_BASE;
+
+  if (hls->next != index) {
+    musicd_log(LOG_DEBUG, "hls", "seeking %" PRId64 " to segment %d",
+               hls->track, index);
+    if (!stream_seek(hls->stream, index * duration)) {
+      return false;
+    }
+    /* Whatever was left over belongs to another position */
+    string_remove_front(hls->out, string_size(hls->out));
+  }
+
+  while (hls->stream->pts < end) {
+    result = stream_next(hls->stream);
+    if (result < 0) {
+      return false;
+    }
+    if (result == 0) {
+      break;
+    }
+  }
+  avio_flush(hls->stream->dst_ctx->pb);
+
+  hls->next = index + 1;
+  return true;
+}
+
+/**
+ * Stores @p data to cache as @p name, so that readers never see it partially
+ * written.
+ */
+static void store(const char *name, string_t *data)
+{
+  char *tmp;
+  int fd = cache_begin_file(name, &tmp);
+  bool success;
+
+  if (fd < 0) {
+    return;
+  }
+  success = write(fd, string_string(data), string_size(data))
+            == (ssize_t)string_size(data);
+  cache_end_file(name, fd, tmp, success);
+}
+
+struct task_args {
+  int64_t track;
+  codec_type_t codec;
+  int bitrate;
+  int index;
+  char *cache_name;
+};
+
+static void *task_func(struct task_args *args)
+{
+  hls_stream_t *hls;
+  bool success = false;
+
+  hls = acquire_stream(args->track, args->codec, args->bitrate, args->index);
+  if (hls) {
+    success = produce(hls, args->index);
+    if (success) {
+      store(args->cache_name, hls->out);
+      string_remove_front(hls->out, string_size(hls->out));
+    } else {
+      musicd_log(LOG_ERROR, "hls", "can't produce segment %d of %" PRId64,
+                 args->index, args->track);
+    }
+    release_stream(hls, success);
+  }
+
+  free(args->cache_name);
+  free(args);
+  return NULL;
+}
+
+task_t *hls_segment_task(track_t *track, codec_type_t codec, int bitrate,
+                         int index)
+{
+  task_t *task = task_new();
+  struct task_args *args = malloc(sizeof(struct task_args));
+  args->track = track->id;
+  args->codec = codec;
+  args->bitrate = bitrate;
+  args->index = index;
+  args->cache_name = hls_segment_cache_name(track, codec, bitrate, index);
+
+  task->func = (void *(*)(void *))task_func;
+  task->data = args;
+  task->class = TASK_CLASS_CPU;
+  task->priority = TASK_PRIORITY_INTERACTIVE;
+
+  return task;
+}
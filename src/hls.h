@@ -0,0 +1,66 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_HLS_H
+#define MUSICD_HLS_H
+
+#include "format.h"
+#include "task.h"
+#include "track.h"
+
+#include <stdbool.h>
+
+/*
+ * HTTP Live Streaming: tracks are split into fixed duration segments, which
+ * are transcoded on demand and cached like thumbnails. Consecutive segments
+ * of the same track, codec and bitrate continue from a shared stream instead
+ * of seeking.
+ */
+
+/** Cache subdirectory for segments */
+#define HLS_CACHE_DIR "hls"
+
+/**
+ * @returns true if @p codec can be segmented
+ */
+bool hls_codec_supported(codec_type_t codec);
+
+/**
+ * @returns number of segments of @p track
+ */
+int hls_segments(track_t *track);
+
+/**
+ * @returns cache name of segment @p index of @p track
+ */
+char *hls_segment_cache_name(track_t *track, codec_type_t codec, int bitrate,
+                             int index);
+
+/**
+ * @returns m3u8 playlist of @p track which must be freed. Segment URIs are
+ * @p segment_uri followed by the segment index.
+ */
+char *hls_playlist(track_t *track, const char *segment_uri);
+
+/**
+ * @returns task that stores segment @p index of @p track to the cache, see
+ * hls_segment_cache_name
+ */
+task_t *hls_segment_task(track_t *track, codec_type_t codec, int bitrate,
+                         int index);
+
+#endif
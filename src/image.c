@@ -25,6 +25,7 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <FreeImage.h>
 
@@ -41,13 +42,14 @@ const char *image_mime_type(const char *path)
   return FreeImage_GetFIFMimeType(FreeImage_GetFileType(path, 0));
 }
 
-char *image_create_thumbnail(const char *path, int size, int *data_size)
+/**
+ * Loads image @p path for making thumbnails, cropping scans of multiple
+ * sheets.
+ */
+static FIBITMAP *load_image(const char *path)
 {
   FIBITMAP *img1, *img2;
-  FIMEMORY *memory;
   double ratio;
-  uint32_t msize;
-  char *mbuf, *buf;
   
   FREE_IMAGE_FORMAT format = FreeImage_GetFileType(path, 0);
   if (format == FIF_UNKNOWN) {
@@ -79,20 +81,18 @@ char *image_create_thumbnail(const char *path, int size, int *data_size)
       img1 = img2;
     }
   }
+  return img1;
+}
 
-  img2 = FreeImage_MakeThumbnail(img1, size, 1);
-  if (!img2) {
-    musicd_log(LOG_ERROR, "image", "can't scale image '%s'", path);
-    FreeImage_Unload(img1);
-    return NULL;
-  }
-
-  FreeImage_Unload(img1);
-  img1 = img2;
+static char *save_jpeg(FIBITMAP *img, int *data_size)
+{
+  FIMEMORY *memory;
+  uint32_t msize;
+  char *mbuf, *buf;
 
   memory = FreeImage_OpenMemory(NULL, 0);
   
-  FreeImage_SaveToMemory(FIF_JPEG, img1, memory, 0);
+  FreeImage_SaveToMemory(FIF_JPEG, img, memory, 0);
   
   FreeImage_AcquireMemory(memory, (BYTE **)&mbuf, &msize);
   
@@ -101,51 +101,135 @@ char *image_create_thumbnail(const char *path, int size, int *data_size)
   *data_size = msize;
   
   FreeImage_CloseMemory(memory);
+  return buf;
+}
+
+char *image_create_thumbnail(const char *path, int size, int *data_size)
+{
+  FIBITMAP *img1, *img2;
+  char *buf;
+
+  img1 = load_image(path);
+  if (!img1) {
+    return NULL;
+  }
+
+  img2 = FreeImage_MakeThumbnail(img1, size, 1);
+  if (!img2) {
+    musicd_log(LOG_ERROR, "image", "can't scale image '%s'", path);
+    FreeImage_Unload(img1);
+    return NULL;
+  }
+
   FreeImage_Unload(img1);
+
+  buf = save_jpeg(img2, data_size);
+  FreeImage_Unload(img2);
   
   return buf;
 }
 
+void image_cache_thumbnails(int64_t id, const int *sizes, int nb_sizes)
+{
+  FIBITMAP *img1, *img2;
+  char *path, *cache_name, *buf;
+  int i, size;
+
+  path = library_image_path(id);
+  if (!path) {
+    return;
+  }
+  img1 = load_image(path);
+
+  for (i = 0; i < nb_sizes; ++i) {
+    buf = NULL;
+    size = 0;
+
+    /* Each size from the previous one, much cheaper than from the source */
+    img2 = img1 ? FreeImage_MakeThumbnail(img1, sizes[i], 1) : NULL;
+    if (img2) {
+      buf = save_jpeg(img2, &size);
+      FreeImage_Unload(img1);
+      img1 = img2;
+    } else if (img1) {
+      musicd_log(LOG_ERROR, "image", "can't scale image '%s'", path);
+    }
+
+    /* Failures are cached empty like in image_task, so they aren't retried */
+    cache_name = image_cache_name(id, sizes[i]);
+    cache_set(cache_name, buf, size);
+    free(cache_name);
+    free(buf);
+  }
+
+  if (img1) {
+    FreeImage_Unload(img1);
+  }
+  free(path);
+}
+
 
 struct task_args {
-  int64_t id;
+  int nb_ids;
   int size;
+  int64_t ids[];
 };
 
-static void *task_func(struct task_args *args)
+static void create_thumbnail(int64_t id, int thumbnail_size)
 {
   char *cache_name, *source_path, *buf = NULL;
   int size = 0;
 
-  /* Round to closest power of two */
-  args->size = pow(2, ceil(log(args->size)/log(2)));
-
-  source_path = library_image_path(args->id);
+  source_path = library_image_path(id);
   if (source_path) {
-    buf = image_create_thumbnail(source_path, args->size, &size);
+    buf = image_create_thumbnail(source_path, thumbnail_size, &size);
   }
 
-  cache_name = image_cache_name(args->id, args->size);
+  cache_name = image_cache_name(id, thumbnail_size);
 
   cache_set(cache_name, buf, size);
   
   free(source_path);
   free(cache_name);
   free(buf);
+}
+
+static void *task_func(struct task_args *args)
+{
+  int i;
+
+  /* Round to closest power of two */
+  args->size = pow(2, ceil(log(args->size)/log(2)));
+
+  for (i = 0; i < args->nb_ids; ++i) {
+    create_thumbnail(args->ids[i], args->size);
+  }
+
   free(args);
   return NULL;
 }
 
 task_t *image_task(int64_t id, int size)
+{
+  task_t *task = image_list_task(&id, 1, size);
+  /* Thumbnails are keyed by cache name, so concurrent misses share a task */
+  task->key = image_cache_name(id, size);
+  return task;
+}
+
+task_t *image_list_task(const int64_t *ids, int nb_ids, int size)
 {
   task_t *task = task_new();
-  struct task_args *args = malloc(sizeof(struct task_args));
-  args->id = id;
+  struct task_args *args =
+    malloc(sizeof(struct task_args) + sizeof(int64_t) * nb_ids);
+  memcpy(args->ids, ids, sizeof(int64_t) * nb_ids);
+  args->nb_ids = nb_ids;
   args->size = size;
 
   task->func = (void *(*)(void *))task_func;
   task->data = args;
-  task->worker = 1;
+  task->class = TASK_CLASS_CPU;
+  task->priority = TASK_PRIORITY_INTERACTIVE;
 
   return task;
 }
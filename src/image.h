@@ -22,6 +22,10 @@
 
 #include <stdint.h>
 
+/** Range of thumbnail sizes, which are rounded up to powers of two */
+#define IMAGE_SIZE_MIN 16
+#define IMAGE_SIZE_MAX 512
+
 /**
  * @Returns cache name for image of id @p image of @p size size.
  */
@@ -35,7 +39,24 @@ const char *image_mime_type(const char *path);
  */
 char *image_create_thumbnail(const char *path, int size, int *data_size);
 
+/**
+ * Makes thumbnails of image @p id in all @p nb_sizes @p sizes, which must be
+ * powers of two from the largest to the smallest, and stores them in the
+ * cache. The image is decoded once and each size is scaled from the previous
+ * one.
+ */
+void image_cache_thumbnails(int64_t id, const int *sizes, int nb_sizes);
+
 
+/**
+ * Makes a thumbnail of @p id into the cache. Tasks for the same thumbnail
+ * started while one is in flight wait for it instead of scaling again.
+ */
 task_t *image_task(int64_t id, int size);
+/**
+ * Like image_task, but makes thumbnails of all @p nb_ids images @p ids in one
+ * task, one after another.
+ */
+task_t *image_list_task(const int64_t *ids, int nb_ids, int size);
 
 #endif
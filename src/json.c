@@ -29,7 +29,12 @@ static void comma(json_t *json)
 
 void json_init(json_t *json)
 {
-  json->buf = string_new();
+  json_init_in(json, NULL);
+}
+
+void json_init_in(json_t *json, arena_t *arena)
+{
+  json->buf = string_new_in(arena);
   json->comma = 0;
 }
 
@@ -43,6 +48,16 @@ const char *json_result(json_t *json)
   return string_string(json->buf);
 }
 
+size_t json_length(json_t *json)
+{
+  return string_size(json->buf);
+}
+
+void json_clear(json_t *json)
+{
+  string_remove_front(json->buf, string_size(json->buf));
+}
+
 void json_object_begin(json_t *json)
 {
   comma(json);
@@ -31,8 +31,17 @@ typedef struct json {
 } json_t;
 
 void json_init(json_t *json);
+/** Like json_init, but the output is allocated from @p arena */
+void json_init_in(json_t *json, arena_t *arena);
 void json_finish(json_t *json);
 const char *json_result(json_t *json);
+/** @returns length of json_result */
+size_t json_length(json_t *json);
+/**
+ * Discards the output so far, serialization continues where it was. Used to
+ * send the document in parts.
+ */
+void json_clear(json_t *json);
 
 void json_object_begin(json_t *json);
 void json_object_end(json_t *json);
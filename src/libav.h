@@ -30,6 +30,7 @@
   #define resampler_alloc swr_alloc
   #define resampler_init swr_init
   #define resampler_free swr_free
+  #define resampler_close swr_close
   #define resampler_convert swr_convert
 #else
   #include <libavresample/avresample.h>
@@ -37,6 +38,7 @@
   #define resampler_alloc avresample_alloc_context
   #define resampler_init avresample_open
   #define resampler_free avresample_free
+  #define resampler_close avresample_close
   #define resampler_convert(resampler, out, out_count, in, in_count) \
     avresample_convert(resampler, out, 0, out_count, (uint8_t **)in, 0, in_count)
 #endif
@@ -33,7 +33,7 @@ int library_open()
 
 static bool prepare_query(const char *sql, sqlite3_stmt **query)
 {
-  if (sqlite3_prepare_v2(db_handle(), sql, -1, query, NULL) != SQLITE_OK) {
+  if (db_prepare(sql, query) != SQLITE_OK) {
     musicd_log(LOG_ERROR, "library", "can't prepare '%s': %s",
                sql, db_error());
     return false;
@@ -41,6 +41,20 @@ static bool prepare_query(const char *sql, sqlite3_stmt **query)
   return true;
 }
 
+/**
+ * prepare_query for statements that only read, which go to the reader
+ * connection of the calling thread.
+ */
+static bool prepare_read(const char *sql, sqlite3_stmt **query)
+{
+  if (db_prepare_read(sql, query) != SQLITE_OK) {
+    musicd_log(LOG_ERROR, "library", "can't prepare '%s': %s",
+               sql, sqlite3_errmsg(db_reader()));
+    return false;
+  }
+  return true;
+}
+
 static bool execute(sqlite3_stmt *query)
 {
   int result = sqlite3_step(query);
@@ -51,7 +65,7 @@ static bool execute(sqlite3_stmt *query)
                sqlite3_sql(query));
     result = false;
   }
-  sqlite3_finalize(query);
+  db_release(query);
   return result;
 }
 
@@ -67,7 +81,7 @@ static int64_t execute_scalar(sqlite3_stmt *query)
                sqlite3_sql(query));
     result = -1;
   }
-  sqlite3_finalize(query);
+  db_release(query);
   return result;
 }
 
@@ -115,6 +129,148 @@ static int64_t field_rowid_create(const char *table, const char *field, const ch
   return sqlite3_last_insert_rowid(db_handle());
 }
 
+/*
+ * Artist and album name to rowid maps used while scanning, so that every
+ * track of an album doesn't look the same names up again. The least recently
+ * used names are dropped once a map has NAMES_MAX of them.
+ */
+
+#define NAMES_BUCKETS 1024
+#define NAMES_MAX 4096
+
+typedef struct name_entry {
+  char *name;
+  unsigned hash;
+  int64_t id;
+  /** Bucket chain */
+  struct name_entry *next;
+  /** Use order, most recent first */
+  struct name_entry *newer, *older;
+} name_entry_t;
+
+typedef struct name_map {
+  const char *table;
+  name_entry_t *buckets[NAMES_BUCKETS];
+  name_entry_t *newest, *oldest;
+  int count;
+} name_map_t;
+
+static bool names_active = false;
+static name_map_t artist_names = { "artists", { NULL }, NULL, NULL, 0 };
+static name_map_t album_names = { "albums", { NULL }, NULL, NULL, 0 };
+
+static void name_unlink(name_map_t *map, name_entry_t *entry)
+{
+  if (entry->newer) {
+    entry->newer->older = entry->older;
+  } else {
+    map->newest = entry->older;
+  }
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    map->oldest = entry->newer;
+  }
+}
+
+static void name_push(name_map_t *map, name_entry_t *entry)
+{
+  entry->newer = NULL;
+  entry->older = map->newest;
+  if (map->newest) {
+    map->newest->newer = entry;
+  } else {
+    map->oldest = entry;
+  }
+  map->newest = entry;
+}
+
+static void name_evict(name_map_t *map)
+{
+  name_entry_t *entry = map->oldest, **prev;
+
+  name_unlink(map, entry);
+  for (prev = &map->buckets[entry->hash % NAMES_BUCKETS]; *prev != entry;
+       prev = &(*prev)->next) { }
+  *prev = entry->next;
+
+  free(entry->name);
+  free(entry);
+  --map->count;
+}
+
+/**
+ * field_rowid_create for the name field of @p map's table, through @p map
+ * when scanning.
+ */
+static int64_t name_rowid(name_map_t *map, const char *name)
+{
+  name_entry_t *entry;
+  unsigned hash;
+  int64_t id;
+
+  if (!names_active) {
+    return field_rowid_create(map->table, "name", name);
+  }
+
+  hash = strhash(name);
+  for (entry = map->buckets[hash % NAMES_BUCKETS]; entry;
+       entry = entry->next) {
+    if (entry->hash == hash && !strcmp(entry->name, name)) {
+      name_unlink(map, entry);
+      name_push(map, entry);
+      return entry->id;
+    }
+  }
+
+  id = field_rowid_create(map->table, "name", name);
+  if (id <= 0) {
+    return id;
+  }
+
+  if (map->count >= NAMES_MAX) {
+    name_evict(map);
+  }
+
+  entry = malloc(sizeof(name_entry_t));
+  entry->name = strcopy(name);
+  entry->hash = hash;
+  entry->id = id;
+  entry->next = map->buckets[hash % NAMES_BUCKETS];
+  map->buckets[hash % NAMES_BUCKETS] = entry;
+  name_push(map, entry);
+  ++map->count;
+  return id;
+}
+
+void library_names_begin()
+{
+  names_active = true;
+}
+
+void library_names_end()
+{
+  names_active = false;
+  while (artist_names.count > 0) {
+    name_evict(&artist_names);
+  }
+  while (album_names.count > 0) {
+    name_evict(&album_names);
+  }
+}
+
+static int64_t generation = 0;
+
+int64_t library_generation()
+{
+  return __sync_add_and_fetch(&generation, 0);
+}
+
+void library_changed()
+{
+  __sync_add_and_fetch(&generation, 1);
+}
+
 static void increment_album_tracks(int64_t album)
 {
   static const char *sql =
@@ -139,7 +295,7 @@ char *library_root_path()
   int result;
   char *path = NULL;;
 
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return NULL;
   }
 
@@ -151,16 +307,17 @@ char *library_root_path()
     path = strcopy((const char *)sqlite3_column_text(query, 0));
   }
 
-  sqlite3_finalize(query);
+  db_release(query);
   return path;
 }
 
 int64_t library_track_add(track_t *track, int64_t directory)
 {
   static const char *sql =
-    "INSERT INTO tracks (fileid, file, cuefileid, cuefile, track, title, artistid, artist, albumid, album, start, duration, trackindex) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    "INSERT INTO tracks (fileid, file, cuefileid, cuefile, track, title, artistid, artist, albumid, album, start, duration, trackindex, directory) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
 
   sqlite3_stmt *query;
+  const char *slash;
 
   if (!prepare_query(sql, &query)) {
     return -1;
@@ -172,10 +329,10 @@ int64_t library_track_add(track_t *track, int64_t directory)
   }
 
   if (track->artist) {
-    track->artistid = field_rowid_create("artists", "name", track->artist);
+    track->artistid = name_rowid(&artist_names, track->artist);
   }
   if (track->album) {
-    track->albumid = field_rowid_create("albums", "name", track->album);
+    track->albumid = name_rowid(&album_names, track->album);
   }
 
   sqlite3_bind_int64(query, 1, track->fileid);
@@ -191,6 +348,11 @@ int64_t library_track_add(track_t *track, int64_t directory)
   sqlite3_bind_double(query, 11, track->start);
   sqlite3_bind_double(query, 12, track->duration);
   sqlite3_bind_double(query, 13, track->trackindex);
+  /* Directory of the file for directory filters, see query.c */
+  slash = track->file ? strrchr(track->file, '/') : NULL;
+  if (slash) {
+    sqlite3_bind_text(query, 14, track->file, slash - track->file, NULL);
+  }
 
   if (!execute(query)) {
     return -1;
@@ -234,7 +396,7 @@ time_t library_file_mtime(int64_t file)
   static const char *sql = "SELECT mtime FROM files WHERE rowid = ?";
   sqlite3_stmt *query;
   
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return -1;
   }
   
@@ -287,7 +449,7 @@ void library_iterate_files_by_directory
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
   
-  sqlite3_finalize(query);
+  db_release(query);
 }
 
 void library_file_clear(int64_t file)
@@ -296,6 +458,7 @@ void library_file_clear(int64_t file)
     "UPDATE albums SET tracks = (SELECT COUNT(tracks.rowid) FROM tracks WHERE tracks.albumid = albums.rowid AND tracks.fileid != ?1) WHERE albums.rowid IN (SELECT albumid FROM tracks WHERE fileid = ?1)";
   static const char *sql_tracks = "DELETE FROM tracks WHERE fileid = ?";
   static const char *sql_images = "DELETE FROM images WHERE fileid = ?";
+  static const char *sql_seekindex = "DELETE FROM seekindex WHERE fileid = ?";
   sqlite3_stmt *query;
   
   if (!prepare_query(sql_album_tracks, &query)) {
@@ -315,6 +478,60 @@ void library_file_clear(int64_t file)
   }
   sqlite3_bind_int64(query, 1, file);
   execute(query);
+
+  if (!prepare_query(sql_seekindex, &query)) {
+    return;
+  }
+  sqlite3_bind_int64(query, 1, file);
+  execute(query);
+}
+
+void library_seek_index_set(int64_t file, double interval,
+                            const int64_t *positions, int count)
+{
+  static const char *sql =
+    "INSERT OR REPLACE INTO seekindex (fileid, interval, positions) VALUES(?, ?, ?)";
+  sqlite3_stmt *query;
+
+  if (!prepare_query(sql, &query)) {
+    return;
+  }
+
+  sqlite3_bind_int64(query, 1, file);
+  sqlite3_bind_double(query, 2, interval);
+  sqlite3_bind_blob(query, 3, positions, count * sizeof(int64_t),
+                    SQLITE_STATIC);
+
+  execute(query);
+}
+
+int64_t *library_seek_index(int64_t file, double *interval, int *count)
+{
+  static const char *sql =
+    "SELECT interval, positions FROM seekindex WHERE fileid = ?";
+  sqlite3_stmt *query;
+  int64_t *positions = NULL;
+  int size;
+
+  if (!prepare_read(sql, &query)) {
+    return NULL;
+  }
+
+  sqlite3_bind_int64(query, 1, file);
+
+  if (sqlite3_step(query) == SQLITE_ROW) {
+    size = sqlite3_column_bytes(query, 1);
+    if (size >= (int)sizeof(int64_t)) {
+      *interval = sqlite3_column_double(query, 0);
+      *count = size / sizeof(int64_t);
+      positions = malloc(*count * sizeof(int64_t));
+      memcpy(positions, sqlite3_column_blob(query, 1),
+             *count * sizeof(int64_t));
+    }
+  }
+
+  db_release(query);
+  return positions;
 }
 
 
@@ -369,7 +586,7 @@ char *library_directory_path(int64_t directory)
   int result;
   char *path = NULL;;
 
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return NULL;
   }
 
@@ -383,7 +600,7 @@ char *library_directory_path(int64_t directory)
     path = strcopy((const char *)sqlite3_column_text(query, 0));
   }
 
-  sqlite3_finalize(query);
+  db_release(query);
   return path;
 }
 static bool delete_files_cb(library_file_t *file)
@@ -485,7 +702,7 @@ void library_iterate_directories
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
   
-  sqlite3_finalize(query);
+  db_release(query);
 }
 
 
@@ -517,7 +734,7 @@ char *library_image_path(int64_t image)
   int result;
   char *path = NULL;;
 
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return NULL;
   }
 
@@ -531,7 +748,7 @@ char *library_image_path(int64_t image)
     path = strcopy((const char *)sqlite3_column_text(query, 0));
   }
 
-  sqlite3_finalize(query);
+  db_release(query);
   return path;
 }
 
@@ -541,7 +758,7 @@ int64_t library_album_image(int64_t album)
     "SELECT imageid FROM albums WHERE rowid = ?";
   sqlite3_stmt *query;
 
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return 0;
   }
 
@@ -550,6 +767,64 @@ int64_t library_album_image(int64_t album)
   return execute_scalar(query);
 }
 
+void library_album_image_list
+  (const int64_t *albums, int nb_albums, int64_t *images)
+{
+  static const char *sql =
+    "SELECT rowid, imageid FROM albums "
+    "WHERE rowid IN (SELECT value FROM json_each(?))";
+  sqlite3_stmt *query;
+  string_t *ids = string_new();
+  int64_t album;
+  int i;
+
+  for (i = 0; i < nb_albums; ++i) {
+    string_appendf(ids, "%s%" PRId64 "", i ? "," : "[", albums[i]);
+    images[i] = 0;
+  }
+  string_append(ids, "]");
+
+  if (!prepare_read(sql, &query)) {
+    string_free(ids);
+    return;
+  }
+  sqlite3_bind_text(query, 1, string_string(ids), -1, NULL);
+
+  while (sqlite3_step(query) == SQLITE_ROW) {
+    album = sqlite3_column_int64(query, 0);
+    for (i = 0; i < nb_albums; ++i) {
+      if (albums[i] == album) {
+        images[i] = sqlite3_column_int64(query, 1);
+      }
+    }
+  }
+  db_release(query);
+  string_free(ids);
+}
+
+int library_album_image_ids(int64_t **images)
+{
+  static const char *sql =
+    "SELECT DISTINCT imageid FROM albums WHERE imageid > 0";
+  sqlite3_stmt *query;
+  int nb_images = 0, max_images = 0;
+
+  *images = NULL;
+  if (!prepare_read(sql, &query)) {
+    return 0;
+  }
+
+  while (sqlite3_step(query) == SQLITE_ROW) {
+    if (nb_images == max_images) {
+      max_images = max_images ? max_images * 2 : 64;
+      *images = realloc(*images, sizeof(int64_t) * max_images);
+    }
+    (*images)[nb_images++] = sqlite3_column_int64(query, 0);
+  }
+  db_release(query);
+  return nb_images;
+}
+
 void library_album_image_set(int64_t album, int64_t image)
 {
   static const char *sql = "UPDATE albums SET imageid = ? WHERE rowid = ?";
@@ -575,7 +850,7 @@ void library_iterate_images_by_directory
   library_image_t image;
   bool cb_result = true;
   
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return;
   }
   
@@ -597,7 +872,7 @@ void library_iterate_images_by_directory
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
   
-  sqlite3_finalize(query);
+  db_release(query);
 }
 
 
@@ -611,7 +886,7 @@ void library_iterate_images_by_album
   library_image_t image;
   bool cb_result = true;
 
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return;
   }
 
@@ -633,10 +908,40 @@ void library_iterate_images_by_album
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
 
-  sqlite3_finalize(query);
+  db_release(query);
 }
 
 
+void library_iterate_album_images
+  (bool (*callback)(library_image_t *image, void *opaque), void *opaque)
+{
+  static const char *sql =
+    "SELECT images.rowid AS id, files.path AS path, files.directoryid AS directoryid, images.albumid AS albumid FROM images JOIN files ON images.fileid = files.rowid WHERE images.albumid > 0 ORDER BY images.albumid";
+  sqlite3_stmt *query;
+  int result;
+  library_image_t image;
+
+  if (!prepare_read(sql, &query)) {
+    return;
+  }
+
+  while ((result = sqlite3_step(query)) == SQLITE_ROW) {
+    image.id = sqlite3_column_int64(query, 0);
+    image.path = (const char*)sqlite3_column_text(query, 1);
+    image.directory = sqlite3_column_int64(query, 2);
+    image.album = sqlite3_column_int64(query, 3);
+
+    if (!callback(&image, opaque)) {
+      break;
+    }
+  }
+  if (result != SQLITE_DONE && result != SQLITE_ROW) {
+    musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
+  }
+
+  db_release(query);
+}
+
 int64_t library_album_by_directory(int64_t directory)
 {
   static const char *sql =
@@ -674,13 +979,13 @@ lyrics_t *library_lyrics(int64_t track, time_t *time)
     "SELECT lyrics, provider, source, mtime FROM lyrics WHERE trackid = ?";
   sqlite3_stmt *query;
   int result;
-  lyrics_t *lyrics;
+  lyrics_t *lyrics = NULL;
 
   if (time) {
     *time = 0;
   }
 
-  if (!prepare_query(sql, &query)) {
+  if (!prepare_read(sql, &query)) {
     return NULL;
   }
   
@@ -694,21 +999,21 @@ lyrics_t *library_lyrics(int64_t track, time_t *time)
     if (time) {
       *time = sqlite3_column_int64(query, 3);
     }
-    if (!sqlite3_column_text(query, 0)) {
-      return NULL;
+    if (sqlite3_column_text(query, 0)) {
+      lyrics = lyrics_new();
+      lyrics->lyrics = strcopy((const char *)sqlite3_column_text(query, 0));
+      if (sqlite3_column_text(query, 1)) {
+        lyrics->provider =
+          strcopy((const char *)sqlite3_column_text(query, 1));
+      }
+      if (sqlite3_column_text(query, 2)) {
+        lyrics->source = strcopy((const char *)sqlite3_column_text(query, 2));
+      }
     }
-
-    lyrics = lyrics_new();
-    lyrics->lyrics = strcopy((const char *)sqlite3_column_text(query, 0));
-    if (sqlite3_column_text(query, 1)) {
-      lyrics->provider = strcopy((const char *)sqlite3_column_text(query, 1));
-    }
-    if (sqlite3_column_text(query, 2)) {
-      lyrics->source = strcopy((const char *)sqlite3_column_text(query, 2));
-    }
-    return lyrics;
   }
-  return NULL;
+
+  db_release(query);
+  return lyrics;
 }
 
 void library_lyrics_set(int64_t track, lyrics_t *lyrics)
@@ -742,9 +1047,7 @@ track_t *library_track_by_id(int64_t id)
   static const char *sql =
     "SELECT rowid AS id, fileid, file, cuefileid, cuefile, track, title, artistid, artist, albumid, album, start, duration, trackindex FROM tracks WHERE rowid = ?";
 
-  if (sqlite3_prepare_v2(db_handle(), sql, -1, &stmt, NULL) != SQLITE_OK) {
-    musicd_log(LOG_ERROR, "library", "can't prepare '%s': %s", sql,
-               db_error());
+  if (!prepare_read(sql, &stmt)) {
     return NULL;
   }
 
@@ -752,9 +1055,11 @@ track_t *library_track_by_id(int64_t id)
 
   result = sqlite3_step(stmt);
   if (result == SQLITE_DONE) {
+    db_release(stmt);
     return NULL;
   } else if (result != SQLITE_ROW) {
     musicd_log(LOG_ERROR, "library", "library_track_by_id: sqlite3_step failed");
+    db_release(stmt);
     return NULL;
   }
 
@@ -778,7 +1083,7 @@ track_t *library_track_by_id(int64_t id)
              track->id, track->file, track->cuefile, track->track, track->title, track->artist,
              track->album, track->start, track->duration);*/
 
-  sqlite3_finalize(stmt);
+  db_release(stmt);
 
   return track;
 }
@@ -786,7 +1091,7 @@ track_t *library_track_by_id(int64_t id)
 int64_t library_tracks_total()
 {
   sqlite3_stmt *query;
-  if (!prepare_query("SELECT COUNT(rowid) FROM tracks", &query)) {
+  if (!prepare_read("SELECT COUNT(rowid) FROM tracks", &query)) {
     return 0;
   }
   return execute_scalar(query);
@@ -794,8 +1099,16 @@ int64_t library_tracks_total()
 
 int64_t library_randomid()
 {
+  /* First track from a random point of the rowid range: two index lookups
+   * instead of sorting the table. Tracks after gaps in the range are a bit
+   * more likely. */
+  static const char *sql =
+    "SELECT rowid FROM tracks WHERE rowid >= "
+    "(SELECT MIN(rowid) + ABS(RANDOM() % (MAX(rowid) - MIN(rowid) + 1)) "
+    "FROM tracks) "
+    "ORDER BY rowid LIMIT 1";
   sqlite3_stmt *query;
-  if (!prepare_query("SELECT rowid FROM tracks ORDER BY RANDOM() LIMIT 1", &query)) {
+  if (!prepare_read(sql, &query)) {
     return 0;
   }
   return execute_scalar(query);
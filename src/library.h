@@ -36,6 +36,26 @@ char *library_root_path();
 
 int64_t library_track_add(track_t *track, int64_t directory);
 
+/**
+ * Makes library_track_add remember artist and album ids of recently added
+ * tracks until library_names_end. Meant for the scan, which is the only one
+ * adding tracks and does so from one thread at a time.
+ */
+void library_names_begin();
+void library_names_end();
+
+/**
+ * @returns library generation, which changes whenever changes to the library
+ * are committed. Anything derived from the library at one generation is
+ * stale at another.
+ */
+int64_t library_generation();
+
+/**
+ * Bumps the library generation, called after committing changes.
+ */
+void library_changed();
+
 /**
  * Returns id of file located by @p path. If it does not exist in the database,
  * it can be created depending on @p directory.
@@ -53,6 +73,17 @@ void library_file_clear(int64_t file);
  * Calls library_file_clear and removes the @p file entry from database.
  */
 void library_file_delete(int64_t file);
+/**
+ * Stores seek index of @p file: byte positions of the packets at every
+ * @p interval seconds from the beginning of the file.
+ */
+void library_seek_index_set(int64_t file, double interval,
+                            const int64_t *positions, int count);
+/**
+ * @returns seek index of @p file which must be freed, storing its interval to
+ * @p interval and number of positions to @p count, or NULL if there is none
+ */
+int64_t *library_seek_index(int64_t file, double *interval, int *count);
 /**
  * @Returns mtime of @p file
  */
@@ -141,6 +172,17 @@ typedef struct {
 char *library_image_path(int64_t image);
 
 int64_t library_album_image(int64_t album);
+/**
+ * Looks up the images of @p nb_albums @p albums with one query, storing them
+ * to @p images in the same order, 0 for albums without an image.
+ */
+void library_album_image_list
+  (const int64_t *albums, int nb_albums, int64_t *images);
+/**
+ * Stores ids of all album images to @p images, to be freed with free().
+ * @returns the number of images
+ */
+int library_album_image_ids(int64_t **images);
 void library_album_image_set(int64_t album, int64_t image);
 
 void library_iterate_images_by_directory
@@ -151,6 +193,13 @@ void library_iterate_images_by_album
    bool (*callback)(library_image_t *image, void *opaque),
    void *opaque);
 
+/**
+ * Iterates through images of all albums, ordered by album. Stops when
+ * @p callback returns false.
+ */
+void library_iterate_album_images
+  (bool (*callback)(library_image_t *image, void *opaque), void *opaque);
+
 
 /**
  * @Returns most common album of tracks in files located in @p directory.
@@ -172,7 +221,9 @@ lyrics_t *library_lyrics(int64_t track, time_t *time);
 
 /**
  * Sets lyrics of @p track to @p lyrics. Timestamp is automatically modified.
- */ 
+ * NULL @p lyrics stores that none were found, to be retried after
+ * lyrics-retry hours.
+ */
 void library_lyrics_set(int64_t track, lyrics_t *lyrics);
 
 track_t *library_track_by_id(int64_t id);
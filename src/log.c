@@ -18,66 +18,278 @@
 #include "log.h"
 
 #include "config.h"
+#include "event.h"
+#include "json.h"
 #include "libav.h"
+#include "metrics.h"
 
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+/*
+ * Messages are formatted by the calling thread into a bounded ring and
+ * written by a writer thread, so a slow stderr never stalls request handling.
+ * The ring is a multi-producer single-consumer queue with a sequence number
+ * per entry: producers claim entries with compare-and-swap on the head, and
+ * the writer frees them by advancing the sequence a lap. Messages that don't
+ * fit are dropped and counted.
+ *
+ * Before log_start, and for fatal messages, lines are written directly.
+ */
+
+#define LOG_ENTRIES 512
+#define LOG_MESSAGE_SIZE 2048
+/* Milliseconds to wait for queued lines on exit or fatal messages */
+#define FLUSH_TIMEOUT 1000
+
+typedef struct log_entry {
+  volatile unsigned int seq;
+  int level;
+  time_t time;
+  char subsys[32];
+  char message[LOG_MESSAGE_SIZE];
+} log_entry_t;
 
 int log_level = LOG_INFO;
 const char *log_time_format = "%H:%M:%S";
+static bool log_json = false;
+
+static log_entry_t ring[LOG_ENTRIES];
+static volatile unsigned int head = 0, tail = 0;
+static volatile int started = 0, writer_sleeping = 0;
+static volatile unsigned int dropped = 0;
+static event_signal_t wakeup;
+
+/* Plain loads of shared counters aren't ordered, so read them atomically */
+#define load(ptr) __sync_fetch_and_add(ptr, 0)
+
+static const char *level_names[] = {
+  "fatal", "error", "warning", "info", "verbose", "debug"
+};
 
-static void print
-  (int level, const char * subsys, const char *fmt, va_list va_args)
+static void write_line(int level, time_t time, const char *subsys,
+                       const char *message)
 {
-  time_t now;
+  struct tm tm;
   char timestr[128];
-  
-  now = time(NULL);
-  
-  if (!strftime(timestr, sizeof(timestr), log_time_format, localtime(&now))) {
+  char line[LOG_MESSAGE_SIZE + 256];
+  json_t json;
+  int n;
+
+  localtime_r(&time, &tm);
+
+  if (log_json) {
+    if (!strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%S%z", &tm)) {
+      timestr[0] = '\0';
+    }
+    json_init(&json);
+    json_object_begin(&json);
+    json_define(&json, "time");    json_string(&json, timestr);
+    json_define(&json, "level");   json_string(&json, level_names[level]);
+    json_define(&json, "subsys");  json_string(&json, subsys);
+    json_define(&json, "message"); json_string(&json, message);
+    json_object_end(&json);
+    fprintf(stderr, "%s\n", json_result(&json));
+    json_finish(&json);
+    return;
+  }
+
+  if (!strftime(timestr, sizeof(timestr), log_time_format, &tm)) {
     timestr[0] = '\0';
   }
-  
-  if (level == LOG_ERROR) {
-    fprintf(stderr, "\033[1;31;40m");
+
+  n = snprintf(line, sizeof(line), "%s%s [%s] %s%s\n",
+               level == LOG_ERROR ? "\033[1;31;40m" :
+               level == LOG_FATAL ? "\033[0;1;41m" : "",
+               timestr, subsys, message,
+               level <= LOG_ERROR ? "\033[0m" : "");
+  if (n >= (int)sizeof(line)) {
+    n = sizeof(line) - 1;
+    line[n - 1] = '\n';
+  }
+  /* One write per line keeps lines from different threads whole */
+  fwrite(line, 1, n, stderr);
+}
+
+static void format(char *buf, const char *fmt, va_list va_args,
+                   const char *error)
+{
+  int n = vsnprintf(buf, LOG_MESSAGE_SIZE, fmt, va_args);
+  if (error && n >= 0 && n < LOG_MESSAGE_SIZE) {
+    snprintf(buf + n, LOG_MESSAGE_SIZE - n, ": %s", error);
+  }
+}
+
+/**
+ * Waits a while for the writer to catch up.
+ */
+static void flush()
+{
+  int waited;
+
+  for (waited = 0;
+       started && load(&tail) != load(&head) && waited < FLUSH_TIMEOUT;
+       ++waited) {
+    usleep(1000);
+  }
+}
+
+static void enqueue(int level, const char *subsys, const char *fmt,
+                    va_list va_args, const char *error)
+{
+  log_entry_t *entry;
+  unsigned int pos = load(&head);
+  int diff;
+
+  while (1) {
+    entry = &ring[pos % LOG_ENTRIES];
+    diff = (int)(load(&entry->seq) - pos);
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&head, pos, pos + 1)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* Full, the entry is a lap behind */
+      __sync_fetch_and_add(&dropped, 1);
+      metrics_count(METRICS_LOG_DROPPED, 1);
+      return;
+    }
+    pos = load(&head);
+  }
+
+  entry->level = level;
+  entry->time = time(NULL);
+  snprintf(entry->subsys, sizeof(entry->subsys), "%s", subsys);
+  format(entry->message, fmt, va_args, error);
+
+  /* Publishes the entry, pos to pos + 1 */
+  __sync_fetch_and_add(&entry->seq, 1);
+
+  if (__sync_bool_compare_and_swap(&writer_sleeping, 1, 0)) {
+    event_signal_raise(&wakeup);
+  }
+}
+
+static void print(int level, const char *subsys, const char *fmt,
+                  va_list va_args, const char *error)
+{
+  char message[LOG_MESSAGE_SIZE];
+
+  if (started && level != LOG_FATAL) {
+    enqueue(level, subsys, fmt, va_args, error);
+    return;
+  }
+
+  /* Fatal messages are usually followed by exiting, so written right away
+   * after what is already queued */
+  flush();
+  format(message, fmt, va_args, error);
+  flockfile(stderr);
+  write_line(level, time(NULL), subsys, message);
+  funlockfile(stderr);
+}
+
+static bool ring_empty()
+{
+  unsigned int pos = load(&tail);
+  return load(&ring[pos % LOG_ENTRIES].seq) != pos + 1;
+}
+
+static void *thread_func(void *data)
+{
+  struct pollfd pfd;
+  log_entry_t *entry;
+  unsigned int lost, pos;
+  char message[64];
+
+  (void)data;
+
+  pfd.fd = event_signal_fd(&wakeup);
+  pfd.events = POLLIN;
+
+  while (1) {
+    if ((lost = __sync_lock_test_and_set(&dropped, 0))) {
+      snprintf(message, sizeof(message), "%u messages dropped", lost);
+      write_line(LOG_WARNING, time(NULL), "log", message);
+    }
+
+    if (!ring_empty()) {
+      pos = load(&tail);
+      entry = &ring[pos % LOG_ENTRIES];
+      write_line(entry->level, entry->time, entry->subsys, entry->message);
+      /* Frees the entry for the next lap */
+      __sync_fetch_and_add(&entry->seq, LOG_ENTRIES - 1);
+      __sync_fetch_and_add(&tail, 1);
+      continue;
+    }
+
+    /* Producers raise the signal only after seeing this set, so check once
+     * more before sleeping */
+    __sync_bool_compare_and_swap(&writer_sleeping, 0, 1);
+    if (!ring_empty()) {
+      __sync_bool_compare_and_swap(&writer_sleeping, 1, 0);
+      continue;
+    }
+    poll(&pfd, 1, 1000);
+    event_signal_clear(&wakeup);
+    __sync_bool_compare_and_swap(&writer_sleeping, 1, 0);
+  }
+
+  return NULL;
+}
+
+void log_start()
+{
+  pthread_t thread;
+  unsigned int i;
+
+  if (started) {
+    return;
   }
-  if (level == LOG_FATAL) {
-    fprintf(stderr, "\033[0;1;41m");
+
+  for (i = 0; i < LOG_ENTRIES; ++i) {
+    ring[i].seq = i;
   }
-  
-  fprintf(stderr, "%s [%s] ", timestr, subsys);
-  vfprintf(stderr, fmt, va_args);
-  
-  if (level <= LOG_ERROR) {
-    fprintf(stderr, "\033[0m");
+
+  if (event_signal_init(&wakeup)
+   || pthread_create(&thread, NULL, thread_func, NULL)) {
+    musicd_perror(LOG_ERROR, "log", "can't start log writer, logging directly");
+    return;
   }
+  pthread_detach(thread);
 
+  atexit(flush);
+  started = 1;
 }
 
-void musicd_log(int level, const char *subsys, const char *fmt, ...)
+void (musicd_log)(int level, const char *subsys, const char *fmt, ...)
 {
   va_list va_args;
   if (level > log_level) {
     return;
   }
   va_start(va_args, fmt);
-  print(level, subsys, fmt, va_args);
-  fprintf(stderr, "\n");
+  print(level, subsys, fmt, va_args, NULL);
   va_end(va_args);
 }
 
-void musicd_perror(int level, const char *subsys, const char *fmt, ... )
+void (musicd_perror)(int level, const char *subsys, const char *fmt, ... )
 {
   va_list va_args;
+  int error = errno;
   if (level > log_level) {
     return;
   }
   va_start(va_args, fmt);
-  print(level, subsys, fmt, va_args);
-  fprintf(stderr, ": %s\n", strerror(errno));
+  print(level, subsys, fmt, va_args, strerror(error));
   va_end(va_args);
 }
 
@@ -109,3 +321,7 @@ void log_time_format_changed(char* format)
   log_time_format = format;
 }
 
+void log_format_changed(char *format)
+{
+  log_json = !strcmp(format, "json");
+}
@@ -25,10 +25,30 @@
 #define LOG_VERBOSE 4
 #define LOG_DEBUG 5
 
+extern int log_level;
+
+/** @returns true if messages of @p level are printed */
+#define log_enabled(level) ((level) <= log_level)
+
 void musicd_log(int level, const char *subsys, const char *fmt, ...);
 void musicd_perror(int level, const char *subsys, const char *fmt, ...);
 
+/* Level is checked before the arguments are evaluated or anything is
+ * formatted, so disabled debug messages cost a comparison. */
+#define musicd_log(level, ...) \
+  (log_enabled(level) ? musicd_log(level, __VA_ARGS__) : (void)0)
+#define musicd_perror(level, ...) \
+  (log_enabled(level) ? musicd_perror(level, __VA_ARGS__) : (void)0)
+
+/**
+ * Starts writing log messages from a background thread. Until then, they
+ * are written directly.
+ */
+void log_start();
+
 void log_level_changed(char *level);
 void log_time_format_changed(char *format);
+/** "text" or "json", one object per line */
+void log_format_changed(char *format);
 
 #endif
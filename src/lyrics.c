@@ -22,6 +22,7 @@
 #include "strings.h"
 #include "url.h"
 
+#include <inttypes.h>
 #include <string.h>
 
 lyrics_t *lyrics_new()
@@ -248,6 +249,8 @@ task_t *lyrics_task(int64_t track)
 
   task->func = task_func;
   task->data = args;
+  task->class = TASK_CLASS_IO;
+  task->key = stringf("lyrics:%" PRId64, track);
 
   return task;
 }
@@ -37,6 +37,10 @@ void lyrics_free();
 lyrics_t *lyrics_fetch(const track_t *track);
 
 
+/**
+ * Fetches lyrics of @p track into the library. Concurrent tasks for the same
+ * track share one fetch.
+ */
 task_t *lyrics_task(int64_t track);
 
 #endif
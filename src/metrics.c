@@ -0,0 +1,165 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+/** Upper bounds of histogram buckets in microseconds, the last one is +Inf */
+static const int64_t bucket_bounds[METRICS_BUCKETS] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+  500000, 1000000, 2500000, 5000000, 10000000
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+} counter_info[METRICS_COUNTER_COUNT] = {
+  { "musicd_cache_hits_total", "Cache lookups that found an entry" },
+  { "musicd_cache_misses_total", "Cache lookups that found nothing" },
+  { "musicd_db_prepares_total", "SQL statements compiled" },
+  { "musicd_db_reuses_total", "SQL statements reused from the cache" },
+  { "musicd_cache_memory_hits_total", "Cache entries found in memory" },
+  { "musicd_cache_memory_misses_total", "Cache entries read from disk" },
+  { "musicd_tasks_joined_total", "Tasks that waited for an identical one" },
+  { "musicd_log_dropped_total", "Log messages dropped with a full buffer" }
+}, gauge_info[METRICS_GAUGE_COUNT] = {
+  { "musicd_clients", "Connected clients" },
+  { "musicd_sessions", "Active sessions" },
+  { "musicd_streams", "Open streams" },
+  { "musicd_tasks_queued", "Tasks waiting for a thread" },
+  { "musicd_cache_memory_bytes", "Size of cache entries held in memory" }
+}, timer_info[METRICS_TIMER_COUNT] = {
+  { "musicd_query_start_seconds", "Time spent in query_start" },
+  { "musicd_query_count_seconds", "Time spent in query_count" },
+  { "musicd_stream_read_seconds", "Time spent demuxing a packet" },
+  { "musicd_stream_decode_seconds", "Time spent decoding a packet" },
+  { "musicd_stream_resample_seconds", "Time spent resampling a frame" },
+  { "musicd_stream_encode_seconds", "Time spent encoding a frame" },
+  { "musicd_stream_mux_seconds", "Time spent muxing a packet" },
+  { "musicd_task_wait_seconds", "Time tasks spent queued" }
+};
+
+static int64_t counters[METRICS_COUNTER_COUNT];
+static int64_t gauges[METRICS_GAUGE_COUNT];
+static metrics_histogram_t timers[METRICS_TIMER_COUNT];
+
+int64_t metrics_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_count(metrics_counter_t counter, int64_t n)
+{
+  __sync_fetch_and_add(&counters[counter], n);
+}
+
+void metrics_gauge_add(metrics_gauge_t gauge, int64_t n)
+{
+  __sync_fetch_and_add(&gauges[gauge], n);
+}
+
+void metrics_observe(metrics_histogram_t *histogram, int64_t usec)
+{
+  int i;
+
+  for (i = 0; i < METRICS_BUCKETS && usec > bucket_bounds[i]; ++i) { }
+
+  __sync_fetch_and_add(&histogram->buckets[i], 1);
+  __sync_fetch_and_add(&histogram->sum, usec);
+}
+
+void metrics_time(metrics_timer_t timer, int64_t start)
+{
+  metrics_observe(&timers[timer], metrics_now() - start);
+}
+
+int64_t metrics_timer_total(metrics_timer_t timer)
+{
+  return __sync_fetch_and_add(&timers[timer].sum, 0);
+}
+
+static void format_header(string_t *string, const char *name, const char *help,
+                          const char *type)
+{
+  string_appendf(string, "# HELP %s %s\n# TYPE %s %s\n",
+                 name, help, name, type);
+}
+
+void metrics_format_histogram(string_t *string, const char *name,
+                              const char *help, const char *labels,
+                              metrics_histogram_t *histogram)
+{
+  int i;
+  int64_t total = 0;
+  const char *sep = labels ? "," : "";
+
+  if (!labels) {
+    labels = "";
+  }
+
+  if (help) {
+    format_header(string, name, help, "histogram");
+  }
+
+  for (i = 0; i < METRICS_BUCKETS; ++i) {
+    total += __sync_fetch_and_add(&histogram->buckets[i], 0);
+    string_appendf(string, "%s_bucket{%s%sle=\"%g\"} %" PRId64 "\n",
+                   name, labels, sep, bucket_bounds[i] / 1000000.0, total);
+  }
+  total += __sync_fetch_and_add(&histogram->buckets[i], 0);
+  string_appendf(string, "%s_bucket{%s%sle=\"+Inf\"} %" PRId64 "\n",
+                 name, labels, sep, total);
+
+  /* The bucket total is used as the count, so that it matches the buckets
+   * even if something was recorded in between. */
+  if (labels[0]) {
+    string_appendf(string, "%s_sum{%s} %g\n", name, labels,
+                   __sync_fetch_and_add(&histogram->sum, 0) / 1000000.0);
+    string_appendf(string, "%s_count{%s} %" PRId64 "\n", name, labels, total);
+  } else {
+    string_appendf(string, "%s_sum %g\n", name,
+                   __sync_fetch_and_add(&histogram->sum, 0) / 1000000.0);
+    string_appendf(string, "%s_count %" PRId64 "\n", name, total);
+  }
+}
+
+void metrics_format(string_t *string)
+{
+  int i;
+
+  for (i = 0; i < METRICS_COUNTER_COUNT; ++i) {
+    format_header(string, counter_info[i].name, counter_info[i].help,
+                  "counter");
+    string_appendf(string, "%s %" PRId64 "\n", counter_info[i].name,
+                   __sync_fetch_and_add(&counters[i], 0));
+  }
+
+  for (i = 0; i < METRICS_GAUGE_COUNT; ++i) {
+    format_header(string, gauge_info[i].name, gauge_info[i].help, "gauge");
+    string_appendf(string, "%s %" PRId64 "\n", gauge_info[i].name,
+                   __sync_fetch_and_add(&gauges[i], 0));
+  }
+
+  for (i = 0; i < METRICS_TIMER_COUNT; ++i) {
+    metrics_format_histogram(string, timer_info[i].name, timer_info[i].help,
+                             NULL, &timers[i]);
+  }
+}
@@ -0,0 +1,108 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_METRICS_H
+#define MUSICD_METRICS_H
+
+#include "strings.h"
+
+#include <stdint.h>
+
+/*
+ * Counters, gauges and latency histograms exported in Prometheus text format.
+ * Everything is updated with atomic operations, so they are cheap enough to be
+ * always on.
+ */
+
+typedef enum metrics_counter {
+  METRICS_CACHE_HITS = 0,
+  METRICS_CACHE_MISSES,
+  METRICS_DB_PREPARES,
+  METRICS_DB_REUSES,
+  METRICS_CACHE_MEMORY_HITS,
+  METRICS_CACHE_MEMORY_MISSES,
+  METRICS_TASKS_JOINED,
+  METRICS_LOG_DROPPED,
+  METRICS_COUNTER_COUNT
+} metrics_counter_t;
+
+typedef enum metrics_gauge {
+  METRICS_CLIENTS = 0,
+  METRICS_SESSIONS,
+  METRICS_STREAMS,
+  METRICS_TASKS_QUEUED,
+  METRICS_CACHE_MEMORY_BYTES,
+  METRICS_GAUGE_COUNT
+} metrics_gauge_t;
+
+typedef enum metrics_timer {
+  METRICS_QUERY_START = 0,
+  METRICS_QUERY_COUNT,
+  METRICS_STREAM_READ,
+  METRICS_STREAM_DECODE,
+  METRICS_STREAM_RESAMPLE,
+  METRICS_STREAM_ENCODE,
+  METRICS_STREAM_MUX,
+  METRICS_TASK_WAIT,
+  METRICS_TIMER_COUNT
+} metrics_timer_t;
+
+#define METRICS_BUCKETS 16
+
+typedef struct metrics_histogram {
+  int64_t buckets[METRICS_BUCKETS + 1];
+  /* Microseconds */
+  int64_t sum;
+} metrics_histogram_t;
+
+/**
+ * @returns monotonic time in microseconds, for measuring durations
+ */
+int64_t metrics_now();
+
+void metrics_count(metrics_counter_t counter, int64_t n);
+void metrics_gauge_add(metrics_gauge_t gauge, int64_t n);
+
+/**
+ * Records a duration of @p usec microseconds.
+ */
+void metrics_observe(metrics_histogram_t *histogram, int64_t usec);
+/**
+ * Records time since @p start, see metrics_now.
+ */
+void metrics_time(metrics_timer_t timer, int64_t start);
+
+/**
+ * @returns total microseconds recorded with @p timer
+ */
+int64_t metrics_timer_total(metrics_timer_t timer);
+
+/**
+ * Appends all global metrics to @p string.
+ */
+void metrics_format(string_t *string);
+
+/**
+ * Appends @p histogram as series @p name with @p labels (like
+ * "method=\"/tracks\"", or NULL) to @p string. HELP and TYPE lines are
+ * written only if @p help is not NULL.
+ */
+void metrics_format_histogram(string_t *string, const char *name,
+                              const char *help, const char *labels,
+                              metrics_histogram_t *histogram);
+
+#endif
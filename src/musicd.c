@@ -18,6 +18,7 @@
 #include "musicd.h"
 
 #include "cache.h"
+#include "catalog.h"
 #include "config.h"
 #include "db.h"
 #include "libav.h"
@@ -26,6 +27,7 @@
 #include "scan.h"
 #include "server.h"
 #include "strings.h"
+#include "url.h"
 
 #include <signal.h>
 #include <stdlib.h>
@@ -127,14 +129,54 @@ int main(int argc, char* argv[])
 
   config_set_hook("log-level", log_level_changed);
   config_set_hook("log-time-format", log_time_format_changed);
+  config_set_hook("log-format", log_format_changed);
+  config_set("log-format", "text");
   config_set("log-level", "debug");
 
   config_set_hook("directory", directory_changed);
   
   config_set("config", "~/.musicd.conf");
   config_set("directory", "~/.musicd");
+  config_set("db-cache-size", "16");
+  config_set("db-mmap-size", "64");
+  config_set("db-readers", "16");
+  config_set("catalog", "false");
   config_set("bind", "any");
   config_set("port", "6800");
+  config_set("max-clients", "1024");
+  config_set("server-threads", "1");
+  config_set("keep-alive-timeout", "15");
+  config_set("keep-alive-requests", "100");
+  config_set("session-timeout", "168");
+  config_set("response-cache-size", "8");
+  config_set("cache-memory-size", "16");
+  config_set("cache-size", "1024");
+  config_set("compression-level", "6");
+  config_set("transcoder-threads", "0");
+  config_set("stream-readahead", "10");
+  config_set("stream-pace", "150");
+  config_set("stream-cache-size", "0");
+  config_set("stream-copy", "true");
+  config_set("stream-share", "true");
+  config_set("stream-feed-size", "64");
+  config_set("stream-feed-time", "500");
+  config_set("codec-pool-size", "8");
+  config_set("seek-index-interval", "0");
+  config_set("scan-threads", "4");
+  config_set("scan-fast-probe", "true");
+  config_set("scan-watch", "false");
+  config_set("scan-resync", "24");
+  config_set("scan-commit-files", "500");
+  config_set("scan-commit-time", "1000");
+  config_set("image-pregenerate", "false");
+  config_set("replaygain", "off");
+  config_set("replaygain-preamp", "0");
+  config_set("hls-segment-duration", "10");
+  config_set("task-cpu-threads", "0");
+  config_set("task-io-threads", "8");
+  config_set("fetch-host-connections", "2");
+  config_set("lyrics-retry", "168");
+  config_set("lyrics-prefetch", "false");
   
   config_set_hook("image-prefix", scan_image_prefix_changed);
   config_set("image-prefix", "front,cover,jacket");
@@ -167,6 +209,8 @@ int main(int argc, char* argv[])
   config_load_args(argc, argv);
   
   confirm_directory();
+
+  log_start();
   
   musicd_log(LOG_INFO, "main", "musicd version %s", MUSICD_VERSION_STRING);
   
@@ -178,6 +222,8 @@ int main(int argc, char* argv[])
   
   av_log_set_level(AV_LOG_QUIET);
 
+  url_init();
+
   if (db_open()) {
     musicd_log(LOG_FATAL, "library", "can't open database");
     return -1;
@@ -187,6 +233,8 @@ int main(int argc, char* argv[])
     musicd_log(LOG_FATAL, "main", "could not open library");
     return -1;
   }
+
+  catalog_update();
   
   if (cache_open()) {
     musicd_log(LOG_FATAL, "main", "could not open cache");
@@ -200,6 +248,7 @@ int main(int argc, char* argv[])
   
   signal(SIGUSR1, start_scan_signal);
   scan_start();
+  scan_watch_start();
   
   while (1) {
     sleep(1);
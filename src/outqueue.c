@@ -0,0 +1,332 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "outqueue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/** Maximum number of iovecs passed to one writev */
+#define MAX_IOV 64
+/** Free chunks kept in the pool at most */
+#define MAX_POOLED 256
+/** Bytes written at most in one outqueue_write, so one client can't hog */
+#define MAX_WRITE (1024 * 1024)
+
+/* Pooled chunks are allocated with their storage right after the header */
+static outchunk_t *pool = NULL;
+static int nb_pooled = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char *chunk_storage(outchunk_t *chunk)
+{
+  return (char *)(chunk + 1);
+}
+
+static outchunk_t *chunk_new()
+{
+  outchunk_t *chunk;
+
+  pthread_mutex_lock(&pool_mutex);
+  chunk = pool;
+  if (chunk) {
+    pool = chunk->next;
+    --nb_pooled;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (!chunk) {
+    chunk = malloc(sizeof(outchunk_t) + OUTQUEUE_CHUNK_SIZE);
+  }
+
+  memset(chunk, 0, sizeof(outchunk_t));
+  chunk->data = chunk_storage(chunk);
+  return chunk;
+}
+
+static void chunk_free(outchunk_t *chunk)
+{
+  if (chunk->type == OUTCHUNK_REF) {
+    if (chunk->release) {
+      chunk->release(chunk->opaque);
+    }
+    free(chunk);
+    return;
+  }
+  if (chunk->type == OUTCHUNK_FILE) {
+    close(chunk->fd);
+    free(chunk);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_mutex);
+  if (nb_pooled < MAX_POOLED) {
+    chunk->next = pool;
+    pool = chunk;
+    ++nb_pooled;
+    chunk = NULL;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  free(chunk);
+}
+
+static void push(outqueue_t *queue, outchunk_t *chunk)
+{
+  chunk->next = NULL;
+  if (queue->last) {
+    queue->last->next = chunk;
+  } else {
+    queue->first = chunk;
+  }
+  queue->last = chunk;
+}
+
+void outqueue_init(outqueue_t *queue)
+{
+  memset(queue, 0, sizeof(outqueue_t));
+}
+
+void outqueue_clear(outqueue_t *queue)
+{
+  outchunk_t *chunk, *next;
+
+  for (chunk = queue->first; chunk; chunk = next) {
+    next = chunk->next;
+    chunk_free(chunk);
+  }
+  outqueue_init(queue);
+}
+
+size_t outqueue_size(outqueue_t *queue)
+{
+  return queue->size;
+}
+
+void outqueue_move(outqueue_t *dst, outqueue_t *src)
+{
+  if (!src->first) {
+    return;
+  }
+
+  if (dst->last) {
+    dst->last->next = src->first;
+  } else {
+    dst->first = src->first;
+  }
+  dst->last = src->last;
+  dst->size += src->size;
+
+  outqueue_init(src);
+}
+
+char *outqueue_reserve(outqueue_t *queue, size_t min, size_t *avail)
+{
+  outchunk_t *last = queue->last;
+
+  if (!last || last->type != OUTCHUNK_POOLED || OUTQUEUE_CHUNK_SIZE - last->end < min
+   || last->end == OUTQUEUE_CHUNK_SIZE) {
+    last = chunk_new();
+    push(queue, last);
+  }
+
+  *avail = OUTQUEUE_CHUNK_SIZE - last->end;
+  return chunk_storage(last) + last->end;
+}
+
+void outqueue_commit(outqueue_t *queue, size_t n)
+{
+  queue->last->end += n;
+  queue->size += n;
+}
+
+void outqueue_append(outqueue_t *queue, const char *data, size_t n)
+{
+  size_t avail;
+  char *p;
+
+  while (n > 0) {
+    p = outqueue_reserve(queue, 1, &avail);
+    if (avail > n) {
+      avail = n;
+    }
+    memcpy(p, data, avail);
+    outqueue_commit(queue, avail);
+    data += avail;
+    n -= avail;
+  }
+}
+
+void outqueue_append_ref(outqueue_t *queue, const char *data, size_t n,
+                         outqueue_release_t release, void *opaque)
+{
+  outchunk_t *chunk = malloc(sizeof(outchunk_t));
+  memset(chunk, 0, sizeof(outchunk_t));
+
+  chunk->data = data;
+  chunk->end = n;
+  chunk->release = release;
+  chunk->opaque = opaque;
+  chunk->type = OUTCHUNK_REF;
+
+  push(queue, chunk);
+  queue->size += n;
+}
+
+void outqueue_append_file(outqueue_t *queue, int fd, off_t offset, size_t n)
+{
+  outchunk_t *chunk = malloc(sizeof(outchunk_t));
+  memset(chunk, 0, sizeof(outchunk_t));
+
+  chunk->type = OUTCHUNK_FILE;
+  chunk->fd = fd;
+  chunk->start = offset;
+  chunk->end = offset + n;
+
+  push(queue, chunk);
+  queue->size += n;
+}
+
+/**
+ * Drops @p n written bytes from the front of @p queue.
+ */
+static void consume(outqueue_t *queue, size_t n)
+{
+  outchunk_t *chunk;
+
+  queue->size -= n;
+
+  while ((chunk = queue->first)) {
+    size_t left = chunk->end - chunk->start;
+    if (n < left) {
+      chunk->start += n;
+      break;
+    }
+    n -= left;
+    queue->first = chunk->next;
+    if (!queue->first) {
+      queue->last = NULL;
+    }
+    chunk_free(chunk);
+  }
+}
+
+static ssize_t write_file(outchunk_t *chunk, int fd)
+{
+  char buf[OUTQUEUE_CHUNK_SIZE];
+  size_t left = chunk->end - chunk->start;
+  ssize_t n;
+
+#ifdef __linux__
+  if (!chunk->no_sendfile) {
+    off_t offset = chunk->start;
+    n = sendfile(fd, chunk->fd, &offset, left);
+    if (n == 0) {
+      /* The file was truncated under us, the entry can't be completed */
+      errno = EIO;
+      return -1;
+    }
+    if (n > 0 || (errno != EINVAL && errno != ENOSYS)) {
+      return n;
+    }
+    /* Not supported for this pair of fds */
+    chunk->no_sendfile = 1;
+  }
+#endif
+
+  if (left > sizeof(buf)) {
+    left = sizeof(buf);
+  }
+  n = pread(chunk->fd, buf, left, chunk->start);
+  if (n < 0) {
+    return -1;
+  }
+  if (n == 0) {
+    /* Truncated like above */
+    errno = EIO;
+    return -1;
+  }
+  /* Whatever isn't written now is read again next time */
+  return write(fd, buf, n);
+}
+
+static ssize_t write_memory(outqueue_t *queue, int fd)
+{
+  struct iovec iov[MAX_IOV];
+  outchunk_t *chunk;
+  int i;
+
+  for (i = 0, chunk = queue->first;
+       chunk && chunk->type != OUTCHUNK_FILE && i < MAX_IOV;
+       chunk = chunk->next) {
+    if (chunk->end == chunk->start) {
+      continue;
+    }
+    iov[i].iov_base = (void *)(chunk->data + chunk->start);
+    iov[i].iov_len = chunk->end - chunk->start;
+    ++i;
+  }
+
+  if (i == 0) {
+    return 0;
+  }
+
+  return writev(fd, iov, i);
+}
+
+ssize_t outqueue_write(outqueue_t *queue, int fd)
+{
+  ssize_t n, total = 0;
+
+  while (queue->first && total < MAX_WRITE) {
+    if (queue->first->end == queue->first->start) {
+      /* Empty chunk, like a zero-length reference */
+      consume(queue, 0);
+      continue;
+    }
+
+    if (queue->first->type == OUTCHUNK_FILE) {
+      n = write_file(queue->first, fd);
+    } else {
+      n = write_memory(queue, fd);
+    }
+
+    if (n < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) {
+        break;
+      }
+      return -1;
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    consume(queue, n);
+    total += n;
+  }
+
+  return total;
+}
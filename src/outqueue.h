@@ -0,0 +1,109 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_OUTQUEUE_H
+#define MUSICD_OUTQUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Size of pooled chunks copied data is stored in */
+#define OUTQUEUE_CHUNK_SIZE (16 * 1024)
+
+typedef void (*outqueue_release_t)(void *opaque);
+
+typedef enum outchunk_type {
+  /** Copied data in a pooled chunk */
+  OUTCHUNK_POOLED = 0,
+  /** Reference to an external buffer */
+  OUTCHUNK_REF,
+  /** Range of an open file */
+  OUTCHUNK_FILE
+} outchunk_type_t;
+
+typedef struct outchunk {
+  outchunk_type_t type;
+
+  const char *data;
+  /** Unsent data is data[start..end), or the same offsets in the file */
+  size_t start, end;
+
+  /** For references, called when the reference is done */
+  outqueue_release_t release;
+  void *opaque;
+
+  /** For files, closed when done */
+  int fd;
+  /** sendfile is not usable for this file, read it instead */
+  int no_sendfile;
+
+  struct outchunk *next;
+} outchunk_t;
+
+/**
+ * Queue of outgoing data. Copied data is packed into pooled fixed-size
+ * chunks, while external buffers are referenced without copying. Memory is
+ * flushed with writev and files with sendfile where available.
+ */
+typedef struct outqueue {
+  outchunk_t *first, *last;
+  size_t size;
+} outqueue_t;
+
+void outqueue_init(outqueue_t *queue);
+/** Releases all remaining chunks */
+void outqueue_clear(outqueue_t *queue);
+
+size_t outqueue_size(outqueue_t *queue);
+
+/** Copies @p n bytes of @p data to the end of @p queue */
+void outqueue_append(outqueue_t *queue, const char *data, size_t n);
+
+/**
+ * Appends @p n bytes of @p data without copying. @p release is called with
+ * @p opaque once the data has been written or the queue cleared; it can be
+ * NULL for static data.
+ */
+void outqueue_append_ref(outqueue_t *queue, const char *data, size_t n,
+                         outqueue_release_t release, void *opaque);
+
+/**
+ * Appends @p n bytes of file @p fd starting at @p offset. The queue takes
+ * ownership of @p fd and closes it when done.
+ */
+void outqueue_append_file(outqueue_t *queue, int fd, off_t offset, size_t n);
+
+/**
+ * Moves all chunks of @p src to the end of @p dst, leaving @p src empty.
+ */
+void outqueue_move(outqueue_t *dst, outqueue_t *src);
+
+/**
+ * Returns writable space at the end of the queue, at least @p min bytes if
+ * @p min <= OUTQUEUE_CHUNK_SIZE. Store size in @p avail. Data written there is
+ * queued with outqueue_commit.
+ */
+char *outqueue_reserve(outqueue_t *queue, size_t min, size_t *avail);
+void outqueue_commit(outqueue_t *queue, size_t n);
+
+/**
+ * Writes as much as possible to @p fd without blocking.
+ * @returns bytes written, or -1 on error (EWOULDBLOCK is not an error)
+ */
+ssize_t outqueue_write(outqueue_t *queue, int fd);
+
+#endif
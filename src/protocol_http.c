@@ -17,37 +17,123 @@
  */
 #include "protocol_http.h"
 
+#include "arena.h"
 #include "cache.h"
 #include "client.h"
 #include "config.h"
+#include "hls.h"
 #include "image.h"
 #include "json.h"
 #include "library.h"
 #include "log.h"
 #include "lyrics.h"
+#include "metrics.h"
 #include "musicd.h"
 #include "query.h"
+#include "response_cache.h"
 #include "session.h"
 #include "scan.h"
 #include "strings.h"
 #include "task.h"
+#include "transcoder.h"
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #define MAX_HEADER_SIZE (10 * 1024) /* Ten kilobytes */
+#define MAX_HEADERS 32
+#define FEED_CHUNK_SIZE (64 * 1024) /* Moved to outbuf per feed call */
+#define GZIP_MIN_SIZE 1024 /* Smaller bodies are sent uncompressed */
+#define STREAM_MIN_ROWS 1000 /* Larger or unlimited row lists are streamed */
+#define IMAGES_MAX 256 /* Images per /images request */
+#define MULTIPART_BOUNDARY "musicd-image-boundary"
+
+/** Header line location, as offsets to the request buffer */
+typedef struct http_header {
+  size_t name, name_len;
+  size_t value, value_len;
+} http_header_t;
+
+/**
+ * Serializes the next row of @p query to @p json.
+ * @returns 0 on success, nonzero if there are no more rows
+ */
+typedef int (*row_writer_t)(query_t *query, json_t *json);
+
+/** JSON document listing rows of a query, serialized in parts */
+typedef struct json_rows {
+  query_t *query;
+  row_writer_t write_row;
+  json_t json;
+  int64_t rows, limit;
+  char *cursor;
+  /** gzip compressor if the document is streamed compressed */
+  z_stream *deflate;
+  /** Copy of the streamed body for the response cache, NULL if not kept */
+  string_t *copy;
+  size_t copy_limit;
+  /* The request's cache key is freed after http_process, keep a copy */
+  char *cache_key;
+  int64_t cache_generation;
+} json_rows_t;
 
 typedef struct http {
   client_t *client;
 
+  /* Incremental parser state: offsets to the request buffer, which can move
+   * between calls */
+  size_t parse_pos;
+  bool have_request_line;
+  size_t method_len, target, target_len, version, version_len;
+  http_header_t headers[MAX_HEADERS];
+  int nb_headers;
+
   /* Current request */
   session_t *session;
   const char *request;
+  /** Request strings, reset when the next request starts */
+  arena_t arena;
   char *query;
   char *path;
   char *args;
   char *cookies;
-
-  stream_t *stream;
+  /** Kept until the next request, replies can be sent asynchronously */
+  char *origin;
+  char *if_none_match;
+  /** Response cache key and entity tag if the method is cacheable */
+  char *cache_key;
+  char *etag;
+  int64_t cache_generation;
+  /** Client accepts gzip content coding */
+  bool gzip;
+
+  /* Connection state */
+  int nb_requests;
+  /** Request is HTTP/1.1 or later, chunked responses can be used */
+  bool http11;
+  /** Connection is kept open after the current response */
+  bool keep_alive;
+  /** Current request is HEAD, no body is sent */
+  bool head;
+  /** Current response body is sent with chunked transfer coding */
+  bool chunked;
+  /** Content coding of the current response body, NULL for identity */
+  const char *content_encoding;
+  /** Current response depends on Accept-Encoding */
+  bool vary_encoding;
+
+  /* Handler for the task the client is waiting for */
+  client_callback_t task_callback;
+
+  transcoder_t *transcoder;
+  /** Row list being streamed */
+  json_rows_t *rows;
 } http_t;
 
 struct { codec_type_t codec; const char *mime; } codecs[] = {
@@ -130,10 +216,10 @@ static char *args_str(http_t *http, const char *key)
   
   /* The parameter is set but it has no value */
   if (*p != '=') {
-    return strcopy("");
+    return strcopy_in(&http->arena, "");
   }
   
-  result = string_new();
+  result = string_new_in(&http->arena);
   for (++p; *p != '&' && *p != '\0'; ++p) {
     if (*p != '%') {
       if (*p == '+') { /* + means space */
@@ -158,6 +244,209 @@ static char *args_str(http_t *http, const char *key)
   return string_release(result);
 }
 
+/**
+ * Finds header @p name of the current request.
+ * @returns pointer to the value and stores its length to @p len, or NULL
+ */
+static const char *http_header
+  (http_t *http, const char *name, size_t *len)
+{
+  http_header_t *header;
+  size_t name_len = strlen(name);
+  int i;
+
+  for (i = 0; i < http->nb_headers; ++i) {
+    header = &http->headers[i];
+    if (header->name_len == name_len
+     && !strncasecmp(http->request + header->name, name, name_len)) {
+      *len = header->value_len;
+      return http->request + header->value;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Parses a single range in @p unit from the Range header of the current
+ * request, like "bytes=100-199". Open ends are stored as -1, so suffix ranges
+ * ("bytes=-500") have @p first -1.
+ * @returns true if there was a valid range
+ */
+static bool http_range
+  (http_t *http, const char *unit, int64_t *first, int64_t *last)
+{
+  const char *value;
+  char buf[64], *p, *end;
+  size_t len, unit_len = strlen(unit);
+
+  value = http_header(http, "Range", &len);
+  if (!value || len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, value, len);
+  buf[len] = '\0';
+
+  if (strncasecmp(buf, unit, unit_len) || buf[unit_len] != '='
+   || strchr(buf, ',')) {
+    /* Other unit, or multiple ranges which aren't supported */
+    return false;
+  }
+  p = buf + unit_len + 1;
+
+  *first = -1;
+  if (*p != '-') {
+    *first = strtoll(p, &end, 10);
+    if (end == p || *first < 0) {
+      return false;
+    }
+    p = end;
+  }
+  if (*p++ != '-') {
+    return false;
+  }
+
+  *last = -1;
+  if (*p) {
+    *last = strtoll(p, &end, 10);
+    if (end == p || *end || *last < 0) {
+      return false;
+    }
+  }
+
+  return (*first >= 0 || *last >= 0) && (*last < 0 || *first <= *last);
+}
+
+/**
+ * Tells if the Accept-Encoding header of the current request allows gzip,
+ * by name or with "*". Codings with q=0 are refused.
+ */
+static bool http_accepts_gzip(http_t *http)
+{
+  const char *value, *end, *p, *name_end, *next, *q;
+  size_t len;
+  bool any = false, accepted;
+
+  value = http_header(http, "Accept-Encoding", &len);
+  if (!value) {
+    return false;
+  }
+  end = value + len;
+
+  for (p = value; p < end; p = next + 1) {
+    next = memchr(p, ',', end - p);
+    if (!next) {
+      next = end;
+    }
+
+    while (p < next && isspace((unsigned char)*p)) {
+      ++p;
+    }
+    for (name_end = p;
+         name_end < next && *name_end != ';'
+         && !isspace((unsigned char)*name_end);
+         ++name_end) { }
+
+    /* The value ends in CRLF in the request buffer, strtod stops there */
+    accepted = true;
+    for (q = name_end; q < next && *q != '='; ++q) { }
+    if (q < next && (*(q - 1) == 'q' || *(q - 1) == 'Q')) {
+      accepted = strtod(q + 1, NULL) > 0;
+    }
+
+    if (name_end - p == 4 && !strncasecmp(p, "gzip", 4)) {
+      /* Explicit value overrides "*" */
+      return accepted;
+    }
+    if (name_end - p == 1 && *p == '*') {
+      any = accepted;
+    }
+  }
+  return any;
+}
+
+/**
+ * @returns true if @p content_type is textual and compresses well
+ */
+static bool compressible_type(const char *content_type)
+{
+  return strbeginswith(content_type, "text/")
+      || strstr(content_type, "json")
+      || strstr(content_type, "javascript")
+      || strstr(content_type, "xml");
+}
+
+/**
+ * Compresses @p size bytes of @p data to gzip format.
+ * @returns compressed data and stores its size to @p out_size, or NULL if it
+ * wasn't any smaller
+ */
+static char *gzip_compress
+  (const char *data, size_t size, int level, size_t *out_size)
+{
+  z_stream stream;
+  char *result;
+  size_t bound;
+
+  if (size > UINT_MAX) {
+    return NULL;
+  }
+
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level > 9 ? 9 : level, Z_DEFLATED,
+                   15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+
+  bound = deflateBound(&stream, size);
+  result = malloc(bound);
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = size;
+  stream.next_out = (Bytef *)result;
+  stream.avail_out = bound;
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END || stream.total_out >= size) {
+    deflateEnd(&stream);
+    free(result);
+    return NULL;
+  }
+
+  *out_size = stream.total_out;
+  deflateEnd(&stream);
+  return result;
+}
+
+/**
+ * Compresses @p content of the current response if it is worth it and the
+ * client accepts it.
+ * @returns compressed body to send instead and replaces @p size, or NULL
+ */
+static char *http_compress
+  (http_t *http,
+   const char *status,
+   const char *content_type,
+   const char *content,
+   size_t *size)
+{
+  char *result;
+  int level = config_to_int("compression-level");
+
+  if ((status && strcmp(status, "200 OK")) || level <= 0
+   || *size < GZIP_MIN_SIZE || !compressible_type(content_type)) {
+    return NULL;
+  }
+
+  http->vary_encoding = true;
+  if (!http->gzip) {
+    return NULL;
+  }
+
+  result = gzip_compress(content, *size, level, size);
+  if (result) {
+    http->content_encoding = "gzip";
+  }
+  return result;
+}
+
 /**
  * Begins HTTP headers
  * @param status default 200 OK if NULL
@@ -171,28 +460,38 @@ static void http_begin_headers
   client_send(http->client, "HTTP/1.1 %s\r\n", status ? status : "200 OK");
   client_send(http->client, "Server: musicd/" MUSICD_VERSION_STRING "\r\n");
   if (content_length >= 0) {
-    client_send(http->client, "Content-Length: %d\r\n", content_length);
+    client_send(http->client, "Content-Length: %" PRId64 "\r\n",
+                content_length);
+  } else if (http->http11) {
+    client_send(http->client, "Transfer-Encoding: chunked\r\n");
+    http->chunked = true;
+  } else {
+    /* The end of the body can only be told by closing */
+    http->keep_alive = false;
   }
+  client_send(http->client, "Connection: %s\r\n",
+              http->keep_alive ? "keep-alive" : "close");
   if (content_type) {
     client_send(http->client, "Content-Type: %s; charset=utf-8\r\n",
                 content_type);
   }
+  if (http->content_encoding) {
+    client_send(http->client, "Content-Encoding: %s\r\n",
+                http->content_encoding);
+  }
+  if (http->vary_encoding) {
+    client_send(http->client, "Vary: Accept-Encoding\r\n");
+  }
+  if (http->etag && (!status || !strcmp(status, "200 OK")
+                  || !strcmp(status, "304 Not Modified"))) {
+    client_send(http->client, "ETag: %s\r\n", http->etag);
+  }
 
   // Cross-origin resource sharing
-  if (config_to_bool("enable-cors")) {
-    const char *origin_start = strcasestr(http->request, "\r\nOrigin: ");
-    if (origin_start) {
-      const char *origin_end = strchrnull(origin_start + 1, '\r');
-      char *origin = strextract(origin_start + 2, origin_end);
-
-      client_send(http->client, "Access-Control-Allow-");
-      client_send(http->client, origin);
-      client_send(http->client, "\r\n");
-
-      free(origin);
-
-      client_send(http->client, "Access-Control-Allow-Credentials: true\r\n");
-    }
+  if (config_to_bool("enable-cors") && http->origin) {
+    client_send(http->client, "Access-Control-Allow-Origin: %s\r\n",
+                http->origin);
+    client_send(http->client, "Access-Control-Allow-Credentials: true\r\n");
   }
 }
 
@@ -207,21 +506,74 @@ static void http_send_headers
 }
 
 /**
- * @param status default 200 OK if NULL
- * @param content_type default text/html if NULL
+ * Sends response body, unless the request was HEAD.
  */
-static void http_send
+static void http_body(http_t *http, const char *content, size_t size)
+{
+  if (!http->head) {
+    client_write(http->client, content, size);
+  }
+}
+
+/**
+ * Like http_send, but @p content is queued without copying and as it is,
+ * without compression. @p release is called with @p content once it has been
+ * sent, NULL for static data.
+ */
+static void http_send_ref
   (http_t *http,
    const char *status,
    const char *content_type,
    size_t content_length,
-   const char *content)
+   const char *content,
+   outqueue_release_t release)
 {
   http_send_headers(http,
               status,
               content_type ? content_type : "text/html",
               content_length);
-  client_write(http->client, content, content_length);
+  if (http->head) {
+    if (release) {
+      release((void *)content);
+    }
+    return;
+  }
+  client_write_ref(http->client, content, content_length, release,
+                   (void *)content);
+}
+
+/**
+ * @param status default 200 OK if NULL
+ * @param content_type default text/html if NULL
+ */
+static void http_send
+  (http_t *http,
+   const char *status,
+   const char *content_type,
+   size_t content_length,
+   const char *content)
+{
+  char *compressed;
+
+  content_type = content_type ? content_type : "text/html";
+  compressed = http_compress(http, status, content_type, content,
+                             &content_length);
+
+  /* Stored as sent, the cache key tells the content coding */
+  if (http->cache_key && (!status || !strcmp(status, "200 OK"))
+   && config_to_int("response-cache-size") > 0) {
+    response_cache_set(http->cache_key, http->cache_generation,
+                       compressed ? compressed : content, content_length);
+  }
+
+  if (compressed) {
+    http_send_ref(http, status, content_type, content_length, compressed,
+                  free);
+    return;
+  }
+
+  http_send_headers(http, status, content_type, content_length);
+  http_body(http, content, content_length);
 }
 
 static void http_send_text
@@ -235,7 +587,8 @@ static void http_send_text
 
 static void http_reply(http_t *http, const char *status)
 {
-  http_send(http, status, "text/plain", strlen(status), status);
+  /* Status is always a literal, no need to copy */
+  http_send_ref(http, status, "text/plain", strlen(status), status, NULL);
 }
 
 static void http_json_success(http_t *http)
@@ -243,32 +596,106 @@ static void http_json_success(http_t *http)
   http_send_text(http, NULL, "text/json", "{success:true}");
 }
 
+/**
+ * Sends @p size bytes of open file @p fd, which is closed when done. Byte
+ * Range requests are answered with 206 Partial Content.
+ */
+static void http_send_fd
+  (http_t *http,
+   const char *status,
+   const char *content_type,
+   int fd,
+   int64_t size)
+{
+  int64_t first = 0, last = size - 1;
+  bool partial = false;
+
+  if (!status && http_range(http, "bytes", &first, &last)) {
+    if (first < 0) {
+      /* Suffix range */
+      first = last < size ? size - last : 0;
+      last = size - 1;
+    } else if (last < 0 || last >= size) {
+      last = size - 1;
+    }
+
+    if (first >= size) {
+      close(fd);
+      http_begin_headers(http, "416 Range Not Satisfiable", NULL, 0);
+      client_send(http->client, "Content-Range: bytes */%" PRId64 "\r\n\r\n",
+                  size);
+      return;
+    }
+
+    status = "206 Partial Content";
+    partial = true;
+  }
+
+  http_begin_headers(http,
+              status,
+              content_type ? content_type : "text/html",
+              last - first + 1);
+  client_send(http->client, "Accept-Ranges: bytes\r\n");
+  if (partial) {
+    client_send(http->client,
+                "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n",
+                first, last, size);
+  }
+  client_send(http->client, "\r\n");
+
+  if (http->head) {
+    close(fd);
+    return;
+  }
+  client_write_file(http->client, fd, first, last - first + 1);
+}
+
+/**
+ * Called when the whole response to the current request has been queued.
+ */
+static void http_finish(http_t *http)
+{
+  if (!http->keep_alive) {
+    client_drain(http->client);
+  }
+}
+
+static int http_task_done(void *self, void *data)
+{
+  http_t *http = (http_t *)self;
+  int result = http->task_callback(self, data);
+  if (result >= 0 && http->client->state == CLIENT_STATE_NORMAL) {
+    http_finish(http);
+  }
+  return result;
+}
+
+/**
+ * Like client_wait_task, but finishes the response after @p callback.
+ */
+static void http_wait_task
+  (http_t *http, task_t *task, client_callback_t callback, void *data)
+{
+  http->task_callback = callback;
+  client_wait_task(http->client, task, http_task_done, data);
+}
+
 static bool http_try_send_file
   (http_t *http, const char *path, const char *content_type)
 {
-  size_t size;
-  char *data;
-  FILE *file = fopen(path, "rb");
-  if (!file) {
+  struct stat status;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
     return false;
   }
 
-  fseek(file, 0, SEEK_END);
-  size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  if (size <= 0) {
-    fclose(file);
+  if (fstat(fd, &status) || !S_ISREG(status.st_mode)
+   || status.st_size <= 0) {
+    close(fd);
     return false;
   }
 
-  data = malloc(size);
-  size = fread(data, 1, size, file);
-  fclose(file);
-
-  http_send(http, NULL, content_type, size, data);
-
-  free(data);
+  http_send_fd(http, NULL, content_type, fd, status.st_size);
   return true;
 }
 
@@ -280,10 +707,10 @@ static void http_send_file
   }
 }
 
-static char *decode_url(const char **p)
+static char *decode_url(http_t *http, const char **p)
 {
   char tmp;
-  string_t *result = string_new();
+  string_t *result = string_new_in(&http->arena);
 
   for (; **p != '&' && **p != '\0'; ++*p) {
     if (**p != '%') {
@@ -325,22 +752,17 @@ static char *decode_url(const char **p)
 
 static char *cookie_get(http_t *http, const char *name)
 {
-  char *search = stringf("%s=", name),
-       *result = NULL;
+  char *search = stringf_in(&http->arena, "%s=", name);
   const char *p1, *p2;
 
   p1 = strstr(http->cookies, search);
   if (!p1) {
-    goto finish;
+    return NULL;
   }
   p1 += strlen(search);
   p2 = strchrnull(p1, ';');
 
-  result = strextract(p1, p2);
-
-finish:
-  free(search);
-  return result;
+  return strextract_in(&http->arena, p1, p2);
 }
 
 /** Iterates through all arguments and sets all valid filters to query. */
@@ -365,19 +787,17 @@ static int parse_query_filters(http_t *http, query_t *query)
       continue;
     }
 
-    name = strextract(args, p);
+    name = strextract_in(&http->arena, args, p);
     field = query_field_from_string(name);
-    free(name);
     
     ++p;
 
     if (!field) {
       for (; *p != '\0' && *p != '&'; ++p) { }
     } else {
-      value = decode_url(&p);
+      value = decode_url(http, &p);
       if (value) {
         query_filter(query, field, value);
-        free(value);
       }
     }
 
@@ -407,8 +827,20 @@ static void parse_query_sort(http_t *http, query_t *query)
   if (!sort) {
     return;
   }
+  query_seed(query, args_int(http, "seed"));
   query_sort_from_string(query, sort);
-  free(sort);
+}
+
+/** @returns nonzero if a cursor was given but it doesn't fit the query */
+static int parse_query_cursor(http_t *http, query_t *query)
+{
+  char *cursor = args_str(http, "cursor");
+  int result;
+  if (!cursor) {
+    return 0;
+  }
+  result = query_seek(query, cursor);
+  return result;
 }
 
 static int64_t parse_total(http_t *http, query_t *query)
@@ -423,7 +855,7 @@ static int method_musicd(http_t *http)
 {
   json_t json;
 
-  json_init(&json);
+  json_init_in(&json, &http->arena);
   json_object_begin(&json);
   json_define(&json, "name"); json_string(&json, config_get("server-name"));
   json_define(&json, "version");  json_string(&json, MUSICD_VERSION_STRING);
@@ -491,13 +923,11 @@ static int method_auth(http_t *http)
 
     http_begin_headers(http, "200 OK", "text/json", strlen(response_ok));
     client_send(http->client,
-                "Set-Cookie: musicd-session=%s;\r\n"
-                "\r\n%s", session->id, response_ok);
+                "Set-Cookie: musicd-session=%s;\r\n\r\n", session->id);
+    http_body(http, response_ok, strlen(response_ok));
   }
 
 finish:
-  free(user);
-  free(password);
   return 0;
 }
 
@@ -508,7 +938,7 @@ static int method_status(http_t *http)
 
   scan_status(&status);
 
-  json_init(&json);
+  json_init_in(&json, &http->arena);
   json_object_begin(&json);
   json_define(&json, "starttime"); json_int64(&json, musicd_start_time);
   json_define(&json, "time");      json_int64(&json, time(NULL));
@@ -541,88 +971,317 @@ static int method_rescan(http_t *http)
   return 0;
 }
 
-static int method_tracks(http_t *http)
+static int write_track(query_t *query, json_t *json)
 {
-  query_t *query = query_tracks_new();
-  int64_t total;
-  json_t json;
   track_t track;
 
-  parse_query_filters(http, query);
-
-  total = parse_total(http, query);
-  if (total < 0) {
-    musicd_log(LOG_ERROR, "protocol_http", "query_count failed");
-    http_reply(http, "500 Internal Server Error");
-    goto finish;
-  }
-  
-  parse_query_bounds(http, query);
-  parse_query_sort(http, query);
-  
-  if(query_start(query)) {
-    musicd_log(LOG_ERROR, "protocol_http", "query_start failed");
-    http_reply(http, "500 Internal Server Error");
-    goto finish;
-  }
-  
-  json_init(&json);
-  json_object_begin(&json);
-  
-  if (total) {
-    json_define(&json, "total");
-    json_int64(&json, total);
-  }
-  
-  json_define(&json, "tracks");
-  json_array_begin(&json);
-  
-  while (!query_tracks_next(query, &track)) {
-    json_object_begin(&json);
-    json_define(&json, "id");       json_int64(&json, track.id);
-    json_define(&json, "track");    json_int(&json, track.track);
-    json_define(&json, "title");    json_string(&json, track.title);
-    json_define(&json, "artistid"); json_int64(&json, track.artistid);
-    json_define(&json, "artist");   json_string(&json, track.artist);
-    json_define(&json, "albumid");  json_int64(&json, track.albumid);
-    json_define(&json, "album");    json_string(&json, track.album);
-    json_define(&json, "duration"); json_int(&json, track.duration);
-    json_object_end(&json);
+  if (query_tracks_next(query, &track)) {
+    return 1;
   }
-  json_array_end(&json);
-  json_object_end(&json);
-  
-  http_send_text(http, "200 OK", "text/json", json_result(&json));
-
-  json_finish(&json);
-
-finish:
-  query_close(query);
+  json_object_begin(json);
+  json_define(json, "id");       json_int64(json, track.id);
+  json_define(json, "track");    json_int(json, track.track);
+  json_define(json, "title");    json_string(json, track.title);
+  json_define(json, "artistid"); json_int64(json, track.artistid);
+  json_define(json, "artist");   json_string(json, track.artist);
+  json_define(json, "albumid");  json_int64(json, track.albumid);
+  json_define(json, "album");    json_string(json, track.album);
+  json_define(json, "duration"); json_int(json, track.duration);
+  json_object_end(json);
   return 0;
 }
 
-static int method_track_index(http_t *http)
+static int write_artist(query_t *query, json_t *json)
 {
-  query_t *query = query_tracks_new();
-  json_t json;
-  int64_t id, index;
+  query_artist_t artist;
 
-  id = args_int(http, "id");
-  if (id <= 0) {
-    http_reply(http, "400 Bad Request");
-    return 0;
+  if (query_artists_next(query, &artist)) {
+    return 1;
   }
+  json_object_begin(json);
+  json_define(json, "id");       json_int64(json, artist.artistid);
+  json_define(json, "artist");    json_string(json, artist.artist);
+  json_object_end(json);
+  return 0;
+}
 
-  parse_query_filters(http, query);
-  parse_query_sort(http, query);
+static int write_album(query_t *query, json_t *json)
+{
+  query_album_t album;
 
-  index = query_index(query, id);
-  if (index < 0) {
-    http_reply(http, "500 Internal Server Error");
-    goto finish;
+  if (query_albums_next(query, &album)) {
+    return 1;
   }
-
-  json_init(&json);
+  json_object_begin(json);
+  json_define(json, "id");       json_int64(json, album.albumid);
+  json_define(json, "album");    json_string(json, album.album);
+  json_define(json, "image");    json_int64(json, album.image);
+  json_define(json, "tracks");   json_int64(json, album.tracks);
+  json_object_end(json);
+  return 0;
+}
+
+static void json_rows_free(json_rows_t *rows)
+{
+  if (!rows) {
+    return;
+  }
+  if (rows->deflate) {
+    deflateEnd(rows->deflate);
+    free(rows->deflate);
+  }
+  query_close(rows->query);
+  json_finish(&rows->json);
+  free(rows->cursor);
+  if (rows->copy) {
+    string_free(rows->copy);
+  }
+  free(rows->cache_key);
+  free(rows);
+}
+
+/**
+ * Serializes rows until there are at least @p size bytes of output, or the
+ * rows end and the document is finished.
+ * @returns true if the document was finished
+ */
+static bool json_rows_serialize(json_rows_t *rows, size_t size)
+{
+  json_t *json = &rows->json;
+
+  while (json_length(json) < size) {
+    if (rows->write_row(rows->query, json)) {
+      json_array_end(json);
+      if (rows->cursor) {
+        json_define(json, "cursor");
+        json_string(json, rows->cursor);
+      }
+      json_object_end(json);
+      return true;
+    }
+    if (++rows->rows == rows->limit) {
+      /* Page is full, there may be more after this row */
+      rows->cursor = query_cursor(rows->query);
+    }
+  }
+  return false;
+}
+
+static void http_send_chunk(http_t *http, const char *data, size_t size)
+{
+  json_rows_t *rows = http->rows;
+
+  /* Given up on once too large to be cached anyway */
+  if (rows && rows->copy) {
+    if (string_size(rows->copy) + size > rows->copy_limit) {
+      string_free(rows->copy);
+      rows->copy = NULL;
+    } else {
+      string_nappend(rows->copy, data, size);
+    }
+  }
+
+  if (size > 0) {
+    client_send(http->client, "%zx\r\n", size);
+    client_write(http->client, data, size);
+    client_send(http->client, "\r\n");
+  }
+}
+
+/**
+ * Sends @p size bytes of @p data as chunks, compressed if the stream is.
+ */
+static void json_rows_send(http_t *http, const char *data, size_t size,
+                           bool finish)
+{
+  z_stream *stream = http->rows->deflate;
+  char buf[OUTQUEUE_CHUNK_SIZE];
+  int result;
+
+  if (!stream) {
+    http_send_chunk(http, data, size);
+    return;
+  }
+
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = size;
+  do {
+    stream->next_out = (Bytef *)buf;
+    stream->avail_out = sizeof(buf);
+    result = deflate(stream, finish ? Z_FINISH : Z_NO_FLUSH);
+    http_send_chunk(http, buf, sizeof(buf) - stream->avail_out);
+  } while (stream->avail_out == 0 && result == Z_OK);
+}
+
+/**
+ * Sends the next part of the streamed row list, called as feeder once the
+ * output queue has been sent.
+ */
+static void http_feed_rows(http_t *http)
+{
+  json_rows_t *rows = http->rows;
+  bool done;
+
+  done = json_rows_serialize(rows, FEED_CHUNK_SIZE);
+  json_rows_send(http, json_result(&rows->json), json_length(&rows->json),
+                 done);
+  json_clear(&rows->json);
+
+  /* A slow client would otherwise hold a read snapshot of the database for
+   * the whole download, which keeps the WAL from being checkpointed */
+  if (!done && query_restart(rows->query)) {
+    musicd_log(LOG_ERROR, "protocol_http", "can't continue row list");
+    client_stop_feed(http->client);
+    json_rows_free(rows);
+    http->rows = NULL;
+    /* Without the terminating chunk the client sees the list as cut short */
+    client_drain(http->client);
+    return;
+  }
+
+  if (done) {
+    if (rows->copy) {
+      response_cache_set(rows->cache_key, rows->cache_generation,
+                         string_string(rows->copy), string_size(rows->copy));
+    }
+
+    /* Terminating chunk */
+    client_send(http->client, "0\r\n\r\n");
+    client_stop_feed(http->client);
+    json_rows_free(rows);
+    http->rows = NULL;
+    http_finish(http);
+  }
+}
+
+/**
+ * Sends started @p query as JSON object with the rows in array @p name, and
+ * closes it. Large lists are streamed with chunked transfer coding as the
+ * client receives them, so that the whole document is never in memory. The
+ * query is restarted from its cursor between the parts.
+ */
+static int send_json_rows(http_t *http, query_t *query, const char *name,
+                          row_writer_t write_row, int64_t total,
+                          int64_t limit)
+{
+  json_rows_t *rows = malloc(sizeof(json_rows_t));
+  int level = config_to_int("compression-level");
+
+  memset(rows, 0, sizeof(json_rows_t));
+  rows->query = query;
+  rows->write_row = write_row;
+  rows->limit = limit;
+
+  json_init_in(&rows->json, &http->arena);
+  json_object_begin(&rows->json);
+
+  if (total) {
+    json_define(&rows->json, "total");
+    json_int64(&rows->json, total);
+  }
+
+  json_define(&rows->json, name);
+  json_array_begin(&rows->json);
+
+  if (http->head || !http->http11 || (limit > 0 && limit <= STREAM_MIN_ROWS)) {
+    json_rows_serialize(rows, SIZE_MAX);
+    http_send(http, "200 OK", "text/json", json_length(&rows->json),
+              json_result(&rows->json));
+    json_rows_free(rows);
+    return 0;
+  }
+
+  if (level > 0) {
+    http->vary_encoding = true;
+  }
+  if (level > 0 && http->gzip) {
+    rows->deflate = malloc(sizeof(z_stream));
+    memset(rows->deflate, 0, sizeof(z_stream));
+    if (deflateInit2(rows->deflate, level > 9 ? 9 : level, Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+      http->content_encoding = "gzip";
+    } else {
+      free(rows->deflate);
+      rows->deflate = NULL;
+    }
+  }
+
+  /* Stored as sent like in http_send, response_cache_set takes up to a
+   * quarter of the cache */
+  if (http->cache_key && config_to_int("response-cache-size") > 0) {
+    rows->copy = string_new();
+    rows->cache_key = strcopy(http->cache_key);
+    rows->cache_generation = http->cache_generation;
+    rows->copy_limit =
+      (size_t)config_to_int("response-cache-size") * 1024 * 1024 / 4;
+  }
+
+  http_send_headers(http, "200 OK", "text/json", -1);
+  http->rows = rows;
+  client_start_feed(http->client);
+  return 0;
+}
+
+static int method_tracks(http_t *http)
+{
+  query_t *query = query_tracks_new();
+  int64_t total, limit = args_int(http, "limit");
+
+  query_arena(query, &http->arena);
+  parse_query_filters(http, query);
+
+  total = parse_total(http, query);
+  if (total < 0) {
+    musicd_log(LOG_ERROR, "protocol_http", "query_count failed");
+    http_reply(http, "500 Internal Server Error");
+    goto finish;
+  }
+  
+  parse_query_bounds(http, query);
+  parse_query_sort(http, query);
+
+  if (parse_query_cursor(http, query)) {
+    http_reply(http, "400 Bad Request");
+    goto finish;
+  }
+  
+  if(query_start(query)) {
+    musicd_log(LOG_ERROR, "protocol_http", "query_start failed");
+    http_reply(http, "500 Internal Server Error");
+    goto finish;
+  }
+  
+  return send_json_rows(http, query, "tracks", write_track, total, limit);
+
+finish:
+  query_close(query);
+  return 0;
+}
+
+static int method_track_index(http_t *http)
+{
+  query_t *query = query_tracks_new();
+  json_t json;
+  int64_t id, index;
+
+  query_arena(query, &http->arena);
+
+  id = args_int(http, "id");
+  if (id <= 0) {
+    http_reply(http, "400 Bad Request");
+    return 0;
+  }
+
+  parse_query_filters(http, query);
+  parse_query_sort(http, query);
+
+  index = query_index(query, id);
+  if (index < 0) {
+    http_reply(http, "500 Internal Server Error");
+    goto finish;
+  }
+
+  json_init_in(&json, &http->arena);
   json_object_begin(&json);
 
   json_define(&json, "index");
@@ -642,10 +1301,9 @@ finish:
 static int method_artists(http_t *http)
 {
   query_t *query = query_artists_new();
-  int64_t total;
-  json_t json;
-  query_artist_t artist;
+  int64_t total, limit = args_int(http, "limit");
 
+  query_arena(query, &http->arena);
   parse_query_filters(http, query);
 
   total = parse_total(http, query);
@@ -657,6 +1315,11 @@ static int method_artists(http_t *http)
   
   parse_query_bounds(http, query);
   parse_query_sort(http, query);
+
+  if (parse_query_cursor(http, query)) {
+    http_reply(http, "400 Bad Request");
+    goto finish;
+  }
   
   if(query_start(query)) {
     musicd_log(LOG_ERROR, "protocol_http", "query_start failed");
@@ -664,29 +1327,7 @@ static int method_artists(http_t *http)
     goto finish;
   }
   
-  json_init(&json);
-  json_object_begin(&json);
-  
-  if (total) {
-    json_define(&json, "total");
-    json_int64(&json, total);
-  }
-  
-  json_define(&json, "artists");
-  json_array_begin(&json);
-  
-  while (!query_artists_next(query, &artist)) {
-    json_object_begin(&json);
-    json_define(&json, "id");       json_int64(&json, artist.artistid);
-    json_define(&json, "artist");    json_string(&json, artist.artist);
-    json_object_end(&json);
-  }
-  json_array_end(&json);
-  json_object_end(&json);
-  
-  http_send_text(http, "200 OK", "text/json", json_result(&json));
-  
-  json_finish(&json);
+  return send_json_rows(http, query, "artists", write_artist, total, limit);
 
 finish:
   query_close(query);
@@ -696,10 +1337,9 @@ finish:
 static int method_albums(http_t *http)
 {
   query_t *query = query_albums_new();
-  int64_t total;
-  json_t json;
-  query_album_t album;
+  int64_t total, limit = args_int(http, "limit");
 
+  query_arena(query, &http->arena);
   parse_query_filters(http, query);
 
   total = parse_total(http, query);
@@ -711,6 +1351,11 @@ static int method_albums(http_t *http)
   
   parse_query_bounds(http, query);
   parse_query_sort(http, query);
+
+  if (parse_query_cursor(http, query)) {
+    http_reply(http, "400 Bad Request");
+    goto finish;
+  }
   
   if(query_start(query)) {
     musicd_log(LOG_ERROR, "protocol_http", "query_start failed");
@@ -718,31 +1363,7 @@ static int method_albums(http_t *http)
     goto finish;
   }
   
-  json_init(&json);
-  json_object_begin(&json);
-  
-  if (total) {
-    json_define(&json, "total");
-    json_int64(&json, total);
-  }
-  
-  json_define(&json, "albums");
-  json_array_begin(&json);
-  
-  while (!query_albums_next(query, &album)) {
-    json_object_begin(&json);
-    json_define(&json, "id");       json_int64(&json, album.albumid);
-    json_define(&json, "album");    json_string(&json, album.album);
-    json_define(&json, "image");    json_int64(&json, album.image);
-    json_define(&json, "tracks");   json_int64(&json, album.tracks);
-    json_object_end(&json);
-  }
-  json_array_end(&json);
-  json_object_end(&json);
-  
-  http_send_text(http, "200 OK", "text/json", json_result(&json));
-
-  json_finish(&json);
+  return send_json_rows(http, query, "albums", write_album, total, limit);
 
 finish:
   query_close(query);
@@ -754,27 +1375,42 @@ static int64_t validate_image_size(int64_t size)
   if (size == 0) {
     return 0;
   }
-  if (size < 16) {
-    return 16;
+  if (size < IMAGE_SIZE_MIN) {
+    return IMAGE_SIZE_MIN;
   }
-  if (size > 512) {
-    return 512;
+  if (size > IMAGE_SIZE_MAX) {
+    return IMAGE_SIZE_MAX;
   }
   return size;
 }
 
 static int send_image(http_t *http, char *cache_name)
 {
-  char *data;
-  int data_size;
-  data = cache_get(cache_name, &data_size);
-  if (!data) {
+  cache_blob_t *blob;
+  int fd;
+  int64_t size;
+
+  /* Popular thumbnails are sent from memory without copying */
+  blob = cache_blob_get(cache_name);
+  if (blob) {
+    http_send_headers(http, "200 OK", "image/jpeg", blob->size);
+    if (http->head) {
+      cache_blob_put(blob);
+    } else {
+      client_write_ref(http->client, blob->data, blob->size,
+                       (outqueue_release_t)cache_blob_put, blob);
+    }
+    free(cache_name);
+    return 0;
+  }
+
+  fd = cache_open_file(cache_name, &size);
+  if (fd < 0) {
     http_reply(http, "404 Not Found");
   } else {
-    http_send(http, "200 OK", "image/jpeg", data_size, data);
+    http_send_fd(http, "200 OK", "image/jpeg", fd, size);
   }
 
-  free(data);
   free(cache_name);
   return 0;
 }
@@ -811,8 +1447,7 @@ static int method_image(http_t *http)
   }
 
   task = image_task(image, size);
-  task_start(task);
-  client_wait_task(http->client, task, (client_callback_t)send_image, cache_name);
+  http_wait_task(http, task, (client_callback_t)send_image, cache_name);
   return 0;
 }
 
@@ -829,12 +1464,235 @@ static int method_album_image(http_t *http)
     return 0;
   }
 
+  http_begin_headers(http, "302 Found", NULL, 0);
   client_send(http->client,
-              "HTTP/1.1 302 Found\r\n"
-              "Server: musicd/" MUSICD_VERSION_STRING "\r\n"
-              "Content-Length: 0\r\n"
-              "Location: /image?id=%" PRId64 "&size=%" PRId64 "\r\n"
-              "\r\n", image, size);
+              "Location: /image?id=%" PRId64 "&size=%" PRId64 "\r\n\r\n",
+              image, size);
+  return 0;
+}
+
+/**
+ * Parses comma-separated list of ids in argument @p key.
+ * @returns array of at most @p max ids and stores their count to @p nb_ids,
+ * or NULL if there were none or too many
+ */
+static int64_t *args_ids(http_t *http, const char *key, int max, int *nb_ids)
+{
+  char *value = args_str(http, key), *p, *end;
+  int64_t *ids = NULL;
+  int64_t id;
+
+  *nb_ids = 0;
+  if (!value) {
+    return NULL;
+  }
+
+  ids = malloc(sizeof(int64_t) * max);
+  for (p = value; *p != '\0'; p = *end ? end + 1 : end) {
+    id = strtoll(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0') || id <= 0
+     || *nb_ids == max) {
+      *nb_ids = 0;
+      break;
+    }
+    ids[(*nb_ids)++] = id;
+  }
+
+  if (*nb_ids == 0) {
+    free(ids);
+    return NULL;
+  }
+  return ids;
+}
+
+/** Images of an /images request */
+struct image_list {
+  int nb_images;
+  int size;
+  /** Album ids if requested by album, otherwise image ids */
+  int64_t *ids;
+  /** Image ids, 0 if there is no image */
+  int64_t *images;
+  bool albums;
+};
+
+static void image_list_free(struct image_list *list)
+{
+  free(list->ids);
+  free(list->images);
+  free(list);
+}
+
+/** Thumbnail in memory, the part of an /images response */
+struct image_part {
+  const char *data;
+  size_t size;
+  /** Shared entry of the memory cache, or NULL if data is a private copy */
+  cache_blob_t *blob;
+  char *header;
+};
+
+/**
+ * Loads thumbnail @p cache_name to @p part, from the memory cache like
+ * send_image if it is there, so that no file stays open until it is sent.
+ * @returns true if it exists and isn't empty
+ */
+static bool image_part_load(struct image_part *part, const char *cache_name)
+{
+  int size = 0;
+
+  part->blob = cache_blob_get(cache_name);
+  if (part->blob) {
+    part->data = part->blob->data;
+    part->size = part->blob->size;
+  } else {
+    part->data = cache_get(cache_name, &size);
+    part->size = size;
+  }
+
+  if (part->data && part->size > 0) {
+    return true;
+  }
+  if (part->blob) {
+    cache_blob_put(part->blob);
+  } else {
+    free((char *)part->data);
+  }
+  part->data = NULL;
+  return false;
+}
+
+/**
+ * Sends all cached thumbnails of @p list as multipart/mixed, each part with
+ * the Content-Location it would be requested from alone. Images that could
+ * not be made are left out. The parts are read to memory first, as the total
+ * length is needed before sending, and a file descriptor held per part would
+ * add up over many clients.
+ */
+static int send_images(http_t *http, struct image_list *list)
+{
+  struct image_part *parts =
+    malloc(sizeof(struct image_part) * list->nb_images);
+  struct image_part *part;
+  int64_t length = 0;
+  char *name;
+  int i;
+
+  for (i = 0; i < list->nb_images; ++i) {
+    part = &parts[i];
+    part->data = NULL;
+    if (list->images[i] <= 0) {
+      continue;
+    }
+
+    name = image_cache_name(list->images[i], list->size);
+    if (!image_part_load(part, name)) {
+      free(name);
+      continue;
+    }
+    free(name);
+
+    part->header = stringf("--" MULTIPART_BOUNDARY "\r\n"
+                           "Content-Type: image/jpeg\r\n"
+                           "Content-Location: /%s?id=%" PRId64 "&size=%d\r\n"
+                           "Content-Length: %zu\r\n\r\n",
+                           list->albums ? "album/image" : "image",
+                           list->ids[i], list->size, part->size);
+    length += strlen(part->header) + part->size + 2;
+  }
+  length += strlen("--" MULTIPART_BOUNDARY "--\r\n");
+
+  http_begin_headers(http, "200 OK", NULL, length);
+  client_send(http->client, "Content-Type: multipart/mixed; boundary="
+                            MULTIPART_BOUNDARY "\r\n\r\n");
+
+  for (i = 0; i < list->nb_images; ++i) {
+    part = &parts[i];
+    if (!part->data) {
+      continue;
+    }
+    if (http->head) {
+      if (part->blob) {
+        cache_blob_put(part->blob);
+      } else {
+        free((char *)part->data);
+      }
+    } else {
+      client_send(http->client, "%s", part->header);
+      if (part->blob) {
+        client_write_ref(http->client, part->data, part->size,
+                         (outqueue_release_t)cache_blob_put, part->blob);
+      } else {
+        client_write_ref(http->client, part->data, part->size, free,
+                         (void *)part->data);
+      }
+      client_send(http->client, "\r\n");
+    }
+    free(part->header);
+  }
+  if (!http->head) {
+    client_send(http->client, "--" MULTIPART_BOUNDARY "--\r\n");
+  }
+
+  free(parts);
+  image_list_free(list);
+  return 0;
+}
+
+static int method_images(http_t *http)
+{
+  struct image_list *list;
+  int64_t *missing;
+  int nb_missing = 0, i, j;
+  char *name;
+
+  list = malloc(sizeof(struct image_list));
+  list->size = validate_image_size(args_int(http, "size"));
+  list->ids = args_ids(http, "id", IMAGES_MAX, &list->nb_images);
+  list->albums = false;
+  if (!list->ids) {
+    list->ids = args_ids(http, "album", IMAGES_MAX, &list->nb_images);
+    list->albums = true;
+  }
+  list->images = malloc(sizeof(int64_t) * (list->nb_images + 1));
+
+  if (!list->ids || !list->size) {
+    image_list_free(list);
+    http_reply(http, "400 Bad Request");
+    return 0;
+  }
+
+  if (list->albums) {
+    library_album_image_list(list->ids, list->nb_images, list->images);
+  } else {
+    memcpy(list->images, list->ids, sizeof(int64_t) * list->nb_images);
+  }
+
+  missing = malloc(sizeof(int64_t) * list->nb_images);
+  for (i = 0; i < list->nb_images; ++i) {
+    if (list->images[i] <= 0) {
+      continue;
+    }
+    for (j = 0; j < nb_missing && missing[j] != list->images[i]; ++j) { }
+    if (j < nb_missing) {
+      continue;
+    }
+    name = image_cache_name(list->images[i], list->size);
+    if (!cache_exists(name)) {
+      missing[nb_missing++] = list->images[i];
+    }
+    free(name);
+  }
+
+  if (nb_missing == 0) {
+    free(missing);
+    return send_images(http, list);
+  }
+
+  /* All missing thumbnails are made in one task */
+  http_wait_task(http, image_list_task(missing, nb_missing, list->size),
+                 (client_callback_t)send_images, list);
+  free(missing);
   return 0;
 }
 
@@ -855,7 +1713,7 @@ static int method_album_images(http_t *http)
     return 0;
   }
 
-  json_init(&json);
+  json_init_in(&json, &http->arena);
   json_object_begin(&json);
   json_define(&json, "images");
   json_array_begin(&json);
@@ -874,7 +1732,7 @@ static void send_lyrics(http_t *http, lyrics_t *lyrics)
 {
   json_t json;
 
-  json_init(&json);
+  json_init_in(&json, &http->arena);
   json_object_begin(&json);
   json_define(&json, "lyrics"); json_string(&json, lyrics->lyrics);
   json_define(&json, "provider"); json_string(&json, lyrics->provider);
@@ -899,6 +1757,16 @@ static int track_lyrics_cb(http_t *http, int64_t *track)
   return 0;
 }
 
+/**
+ * @returns true if lyrics last updated at @p ltime, 0 for never, should be
+ * fetched again
+ */
+static bool lyrics_stale(time_t ltime)
+{
+  int retry = config_to_int("lyrics-retry");
+  return !ltime || (retry > 0 && time(NULL) - ltime >= (time_t)retry * 3600);
+}
+
 static int method_track_lyrics(http_t *http)
 {
   int64_t track;
@@ -921,14 +1789,13 @@ static int method_track_lyrics(http_t *http)
     return 0;
   }
 
-  if (!ltime) {
+  if (lyrics_stale(ltime)) {
     task = lyrics_task(track);
-    task_start(task);
 
     id_ptr = malloc(sizeof(int64_t));
     *id_ptr = track;
 
-    client_wait_task(http->client, task, (client_callback_t)track_lyrics_cb, id_ptr);
+    http_wait_task(http, task, (client_callback_t)track_lyrics_cb, id_ptr);
     return 0;
   }
 
@@ -944,121 +1811,452 @@ static bool root_iterate_directories(library_directory_t *directory, void *opaqu
 
   for (name = directory->path + strlen(directory->path) - 1; name > directory->path && *(name - 1) != '/'; --name) { }
 
-  json_object_begin(json);
-  json_define(json, "name");
-  json_string(json, name);
-  json_object_end(json);
+  json_object_begin(json);
+  json_define(json, "name");
+  json_string(json, name);
+  json_object_end(json);
+
+  return true;
+}
+
+static int method_root(http_t *http)
+{
+  const char *raw_temp = http->path + strlen("/root");
+  char *request_path = decode_url(http, &raw_temp),
+       *root_path = library_root_path(),
+       *full_path = stringf("%s%s", root_path, request_path);
+  int64_t directory = library_directory(full_path, -1);
+
+  musicd_log(LOG_DEBUG, "protocol_http", "%s %s %s", request_path, root_path, full_path);
+
+  if (!directory) {
+    http_reply(http, "404 Not Found");
+    goto finish;
+  }
+
+  json_t json;
+
+  json_init_in(&json, &http->arena);
+  json_object_begin(&json);
+  json_define(&json, "directories");
+  json_array_begin(&json);
+  library_iterate_directories(directory, root_iterate_directories, &json);
+  json_array_end(&json);
+  json_object_end(&json);
+
+  http_send_text(http, "200 OK", "text/json", json_result(&json));
+
+finish:
+  free(root_path);
+  free(full_path);
+  return 0;
+}
+
+/**
+ * @returns cache name of @p track transcoded to @p codec at @p bitrate, or
+ * NULL if the stream cache is disabled. The file mtime is part of the name, so
+ * that changed files are transcoded again.
+ */
+static char *stream_cache_name(track_t *track, codec_type_t codec,
+                               int64_t bitrate)
+{
+  if (config_to_int("stream-cache-size") <= 0) {
+    return NULL;
+  }
+  return stringf(TRANSCODER_CACHE_DIR "/%" PRId64 "-%d-%" PRId64 "-%" PRId64,
+                 track->id, codec, bitrate,
+                 (int64_t)library_file_mtime(track->fileid));
+}
+
+/**
+ * Reads the configured codec and the requested bitrate for streaming.
+ */
+static void stream_params(http_t *http, codec_type_t *codec, int64_t *bitrate)
+{
+  if (config_get_value("codec"))
+    *codec = codec_type_from_string(config_get("codec"));
+  else
+    *codec = codec_type_from_string("mp3");
+
+  *bitrate = args_int(http, "bitrate");
+  if (!*bitrate) {
+    *bitrate = config_to_int("bitrate") * 1000;
+    if (*bitrate == 0)
+      *bitrate = 192000;
+  } else if (*bitrate < 64000) {
+    *bitrate = 64000;
+  } else if (*bitrate > 320000) {
+    *bitrate = 320000;
+  }
+}
+
+/**
+ * @returns key under which streams of @p track are shared and prefetched
+ */
+static char *stream_share_key(track_t *track, codec_type_t codec,
+                              int64_t bitrate)
+{
+  return stringf("%" PRId64 "-%d-%" PRId64, track->id, codec, bitrate);
+}
+
+/**
+ * @returns owner of prefetched streams of the request's session
+ */
+static const char *prefetch_owner(http_t *http)
+{
+  return http->session ? http->session->id : "";
+}
+
+/**
+ * Opens a transcoder for @p track, which is owned by the transcoder from now
+ * on, and seeks it to @p seek if positive.
+ * @returns the transcoder, not started yet, or NULL on failure
+ */
+static transcoder_t *open_transcoder(track_t *track, codec_type_t codec,
+                                     int64_t bitrate, int64_t seek,
+                                     stream_t **stream_out)
+{
+  stream_t *stream;
+  transcoder_t *transcoder;
+
+  stream = stream_new();
+
+  if (!stream_open(stream, track)) {
+    track_free(track);
+    stream_close(stream);
+    return NULL;
+  }
+
+  transcoder = transcoder_new(stream);
+  if (!transcoder) {
+    stream_close(stream);
+    return NULL;
+  }
+
+  if ((!(config_to_bool("stream-copy") && stream_copy(stream, codec, bitrate))
+    && !stream_transcode(stream, codec, bitrate))
+   || !transcoder_remux(transcoder)) {
+    transcoder_close(transcoder);
+    return NULL;
+  }
+
+  if (seek > 0 && stream_seek(stream, seek) < 0) {
+    transcoder_close(transcoder);
+    return NULL;
+  }
+
+  *stream_out = stream;
+  return transcoder;
+}
+
+/**
+ * Starts @p transcoder of @p stream, caching it as @p cache_name and sharing
+ * it as @p share_key if not NULL.
+ */
+static void start_transcoder(transcoder_t *transcoder, stream_t *stream,
+                             const char *cache_name, const char *share_key)
+{
+  if (cache_name) {
+    transcoder_cache(transcoder, cache_name);
+  }
+  if (share_key && config_to_bool("stream-share")) {
+    transcoder_share(transcoder, share_key);
+  }
+
+  stream_set_pacing(stream, config_to_int("stream-readahead"),
+                    config_to_int("stream-pace") / 100.0);
+  stream_start(stream);
+  transcoder_start(transcoder);
+}
+
+static int method_open(http_t *http)
+{
+  int64_t id, seek, bitrate, size, range_first, range_last;
+  bool time_range = false;
+  track_t *track = NULL;
+  stream_t *stream;
+  transcoder_t *transcoder = NULL;
+  codec_type_t codec;
+  char *cache_name = NULL, *share_key = NULL;
+  int fd, duration;
+
+  stream_params(http, &codec, &bitrate);
+
+  id = args_int(http, "id");
+  seek = args_int(http, "seek");
+
+  track = library_track_by_id(id);
+  if (!track) {
+    http_reply(http, "404 Not Found");
+    return 0;
+  }
+
+  /* Time ranges ("Range: seconds=30-") work like seek for any stream, byte
+   * ranges only for cached ones */
+  if (seek <= 0 && http_range(http, "seconds", &range_first, &range_last)
+   && range_first >= 0) {
+    seek = range_first;
+    time_range = true;
+  }
+
+  /* Only whole streams are cached */
+  if (seek <= 0) {
+    cache_name = stream_cache_name(track, codec, bitrate);
+  }
+  if (cache_name) {
+    fd = cache_open_file(cache_name, &size);
+    if (fd >= 0) {
+      musicd_log(LOG_DEBUG, "protocol_http", "stream from cache: %s",
+                 cache_name);
+      cache_touch(cache_name);
+      free(cache_name);
+      track_free(track);
+      http_send_fd(http, NULL, get_mime_by_codec(codec), fd, size);
+      return 0;
+    }
+  }
+
+  /* A prefetched stream or one that other listeners of the same track are
+   * reading can be used from the start, seeking ones are always separate */
+  if (seek <= 0) {
+    share_key = stream_share_key(track, codec, bitrate);
+    /* HEAD leaves the prefetched stream for the request that plays it */
+    if (!http->head) {
+      transcoder = transcoder_take(prefetch_owner(http), share_key);
+    }
+    if (transcoder) {
+      musicd_log(LOG_DEBUG, "protocol_http", "stream from prefetch: %s",
+                 share_key);
+    } else if (config_to_bool("stream-share")) {
+      transcoder = transcoder_join(share_key);
+    }
+  }
+
+  duration = track->duration;
+  if (transcoder) {
+    track_free(track);
+    stream = NULL;
+  } else {
+    transcoder = open_transcoder(track, codec, bitrate, seek, &stream);
+    if (!transcoder) {
+      http_reply(http, "500 Internal Server Error");
+      free(cache_name);
+      free(share_key);
+      return 0;
+    }
+  }
+
+  if (time_range) {
+    http_begin_headers(http, "206 Partial Content", get_mime_by_codec(codec),
+                       -1);
+    client_send(http->client, "Content-Range: seconds %" PRId64 "-%d/%d\r\n\r\n",
+                seek, duration, duration);
+  } else {
+    http_send_headers(http, "200 OK", get_mime_by_codec(codec), -1);
+  }
+  if (http->head) {
+    transcoder_close(transcoder);
+    free(cache_name);
+    free(share_key);
+    return 0;
+  }
+
+  if (stream) {
+    /* Newly opened, not running yet */
+    start_transcoder(transcoder, stream, cache_name, share_key);
+  }
+  free(cache_name);
+  free(share_key);
+
+  transcoder_close(http->transcoder);
+  http->transcoder = transcoder;
+  client_start_feed(http->client);
+
+  return 0;
+}
+
+static void prefetch_lyrics(int64_t track)
+{
+  lyrics_t *lyrics;
+  time_t ltime;
+  task_t *task;
+
+  lyrics = library_lyrics(track, &ltime);
+  if (lyrics) {
+    lyrics_free(lyrics);
+    return;
+  }
+  if (!lyrics_stale(ltime)) {
+    return;
+  }
+
+  /* A /track/lyrics request for the same track joins this one */
+  task = lyrics_task(track);
+  task->priority = TASK_PRIORITY_BACKGROUND;
+  task_launch(task);
+}
+
+static int method_prefetch(http_t *http)
+{
+  int64_t id, bitrate;
+  track_t *track;
+  stream_t *stream;
+  transcoder_t *transcoder = NULL;
+  codec_type_t codec;
+  char *cache_name, *share_key;
+
+  stream_params(http, &codec, &bitrate);
+
+  id = args_int(http, "id");
+  track = library_track_by_id(id);
+  if (!track) {
+    http_reply(http, "404 Not Found");
+    return 0;
+  }
+
+  if (config_to_bool("lyrics-prefetch")) {
+    prefetch_lyrics(id);
+  }
+
+  cache_name = stream_cache_name(track, codec, bitrate);
+  if (cache_name && cache_exists(cache_name)) {
+    /* Served right away anyway */
+    free(cache_name);
+    track_free(track);
+    http_json_success(http);
+    return 0;
+  }
+
+  share_key = stream_share_key(track, codec, bitrate);
+  if (config_to_bool("stream-share")) {
+    transcoder = transcoder_join(share_key);
+  }
+
+  if (transcoder) {
+    track_free(track);
+  } else {
+    transcoder = open_transcoder(track, codec, bitrate, 0, &stream);
+    if (!transcoder) {
+      http_reply(http, "500 Internal Server Error");
+      free(cache_name);
+      free(share_key);
+      return 0;
+    }
+    start_transcoder(transcoder, stream, cache_name, share_key);
+  }
+
+  musicd_log(LOG_DEBUG, "protocol_http", "prefetching %s", share_key);
+  transcoder_hold(transcoder, prefetch_owner(http), share_key);
 
-  return true;
+  free(cache_name);
+  free(share_key);
+  http_json_success(http);
+  return 0;
 }
 
-static int method_root(http_t *http)
+
+static int method_hls(http_t *http)
 {
-  const char *raw_temp = http->path + strlen("/root");
-  char *request_path = decode_url(&raw_temp),
-       *root_path = library_root_path(),
-       *full_path = stringf("%s%s", root_path, request_path);
-  int64_t directory = library_directory(full_path, -1);
+  int64_t id, bitrate;
+  codec_type_t codec;
+  track_t *track;
+  char *uri, *playlist;
 
-  musicd_log(LOG_DEBUG, "protocol_http", "%s %s %s", request_path, root_path, full_path);
+  stream_params(http, &codec, &bitrate);
+  if (!hls_codec_supported(codec)) {
+    http_reply(http, "501 Not Implemented");
+    return 0;
+  }
 
-  if (!directory) {
+  id = args_int(http, "id");
+  track = library_track_by_id(id);
+  if (!track) {
     http_reply(http, "404 Not Found");
-    goto finish;
+    return 0;
   }
 
-  json_t json;
-
-  json_init(&json);
-  json_object_begin(&json);
-  json_define(&json, "directories");
-  json_array_begin(&json);
-  library_iterate_directories(directory, root_iterate_directories, &json);
-  json_array_end(&json);
-  json_object_end(&json);
-
-  http_send_text(http, "200 OK", "text/json", json_result(&json));
+  uri = stringf("/hls/segment?id=%" PRId64 "&bitrate=%" PRId64 "&index=",
+                id, bitrate);
+  playlist = hls_playlist(track, uri);
+  http_send_text(http, "200 OK", "application/vnd.apple.mpegurl", playlist);
 
-finish:
-  free(request_path);
-  free(root_path);
-  free(full_path);
+  free(playlist);
+  free(uri);
+  track_free(track);
   return 0;
 }
 
-static int feed_write(void *opaque, uint8_t *buf, int buf_size)
+/** Callback data of a segment being transcoded, as args are gone by then */
+struct segment_request {
+  char *cache_name;
+  const char *mime;
+};
+
+static int send_segment(http_t *http, struct segment_request *segment)
 {
-  http_t *http = (http_t *)opaque;
-  client_write(http->client, (char *)buf, buf_size);
-  return buf_size;
+  int64_t size;
+  int fd;
+
+  fd = cache_open_file(segment->cache_name, &size);
+  if (fd < 0) {
+    http_reply(http, "500 Internal Server Error");
+  } else {
+    http_send_fd(http, NULL, segment->mime, fd, size);
+  }
+
+  free(segment->cache_name);
+  free(segment);
+  return 0;
 }
 
-static int method_open(http_t *http)
+static int method_hls_segment(http_t *http)
 {
-  int64_t id, seek, bitrate;
-  track_t *track = NULL;
-  stream_t *stream;
+  int64_t id, bitrate, index;
   codec_type_t codec;
-  if (config_get_value("codec"))
-    codec = codec_type_from_string(config_get("codec"));
-  else
-    codec = codec_type_from_string("mp3");
+  track_t *track;
+  struct segment_request *segment;
 
-  id = args_int(http, "id");
-  seek = args_int(http, "seek");
-  bitrate = args_int(http, "bitrate");
-  if (!bitrate) {
-    bitrate = config_to_int("bitrate") * 1000;
-    if (bitrate == 0)
-      bitrate = 192000;
-  } else if (bitrate < 64000) {
-    bitrate = 64000;
-  } else if (bitrate > 320000) {
-    bitrate = 320000;
+  stream_params(http, &codec, &bitrate);
+  if (!hls_codec_supported(codec)) {
+    http_reply(http, "501 Not Implemented");
+    return 0;
   }
 
+  id = args_int(http, "id");
+  index = args_int(http, "index");
   track = library_track_by_id(id);
   if (!track) {
     http_reply(http, "404 Not Found");
     return 0;
   }
-
-  stream = stream_new();
-
-  if (!stream_open(stream, track)) {
-    http_reply(http, "500 Internal Server Error");
+  if (index < 0 || index >= hls_segments(track)) {
     track_free(track);
-    stream_close(stream);
-    return 0;
-  }
-
-  if (!stream_transcode(stream, codec, bitrate)
-   || !stream_remux(stream, feed_write, http)) {
-    http_reply(http, "500 Internal Server Error");
-    stream_close(stream);
+    http_reply(http, "404 Not Found");
     return 0;
   }
 
-  if (seek > 0) {
-    if (stream_seek(stream, seek) < 0) {
-      http_reply(http, "500 Internal Server Error");
-      stream_close(stream);
-      return 0;
-    }
+  segment = malloc(sizeof(struct segment_request));
+  segment->cache_name = hls_segment_cache_name(track, codec, bitrate, index);
+  segment->mime = get_mime_by_codec(codec);
+  if (cache_exists(segment->cache_name)) {
+    track_free(track);
+    return send_segment(http, segment);
   }
 
-  http->stream = stream;
-  http_send_headers(http, "200 OK", get_mime_by_codec(codec), -1);
-  stream_start(stream);
-  client_start_feed(http->client);
-
+  http_wait_task(http, hls_segment_task(track, codec, bitrate, index),
+                 (client_callback_t)send_segment, segment);
+  track_free(track);
   return 0;
 }
 
 
+/* Needs the method table, defined below it */
+static int method_metrics(http_t *http);
+
 #define NO_AUTH 0x02 // Allow access without authorisation
 #define SHARE_CAPABLE 0x04 // Supports restricted share access
 #define ONLY_PREFIX 0x08 // Will be called as long as path begins with the name
+#define CACHEABLE 0x10 // JSON response depends only on the request and library
 
 struct method_entry {
   const char *name;
@@ -1070,26 +2268,58 @@ static struct method_entry methods[] = {
   { "/auth", method_auth, NO_AUTH },
 
   { "/status", method_status, 0 },
+  { "/metrics", method_metrics, 0 },
 
   { "/rescan", method_rescan, 0 },
 
-  { "/tracks", method_tracks, 0 },
+  { "/tracks", method_tracks, CACHEABLE },
   { "/track/index", method_track_index, 0 },
-  { "/artists", method_artists, 0 },
-  { "/albums", method_albums, 0 },
+  { "/artists", method_artists, CACHEABLE },
+  { "/albums", method_albums, CACHEABLE },
 
   { "/image", method_image, 0 },
   { "/album/image", method_album_image, 0 },
   { "/album/images", method_album_images, 0 },
+  { "/images", method_images, 0 },
 
   { "/track/lyrics", method_track_lyrics, 0 },
 
   { "/root", method_root, ONLY_PREFIX },
 
   { "/open", method_open, 0 },
+  { "/prefetch", method_prefetch, 0 },
+  { "/hls", method_hls, 0 },
+  { "/hls/segment", method_hls_segment, 0 },
 
   { NULL, NULL, 0 }
 };
+#define NB_METHODS (sizeof(methods) / sizeof(methods[0]) - 1)
+
+/** Handler latency for each entry in methods */
+static metrics_histogram_t method_latency[NB_METHODS];
+
+static int method_metrics(http_t *http)
+{
+  string_t *string = string_new();
+  char *labels;
+  size_t i;
+
+  metrics_format(string);
+
+  for (i = 0; i < NB_METHODS; ++i) {
+    labels = stringf("method=\"%s\"", methods[i].name);
+    metrics_format_histogram(string, "musicd_http_request_seconds",
+                             i == 0 ? "Time spent in HTTP method handlers"
+                                    : NULL,
+                             labels, &method_latency[i]);
+    free(labels);
+  }
+
+  http_send_text(http, "200 OK", "text/plain; version=0.0.4",
+                 string_string(string));
+  string_free(string);
+  return 0;
+}
 
 struct mime_entry {
   const char *extension;
@@ -1135,7 +2365,6 @@ static void attach_session(http_t *http)
   session_id = args_str(http, "share");
   if (session_id) {
     http->session = session_get(session_id);
-    free(session_id);
     if (http->session) {
       /* Valid share */
       return;
@@ -1145,7 +2374,6 @@ static void attach_session(http_t *http)
   session_id = cookie_get(http, "musicd-session");
   if (session_id) {
     http->session = session_get(session_id);
-    free(session_id);
     if (http->session) {
       /* Valid session (real or share) */
       return;
@@ -1153,9 +2381,88 @@ static void attach_session(http_t *http)
   }
 }
 
+static int compare_args(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * @returns path and arguments of the current request, the arguments sorted so
+ * that their order doesn't matter. Allocated with malloc, not from the
+ * request arena, and freed with free() once the request has been processed.
+ * The arguments are only split in the arena while building it.
+ */
+static char *normalized_request(http_t *http)
+{
+  string_t *result = string_from(http->path);
+  char **args = NULL, *p, *end;
+  int nb_args = 0, i;
+
+  for (p = http->args; p && *p != '\0'; p = *end ? end + 1 : end) {
+    end = strchr(p, '&');
+    if (!end) {
+      end = p + strlen(p);
+    }
+    if (end > p) {
+      args = realloc(args, sizeof(char *) * (nb_args + 1));
+      args[nb_args++] = strextract_in(&http->arena, p, end);
+    }
+  }
+  qsort(args, nb_args, sizeof(char *), compare_args);
+
+  for (i = 0; i < nb_args; ++i) {
+    string_push_back(result, i == 0 ? '?' : '&');
+    string_append(result, args[i]);
+  }
+  free(args);
+
+  /* Compressed and uncompressed responses are different entities */
+  if (http->gzip && config_to_int("compression-level") > 0) {
+    string_append(result, " gzip");
+  }
+  return string_release(result);
+}
+
+/**
+ * Answers cacheable method from the response cache, or with 304 Not Modified
+ * if the client has the current response already.
+ * @returns 0 if answered, nonzero if the method has to be called
+ */
+static int send_cached(http_t *http)
+{
+  char *body;
+  size_t size;
+
+  http->cache_generation = library_generation();
+  http->cache_key = normalized_request(http);
+  http->etag = response_cache_etag(http->cache_key, http->cache_generation);
+
+  if (http->if_none_match && (!strcmp(http->if_none_match, "*")
+                           || strstr(http->if_none_match, http->etag))) {
+    http_send_headers(http, "304 Not Modified", NULL, 0);
+    return 0;
+  }
+
+  body = response_cache_get(http->cache_key, http->cache_generation, &size);
+  if (!body) {
+    return 1;
+  }
+
+  /* JSON never begins with the gzip magic */
+  if (size >= 2 && (unsigned char)body[0] == 0x1f
+   && (unsigned char)body[1] == 0x8b) {
+    http->content_encoding = "gzip";
+  }
+  http->vary_encoding = http->content_encoding || size >= GZIP_MIN_SIZE;
+  http_send_ref(http, "200 OK", "text/json", size, body, free);
+  return 0;
+}
+
 static int call_method(http_t *http)
 {
   struct method_entry *method;
+  int64_t start;
+  int result;
 
   for (method = methods; method->name != NULL; ++method) {
 
@@ -1176,12 +2483,42 @@ static int call_method(http_t *http)
         http_reply(http, "403 Forbidden");
         return 0;
       }
-      return method->handler(http);
+      start = metrics_now();
+      if (method->flags & CACHEABLE && !send_cached(http)) {
+        result = 0;
+      } else {
+        result = method->handler(http);
+      }
+      metrics_observe(&method_latency[method - methods], metrics_now() - start);
+      return result;
     }
   }
   return 1;
 }
 
+/**
+ * Sends document @p path, or its precompressed sibling "<path>.gz" if the
+ * client accepts gzip and there is one.
+ */
+static bool send_document_file
+  (http_t *http, const char *path, const char *mime)
+{
+  char *gzip_path;
+  bool result = false;
+
+  if (http->gzip && compressible_type(mime)) {
+    gzip_path = stringf("%s.gz", path);
+    http->content_encoding = "gzip";
+    http->vary_encoding = true;
+    result = http_try_send_file(http, gzip_path, mime);
+    if (!result) {
+      http->content_encoding = NULL;
+    }
+    free(gzip_path);
+  }
+  return result || http_try_send_file(http, path, mime);
+}
+
 static int send_document(http_t *http)
 {
   int result;
@@ -1194,7 +2531,7 @@ static int send_document(http_t *http)
 
   if (!strcmp(http->path, "/")) {
     path = stringf("%s/index.html", config_to_path("http-root"));
-    result = http_try_send_file(http, path, "text/html");
+    result = send_document_file(http, path, "text/html");
     free(path);
     return result ? 0 : 1;
   }
@@ -1212,7 +2549,7 @@ static int send_document(http_t *http)
   musicd_log(LOG_DEBUG, "protocol_http", "static path: %s, mime: %s",
              path, mime);
 
-  result = http_try_send_file(http, path, mime);
+  result = send_document_file(http, path, mime);
   free(path);
   return result ? 0 : 1;
 }
@@ -1220,11 +2557,12 @@ static int send_document(http_t *http)
 #ifdef HTTP_BUILTIN
 /* Found in generated http_builtin.c */
 extern int http_builtin_file(char *url, char **data, int *size);
+extern int http_builtin_file_gzip(char *url, char **data, int *size);
 
 static int send_builtin(http_t *http)
 {
-  char *path = http->path, *data;
-  int size;
+  char *path = http->path, *data, *gzip_data;
+  int size, gzip_size;
 
   if (!strcmp(http->path, "/")) {
     path = "/index.html";
@@ -1234,7 +2572,17 @@ static int send_builtin(http_t *http)
     return 1;
   }
 
-  http_send(http, NULL, mime_type_from_path(path), size, data);
+  /* Compressed when packed if it was worth it */
+  if (http_builtin_file_gzip(path, &gzip_data, &gzip_size)) {
+    http->vary_encoding = true;
+    if (http->gzip) {
+      http->content_encoding = "gzip";
+      data = gzip_data;
+      size = gzip_size;
+    }
+  }
+
+  http_send_ref(http, NULL, mime_type_from_path(path), size, data, NULL);
   return 0;
 }
 #endif
@@ -1294,63 +2642,258 @@ static void *http_open(client_t *client)
 static void http_close(void *self)
 {
   http_t *http = (http_t *)self;
-  stream_close(http->stream);
+  transcoder_close(http->transcoder);
+  json_rows_free(http->rows);
+  arena_free(&http->arena);
+  free(http->origin);
   free(http);
 }
 
+static void reset_parser(http_t *http)
+{
+  http->parse_pos = 0;
+  http->have_request_line = false;
+  http->nb_headers = 0;
+}
+
+/**
+ * Parses request line "METHOD target version" at @p line.
+ * @returns 0 on success
+ */
+static int parse_request_line
+  (http_t *http, const char *buf, const char *line, const char *line_end)
+{
+  const char *p1, *p2;
+
+  p1 = memchr(line, ' ', line_end - line);
+  if (!p1) {
+    return -1;
+  }
+  http->method_len = p1 - line;
+
+  ++p1;
+  p2 = memchr(p1, ' ', line_end - p1);
+  if (!p2) {
+    musicd_log(LOG_VERBOSE, "protocol_http",
+               "malformed request line (no tailing version)");
+    return -1;
+  }
+
+  http->target = p1 - buf;
+  http->target_len = p2 - p1;
+  http->version = p2 + 1 - buf;
+  http->version_len = line_end - (p2 + 1);
+  return 0;
+}
+
+/**
+ * Parses header line "Name: value" at @p line to the header table.
+ * @returns 0 on success
+ */
+static int parse_header_line
+  (http_t *http, const char *buf, const char *line, const char *line_end)
+{
+  http_header_t *header;
+  const char *colon, *value, *value_end;
+
+  if (*line == ' ' || *line == '\t') {
+    /* Obsolete line folding is not supported */
+    return -1;
+  }
+
+  colon = memchr(line, ':', line_end - line);
+  if (!colon || colon == line) {
+    return -1;
+  }
+
+  if (http->nb_headers >= MAX_HEADERS) {
+    /* Ignore the rest, nothing we care about is that far */
+    return 0;
+  }
+
+  for (value = colon + 1;
+       value < line_end && (*value == ' ' || *value == '\t'); ++value) { }
+  for (value_end = line_end;
+       value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t');
+       --value_end) { }
+
+  header = &http->headers[http->nb_headers++];
+  header->name = line - buf;
+  header->name_len = colon - line;
+  header->value = value - buf;
+  header->value_len = value_end - value;
+  return 0;
+}
+
+/**
+ * Continues parsing request headers from where the previous call stopped.
+ * @returns size of the complete request head, 0 if more data is needed or <0
+ * if the request is invalid
+ */
+static int parse_request(http_t *http, const char *buf, size_t buf_size)
+{
+  const char *line, *line_end, *newline;
+
+  while (1) {
+    line = buf + http->parse_pos;
+    newline = memchr(line, '\n', buf_size - http->parse_pos);
+
+    if (!newline) {
+      if (buf_size > MAX_HEADER_SIZE) {
+        /* Way too big header */
+        musicd_log(LOG_VERBOSE, "protocol_http",
+                   "MAX_HEADER_SIZE exceeded (%d > %d)",
+                   buf_size, MAX_HEADER_SIZE);
+        return -1;
+      }
+      /* Not enough data */
+      return 0;
+    }
+
+    line_end = newline;
+    if (line_end > line && line_end[-1] == '\r') {
+      --line_end;
+    }
+
+    http->parse_pos = newline + 1 - buf;
+
+    if (!http->have_request_line) {
+      if (line_end == line) {
+        /* Empty lines before the request line are allowed */
+        continue;
+      }
+      if (parse_request_line(http, buf, line, line_end)) {
+        return -1;
+      }
+      http->have_request_line = true;
+    } else if (line_end == line) {
+      /* End of headers */
+      return http->parse_pos;
+    } else if (parse_header_line(http, buf, line, line_end)) {
+      musicd_log(LOG_VERBOSE, "protocol_http", "malformed header line");
+      return -1;
+    }
+  }
+}
+
+/**
+ * @returns true if the connection can be kept open after current request
+ */
+static bool http_keep_alive(http_t *http)
+{
+  const char *connection;
+  size_t len;
+  int max_requests = config_to_int("keep-alive-requests");
+  bool result = http->http11;
+
+  ++http->nb_requests;
+  if (max_requests > 0 && http->nb_requests >= max_requests) {
+    return false;
+  }
+
+  connection = http_header(http, "Connection", &len);
+  if (connection) {
+    char *value = strextract(connection, connection + len);
+    if (strcasestr(value, "close")) {
+      result = false;
+    } else if (strcasestr(value, "keep-alive")) {
+      result = true;
+    }
+    free(value);
+  }
+
+  return result;
+}
+
+/**
+ * Joins all Cookie headers to one string.
+ */
+static char *extract_cookies(http_t *http)
+{
+  string_t *result = string_new_in(&http->arena);
+  http_header_t *header;
+  int i;
+
+  for (i = 0; i < http->nb_headers; ++i) {
+    header = &http->headers[i];
+    if (header->name_len != 6
+     || strncasecmp(http->request + header->name, "Cookie", 6)) {
+      continue;
+    }
+    if (string_size(result) > 0) {
+      string_append(result, "; ");
+    }
+    string_nappend(result, http->request + header->value, header->value_len);
+  }
+
+  return string_release(result);
+}
+
 static int http_process(void *self, const char *buf, size_t buf_size)
 {
   http_t *http = (http_t *)self;
-  const char *end, *p1, *p2;
-  int result = 0;
-
-  /* Do we have all headers? */
-  end = strstr(buf, "\r\n\r\n");
-  if (!end) {
-    if (buf_size > MAX_HEADER_SIZE) {
-      /* Way too big header */
-      musicd_log(LOG_VERBOSE, "protocol_http",
-                 "MAX_HEADER_SIZE exceeded (%d > %d)",
-                 buf_size, MAX_HEADER_SIZE);
+  const char *p2, *origin;
+  size_t origin_len;
+  int end, result = 0;
+
+  http->request = buf;
+
+  end = parse_request(http, buf, buf_size);
+  if (end <= 0) {
+    if (end < 0) {
+      reset_parser(http);
       http_reply(http, "400 Bad Request");
-      return -1;
     }
-    /* Not enough data */
-    return 0;
+    return end;
   }
-  end += 4;
+
+  /* Nothing of the previous request is in use once the next one is read,
+   * streamed rows block reading it */
+  arena_reset(&http->arena);
+
+  free(http->origin);
+  origin = http_header(http, "Origin", &origin_len);
+  http->origin = origin ? strextract(origin, origin + origin_len) : NULL;
+
+  http->head = http->method_len == 4 && !strncmp(buf, "HEAD", 4);
+  http->chunked = false;
+  http->content_encoding = NULL;
+  http->vary_encoding = false;
+  http->http11 = http->version_len == 8
+              && !strncmp(buf + http->version, "HTTP/1.", 7)
+              && buf[http->version + 7] >= '1';
+  http->keep_alive = http_keep_alive(http);
+
+  http->cookies = extract_cookies(http);
+  http->gzip = http_accepts_gzip(http);
+
+  p2 = http_header(http, "If-None-Match", &origin_len);
+  http->if_none_match = p2 ? strextract_in(&http->arena, p2, p2 + origin_len)
+                           : NULL;
+
+  /* Everything needed from the header table has been extracted */
+  reset_parser(http);
 
   /* Is this an HTTP method we can handle? */
-  if (strbeginswith(buf, "GET ")
-   || strbeginswith(buf, "HEAD ")) {
-  } else {
+  if (!(http->method_len == 3 && !strncmp(buf, "GET", 3))
+   && !(http->method_len == 4 && !strncmp(buf, "HEAD", 4))) {
     musicd_log(LOG_VERBOSE, "protocol_http",
                "unsupported http method (not GET or HEAD)");
     http_reply(http, "400 Bad Request");
+    http->if_none_match = NULL;
     return -1;
   }
-  http->request = buf;
   
   /* Extract HTTP query */
-  for (p1 = buf; *p1 != ' '; ++p1) { }
-  ++p1;
-  if (*p1 != '/') {
+  if (http->target_len == 0 || buf[http->target] != '/') {
     /* Not valid */
     http_reply(http, "400 Bad Request");
+    http->if_none_match = NULL;
     return -1;
   }
 
-  for (p2 = p1; *p2 != ' '; ++p2) {
-    if (*p2 == '\0' || *p2 == '\r' || *p2 == '\n') {
-      musicd_log(LOG_VERBOSE, "protocol_http",
-                 "malformed request line (no tailing version)");
-      musicd_log(LOG_DEBUG, "protocol_http", "request was:\n%s", buf);
-      http_reply(http, "400 Bad Request");
-      return -1;
-    }
-  }
-
-  http->query = strextract(p1, p2);
+  http->query = strextract_in(&http->arena, buf + http->target,
+                              buf + http->target + http->target_len);
   
   musicd_log(LOG_VERBOSE, "protocol_http", "query: %s", http->query);
 
@@ -1358,20 +2901,11 @@ static int http_process(void *self, const char *buf, size_t buf_size)
   p2 = strchr(http->query, '?');
   if (!p2) {
     /* No arguments */
-    http->path = strcopy(http->query);
+    http->path = http->query;
     http->args = NULL;
   } else {
-    http->path = strextract(http->query, p2);
-    http->args = strextract(p2 + 1, NULL);
-  }
-
-  /* Extract cookies */
-  p1 = strstr(http->request, "Cookie: ");
-  if (!p1) {
-    http->cookies = strcopy("");
-  } else {
-    p2 = strstrnull(p1, "\r\n");
-    http->cookies = strextract(p1, p2);
+    http->path = strextract_in(&http->arena, http->query, p2);
+    http->args = strextract_in(&http->arena, p2 + 1, NULL);
   }
 
   /*musicd_log(LOG_DEBUG, "protocol_http", "cookies: '%s'", http->cookies);*/
@@ -1379,25 +2913,60 @@ static int http_process(void *self, const char *buf, size_t buf_size)
   attach_session(http);
   
   result = process_request(http);
+  if (result >= 0 && http->client->state == CLIENT_STATE_NORMAL) {
+    http_finish(http);
+  }
 
   session_deref(http->session);
-  free(http->query);
-  free(http->path);
-  free(http->args);
-  free(http->cookies);
+  free(http->cache_key);
+  free(http->etag);
+  http->if_none_match = http->cache_key = http->etag = NULL;
 
   if (result < 0) {
     return result;
   }
-  return end - buf;
+  return end;
 }
 
 int http_feed(void *self)
 {
   http_t *http = (http_t *)self;
-  int result = stream_next(http->stream);
-  if (result <= 0) {
-    client_drain(http->client);
+  int result;
+
+  if (http->rows) {
+    http_feed_rows(http);
+    return 0;
+  }
+
+  /* Transcoding happens in the transcoder pool, only move what is ready */
+  if (http->chunked) {
+    outqueue_t chunk;
+    outqueue_init(&chunk);
+    result = transcoder_read(http->transcoder, &chunk, FEED_CHUNK_SIZE);
+    if (result > 0) {
+      client_send(http->client, "%x\r\n", result);
+      outqueue_move(&http->client->outbuf, &chunk);
+      client_send(http->client, "\r\n");
+    }
+  } else {
+    result = transcoder_read(http->transcoder, &http->client->outbuf,
+                             FEED_CHUNK_SIZE);
+  }
+
+  if (result == 0) {
+    client_feed_wait(http->client, transcoder_pollfd(http->transcoder));
+  } else if (result < 0) {
+    if (!http->chunked) {
+      client_drain(http->client);
+      return 0;
+    }
+
+    /* Terminating chunk, the connection can be reused */
+    client_send(http->client, "0\r\n\r\n");
+    client_stop_feed(http->client);
+    transcoder_close(http->transcoder);
+    http->transcoder = NULL;
+    http_finish(http);
   }
   return 0;
 }
@@ -17,11 +17,14 @@
  */
 #include "query.h"
 
+#include "catalog.h"
 #include "db.h"
 #include "library.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 
 static const char *field_names[QUERY_FIELD_ALL] = {
@@ -37,6 +40,8 @@ static const char *field_names[QUERY_FIELD_ALL] = {
   "tracks",
   "directory",
   "directoryprefix",
+  "text",
+  "random",
 };
 
 /* All id fields. */
@@ -53,6 +58,8 @@ static bool id_fields[QUERY_FIELD_ALL + 1] = {
   false,
   false,
   false,
+  false,
+  false,
   false
 };
 
@@ -69,6 +76,8 @@ static bool like_fields[QUERY_FIELD_ALL + 1] = {
   false,
   false,
   false,
+  false,
+  false,
   true,
 };
 
@@ -93,14 +102,16 @@ struct query_format {
 
   const char *body; /**< Main query results */
   const char *count; /**< Result set size  */
-  /** Index of id in result set
-   *  @note Currently we just count through rowids
-   */
-  const char *index;
 
   const char *from; /**< From clause */
 
   const char *join; /**< Join clause */
+
+  const char *id; /**< Unique row id, last key of every ordering */
+
+  const char *text_join; /**< Join clause for full-text search, or NULL */
+
+  catalog_table_t table; /**< Table in the catalog */
 };
 
 static const char *track_maps[QUERY_FIELD_ALL + 1] = {
@@ -114,8 +125,10 @@ static const char *track_maps[QUERY_FIELD_ALL + 1] = {
   "tracks.track",
   "tracks.duration",
   NULL,
+  "tracks.directory",
   "tracks.file",
-  "tracks.file",
+  "tracks_fts",
+  "tracks.rowid",
   /* Special case... */
   "(COALESCE(tracks.title, '') || COALESCE(tracks.artist, '') || COALESCE(tracks.album, ''))",
 };
@@ -124,11 +137,16 @@ static struct query_format track_query = {
 
   " SELECT tracks.rowid AS id, tracks.file AS file, tracks.cuefile AS cuefile, tracks.track AS track, tracks.title AS title, tracks.artistid AS artistid, tracks.artist AS artist, tracks.albumid AS albumid, tracks.album AS album, tracks.start AS start, tracks.duration AS duration ",
   " SELECT COUNT(tracks.rowid) ",
-  " SELECT tracks.rowid ",
 
   " FROM tracks ",
 
-  " "
+  " ",
+
+  "tracks.rowid",
+
+  " JOIN tracks_fts ON tracks_fts.rowid = tracks.rowid ",
+
+  CATALOG_TRACKS
 };
 
 static const char *artist_maps[QUERY_FIELD_ALL + 1] = {
@@ -144,6 +162,8 @@ static const char *artist_maps[QUERY_FIELD_ALL + 1] = {
   NULL,
   NULL,
   NULL,
+  NULL,
+  "artists.rowid",
   /* Special case... */
   "(COALESCE(artists.name, ''))",
 };
@@ -152,11 +172,16 @@ static struct query_format artist_query = {
 
   " SELECT artists.rowid AS artistid, artists.name AS artist ",
   " SELECT COUNT(artists.rowid) ",
-  " SELECT artists.rowid ",
 
   " FROM artists ",
 
-  " "
+  " ",
+
+  "artists.rowid",
+
+  NULL,
+
+  CATALOG_ARTISTS
 };
 
 static const char *album_maps[QUERY_FIELD_ALL + 1] = {
@@ -172,6 +197,8 @@ static const char *album_maps[QUERY_FIELD_ALL + 1] = {
   "albums.tracks",
   NULL,
   NULL,
+  NULL,
+  "albums.rowid",
   /* Special case... */
   "(COALESCE(albums.name, ''))",
 };
@@ -179,11 +206,27 @@ static struct query_format album_query = {
   album_maps,
   " SELECT albums.rowid AS albumid, albums.name AS album, albums.imageid AS imageid, albums.tracks AS tracks ",
   " SELECT COUNT(albums.rowid) ",
-  " SELECT albums.rowid ",
 
   " FROM albums ",
 
-  " "
+  " ",
+
+  "albums.rowid",
+
+  NULL,
+
+  CATALOG_ALBUMS
+};
+
+/** Upper bound for sorting rules accepted per query */
+#define QUERY_SORT_MAX 8
+
+/** Value of one sort key decoded from a cursor */
+struct seek_value {
+  int type; /**< SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT */
+  int64_t integer;
+  double real;
+  char *text;
 };
 
 struct query {
@@ -196,8 +239,295 @@ struct query {
   int64_t offset;
 
   string_t *order;
+
+  int64_t seed;
+  query_field_t sort_fields[QUERY_SORT_MAX];
+  bool sort_descending[QUERY_SORT_MAX];
+  int sorts;
+
+  /** Sort keys followed by the row id, or NULL if not seeking */
+  struct seek_value *seek;
+
+  /** Index of the first key column appended after the body columns */
+  int key_column;
+
+  /** Catalog answering the query instead of SQLite, or NULL */
+  catalog_t *catalog;
+  const catalog_columns_t *columns;
+  const uint32_t *rows; /**< Rows in order, NULL for id order */
+  uint32_t position; /**< Next index in rows */
+  uint32_t row; /**< Row returned last */
+  int64_t skipped;
+  int64_t returned; /**< Rows returned so far, also by SQLite */
+  /** Id filters as sorted arrays */
+  int64_t *ids[QUERY_FIELD_ALL + 1];
+  size_t nb_ids[QUERY_FIELD_ALL + 1];
+  /** Buffer for matching QUERY_FIELD_ALL */
+  string_t *scratch;
+
+  /** Filters and generated SQL are allocated from here, if not NULL */
+  arena_t *arena;
 };
 
+static void seek_free(struct seek_value *seek, int sorts)
+{
+  int i;
+  if (!seek) {
+    return;
+  }
+  for (i = 0; i <= sorts; ++i) {
+    free(seek[i].text);
+  }
+  free(seek);
+}
+
+static void catalog_release(query_t *query)
+{
+  int i;
+  if (!query->catalog) {
+    return;
+  }
+  for (i = 0; i <= QUERY_FIELD_ALL; ++i) {
+    free(query->ids[i]);
+    query->ids[i] = NULL;
+  }
+  if (query->scratch) {
+    string_free(query->scratch);
+    query->scratch = NULL;
+  }
+  catalog_put(query->catalog);
+  query->catalog = NULL;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+  int64_t id_a = *(const int64_t *)a, id_b = *(const int64_t *)b;
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+/* Parses comma-separated ids of @p field into a sorted array. */
+static void catalog_parse_ids(query_t *query, query_field_t field)
+{
+  const char *p = query->filters[field];
+  size_t size = 0;
+
+  for (; *p != '\0'; ++p) {
+    if (*p >= '0' && *p <= '9' && (p[1] < '0' || p[1] > '9')) {
+      ++size;
+    }
+  }
+  query->ids[field] = malloc(sizeof(int64_t) * (size + 1));
+  query->nb_ids[field] = 0;
+
+  for (p = query->filters[field]; *p != '\0'; ++p) {
+    if (*p >= '0' && *p <= '9') {
+      query->ids[field][query->nb_ids[field]++] = strtoll(p, (char **)&p, 10);
+      if (*p == '\0') {
+        break;
+      }
+    }
+  }
+  qsort(query->ids[field], query->nb_ids[field], sizeof(int64_t),
+        compare_ids);
+}
+
+/* @returns true if LIKE pattern @p filter is a plain substring match. */
+static bool catalog_like_filter(const char *filter)
+{
+  size_t len = strlen(filter);
+  return len >= 2 && strcspn(filter + 1, "%_") == len - 2;
+}
+
+/**
+ * Makes @p query answered from the catalog, if there is one and it can
+ * answer the filters, and if @p sorted, the sorting too.
+ * @returns 0 if the catalog is used
+ */
+static int catalog_prepare(query_t *query, bool sorted)
+{
+  catalog_t *catalog = catalog_get();
+  const uint32_t *rows = NULL;
+  int i;
+
+  if (!catalog) {
+    return -1;
+  }
+
+  for (i = 1; i <= QUERY_FIELD_ALL; ++i) {
+    if (!query->filters[i] || !query->format->maps[i] || id_fields[i]) {
+      continue;
+    }
+    if ((i == QUERY_FIELD_TITLE || i == QUERY_FIELD_ARTIST
+      || i == QUERY_FIELD_ALBUM || i == QUERY_FIELD_ALL)
+     && catalog_like_filter(query->filters[i])) {
+      continue;
+    }
+    catalog_put(catalog);
+    return -1;
+  }
+
+  if (sorted && catalog_order(catalog, query->format->table,
+                              query->sort_fields, query->sort_descending,
+                              query->sorts, &rows)) {
+    catalog_put(catalog);
+    return -1;
+  }
+
+  query->catalog = catalog;
+  query->columns = catalog_columns(catalog, query->format->table);
+  query->rows = rows;
+  query->position = 0;
+  query->skipped = 0;
+  query->returned = 0;
+
+  for (i = 1; i <= QUERY_FIELD_ALL; ++i) {
+    if (query->filters[i] && query->format->maps[i] && id_fields[i]) {
+      catalog_parse_ids(query, i);
+    }
+  }
+  return 0;
+}
+
+static int ascii_lower(unsigned char c)
+{
+  return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+/* Case-insensitive for ASCII like LIKE */
+static bool contains_nocase(const char *haystack, const char *needle,
+                            size_t len)
+{
+  size_t i;
+  for (; *haystack != '\0'; ++haystack) {
+    for (i = 0; i < len && haystack[i] != '\0'; ++i) {
+      if (ascii_lower(haystack[i]) != ascii_lower(needle[i])) {
+        break;
+      }
+    }
+    if (i == len) {
+      return true;
+    }
+  }
+  return len == 0;
+}
+
+static bool catalog_match(query_t *query, uint32_t row)
+{
+  static const query_field_t all_fields[] = {
+    QUERY_FIELD_TITLE, QUERY_FIELD_ARTIST, QUERY_FIELD_ALBUM
+  };
+  const catalog_columns_t *columns = query->columns;
+  catalog_value_t value;
+  const char *text;
+  size_t i;
+  int field;
+
+  for (field = 1; field <= QUERY_FIELD_ALL; ++field) {
+    if (!query->filters[field] || !query->format->maps[field]) {
+      continue;
+    }
+
+    if (id_fields[field]) {
+      catalog_value(columns, field, row, &value);
+      if (!bsearch(&value.integer, query->ids[field], query->nb_ids[field],
+                   sizeof(int64_t), compare_ids)) {
+        return false;
+      }
+      continue;
+    }
+
+    if (field == QUERY_FIELD_ALL) {
+      /* Concatenation of the names, NULLs as empty */
+      if (!query->scratch) {
+        query->scratch = string_new();
+      }
+      string_remove_front(query->scratch, string_size(query->scratch));
+      for (i = 0; i < sizeof(all_fields) / sizeof(query_field_t); ++i) {
+        if (columns->text[all_fields[i]]
+         && columns->text[all_fields[i]][row]) {
+          string_append(query->scratch, columns->text[all_fields[i]][row]);
+        }
+      }
+      text = string_string(query->scratch);
+    } else {
+      text = columns->text[field][row];
+    }
+
+    /* Pattern is "%text%" */
+    if (!text || !contains_nocase(text, query->filters[field] + 1,
+                                  strlen(query->filters[field]) - 2)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Compares sort keys of @p row to the seek keys. */
+static int catalog_compare_seek(query_t *query, uint32_t row)
+{
+  catalog_value_t a, b;
+  int i, result;
+
+  for (i = 0; i <= query->sorts; ++i) {
+    catalog_value(query->columns,
+                  i < query->sorts ? query->sort_fields[i] : QUERY_FIELD_NONE,
+                  row, &a);
+    b.type = query->seek[i].type;
+    b.integer = query->seek[i].integer;
+    b.real = query->seek[i].real;
+    b.text = query->seek[i].text;
+    result = catalog_value_compare(&a, &b);
+    if (result) {
+      return i < query->sorts && query->sort_descending[i] ? -result : result;
+    }
+  }
+  return 0;
+}
+
+/* Positions the catalog query after the seek keys. */
+static void catalog_seek(query_t *query)
+{
+  uint32_t low = 0, high = query->columns->size, middle;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (catalog_compare_seek(query, query->rows ? query->rows[middle]
+                                                : middle) <= 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  query->position = low;
+}
+
+/* @returns next matching row, or -1 if there is none */
+static int64_t catalog_next(query_t *query)
+{
+  uint32_t row;
+
+  if (query->limit > 0 && query->returned >= query->limit) {
+    return -1;
+  }
+
+  while (query->position < query->columns->size) {
+    row = query->rows ? query->rows[query->position] : query->position;
+    ++query->position;
+
+    if (!catalog_match(query, row)) {
+      continue;
+    }
+    if (query->skipped < query->offset) {
+      ++query->skipped;
+      continue;
+    }
+    query->row = row;
+    ++query->returned;
+    return row;
+  }
+  return -1;
+}
+
 static query_t *query_new()
 {
   query_t *query = malloc(sizeof(query_t));
@@ -228,34 +558,91 @@ query_t *query_albums_new()
   return query;
 }
 
+void query_arena(query_t *query, arena_t *arena)
+{
+  string_free(query->order);
+  query->arena = arena;
+  query->order = string_new_in(arena);
+}
+
+/* Frees @p string made with the query's allocator. */
+static void release(query_t *query, char *string)
+{
+  if (!query->arena) {
+    free(string);
+  }
+}
+
 void query_close(query_t *query)
 {
   int i;
 
   sqlite3_finalize(query->stmt);
   for (i = 0; i <= QUERY_FIELD_ALL; ++i) {
-    free(query->filters[i]);
+    release(query, query->filters[i]);
   }
   string_free(query->order);
+  seek_free(query->seek, query->sorts);
+  catalog_release(query);
   free(query);
 }
 
+/* Turns free text into a full-text query matching every word as a prefix.
+ * Words are quoted so that no FTS5 syntax leaks through. */
+static char *text_match(query_t *query, const char *text)
+{
+  string_t *match = string_new_in(query->arena);
+  const char *p;
+
+  while (*text != '\0') {
+    for (; *text == ' ' || *text == '\t'; ++text) { }
+    if (*text == '\0') {
+      break;
+    }
+    if (string_size(match) > 0) {
+      string_push_back(match, ' ');
+    }
+    string_push_back(match, '"');
+    for (p = text; *p != '\0' && *p != ' ' && *p != '\t'; ++p) {
+      if (*p == '"') {
+        string_push_back(match, '"');
+      }
+      string_push_back(match, *p);
+    }
+    string_append(match, "\"*");
+    text = p;
+  }
+
+  if (string_size(match) == 0) {
+    string_free(match);
+    return NULL;
+  }
+  return string_release(match);
+}
+
 void query_filter(query_t *query, query_field_t field,
                       const char *filter)
 {
   string_t *string;
-  if (!filter) {
+  if (!filter || field == QUERY_FIELD_RANDOM) {
+    /* Nothing to filter by in a sort-only field */
     query->filters[field] = NULL;
     return;
   }
+  if (field == QUERY_FIELD_TEXT) {
+    query->filters[field] = text_match(query, filter);
+    return;
+  }
   if (!id_fields[field]) {
-    query->filters[field] = stringf(like_fields[field] ? "%%%s%%" : "%s", filter);
+    query->filters[field] = stringf_in(query->arena,
+                                       like_fields[field] ? "%%%s%%" : "%s",
+                                       filter);
     return;
   }
 
   /* The field is an id field. Ensure the filter is a comma-separated list of
    * decimal numbers. */
-  string = string_new();
+  string = string_new_in(query->arena);
   for (; *filter != '\0'; ++filter) {
     if (*filter == ',' || (*filter >= '0' && *filter <= '9')) {
       string_push_back(string, *filter);
@@ -274,6 +661,22 @@ void query_offset(query_t *query, int64_t offset)
   query->offset = offset;
 }
 
+/* Appends expression sorting by @p field. */
+static void append_sort_key(query_t *query, string_t *sql, query_field_t field)
+{
+  if (field == QUERY_FIELD_TEXT) {
+    /* bm25() score, smaller is better */
+    string_append(sql, "tracks_fts.rank");
+    return;
+  }
+  if (field == QUERY_FIELD_RANDOM) {
+    string_appendf(sql, "shuffle(%s, %" PRId64 ")", query->format->maps[field],
+                   query->seed);
+    return;
+  }
+  string_appendf(sql, "%s COLLATE NOCASE", query->format->maps[field]);
+}
+
 void query_sort(query_t *query, query_field_t field,
                         bool descending)
 {
@@ -281,12 +684,35 @@ void query_sort(query_t *query, query_field_t field,
     /* Not valid field for this query format, ignore. */
     return;
   }
+  if (query->sorts >= QUERY_SORT_MAX) {
+    return;
+  }
+  if (field == QUERY_FIELD_TEXT && !query->filters[field]) {
+    /* Nothing to rank by */
+    return;
+  }
+  query->sort_fields[query->sorts] = field;
+  query->sort_descending[query->sorts] = descending;
+  ++query->sorts;
+
   if (string_size(query->order) > 0) {
     string_append(query->order, ", ");
   }
-  string_appendf(query->order, "%s COLLATE NOCASE %s",
-                               query->format->maps[field],
-                               descending ? "DESC" : "ASC");
+  append_sort_key(query, query->order, field);
+  string_append(query->order, descending ? " DESC" : " ASC");
+}
+
+void query_seed(query_t *query, int64_t seed)
+{
+  query->seed = seed;
+}
+
+/* Orders full-text search by relevance unless some other order is given. */
+static void sort_default(query_t *query)
+{
+  if (query->sorts == 0 && query->filters[QUERY_FIELD_TEXT]) {
+    query_sort(query, QUERY_FIELD_TEXT, false);
+  }
 }
 
 int query_sort_from_string(query_t *query, const char *sort)
@@ -326,11 +752,21 @@ int query_sort_from_string(query_t *query, const char *sort)
   return 0;
 }
 
+/* Appends FROM and JOIN clauses. */
+static void append_from(query_t *query, string_t *sql)
+{
+  string_append(sql, query->format->from);
+  string_append(sql, query->format->join);
+  if (query->filters[QUERY_FIELD_TEXT] && query->format->text_join) {
+    string_append(sql, query->format->text_join);
+  }
+}
+
 /* Generates SQL for the WHERE clause. */
 static char *build_filters(query_t *query)
 {
   int i;
-  string_t *sql = string_new();
+  string_t *sql = string_new_in(query->arena);
 
   bool join = false;
   for (i = 1; i <= QUERY_FIELD_ALL; ++i) {
@@ -347,7 +783,12 @@ static char *build_filters(query_t *query)
 
     if (!id_fields[i]) {
       if (i == QUERY_FIELD_DIRECTORY) {
-        string_appendf(sql, "%s LIKE ? AND %s NOT LIKE ?", query->format->maps[i], query->format->maps[i]);
+        string_appendf(sql, "%s = ?", query->format->maps[i]);
+      } else if (i == QUERY_FIELD_TEXT) {
+        string_appendf(sql, "%s MATCH ?", query->format->maps[i]);
+      } else if (i == QUERY_FIELD_DIRECTORYPREFIX) {
+        /* Range rather than LIKE so that the index can be used */
+        string_appendf(sql, "%s >= ? AND %s < ?", query->format->maps[i], query->format->maps[i]);
       } else {
         string_appendf(sql, "%s LIKE ?", query->format->maps[i]);
       }
@@ -366,6 +807,10 @@ static char *build_filters(query_t *query)
 static void bind_filters(query_t *query, sqlite3_stmt *stmt)
 {
   char *root_path = library_root_path(), *temp;
+  size_t len;
+  /* Arena memory outlives the statement, which is finalized by query_close
+   * at the latest */
+  void (*destructor)(void *) = query->arena ? SQLITE_STATIC : free;
 
   int i, n;
   for (i = 1, n = 1; i <= QUERY_FIELD_ALL; ++i) {
@@ -374,14 +819,25 @@ static void bind_filters(query_t *query, sqlite3_stmt *stmt)
     }
 
     if (i == QUERY_FIELD_DIRECTORY) {
-      temp = stringf("%s%s%%", root_path, query->filters[i]);
-      sqlite3_bind_text(stmt, n, temp, -1, free);
-      ++n;
-      temp = stringf("%s%s%%/%%", root_path, query->filters[i]);
-      sqlite3_bind_text(stmt, n, temp, -1, free);
+      /* Directories are stored without trailing / */
+      temp = stringf_in(query->arena, "%s%s", root_path, query->filters[i]);
+      len = strlen(temp);
+      if (len > 0 && temp[len - 1] == '/') {
+        temp[--len] = '\0';
+      }
+      sqlite3_bind_text(stmt, n, temp, -1, destructor);
     } else if (i == QUERY_FIELD_DIRECTORYPREFIX) {
-      temp = stringf("%s%s%%", root_path, query->filters[i]);
-      sqlite3_bind_text(stmt, n, temp, -1, free);
+      /* Paths from prefix up to, but not including, prefix with its last
+       * byte incremented */
+      temp = stringf_in(query->arena, "%s%s", root_path, query->filters[i]);
+      sqlite3_bind_text(stmt, n, strcopy_in(query->arena, temp), -1,
+                        destructor);
+      ++n;
+      len = strlen(temp);
+      if (len > 0) {
+        ++temp[len - 1];
+      }
+      sqlite3_bind_text(stmt, n, temp, -1, destructor);
     } else {
       sqlite3_bind_text(stmt, n, query->filters[i], -1, NULL);
     }
@@ -391,30 +847,389 @@ static void bind_filters(query_t *query, sqlite3_stmt *stmt)
   free(root_path);
 }
 
-int64_t query_count(query_t *query)
+/* Generates the ORDER BY clause. The row id is always the last key so that
+ * the ordering is total and a cursor identifies exactly one position. */
+static char *build_order(query_t *query)
+{
+  if (string_size(query->order) > 0) {
+    return stringf_in(query->arena, " ORDER BY %s, %s ASC",
+                      string_string(query->order), query->format->id);
+  }
+  return stringf_in(query->arena, " ORDER BY %s ASC", query->format->id);
+}
+
+/* Appends expression of sort key @p key, the row id following the sorts. */
+static void append_key(query_t *query, string_t *sql, int key)
+{
+  if (key < query->sorts) {
+    append_sort_key(query, sql, query->sort_fields[key]);
+  } else {
+    string_append(sql, query->format->id);
+  }
+}
+
+/* Direction of sort key @p key, reversed if @p reverse. Reversing also moves
+ * NULLs to the other end, matching SQLite which sorts them as the smallest
+ * value. */
+static bool key_descending(query_t *query, int key, bool reverse)
+{
+  bool descending = key < query->sorts ? query->sort_descending[key] : false;
+  return descending != reverse;
+}
+
+/* Generates the condition selecting rows ordered after the seek keys, or
+ * before them if @p reverse. */
+static char *build_seek(query_t *query, bool reverse)
+{
+  string_t *sql = string_new_in(query->arena);
+  bool simple = true, first = true;
+  int i, j;
+
+  for (i = 0; i <= query->sorts; ++i) {
+    if (key_descending(query, i, reverse)
+     || query->seek[i].type == SQLITE_NULL) {
+      simple = false;
+    }
+  }
+
+  if (query->sorts > 0 && !key_descending(query, 0, reverse)
+   && query->seek[0].type != SQLITE_NULL) {
+    /* Redundant bound on the leading key lets the planner seek the index
+     * instead of filtering it from the start */
+    append_key(query, sql, 0);
+    string_append(sql, " >= :k0 AND ");
+  }
+
+  if (simple) {
+    /* Keys in one row value comparison */
+    string_append(sql, "(");
+    for (i = 0; i <= query->sorts; ++i) {
+      string_append(sql, i > 0 ? ", " : "");
+      append_key(query, sql, i);
+    }
+    string_append(sql, ") > (");
+    for (i = 0; i <= query->sorts; ++i) {
+      string_appendf(sql, "%s:k%d", i > 0 ? ", " : "", i);
+    }
+    string_append(sql, ")");
+    return string_release(sql);
+  }
+
+  /* Mixed directions or NULL keys: expand the comparison term by term, NULLs
+   * sorting first in ascending and last in descending order. */
+  string_append(sql, "(");
+  for (i = 0; i <= query->sorts; ++i) {
+    if (key_descending(query, i, reverse)
+     && query->seek[i].type == SQLITE_NULL) {
+      /* Nothing sorts after NULL in descending order */
+      continue;
+    }
+
+    string_append(sql, first ? "(" : " OR (");
+    first = false;
+
+    for (j = 0; j < i; ++j) {
+      append_key(query, sql, j);
+      if (query->seek[j].type == SQLITE_NULL) {
+        string_append(sql, " IS NULL AND ");
+      } else {
+        string_appendf(sql, " = :k%d AND ", j);
+      }
+    }
+
+    if (key_descending(query, i, reverse)) {
+      string_append(sql, "(");
+      append_key(query, sql, i);
+      string_appendf(sql, " < :k%d OR ", i);
+      append_key(query, sql, i);
+      string_append(sql, " IS NULL)");
+    } else if (query->seek[i].type == SQLITE_NULL) {
+      append_key(query, sql, i);
+      string_append(sql, " IS NOT NULL");
+    } else {
+      append_key(query, sql, i);
+      string_appendf(sql, " > :k%d", i);
+    }
+    string_append(sql, ")");
+  }
+  string_append(sql, ")");
+  return string_release(sql);
+}
+
+static void bind_seek(query_t *query, sqlite3_stmt *stmt)
+{
+  struct seek_value *value;
+  char name[16];
+  int i, n;
+
+  for (i = 0; i <= query->sorts; ++i) {
+    value = &query->seek[i];
+    snprintf(name, sizeof(name), ":k%d", i);
+    n = sqlite3_bind_parameter_index(stmt, name);
+    if (n == 0) {
+      continue;
+    }
+    if (value->type == SQLITE_INTEGER) {
+      sqlite3_bind_int64(stmt, n, value->integer);
+    } else if (value->type == SQLITE_FLOAT) {
+      sqlite3_bind_double(stmt, n, value->real);
+    } else if (value->type == SQLITE_TEXT) {
+      sqlite3_bind_text(stmt, n, value->text, -1, NULL);
+    }
+  }
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+char *query_cursor(query_t *query)
+{
+  catalog_value_t keys[QUERY_SORT_MAX + 1];
+  string_t *plain, *result;
+  const char *p;
+  int i, column;
+
+  if (query->catalog && query->returned > 0) {
+    for (i = 0; i <= query->sorts; ++i) {
+      catalog_value(query->columns,
+                    i < query->sorts ? query->sort_fields[i] : QUERY_FIELD_NONE,
+                    query->row, &keys[i]);
+    }
+  } else if (query->stmt && query->key_column > 0) {
+    for (i = 0; i <= query->sorts; ++i) {
+      column = query->key_column + i;
+      keys[i].type = sqlite3_column_type(query->stmt, column);
+      keys[i].integer = sqlite3_column_int64(query->stmt, column);
+      keys[i].real = sqlite3_column_double(query->stmt, column);
+      keys[i].text = (const char *)sqlite3_column_text(query->stmt, column);
+    }
+  } else {
+    return NULL;
+  }
+
+  /* Each key is a type letter followed by its value: integers and reals end
+   * in ';', text is prefixed by its length in bytes. */
+  plain = string_new();
+  for (i = 0; i <= query->sorts; ++i) {
+    switch (keys[i].type) {
+    case SQLITE_INTEGER:
+      string_appendf(plain, "i%" PRId64 ";", keys[i].integer);
+      break;
+    case SQLITE_FLOAT:
+      string_appendf(plain, "f%.17g;", keys[i].real);
+      break;
+    case SQLITE_NULL:
+      string_append(plain, "n");
+      break;
+    default:
+      string_appendf(plain, "t%d:%s", (int)strlen(keys[i].text),
+                     keys[i].text);
+      break;
+    }
+  }
+
+  /* Hex keeps the cursor opaque and safe to pass in an URL as is */
+  result = string_new();
+  for (p = string_string(plain); *p != '\0'; ++p) {
+    string_push_back(result, hex_digits[(unsigned char)*p >> 4]);
+    string_push_back(result, hex_digits[(unsigned char)*p & 0xf]);
+  }
+  string_free(plain);
+  return string_release(result);
+}
+
+int query_seek(query_t *query, const char *cursor)
+{
+  struct seek_value *seek;
+  string_t *plain = string_new();
+  const char *p;
+  char *end;
+  int high, low, i;
+  long length;
+
+  sort_default(query);
+
+  for (p = cursor; *p != '\0'; p += 2) {
+    high = hex_value(p[0]);
+    low = high < 0 ? -1 : hex_value(p[1]);
+    if (low < 0 || (high == 0 && low == 0)) {
+      string_free(plain);
+      return -1;
+    }
+    string_push_back(plain, (char)(high << 4 | low));
+  }
+
+  seek = malloc(sizeof(struct seek_value) * (query->sorts + 1));
+  memset(seek, 0, sizeof(struct seek_value) * (query->sorts + 1));
+
+  p = string_string(plain);
+  for (i = 0; i <= query->sorts; ++i) {
+    switch (*p++) {
+    case 'i':
+      seek[i].type = SQLITE_INTEGER;
+      seek[i].integer = strtoll(p, &end, 10);
+      break;
+    case 'f':
+      seek[i].type = SQLITE_FLOAT;
+      seek[i].real = strtod(p, &end);
+      break;
+    case 'n':
+      seek[i].type = SQLITE_NULL;
+      continue;
+    case 't':
+      seek[i].type = SQLITE_TEXT;
+      length = strtol(p, &end, 10);
+      if (end == p || *end != ':' || length < 0
+       || (size_t)length > strlen(end + 1)) {
+        goto error;
+      }
+      seek[i].text = strextract(end + 1, end + 1 + length);
+      p = end + 1 + length;
+      continue;
+    default:
+      goto error;
+    }
+    if (end == p || *end != ';') {
+      goto error;
+    }
+    p = end + 1;
+  }
+
+  /* The row id is never NULL and the cursor must cover the whole ordering */
+  if (*p != '\0' || seek[query->sorts].type != SQLITE_INTEGER) {
+    goto error;
+  }
+
+  string_free(plain);
+  query->seek = seek;
+  return 0;
+
+error:
+  seek_free(seek, query->sorts);
+  string_free(plain);
+  return -1;
+}
+
+static sqlite3_stmt *prepare_query(string_t *sql)
 {
-  string_t *sql = string_new();
-  char *where = build_filters(query);
   sqlite3_stmt *stmt;
-  int64_t result;
-  
-  string_append(sql, query->format->count);
-  string_append(sql, query->format->from);
-  string_append(sql, query->format->join);
-  string_append(sql, where);
-  free(where);
 
   musicd_log(LOG_DEBUG, "query", "%s", string_string(sql));
 
-  if (sqlite3_prepare_v2(db_handle(),
+  if (sqlite3_prepare_v2(db_reader(),
                          string_string(sql), -1,
                          &stmt, NULL) != SQLITE_OK) {
     musicd_log(LOG_ERROR, "query", "can't prepare '%s': %s",
-               string_string(sql), db_error());
-    string_free(sql);
-    return -1;
+               string_string(sql), sqlite3_errmsg(db_reader()));
+    return NULL;
+  }
+  return stmt;
+}
+
+/*
+ * Counts of recent queries by their filters, so that paging through results
+ * with totals doesn't count them again for every page. Entries are valid for
+ * the library generation they were counted at.
+ */
+
+#define COUNT_CACHE_SIZE 64
+
+struct count_entry {
+  char *key;
+  int64_t generation;
+  int64_t count;
+};
+
+static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct count_entry count_cache[COUNT_CACHE_SIZE];
+
+/* Key of the query type and its filters, which are normalized when set. */
+static char *count_key(query_t *query)
+{
+  string_t *key = string_new();
+  int i;
+
+  string_append(key, query->format->count);
+  for (i = 1; i <= QUERY_FIELD_ALL; ++i) {
+    if (query->filters[i] && query->format->maps[i]) {
+      string_appendf(key, "\x1f%d=%s", i, query->filters[i]);
+    }
+  }
+  return string_release(key);
+}
+
+static int64_t count_lookup(const char *key, int64_t generation)
+{
+  struct count_entry *entry = &count_cache[strhash(key) % COUNT_CACHE_SIZE];
+  int64_t result = -1;
+
+  pthread_mutex_lock(&count_mutex);
+  if (entry->key && entry->generation == generation
+   && !strcmp(entry->key, key)) {
+    result = entry->count;
+  }
+  pthread_mutex_unlock(&count_mutex);
+  return result;
+}
+
+static void count_store(char *key, int64_t generation, int64_t count)
+{
+  struct count_entry *entry = &count_cache[strhash(key) % COUNT_CACHE_SIZE];
+  char *old;
+
+  pthread_mutex_lock(&count_mutex);
+  old = entry->key;
+  entry->key = key;
+  entry->generation = generation;
+  entry->count = count;
+  pthread_mutex_unlock(&count_mutex);
+  free(old);
+}
+
+static int64_t count_rows(query_t *query)
+{
+  int64_t start = metrics_now();
+  string_t *sql;
+  char *where;
+  sqlite3_stmt *stmt;
+  int64_t result;
+  uint32_t row;
+
+  if (!catalog_prepare(query, false)) {
+    result = 0;
+    for (row = 0; row < query->columns->size; ++row) {
+      if (catalog_match(query, row)) {
+        ++result;
+      }
+    }
+    catalog_release(query);
+    metrics_time(METRICS_QUERY_COUNT, start);
+    return result;
   }
+
+  sql = string_new_in(query->arena);
+  where = build_filters(query);
+
+  string_append(sql, query->format->count);
+  append_from(query, sql);
+  string_append(sql, where);
+  release(query, where);
+
+  stmt = prepare_query(sql);
   string_free(sql);
+  if (!stmt) {
+    return -1;
+  }
 
   bind_filters(query, stmt);
 
@@ -428,112 +1243,272 @@ int64_t query_count(query_t *query)
 
 finish:
   sqlite3_finalize(stmt);
+  metrics_time(METRICS_QUERY_COUNT, start);
+  return result;
+}
+
+int64_t query_count(query_t *query)
+{
+  int64_t generation = library_generation(), result;
+  char *key = count_key(query);
+
+  result = count_lookup(key, generation);
+  if (result >= 0) {
+    free(key);
+    return result;
+  }
+
+  result = count_rows(query);
+  if (result >= 0) {
+    count_store(key, generation, result);
+  } else {
+    free(key);
+  }
   return result;
 }
 
+/* Reads the sort keys of the current row of @p stmt starting at @p column. */
+static struct seek_value *seek_from_row(query_t *query, sqlite3_stmt *stmt,
+                                        int column)
+{
+  struct seek_value *seek;
+  int i;
+
+  seek = malloc(sizeof(struct seek_value) * (query->sorts + 1));
+  memset(seek, 0, sizeof(struct seek_value) * (query->sorts + 1));
+
+  for (i = 0; i <= query->sorts; ++i) {
+    seek[i].type = sqlite3_column_type(stmt, column + i);
+    if (seek[i].type == SQLITE_INTEGER) {
+      seek[i].integer = sqlite3_column_int64(stmt, column + i);
+    } else if (seek[i].type == SQLITE_FLOAT) {
+      seek[i].real = sqlite3_column_double(stmt, column + i);
+    } else if (seek[i].type != SQLITE_NULL) {
+      seek[i].type = SQLITE_TEXT;
+      seek[i].text = strcopy((const char *)sqlite3_column_text(stmt,
+                                                               column + i));
+    }
+  }
+  return seek;
+}
+
 int64_t query_index(query_t *query, int64_t id)
 {
-  string_t *sql = string_new();
-  char *where = build_filters(query);
+  string_t *sql = string_new_in(query->arena);
+  char *where = build_filters(query), *seek;
+  struct seek_value *saved = query->seek;
   sqlite3_stmt *stmt;
   int64_t result;
-  int64_t index = 1;
+  int i;
 
-  string_append(sql, query->format->index);
-  string_append(sql, query->format->from);
-  string_append(sql, query->format->join);
-  string_append(sql, where);
-  free(where);
+  sort_default(query);
 
-  if (string_size(query->order) > 0) {
-    string_appendf(sql, " ORDER BY %s", string_string(query->order));
+  /* Sort keys of the target row, which must also match the filters */
+  string_append(sql, " SELECT ");
+  for (i = 0; i <= query->sorts; ++i) {
+    string_append(sql, i > 0 ? ", " : "");
+    append_key(query, sql, i);
   }
+  append_from(query, sql);
+  string_appendf(sql, "%s%s%s = :id", where,
+                 where[0] == '\0' ? "WHERE " : " AND ", query->format->id);
 
-  musicd_log(LOG_DEBUG, "query", "%s", string_string(sql));
-
-  if (sqlite3_prepare_v2(db_handle(),
-                         string_string(sql), -1,
-                         &stmt, NULL) != SQLITE_OK) {
-    musicd_log(LOG_ERROR, "query", "can't prepare '%s': %s",
-               string_string(sql), db_error());
-    string_free(sql);
+  stmt = prepare_query(sql);
+  string_free(sql);
+  if (!stmt) {
+    release(query, where);
     return -1;
   }
-  string_free(sql);
 
   bind_filters(query, stmt);
+  sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":id"), id);
 
-  while (1) {
-    result = sqlite3_step(stmt);
-    if (result == SQLITE_DONE) {
-      result = 0;
-      goto finish;
-    }
-    if (result != SQLITE_ROW) {
-      musicd_log(LOG_ERROR, "query", "query_count: sqlite3_step failed");
-      result = -1;
-      goto finish;
-    }
-    if (sqlite3_column_int64(stmt, 0) == id) {
-      result = index;
-      goto finish;
+  result = sqlite3_step(stmt);
+  if (result != SQLITE_ROW) {
+    if (result != SQLITE_DONE) {
+      musicd_log(LOG_ERROR, "query", "query_index: sqlite3_step failed");
     }
-    ++index;
+    sqlite3_finalize(stmt);
+    release(query, where);
+    return result == SQLITE_DONE ? 0 : -1;
   }
+  query->seek = seek_from_row(query, stmt, 0);
+  sqlite3_finalize(stmt);
 
-finish:
+  /* The index is the amount of rows ordered before the target */
+  seek = build_seek(query, true);
+  sql = string_new_in(query->arena);
+  string_append(sql, query->format->count);
+  append_from(query, sql);
+  string_appendf(sql, "%s%s%s", where, where[0] == '\0' ? "WHERE " : " AND ",
+                 seek);
+  release(query, seek);
+  release(query, where);
+
+  stmt = prepare_query(sql);
+  string_free(sql);
+  if (!stmt) {
+    result = -1;
+    goto finish;
+  }
+
+  bind_filters(query, stmt);
+  bind_seek(query, stmt);
+
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    result = sqlite3_column_int64(stmt, 0) + 1;
+  } else {
+    musicd_log(LOG_ERROR, "query", "query_index: sqlite3_step failed");
+    result = -1;
+  }
   sqlite3_finalize(stmt);
+
+finish:
+  seek_free(query->seek, query->sorts);
+  query->seek = saved;
   return result;
 }
 
-int query_start(query_t *query)
+/**
+ * Prepares the statement of @p query, limited to the rows not returned yet.
+ */
+static int start_statement(query_t *query)
 {
-  string_t *sql = string_new();
-  char *where = build_filters(query);
+  string_t *sql;
+  char *where, *seek, *order;
   sqlite3_stmt *stmt;
+  int i;
+
+  sql = string_new_in(query->arena);
+  where = build_filters(query);
 
   string_append(sql, query->format->body);
-  string_append(sql, query->format->from);
-  string_append(sql, query->format->join);
+  /* Sort keys for query_cursor() follow the columns of the body */
+  for (i = 0; i <= query->sorts; ++i) {
+    string_append(sql, ", ");
+    append_key(query, sql, i);
+  }
+  append_from(query, sql);
   string_append(sql, where);
-  free(where);
 
-  if (string_size(query->order) > 0) {
-    string_appendf(sql, " ORDER BY %s", string_string(query->order));
+  if (query->seek) {
+    seek = build_seek(query, false);
+    string_appendf(sql, "%s%s", where[0] == '\0' ? "WHERE " : " AND ", seek);
+    release(query, seek);
   }
+  release(query, where);
+
+  order = build_order(query);
+  string_append(sql, order);
+  release(query, order);
 
   if (query->limit > 0 || query->offset > 0) {
-    string_appendf(sql, " LIMIT %" PRId64 " OFFSET %" PRId64 "", query->limit, query->offset);
+    string_appendf(sql, " LIMIT %" PRId64 " OFFSET %" PRId64 "",
+                   query->limit > 0 ? query->limit - query->returned
+                                    : query->limit,
+                   query->offset);
   }
 
-  musicd_log(LOG_DEBUG, "query", "%s", string_string(sql));
-
-  if (sqlite3_prepare_v2(db_handle(),
-                         string_string(sql), -1,
-                         &stmt, NULL) != SQLITE_OK) {
-    musicd_log(LOG_ERROR, "query", "can't prepare '%s': %s",
-               string_string(sql), db_error());
-    string_free(sql);
+  stmt = prepare_query(sql);
+  string_free(sql);
+  if (!stmt) {
     return -1;
   }
-  string_free(sql);
 
   bind_filters(query, stmt);
+  if (query->seek) {
+    bind_seek(query, stmt);
+  }
 
   query->stmt = stmt;
-
+  query->key_column = sqlite3_column_count(stmt) - (query->sorts + 1);
   return 0;
 }
 
+int query_start(query_t *query)
+{
+  int64_t start = metrics_now();
+  int result;
+
+  sort_default(query);
+
+  if (!catalog_prepare(query, true)) {
+    if (query->seek) {
+      catalog_seek(query);
+    }
+    metrics_time(METRICS_QUERY_START, start);
+    return 0;
+  }
+
+  result = start_statement(query);
+  if (!result) {
+    metrics_time(METRICS_QUERY_START, start);
+  }
+  return result;
+}
+
+int query_restart(query_t *query)
+{
+  char *cursor;
+  arena_t *arena;
+  int result;
+
+  /* Catalog queries hold no statement, and nothing to continue after yet */
+  if (!query->stmt || query->returned == 0) {
+    return 0;
+  }
+
+  cursor = query_cursor(query);
+  sqlite3_finalize(query->stmt);
+  query->stmt = NULL;
+  if (!cursor) {
+    return -1;
+  }
+
+  /* The offset was skipped by the first statement */
+  seek_free(query->seek, query->sorts);
+  query->seek = NULL;
+  query->offset = 0;
+
+  /* The arena can't be reset while the result is still being read, so the
+   * SQL of every later statement is malloc'd and released instead */
+  arena = query->arena;
+  query->arena = NULL;
+  result = query_seek(query, cursor) || start_statement(query);
+  query->arena = arena;
+  free(cursor);
+  return result;
+}
+
 int query_tracks_next(query_t *query, track_t *track)
 {
   int result;
   sqlite3_stmt *stmt;
+  const catalog_columns_t *columns;
+  int64_t row;
 
   if (!query) {
     return -1;
   }
 
+  if (query->catalog) {
+    row = catalog_next(query);
+    if (row < 0) {
+      return 1;
+    }
+    columns = query->columns;
+    memset(track, 0, sizeof(track_t));
+    track->id = columns->ids[row];
+    track->track = columns->integer[QUERY_FIELD_TRACK][row];
+    track->title = (char *)columns->text[QUERY_FIELD_TITLE][row];
+    track->artistid = columns->integer[QUERY_FIELD_ARTISTID][row];
+    track->artist = (char *)columns->text[QUERY_FIELD_ARTIST][row];
+    track->albumid = columns->integer[QUERY_FIELD_ALBUMID][row];
+    track->album = (char *)columns->text[QUERY_FIELD_ALBUM][row];
+    track->duration = columns->real[QUERY_FIELD_DURATION][row];
+    return 0;
+  }
+
   stmt = query->stmt;
 
   result = sqlite3_step(stmt);
@@ -544,6 +1519,7 @@ int query_tracks_next(query_t *query, track_t *track)
                "query_tracks_next: sqlite3_step failed");
     return -1;
   }
+  ++query->returned;
 
   track->id = sqlite3_column_int64(stmt, 0);
   track->file = (char *)sqlite3_column_text(stmt, 1);
@@ -564,11 +1540,22 @@ int query_artists_next(query_t *query, query_artist_t *artist)
 {
   int result;
   sqlite3_stmt *stmt;
+  int64_t row;
 
   if (!query) {
     return -1;
   }
 
+  if (query->catalog) {
+    row = catalog_next(query);
+    if (row < 0) {
+      return 1;
+    }
+    artist->artistid = query->columns->ids[row];
+    artist->artist = (char *)query->columns->text[QUERY_FIELD_ARTIST][row];
+    return 0;
+  }
+
   stmt = query->stmt;
 
   result = sqlite3_step(stmt);
@@ -579,6 +1566,7 @@ int query_artists_next(query_t *query, query_artist_t *artist)
                "query_artists_next: sqlite3_step failed");
     return -1;
   }
+  ++query->returned;
 
   artist->artistid = sqlite3_column_int64(stmt, 0);
   artist->artist = (char *)sqlite3_column_text(stmt, 1);
@@ -590,11 +1578,24 @@ int query_albums_next(query_t *query, query_album_t *album)
 {
   int result;
   sqlite3_stmt *stmt;
+  int64_t row;
 
   if (!query) {
     return -1;
   }
 
+  if (query->catalog) {
+    row = catalog_next(query);
+    if (row < 0) {
+      return 1;
+    }
+    album->albumid = query->columns->ids[row];
+    album->album = (char *)query->columns->text[QUERY_FIELD_ALBUM][row];
+    album->image = query->columns->images[row];
+    album->tracks = query->columns->integer[QUERY_FIELD_TRACKS][row];
+    return 0;
+  }
+
   stmt = query->stmt;
 
   result = sqlite3_step(stmt);
@@ -605,6 +1606,7 @@ int query_albums_next(query_t *query, query_album_t *album)
                "query_albums_next: sqlite3_step failed");
     return -1;
   }
+  ++query->returned;
 
   album->albumid = sqlite3_column_int64(stmt, 0);
   album->album = (char *)sqlite3_column_text(stmt, 1);
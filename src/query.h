@@ -18,6 +18,7 @@
 #ifndef MUSICD_QUERY_H
 #define MUSICD_QUERY_H
 
+#include "arena.h"
 #include "track.h"
 
 #include <stdbool.h>
@@ -38,6 +39,10 @@ typedef enum {
   QUERY_FIELD_TRACKS,
   QUERY_FIELD_DIRECTORY,
   QUERY_FIELD_DIRECTORYPREFIX,
+  /** Full-text search; as a sort field, orders by relevance */
+  QUERY_FIELD_TEXT,
+  /** Sort only: pseudorandom order given by query_seed */
+  QUERY_FIELD_RANDOM,
   QUERY_FIELD_ALL,
 } query_field_t;
 
@@ -49,6 +54,12 @@ query_t *query_tracks_new();
 query_t *query_artists_new();
 query_t *query_albums_new();
 
+/**
+ * Allocates filters and generated SQL of @p query from @p arena, which must
+ * outlive it. Must be called right after creating the query.
+ */
+void query_arena(query_t *query, arena_t *arena);
+
 void query_close(query_t *query);
 
 /**
@@ -72,10 +83,18 @@ void query_offset(query_t *query, int64_t offset);
 /**
  * Adds sorting rule on @p query by @p field. @p descending changes sorting
  * direction.
+ * @note Sorting by QUERY_FIELD_TEXT requires its filter to be set first. When
+ * it is set and no other sorting is, results are ordered by relevance.
  */
 void query_sort(query_t *query, query_field_t field,
                         bool descending);
 
+/**
+ * Sets seed of the order of sort field QUERY_FIELD_RANDOM, which is the same
+ * for the same seed and rows. Must be set before sorting.
+ */
+void query_seed(query_t *query, int64_t seed);
+
 /**
  * Parses sorting rules from @p sort
  * Format:
@@ -87,6 +106,21 @@ void query_sort(query_t *query, query_field_t field,
  */
 int query_sort_from_string(query_t *query, const char *sort);
 
+/**
+ * Continues @p query after the row @p cursor was returned for, as given by
+ * query_cursor() for the same filters and sorting. Sorting rules must be set
+ * before calling this.
+ * @returns 0 on success, nonzero if @p cursor is not valid for @p query
+ */
+int query_seek(query_t *query, const char *cursor);
+
+/**
+ * @returns opaque cursor of the row last returned by the query, to be passed
+ * to query_seek() for fetching the next page; NULL if there is no such row.
+ * Must be called before reading the next row. Free with free().
+ */
+char *query_cursor(query_t *query);
+
 /**
  * @returns amount of results returned by the current filters.
  */
@@ -103,6 +137,16 @@ int64_t query_index(query_t *query, int64_t id);
  */
 int query_start(query_t *query);
 
+/**
+ * Finalizes the statement of a started query and prepares it again to
+ * continue after the row returned last, so that reading a long result in
+ * parts doesn't keep the database snapshot open in between. Queries answered
+ * from the catalog are left as they are. Nothing of the new statement is
+ * taken from the query's arena, so restarting doesn't grow it.
+ * @returns 0 on success
+ */
+int query_restart(query_t *query);
+
 int query_tracks_next(query_t *query, track_t *track);
 
 typedef struct {
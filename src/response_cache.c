@@ -0,0 +1,170 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "response_cache.h"
+
+#include "config.h"
+#include "strings.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUCKETS 256
+
+typedef struct entry {
+  char *key;
+  int64_t generation;
+  char *body;
+  size_t size;
+
+  /** Next in bucket */
+  struct entry *next;
+  /** Neighbours in use order, most recent first */
+  struct entry *newer, *older;
+} entry_t;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static entry_t *buckets[BUCKETS];
+static entry_t *newest = NULL, *oldest = NULL;
+static size_t total = 0;
+
+static pthread_once_t instance_once = PTHREAD_ONCE_INIT;
+static char *instance;
+
+static void instance_init()
+{
+  instance = stringf("%" PRIx64 "%" PRIx64, (int64_t)time(NULL),
+                     (int64_t)getpid());
+}
+
+char *response_cache_etag(const char *key, int64_t generation)
+{
+  pthread_once(&instance_once, instance_init);
+  return stringf("\"%s-%" PRIx64 "-%08x\"", instance, generation,
+                 strhash(key));
+}
+
+static void unlink_use(entry_t *entry)
+{
+  if (entry->newer) {
+    entry->newer->older = entry->older;
+  } else {
+    newest = entry->older;
+  }
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    oldest = entry->newer;
+  }
+  entry->newer = entry->older = NULL;
+}
+
+static void link_newest(entry_t *entry)
+{
+  entry->older = newest;
+  entry->newer = NULL;
+  if (newest) {
+    newest->newer = entry;
+  } else {
+    oldest = entry;
+  }
+  newest = entry;
+}
+
+static void remove_entry(entry_t *entry)
+{
+  entry_t **p;
+
+  for (p = &buckets[strhash(entry->key) % BUCKETS]; *p != entry;
+       p = &(*p)->next) { }
+  *p = entry->next;
+  unlink_use(entry);
+
+  total -= entry->size;
+  free(entry->key);
+  free(entry->body);
+  free(entry);
+}
+
+static entry_t *find(const char *key)
+{
+  entry_t *entry;
+  for (entry = buckets[strhash(key) % BUCKETS]; entry; entry = entry->next) {
+    if (!strcmp(entry->key, key)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+char *response_cache_get(const char *key, int64_t generation, size_t *size)
+{
+  entry_t *entry;
+  char *result = NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+  entry = find(key);
+  if (entry && entry->generation != generation) {
+    remove_entry(entry);
+  } else if (entry) {
+    unlink_use(entry);
+    link_newest(entry);
+    result = malloc(entry->size);
+    memcpy(result, entry->body, entry->size);
+    *size = entry->size;
+  }
+  pthread_mutex_unlock(&cache_mutex);
+
+  return result;
+}
+
+void response_cache_set(const char *key, int64_t generation,
+                        const char *body, size_t size)
+{
+  size_t limit = (size_t)config_to_int("response-cache-size") * 1024 * 1024;
+  entry_t *entry, *old;
+
+  if (size > limit / 4) {
+    /* Don't let one response flush the whole cache */
+    return;
+  }
+
+  entry = malloc(sizeof(entry_t));
+  entry->key = strcopy(key);
+  entry->generation = generation;
+  entry->body = malloc(size);
+  memcpy(entry->body, body, size);
+  entry->size = size;
+
+  pthread_mutex_lock(&cache_mutex);
+  old = find(key);
+  if (old) {
+    remove_entry(old);
+  }
+  while (oldest && total + size > limit) {
+    remove_entry(oldest);
+  }
+  entry->next = buckets[strhash(key) % BUCKETS];
+  buckets[strhash(key) % BUCKETS] = entry;
+  link_newest(entry);
+  total += size;
+  pthread_mutex_unlock(&cache_mutex);
+}
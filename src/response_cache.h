@@ -0,0 +1,49 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_RESPONSE_CACHE_H
+#define MUSICD_RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded least recently used cache of API response bodies, which depend only
+ * on the request and the library. Entries are valid for the library
+ * generation they were made at, and the size is bounded by config
+ * response-cache-size.
+ */
+
+/**
+ * @returns entity tag for response of request @p key at library generation
+ * @p generation, unique across restarts. Free with free().
+ */
+char *response_cache_etag(const char *key, int64_t generation);
+
+/**
+ * @returns copy of cached body for @p key at @p generation with its size in
+ * @p size, or NULL if there is none. Free with free().
+ */
+char *response_cache_get(const char *key, int64_t generation, size_t *size);
+
+/**
+ * Stores @p size bytes of @p body as response for @p key at @p generation.
+ */
+void response_cache_set(const char *key, int64_t generation,
+                        const char *body, size_t size);
+
+#endif
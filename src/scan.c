@@ -17,11 +17,16 @@
  */
 #include "scan.h"
 
+#include "cache.h"
+#include "catalog.h"
 #include "config.h"
 #include "cue.h"
 #include "db.h"
+#include "image.h"
 #include "library.h"
 #include "log.h"
+#include "metrics.h"
+#include "stream.h"
 #include "strings.h"
 
 #include <dirent.h>
@@ -34,6 +39,13 @@
 #include <strings.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 #include <FreeImage.h>
 
@@ -75,17 +87,23 @@ int scan_start()
     pthread_mutex_unlock(&scan_mutex);
     return 0;
   }
-  pthread_mutex_unlock(&scan_mutex);
 
   if (!config_get_value("music-directory")) {
+    pthread_mutex_unlock(&scan_mutex);
     musicd_log(LOG_WARNING, "scan", "music-directory not set, no scanning");
     return 0;
   }
 
+  /* Claimed under the lock so that concurrent callers from different server
+   * threads can't start two scans. */
   thread_running = true;
+  pthread_mutex_unlock(&scan_mutex);
 
   if (pthread_create(&scan_thread, NULL, scan_thread_func, NULL)) {
     musicd_perror(LOG_ERROR, "scan", "could not create thread");
+    pthread_mutex_lock(&scan_mutex);
+    thread_running = false;
+    pthread_mutex_unlock(&scan_mutex);
     return -1;
   }
   pthread_detach(scan_thread);
@@ -110,69 +128,465 @@ void scan_status(scan_status_t *status_out)
 
 static void scan_directory(const char *dirpath, int parent);
 
-static int64_t scan_file(const char *path, int64_t directory)
+
+/*
+ * The scan is written in chunks of scan-commit-files files or
+ * scan-commit-time milliseconds, so that new tracks show up while scanning
+ * and the database isn't locked for the whole scan.
+ */
+
+static int commit_files, commit_time;
+static int uncommitted;
+static int64_t last_commit;
+
+static void begin_chunks()
 {
-  const char *extension;
-  int64_t file = 0;
+  commit_files = config_to_int("scan-commit-files");
+  commit_time = config_to_int("scan-commit-time");
+  uncommitted = 0;
+  last_commit = metrics_now() / 1000;
+  db_simple_exec("BEGIN TRANSACTION", NULL);
+}
+
+/**
+ * Called after each file written, commits the chunk if it is full.
+ */
+static void chunk_progress()
+{
+  int64_t now;
+
+  ++uncommitted;
+  now = metrics_now() / 1000;
+  if ((commit_files <= 0 || uncommitted < commit_files)
+   && (commit_time <= 0 || now - last_commit < commit_time)) {
+    return;
+  }
+
+  db_simple_exec("COMMIT TRANSACTION", NULL);
+  library_changed();
+  db_simple_exec("BEGIN TRANSACTION", NULL);
+  uncommitted = 0;
+  last_commit = now;
+}
+
+static void end_chunks()
+{
+  db_simple_exec("COMMIT TRANSACTION", NULL);
+  library_changed();
+}
+
+
+/*
+ * Files are probed by scan-threads worker threads, while the scan thread
+ * walks the tree and is the only one writing to the database. Probing results
+ * of each directory are applied in order as they become ready.
+ */
+
+/** Most jobs in the work queue at once */
+#define QUEUE_LIMIT 64
+
+typedef enum scan_kind {
+  SCAN_KIND_NONE = 0,
+  SCAN_KIND_CUE,
+  SCAN_KIND_IMAGE,
+  SCAN_KIND_TRACKS
+} scan_kind_t;
+
+typedef struct scan_job {
+  char *path;
+  int64_t directory;
+  /** Known file being scanned again, 0 if new */
+  int64_t file;
+  time_t mtime;
+
+  /* Set by probe_file */
+  scan_kind_t kind;
   track_t **tracks;
-  int i;
+  int64_t *seek_index;
+  int seek_count;
+  int seek_interval;
+
+  bool done;
+  struct scan_job *next;
+} scan_job_t;
+
+typedef struct scan_batch {
+  scan_job_t *jobs;
+  int count, size;
+} scan_batch_t;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static scan_job_t *queue_first = NULL, *queue_last = NULL;
+static bool workers_quit = false;
+static pthread_t *workers = NULL;
+static int nb_workers = 0;
+
+/**
+ * Probes the file of @p job without touching the database, so that this can
+ * be done in any thread.
+ */
+static void probe_file(scan_job_t *job)
+{
+  const char *extension;
 
-  for (extension = path + strlen(path);
-    *(extension) != '.' && extension != path; --extension) { }
+  for (extension = job->path + strlen(job->path);
+    *(extension) != '.' && extension != job->path; --extension) { }
   ++extension;
-    
+
   if (!strcasecmp(extension, "cue")) {
-    /* CUE sheet */
-    musicd_log(LOG_DEBUG, "scan", "cue: %s", path);
-    cue_read(path, directory);
-  } else if(FreeImage_GetFIFFromFilename(path) != FIF_UNKNOWN) {
+    /* CUE sheet, read when applying as it refers to other files */
+    job->kind = SCAN_KIND_CUE;
+  } else if(FreeImage_GetFIFFromFilename(job->path) != FIF_UNKNOWN) {
     /* Image file */
-    if (FreeImage_GetFileType(path, 0) != FIF_UNKNOWN) {
-      musicd_log(LOG_DEBUG, "scan", "image: %s", path);
-      file = library_file(path, directory);
-      library_image_add(file);
+    if (FreeImage_GetFileType(job->path, 0) != FIF_UNKNOWN) {
+      job->kind = SCAN_KIND_IMAGE;
     }
   } else {
-    tracks = tracks_from_path(path);
     /* Try tracks */
-    if (!tracks) {
-      return file;
+    job->tracks = tracks_from_path(job->path);
+    if (!job->tracks) {
+      return;
     }
-    for (i = 0; tracks[i]; ++i) {
-      musicd_log(LOG_DEBUG, "scan", "track: %s", path);
-      library_track_add(tracks[i], directory);
+    job->kind = SCAN_KIND_TRACKS;
+
+    job->seek_interval = config_to_int("seek-index-interval");
+    if (job->seek_interval > 0) {
+      job->seek_index = stream_build_seek_index(job->path, job->seek_interval,
+                                                &job->seek_count);
+    }
+  }
+}
+
+/**
+ * Stores what probe_file found in the library.
+ */
+static void apply_file(scan_job_t *job)
+{
+  int64_t file = 0;
+  int i;
+
+  if (job->file > 0) {
+    library_file_clear(job->file);
+  }
+
+  if (job->kind == SCAN_KIND_CUE) {
+    musicd_log(LOG_DEBUG, "scan", "cue: %s", job->path);
+    cue_read(job->path, job->directory);
+  } else if (job->kind == SCAN_KIND_IMAGE) {
+    musicd_log(LOG_DEBUG, "scan", "image: %s", job->path);
+    file = library_file(job->path, job->directory);
+    library_image_add(file);
+  } else if (job->kind == SCAN_KIND_TRACKS) {
+    for (i = 0; job->tracks[i]; ++i) {
+      musicd_log(LOG_DEBUG, "scan", "track: %s", job->path);
+      library_track_add(job->tracks[i], job->directory);
       scan_track_added();
-      file = library_file(path, 0);
+      file = library_file(job->path, 0);
+    }
+    if (file > 0 && job->seek_index) {
+      library_seek_index_set(file, job->seek_interval, job->seek_index,
+                             job->seek_count);
+    }
+  }
+
+  if (file) {
+    library_file_mtime_set(file, job->mtime);
+  } else if (job->file > 0) {
+    library_file_delete(job->file);
+  }
+}
+
+static void *worker_func(void *data)
+{
+  scan_job_t *job;
+
+  (void)data;
+
+  pthread_mutex_lock(&queue_mutex);
+  while (1) {
+    while (!queue_first && !workers_quit) {
+      pthread_cond_wait(&queue_cond, &queue_mutex);
+    }
+    if (!queue_first) {
+      break;
+    }
+
+    job = queue_first;
+    queue_first = job->next;
+    if (!queue_first) {
+      queue_last = NULL;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    /* Cancelled jobs are only marked done */
+    if (!interrupted) {
+      probe_file(job);
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    job->done = true;
+    pthread_cond_broadcast(&done_cond);
+  }
+  pthread_mutex_unlock(&queue_mutex);
+
+  return NULL;
+}
+
+static void start_workers()
+{
+  int threads = config_to_int("scan-threads");
+
+  /* With one thread, files are probed on the scan thread itself */
+  if (threads <= 1) {
+    return;
+  }
+
+  workers_quit = false;
+  workers = malloc(sizeof(pthread_t) * threads);
+  for (nb_workers = 0; nb_workers < threads; ++nb_workers) {
+    if (pthread_create(&workers[nb_workers], NULL, worker_func, NULL)) {
+      musicd_perror(LOG_ERROR, "scan", "could not create worker thread");
+      break;
+    }
+  }
+
+  musicd_log(LOG_VERBOSE, "scan", "probing with %d thread(s)", nb_workers);
+
+  if (nb_workers == 0) {
+    free(workers);
+    workers = NULL;
+  }
+}
+
+static void stop_workers()
+{
+  int i;
+
+  pthread_mutex_lock(&queue_mutex);
+  workers_quit = true;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+
+  for (i = 0; i < nb_workers; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  workers = NULL;
+  nb_workers = 0;
+}
+
+static void batch_add(scan_batch_t *batch, const char *path,
+                      int64_t directory, int64_t file, time_t mtime)
+{
+  scan_job_t *job;
+
+  if (batch->count == batch->size) {
+    batch->size = batch->size ? batch->size * 2 : 16;
+    batch->jobs = realloc(batch->jobs, sizeof(scan_job_t) * batch->size);
+  }
+
+  job = &batch->jobs[batch->count++];
+  memset(job, 0, sizeof(scan_job_t));
+  job->path = strcopy(path);
+  job->directory = directory;
+  job->file = file;
+  job->mtime = mtime;
+}
+
+static void submit(scan_job_t *job)
+{
+  pthread_mutex_lock(&queue_mutex);
+  job->next = NULL;
+  if (queue_last) {
+    queue_last->next = job;
+  } else {
+    queue_first = job;
+  }
+  queue_last = job;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/**
+ * Probes all files of @p batch and applies the results in order, then empties
+ * the batch. At most QUEUE_LIMIT files are being probed at once.
+ */
+static void batch_run(scan_batch_t *batch)
+{
+  int submitted = 0, applied, i;
+  scan_job_t *job;
+
+  for (applied = 0; applied < batch->count; ++applied) {
+    job = &batch->jobs[applied];
+
+    if (nb_workers > 0) {
+      /* Jobs are not moved anymore once the batch is running */
+      for (; submitted < batch->count
+           && submitted - applied < QUEUE_LIMIT; ++submitted) {
+        submit(&batch->jobs[submitted]);
+      }
+
+      pthread_mutex_lock(&queue_mutex);
+      while (!job->done) {
+        pthread_cond_wait(&done_cond, &queue_mutex);
+      }
+      pthread_mutex_unlock(&queue_mutex);
+    } else if (!interrupted) {
+      probe_file(job);
+    }
+
+    if (!interrupted) {
+      apply_file(job);
+      chunk_progress();
+    }
+  }
+
+  for (i = 0; i < batch->count; ++i) {
+    job = &batch->jobs[i];
+    free(job->path);
+    if (job->tracks) {
+      tracks_free(job->tracks);
+    }
+    free(job->seek_index);
+  }
+  batch->count = 0;
+}
+
+static void batch_free(scan_batch_t *batch)
+{
+  free(batch->jobs);
+}
+
+/** Batch of known files being scanned again, see scan_files_cb */
+static scan_batch_t *files_batch;
+
+
+/*
+ * Files of a directory as found in the database by scan_files, so that
+ * iterate_directory can tell whether a file is known without querying it.
+ */
+
+typedef struct known_file {
+  char *path;
+  unsigned hash;
+  int64_t id;
+  time_t mtime;
+  struct known_file *next;
+} known_file_t;
+
+typedef struct known_files {
+  known_file_t **buckets;
+  int nb_buckets, count;
+} known_files_t;
+
+/** Known files of the directory in scan_files, see scan_files_cb */
+static known_files_t *files_known;
+
+static void known_add(known_files_t *known, const char *path, int64_t id,
+                      time_t mtime)
+{
+  known_file_t *file, *next, **buckets;
+  int nb_buckets, i;
+
+  if (known->count >= known->nb_buckets) {
+    /* Keep chains short by growing along with the directory */
+    nb_buckets = known->nb_buckets ? known->nb_buckets * 2 : 64;
+    buckets = calloc(nb_buckets, sizeof(known_file_t *));
+    for (i = 0; i < known->nb_buckets; ++i) {
+      for (file = known->buckets[i]; file; file = next) {
+        next = file->next;
+        file->next = buckets[file->hash % nb_buckets];
+        buckets[file->hash % nb_buckets] = file;
+      }
+    }
+    free(known->buckets);
+    known->buckets = buckets;
+    known->nb_buckets = nb_buckets;
+  }
+
+  file = malloc(sizeof(known_file_t));
+  file->path = strcopy(path);
+  file->hash = strhash(path);
+  file->id = id;
+  file->mtime = mtime;
+  file->next = known->buckets[file->hash % known->nb_buckets];
+  known->buckets[file->hash % known->nb_buckets] = file;
+  ++known->count;
+}
+
+static known_file_t *known_find(known_files_t *known, const char *path)
+{
+  known_file_t *file;
+  unsigned hash;
+
+  if (!known->count) {
+    return NULL;
+  }
+
+  hash = strhash(path);
+  for (file = known->buckets[hash % known->nb_buckets]; file;
+       file = file->next) {
+    if (file->hash == hash && !strcmp(file->path, path)) {
+      return file;
     }
-    tracks_free(tracks);
-  } 
-  return file;
+  }
+  return NULL;
+}
+
+static void known_free(known_files_t *known)
+{
+  known_file_t *file, *next;
+  int i;
+
+  for (i = 0; i < known->nb_buckets; ++i) {
+    for (file = known->buckets[i]; file; file = next) {
+      next = file->next;
+      free(file->path);
+      free(file);
+    }
+  }
+  free(known->buckets);
 }
 
 /**
  * Iterates through directory. Subdirectories will be scanned using
- * scan_directory.
+ * scan_directory. Files in @p known, as filled by scan_files, are up to date
+ * unless their mtime has changed since.
  */
-static void iterate_directory(const char *dirpath, int dir_id)
+static void iterate_directory(const char *dirpath, int dir_id,
+                              known_files_t *known)
 {
   struct stat status;
   DIR *dir;
   struct dirent *entry;
   
-  int64_t file;
-  time_t file_mtime;
+  known_file_t *file;
   
-  char *path;
+  char *path, *name;
+  size_t dirpath_len;
+  int fd;
+  scan_batch_t batch;
   
   if (!(dir = opendir(dirpath))) {
     /* Probably no read access - ok, we just omit. */
     musicd_perror(LOG_WARNING, "scan", "could not open directory %s", dirpath);
     return;
   }
+  /* Entries are stat'd relative to the directory, so that the path doesn't
+   * have to be resolved again for each of them */
+  fd = dirfd(dir);
   
   /* + 256 4-bit UTF-8 characters + / and \0 
    * More than enough on every platform really in use. */
-  path = malloc(strlen(dirpath) + 1024 + 2);
+  dirpath_len = strlen(dirpath);
+  path = malloc(dirpath_len + 1024 + 2);
+  memcpy(path, dirpath, dirpath_len);
+  path[dirpath_len] = '/';
+  name = path + dirpath_len + 1;
+
+  memset(&batch, 0, sizeof(scan_batch_t));
   
   errno = 0;
   while ((entry = readdir(dir))) {
@@ -185,9 +599,22 @@ static void iterate_directory(const char *dirpath, int dir_id)
       goto next;
     }
     
-    sprintf(path, "%s/%s", dirpath, entry->d_name);
+    strcpy(name, entry->d_name);
+
+#ifdef _DIRENT_HAVE_D_TYPE
+    /* scan_directory stats directories itself, and other types than regular
+     * files and possible links to them are of no interest. */
+    if (entry->d_type == DT_DIR) {
+      scan_directory(path, dir_id);
+      goto next;
+    }
+    if (entry->d_type != DT_REG && entry->d_type != DT_LNK
+     && entry->d_type != DT_UNKNOWN) {
+      goto next;
+    }
+#endif
 
-    if (stat(path, &status)) {
+    if (fstatat(fd, entry->d_name, &status, 0)) {
       goto next;
     }
       
@@ -199,18 +626,13 @@ static void iterate_directory(const char *dirpath, int dir_id)
       goto next;
     }
     
-    file = library_file(path, 0);
-    if (file > 0) {
-      file_mtime = library_file_mtime(file);
-      if (file_mtime == status.st_mtime) {
-        goto next;
-      }
+    file = known_find(known, path);
+    if (file && file->mtime == status.st_mtime) {
+      goto next;
     }
     
-    file = scan_file(path, dir_id);
-    if (file) {
-      library_file_mtime_set(file, status.st_mtime);
-    }
+    /* Probed in parallel once the directory has been read */
+    batch_add(&batch, path, dir_id, file ? file->id : 0, status.st_mtime);
 
   next:
     errno = 0;
@@ -221,9 +643,12 @@ static void iterate_directory(const char *dirpath, int dir_id)
   if (errno) {
     /* It was possible to open the directory but we can't iterate it anymore?
      * Something's fishy. */
-    musicd_perror(LOG_ERROR, "scan", "could not iterate directory %s", path);
+    musicd_perror(LOG_ERROR, "scan", "could not iterate directory %s", dirpath);
   }
   free(path);
+
+  batch_run(&batch);
+  batch_free(&batch);
 }
 
 
@@ -237,34 +662,86 @@ static bool scan_files_cb(library_file_t *file)
     return true;
   }
   
+  /* Up to date once scan_files is done */
+  known_add(files_known, file->path, file->id, status.st_mtime);
+
   if (file->mtime == status.st_mtime) {
     return true;
   }
   
-  library_file_clear(file->id);
-  if (scan_file(file->path, file->directory)) {
-    library_file_mtime_set(file->id, status.st_mtime);
-  } else {
-    library_file_delete(file->id);
-  }
+  /* Cleared and scanned again by scan_files once the iteration is done */
+  batch_add(files_batch, file->path, file->directory, file->id,
+            status.st_mtime);
   
   return true;
 }
 
+/**
+ * Removes files of @p directory that no longer exist, and scans changed ones
+ * again. The remaining files are stored to @p known, which must be freed with
+ * known_free.
+ */
+static void scan_files(int64_t directory, known_files_t *known)
+{
+  scan_batch_t batch;
+
+  memset(&batch, 0, sizeof(scan_batch_t));
+  memset(known, 0, sizeof(known_files_t));
+  files_batch = &batch;
+  files_known = known;
+  library_iterate_files_by_directory(directory, scan_files_cb);
+  files_batch = NULL;
+  files_known = NULL;
+
+  batch_run(&batch);
+  batch_free(&batch);
+}
+
+/*
+ * Album images are chosen once per scan for every album that images were
+ * assigned to, rather than after each directory.
+ */
+
+/** Up to this many albums are updated one by one, beyond that in one pass
+ * over the images of all albums */
+#define ALBUM_IMAGES_PASS 64
+
+/** Albums to choose images for, possibly with duplicates */
+static int64_t *dirty_albums = NULL;
+static int nb_dirty_albums = 0, dirty_albums_size = 0;
+
 struct albumimg_comparison {
+  int64_t album;
   int64_t id;
   char *name;
   int level;
 };
 
-static bool update_albumimg_cb(library_image_t *image, void *opaque)
+/**
+ * strcasecmp of @p len bytes at @p a and string @p b.
+ */
+static int name_compare(const char *a, size_t len, const char *b)
 {
-  char *name;
-  int level, diff;
-  bool better = false;
-  struct albumimg_comparison *comparison = opaque;
+  size_t b_len = strlen(b);
+  int diff = strncasecmp(a, b, len < b_len ? len : b_len);
 
-  /* Extract what's between last '/' and last '.' in the path */
+  if (diff) {
+    return diff;
+  }
+  return len < b_len ? -1 : len > b_len;
+}
+
+/**
+ * Takes @p image as the best of @p comparison if it is better than the best
+ * so far.
+ */
+static void compare_albumimg(struct albumimg_comparison *comparison,
+                             library_image_t *image)
+{
+  size_t len;
+  int level;
+
+  /* Compare what's between last '/' and last '.' in the path */
 
   const char *p1 = image->path + strlen(image->path), *p2 = NULL;
 
@@ -276,11 +753,11 @@ static bool update_albumimg_cb(library_image_t *image, void *opaque)
   if (!p2) {
     p2 = image->path + strlen(image->path);
   }
+  len = p2 - p1;
 
-  name = strextract(p1, p2);
   if (image_prefixes) {
     for (level = 0; image_prefixes[level]; ++level) {
-      if (!strncasecmp(image_prefixes[level], name, strlen(image_prefixes[level]))) {
+      if (!strncasecmp(image_prefixes[level], p1, strlen(image_prefixes[level]))) {
         /* Matches current level */
         break;
       }
@@ -289,39 +766,35 @@ static bool update_albumimg_cb(library_image_t *image, void *opaque)
     level = 0;
   }
 
-  /* First entry */
-  if (!comparison->id) {
-    better = true;
-    goto skip;
-  }
-
-  /* Lower level than previous best, must be better */
-  if (level < comparison->level) {
-    better = true;
-    goto skip;
-  }
-
-  /* Higher level than previous best, can't be better */
-  if (level > comparison->level) {
-    goto skip;
+  /* Higher level than previous best can't be better, lower must be. On the
+   * same level "smaller" name means better. */
+  if (comparison->id
+   && (level > comparison->level
+    || (level == comparison->level
+     && name_compare(p1, len, comparison->name) >= 0))) {
+    return;
   }
 
-  diff = strcasecmp(name, comparison->name);
-  if (diff < 0) {
-    /* "Smaller" means better */
-    better = true;
-  }
+  comparison->id = image->id;
+  free(comparison->name);
+  comparison->name = strextract(p1, p2);
+  comparison->level = level;
+}
 
-skip:
-  if (better) {
-    comparison->id = image->id;
-    free(comparison->name);
-    comparison->name = name;
-    comparison->level = level;
-  } else {
-    free(name);
+static void finish_albumimg(struct albumimg_comparison *comparison)
+{
+  if (comparison->id > 0) {
+    library_album_image_set(comparison->album, comparison->id);
   }
+  free(comparison->name);
+  comparison->id = 0;
+  comparison->name = NULL;
+  comparison->level = INT_MAX;
+}
 
+static bool update_albumimg_cb(library_image_t *image, void *opaque)
+{
+  compare_albumimg(opaque, image);
   return true;
 }
 
@@ -331,14 +804,71 @@ skip:
 static void update_albumimg(int64_t album)
 {
   struct albumimg_comparison comparison = {
-    0, NULL, INT_MAX
+    album, 0, NULL, INT_MAX
   };
 
   library_iterate_images_by_album(album, update_albumimg_cb, &comparison);
+  finish_albumimg(&comparison);
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static bool album_images_cb(library_image_t *image, void *opaque)
+{
+  struct albumimg_comparison *comparison = opaque;
+
+  if (image->album != comparison->album) {
+    finish_albumimg(comparison);
+    /* Only albums images were assigned to are chosen for */
+    comparison->album =
+      bsearch(&image->album, dirty_albums, nb_dirty_albums, sizeof(int64_t),
+              compare_ids) ? image->album : -image->album;
+  }
+  if (comparison->album > 0) {
+    compare_albumimg(comparison, image);
+  }
+  return true;
+}
+
+/**
+ * Chooses images for the albums images were assigned to by assign_images.
+ */
+static void update_album_images()
+{
+  struct albumimg_comparison comparison = {
+    0, 0, NULL, INT_MAX
+  };
+  int i, n;
+
+  if (nb_dirty_albums == 0) {
+    return;
+  }
 
-  if (comparison.id > 0) {
-    library_album_image_set(album, comparison.id);
+  qsort(dirty_albums, nb_dirty_albums, sizeof(int64_t), compare_ids);
+  for (i = 1, n = 1; i < nb_dirty_albums; ++i) {
+    if (dirty_albums[i] != dirty_albums[n - 1]) {
+      dirty_albums[n++] = dirty_albums[i];
+    }
   }
+  nb_dirty_albums = n;
+
+  musicd_log(LOG_VERBOSE, "scan", "choosing images for %d albums",
+             nb_dirty_albums);
+
+  if (nb_dirty_albums <= ALBUM_IMAGES_PASS) {
+    for (i = 0; i < nb_dirty_albums; ++i) {
+      update_albumimg(dirty_albums[i]);
+    }
+  } else {
+    library_iterate_album_images(album_images_cb, &comparison);
+    finish_albumimg(&comparison);
+  }
+
+  nb_dirty_albums = 0;
 }
 
 static bool assign_images_cb(library_directory_t *directory, void *album)
@@ -361,13 +891,20 @@ static void assign_images(int64_t directory)
 
   library_iterate_directories(directory, assign_images_cb, (void *)&album);
 
-  update_albumimg(album);
+  /* Image chosen by update_album_images */
+  if (nb_dirty_albums == dirty_albums_size) {
+    dirty_albums_size = dirty_albums_size ? dirty_albums_size * 2 : 256;
+    dirty_albums =
+      realloc(dirty_albums, sizeof(int64_t) * dirty_albums_size);
+  }
+  dirty_albums[nb_dirty_albums++] = album;
 }
 
 static bool scan_directory_cb(library_directory_t *directory, void *empty)
 {
   (void)empty;
   struct stat status;
+  known_files_t known;
   if (stat(directory->path, &status)) {
     musicd_perror(LOG_DEBUG, "scan", "removing directory %s", directory->path);
     library_directory_delete(directory->id);
@@ -384,8 +921,9 @@ static bool scan_directory_cb(library_directory_t *directory, void *empty)
     return true;
   }
   
-  library_iterate_files_by_directory(directory->id, scan_files_cb);
-  iterate_directory(directory->path, directory->id);
+  scan_files(directory->id, &known);
+  iterate_directory(directory->path, directory->id, &known);
+  known_free(&known);
   
   assign_images(directory->id);
   
@@ -403,6 +941,7 @@ static void scan_directory(const char *dirpath, int parent)
   int dir_id;
   time_t dir_mtime;
   struct stat status;
+  known_files_t known;
   
   dir_id = library_directory(dirpath, -1);
   
@@ -424,8 +963,9 @@ static void scan_directory(const char *dirpath, int parent)
     dir_id = library_directory(dirpath, parent);
   }
   
-  library_iterate_files_by_directory(dir_id, scan_files_cb);
-  iterate_directory(dirpath, dir_id);
+  scan_files(dir_id, &known);
+  iterate_directory(dirpath, dir_id, &known);
+  known_free(&known);
   
   assign_images(dir_id);
   
@@ -463,6 +1003,7 @@ static void scan()
   signal(SIGINT, scan_signal_handler);
   
   scan_directory(path, 0);
+  update_album_images();
   
   free(path);
   
@@ -478,9 +1019,44 @@ static void scan()
   db_meta_set_int("last-scan", now);
 }
 
+/**
+ * Makes thumbnails of every album image in all sizes, decoding each image
+ * only once, so that browsing is served from the cache from the start.
+ */
+static void pregenerate_thumbnails()
+{
+  int64_t *images;
+  int sizes[16], nb_sizes, nb_images, i, size, done = 0;
+  char *cache_name;
+
+  nb_images = library_album_image_ids(&images);
+  musicd_log(LOG_INFO, "scan", "making thumbnails of %d images", nb_images);
+
+  for (i = 0; i < nb_images && !interrupted; ++i) {
+    nb_sizes = 0;
+    for (size = IMAGE_SIZE_MAX; size >= IMAGE_SIZE_MIN; size /= 2) {
+      cache_name = image_cache_name(images[i], size);
+      if (!cache_exists(cache_name)) {
+        sizes[nb_sizes++] = size;
+      }
+      free(cache_name);
+    }
+    if (nb_sizes > 0) {
+      image_cache_thumbnails(images[i], sizes, nb_sizes);
+      ++done;
+    }
+  }
+
+  musicd_log(LOG_INFO, "scan", "made thumbnails of %d images", done);
+  free(images);
+}
+
 static void *scan_thread_func(void *data)
 {
   (void)data;
+
+  /* The scan reads its own uncommitted changes */
+  db_writer_thread();
   
   pthread_mutex_lock(&scan_mutex);
   memset(&status, 0, sizeof(scan_status_t));
@@ -488,9 +1064,23 @@ static void *scan_thread_func(void *data)
   status.start_time = time(NULL);
   pthread_mutex_unlock(&scan_mutex);
 
-  db_simple_exec("BEGIN TRANSACTION", NULL);
+  start_workers();
+  library_names_begin();
+  begin_chunks();
   scan();
-  db_simple_exec("COMMIT TRANSACTION", NULL);
+  end_chunks();
+  library_names_end();
+  stop_workers();
+
+  if (!interrupted) {
+    /* Keep the query planner statistics up to date with the library */
+    db_simple_exec("ANALYZE", NULL);
+  }
+  catalog_update();
+
+  if (!interrupted && config_to_bool("image-pregenerate")) {
+    pregenerate_thumbnails();
+  }
 
   pthread_mutex_lock(&scan_mutex);
   thread_running = false;
@@ -515,6 +1105,391 @@ static void *scan_thread_func(void *data)
   return NULL;
 }
 
+
+#ifdef __linux__
+
+/** Seconds without events before changes are scanned */
+#define WATCH_DEBOUNCE 2
+/** ...but changes wait at most this long during bulk copies */
+#define WATCH_DEBOUNCE_MAX 30
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+static int watch_fd = -1;
+/** Watched directory paths, indexed by watch descriptor */
+static char **watch_paths = NULL;
+static int watch_paths_size = 0;
+
+/** Directories with changes not yet scanned */
+static char **dirty = NULL;
+static int nb_dirty = 0, dirty_size = 0;
+
+/**
+ * Watches @p path and all directories below it.
+ *
+ * A directory reached again through a symlink is not descended into, as
+ * inotify gives the same watch for it, so symlink loops terminate.
+ */
+static void watch_directory(const char *path)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct stat status, watched;
+  char *sub;
+  int wd;
+
+  wd = inotify_add_watch(watch_fd, path, WATCH_MASK);
+  if (wd < 0) {
+    if (errno == ENOSPC) {
+      musicd_log(LOG_WARNING, "scan", "out of inotify watches, %s and below "
+                 "are only updated by full scans", path);
+    } else {
+      musicd_perror(LOG_WARNING, "scan", "can't watch %s", path);
+    }
+    return;
+  }
+
+  /* A watch moved with its directory still has the old path, which is gone */
+  if (wd < watch_paths_size && watch_paths[wd]
+   && strcmp(watch_paths[wd], path)
+   && !stat(watch_paths[wd], &watched) && !stat(path, &status)
+   && watched.st_dev == status.st_dev && watched.st_ino == status.st_ino) {
+    return;
+  }
+
+  if (wd >= watch_paths_size) {
+    int size = watch_paths_size ? watch_paths_size : 256;
+    while (size <= wd) {
+      size *= 2;
+    }
+    watch_paths = realloc(watch_paths, sizeof(char *) * size);
+    memset(watch_paths + watch_paths_size, 0,
+           sizeof(char *) * (size - watch_paths_size));
+    watch_paths_size = size;
+  }
+  free(watch_paths[wd]);
+  watch_paths[wd] = strcopy(path);
+
+  if (!(dir = opendir(path))) {
+    return;
+  }
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    sub = stringf("%s/%s", path, entry->d_name);
+    if (!stat(sub, &status) && S_ISDIR(status.st_mode)) {
+      watch_directory(sub);
+    }
+    free(sub);
+  }
+  closedir(dir);
+}
+
+static void mark_dirty(const char *path)
+{
+  int i;
+
+  for (i = 0; i < nb_dirty; ++i) {
+    if (!strcmp(dirty[i], path)) {
+      return;
+    }
+  }
+
+  if (nb_dirty == dirty_size) {
+    dirty_size = dirty_size ? dirty_size * 2 : 16;
+    dirty = realloc(dirty, sizeof(char *) * dirty_size);
+  }
+  dirty[nb_dirty++] = strcopy(path);
+}
+
+/**
+ * Handles one inotify event.
+ * @returns false if events were lost and everything must be scanned
+ */
+static bool watch_event(struct inotify_event *event)
+{
+  const char *path;
+  char *sub;
+
+  if (event->mask & IN_Q_OVERFLOW) {
+    return false;
+  }
+
+  if (event->wd < 0 || event->wd >= watch_paths_size
+   || !watch_paths[event->wd]) {
+    return true;
+  }
+  path = watch_paths[event->wd];
+
+  if (event->mask & IN_IGNORED) {
+    /* Directory is gone */
+    free(watch_paths[event->wd]);
+    watch_paths[event->wd] = NULL;
+    return true;
+  }
+
+  if (event->len == 0 || event->name[0] == '.') {
+    return true;
+  }
+
+  if (event->mask & (IN_CREATE | IN_MOVED_TO) && event->mask & IN_ISDIR) {
+    sub = stringf("%s/%s", path, event->name);
+    watch_directory(sub);
+    free(sub);
+  }
+
+  mark_dirty(path);
+  return true;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Scans directory @p path again even if its mtime hasn't changed, as files
+ * in it can have been modified.
+ */
+static void update_directory(const char *path)
+{
+  int64_t dir_id, parent;
+  struct stat status;
+  char *parent_path;
+  known_files_t known;
+
+  dir_id = library_directory(path, -1);
+  if (dir_id <= 0) {
+    /* New directory, parents come first so the parent should be known */
+    parent_path = strextract(path, strrchr(path, '/'));
+    parent = library_directory(parent_path, -1);
+    free(parent_path);
+    if (parent > 0) {
+      scan_directory(path, parent);
+    }
+    return;
+  }
+
+  if (stat(path, &status)) {
+    musicd_perror(LOG_DEBUG, "scan", "removing directory %s", path);
+    library_directory_delete(dir_id);
+    return;
+  }
+
+  library_iterate_directories(dir_id, scan_directory_cb, NULL);
+  scan_files(dir_id, &known);
+  iterate_directory(path, dir_id, &known);
+  known_free(&known);
+  assign_images(dir_id);
+
+  if (!interrupted) {
+    library_directory_mtime_set(dir_id, status.st_mtime);
+  }
+}
+
+/**
+ * Scans the dirty directories, unless a scan is already running.
+ * @returns true if done, false if it has to be tried again later
+ */
+static bool update_dirty()
+{
+  int i;
+
+  pthread_mutex_lock(&scan_mutex);
+  if (thread_running) {
+    pthread_mutex_unlock(&scan_mutex);
+    return false;
+  }
+  thread_running = true;
+  memset(&status, 0, sizeof(scan_status_t));
+  status.active = true;
+  status.start_time = time(NULL);
+  pthread_mutex_unlock(&scan_mutex);
+
+  musicd_log(LOG_VERBOSE, "scan", "updating %d changed directories", nb_dirty);
+
+  /* Parents before their subdirectories */
+  qsort(dirty, nb_dirty, sizeof(char *), compare_paths);
+
+  start_workers();
+  library_names_begin();
+  begin_chunks();
+  for (i = 0; i < nb_dirty && !interrupted; ++i) {
+    update_directory(dirty[i]);
+  }
+  update_album_images();
+  end_chunks();
+  library_names_end();
+  stop_workers();
+  catalog_update();
+
+  for (i = 0; i < nb_dirty; ++i) {
+    free(dirty[i]);
+  }
+  nb_dirty = 0;
+
+  pthread_mutex_lock(&scan_mutex);
+  thread_running = false;
+  status.active = false;
+  status.end_time = time(NULL);
+  if (restart) {
+    /* scan_start was called meanwhile */
+    restart = 0;
+    interrupted = 0;
+    pthread_mutex_unlock(&scan_mutex);
+    scan_start();
+    return true;
+  }
+  pthread_mutex_unlock(&scan_mutex);
+
+  return true;
+}
+
+static void *watch_thread_func(void *data)
+{
+  char buf[64 * 1024]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  struct pollfd pollfd;
+  char *root;
+  ssize_t n;
+  char *p;
+  int timeout;
+  time_t now, first_event = 0, last_event = 0, next_resync = 0;
+  int resync = config_to_int("scan-resync");
+  bool overflow;
+
+  (void)data;
+
+  /* Updates read their own uncommitted changes */
+  db_writer_thread();
+
+  root = strcopy(config_to_path("music-directory"));
+  if (root[strlen(root) - 1] == '/') {
+    root[strlen(root) - 1] = '\0';
+  }
+  watch_directory(root);
+  free(root);
+
+  musicd_log(LOG_INFO, "scan", "watching music-directory for changes");
+
+  if (resync > 0) {
+    next_resync = time(NULL) + resync * 3600;
+  }
+
+  pollfd.fd = watch_fd;
+  pollfd.events = POLLIN;
+
+  while (1) {
+    /* Wait for more events, until the changes have settled or it's time to
+     * resync */
+    now = time(NULL);
+    timeout = -1;
+    if (nb_dirty > 0) {
+      timeout = last_event + WATCH_DEBOUNCE - now;
+    }
+    if (next_resync && (timeout == -1 || next_resync - now < timeout)) {
+      timeout = next_resync - now;
+    }
+    if (timeout != -1) {
+      timeout = timeout > 0 ? timeout * 1000 : 0;
+    }
+
+    if (poll(&pollfd, 1, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      musicd_perror(LOG_ERROR, "scan", "poll");
+      break;
+    }
+
+    now = time(NULL);
+    overflow = false;
+
+    if (pollfd.revents & POLLIN) {
+      n = read(watch_fd, buf, sizeof(buf));
+      for (p = buf; n > 0 && p < buf + n;
+           p += sizeof(struct inotify_event) + event->len) {
+        event = (struct inotify_event *)p;
+        if (!watch_event(event)) {
+          overflow = true;
+        }
+      }
+      if (nb_dirty > 0) {
+        if (!first_event) {
+          first_event = now;
+        }
+        last_event = now;
+      }
+    }
+
+    if (overflow) {
+      musicd_log(LOG_WARNING, "scan", "missed changes, scanning everything");
+      scan_start();
+    }
+
+    if (nb_dirty > 0 && (now - last_event >= WATCH_DEBOUNCE
+                      || now - first_event >= WATCH_DEBOUNCE_MAX)) {
+      if (update_dirty()) {
+        first_event = 0;
+      } else {
+        /* Scan running, try again later */
+        last_event = now;
+      }
+    }
+
+    if (next_resync && now >= next_resync) {
+      musicd_log(LOG_VERBOSE, "scan", "periodic full scan");
+      scan_start();
+      next_resync = now + resync * 3600;
+    }
+  }
+
+  return NULL;
+}
+
+int scan_watch_start()
+{
+  pthread_t thread;
+
+  if (!config_to_bool("scan-watch")) {
+    return 0;
+  }
+  if (!config_get_value("music-directory")) {
+    return 0;
+  }
+
+  watch_fd = inotify_init();
+  if (watch_fd < 0) {
+    musicd_perror(LOG_ERROR, "scan", "inotify_init");
+    return -1;
+  }
+
+  if (pthread_create(&thread, NULL, watch_thread_func, NULL)) {
+    musicd_perror(LOG_ERROR, "scan", "could not create watch thread");
+    close(watch_fd);
+    watch_fd = -1;
+    return -1;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
+
+#else
+
+int scan_watch_start()
+{
+  if (config_to_bool("scan-watch")) {
+    musicd_log(LOG_WARNING, "scan", "scan-watch is only supported on Linux");
+  }
+  return 0;
+}
+
+#endif
+
 /**
  * Splits @p prefix to an array of strings in @var image_prefixes
  */
@@ -29,6 +29,14 @@ int scan_start();
 
 void scan_stop();
 
+/**
+ * Starts watching music-directory for changes if scan-watch is set, scanning
+ * changed directories as they settle down. Also starts a full scan every
+ * scan-resync hours as a safety net.
+ * @returns 0 if watching or not enabled, nonzero on failure
+ */
+int scan_watch_start();
+
 /**
  * Increments status' new track counter
  */
@@ -19,137 +19,284 @@
 
 #include "client.h"
 #include "config.h"
+#include "event.h"
 #include "log.h"
+#include "metrics.h"
+#include "task.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h> 
 #include <pthread.h>
-#include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_CLIENTS 1024
+/** Maximum number of events fetched from the backend at once */
+#define MAX_EVENTS 64
 
-static int master_sock = -1;
-static pthread_t thread;
+/**
+ * Event loop thread. Every reactor owns its clients, which are processed only
+ * by the reactor's own thread.
+ */
+typedef struct reactor {
+  int id;
+  pthread_t thread;
+  event_loop_t *loop;
+
+  /** Listening socket, either private (SO_REUSEPORT) or shared */
+  int listen_fd;
+
+  /** Completion queue for tasks started by the reactor's clients */
+  task_notify_t tasks;
+
+  struct client_list_t clients;
+  /** Clients disconnected during current event batch, freed after the batch
+   * so that pending events can't refer to freed memory. */
+  struct client_list_t closed_clients;
+  int nb_clients;
+} reactor_t;
+
+static reactor_t *reactors = NULL;
+static int nb_reactors = 0;
 
-static struct client_list_t clients;
-static struct pollfd *poll_fds = NULL;
-static int poll_nfds = 1, nb_clients = 0;
+static int max_clients;
+/** Seconds idle clients are kept open, 0 to keep forever */
+static int idle_timeout;
+/** Clients over all reactors, updated atomically */
+static int total_clients = 0;
 
-static void build_pollfds()
+/**
+ * Synchronizes the event loop registration with the client's current state.
+ */
+static void update_client(client_t *client)
+{
+  event_loop_t *loop = client->reactor->loop;
+  int fd = client_poll_fd(client), events = client_poll_events(client);
+
+  if (fd == client->poll_fd) {
+    if (events != client->poll_events) {
+      event_mod(loop, fd, events, client);
+      client->poll_events = events;
+    }
+    return;
+  }
+
+  if (client->poll_fd >= 0) {
+    event_del(loop, client->poll_fd);
+  }
+  event_add(loop, fd, events, client);
+  client->poll_fd = fd;
+  client->poll_events = events;
+}
+
+static void unregister_client(client_t *client)
+{
+  if (client->poll_fd >= 0) {
+    event_del(client->reactor->loop, client->poll_fd);
+    client->poll_fd = -1;
+  }
+}
+
+static void free_closed_clients(reactor_t *reactor)
 {
-  int i = 0;
   client_t *client;
-  
-  if (poll_fds) {
-    free(poll_fds);
+
+  while ((client = TAILQ_FIRST(&reactor->closed_clients))) {
+    TAILQ_REMOVE(&reactor->closed_clients, client, clients);
+    client_close(client);
   }
-  
-  poll_nfds = nb_clients + 1;
-  poll_fds = calloc(poll_nfds, sizeof(struct pollfd));
-  
-  TAILQ_FOREACH(client, &clients, clients) {
-    poll_fds[i].fd = client_poll_fd(client);
-    poll_fds[i].events = client_poll_events(client);
+}
+
+static void process_client(client_t *client, time_t now)
+{
+  reactor_t *reactor = client->reactor;
 
-    ++i;
+  if (client->disconnected) {
+    return;
   }
-  
-  poll_fds[i].fd = master_sock;
-  poll_fds[i].events = POLLIN;
+
+  /* Keep the list ordered by activity so that expired clients are first */
+  client->last_active = now;
+  TAILQ_REMOVE(&reactor->clients, client, clients);
+  TAILQ_INSERT_TAIL(&reactor->clients, client, clients);
+
+  if (client_process(client)) {
+    musicd_log(LOG_INFO, "server", "client from %s disconnected",
+               client->address);
+    server_del_client(client);
+    return;
+  }
+
+  update_client(client);
 }
 
-static client_t *find_client(int i) {
-  client_t *client = TAILQ_FIRST(&clients);
-  for (; i > 0; --i) {
-    client = TAILQ_NEXT(client, clients);
+/**
+ * Closes idle clients which haven't been active in idle_timeout seconds.
+ */
+static void expire_clients(reactor_t *reactor, time_t now)
+{
+  client_t *client, *next;
+
+  for (client = TAILQ_FIRST(&reactor->clients);
+       client && client->last_active + idle_timeout <= now;
+       client = next) {
+    next = TAILQ_NEXT(client, clients);
+
+    /* Streaming clients or ones waiting for tasks are not idle, even if
+     * nothing has happened in a while. */
+    if (!client_idle(client)) {
+      continue;
+    }
+
+    musicd_log(LOG_VERBOSE, "server", "client from %s timed out",
+               client->address);
+    server_del_client(client);
   }
-  return client;
 }
 
+static client_t *accept_client(reactor_t *reactor)
+{
+  int fd, flags;
+  struct sockaddr_in cli_addr;
+  socklen_t clilen = sizeof(struct sockaddr_in);
+  client_t *client;
+
+  fd = accept(reactor->listen_fd, (struct sockaddr *)&cli_addr, &clilen);
+  if (fd < 0) {
+    /* With a shared socket other reactors race for the same connections */
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      musicd_perror(LOG_ERROR, "server", "can't accept incoming connection");
+    }
+    return NULL;
+  }
+
+  if (__sync_add_and_fetch(&total_clients, 1) > max_clients) {
+    __sync_sub_and_fetch(&total_clients, 1);
+    musicd_log(LOG_VERBOSE, "server",
+               "max-clients (%d) reached, terminating new client",
+               max_clients);
+    close(fd);
+    return NULL;
+  }
+
+  metrics_gauge_add(METRICS_CLIENTS, 1);
+
+  flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  client = client_new(fd);
+  client->address = malloc(INET6_ADDRSTRLEN);
+  client->address[0] = '\0';
+  inet_ntop(cli_addr.sin_family, &(cli_addr.sin_addr), client->address,
+            INET6_ADDRSTRLEN);
+  client->reactor = reactor;
+  server_add_client(client);
+  return client;
+}
 
 static void *thread_func(void *data)
 { 
+  reactor_t *reactor = data;
+  event_t events[MAX_EVENTS];
   int n, i;
   client_t *client;
-  
-  (void)data;
+  task_t *task;
+  time_t now, last_expire = 0;
   
   signal(SIGPIPE, SIG_IGN);
   
   while (1) {
-    n = poll(poll_fds, poll_nfds, -1);
+    n = event_wait(reactor->loop, events, MAX_EVENTS,
+                   idle_timeout > 0 ? 1000 : -1);
 
     if (n == -1) {
-      musicd_perror(LOG_ERROR, "server", "can't poll socket(s)");
-      continue;
-    }
-    
-    if (n == 0) {
+      musicd_perror(LOG_ERROR, "server", "can't wait for events");
       continue;
     }
-    
-    if (poll_fds[nb_clients].revents & POLLIN) {
-      if ((client = server_accept())) {
-        musicd_log(LOG_INFO, "server", "new client from %s", client->address);
-      }
-      continue; /* poll_fds changed */
-    }
 
-    for (i = 0; i < nb_clients; ++i) {
-      if (poll_fds[i].revents & POLLIN
-       || poll_fds[i].revents & POLLOUT) {
-        client = find_client(i);
-        if (client_process(client)) {
-          musicd_log(LOG_INFO, "server", "client from %s disconnected",
-                     client->address);
-          server_del_client(client);
-          break; /* Break, because poll_fds has changed. */
+    now = time(NULL);
+
+    for (i = 0; i < n; ++i) {
+      if (events[i].data == reactor) {
+        while ((client = accept_client(reactor))) {
+          musicd_log(LOG_INFO, "server", "new client from %s (thread %d)",
+                     client->address, reactor->id);
         }
+        continue;
+      }
 
-        poll_fds[i].fd = client_poll_fd(client);
-        poll_fds[i].events = client_poll_events(client);
+      if (events[i].data == &reactor->tasks) {
+        while ((task = task_notify_next(&reactor->tasks))) {
+          client = task->owner;
+          client->wait_done = true;
+          process_client(client, now);
+        }
+        continue;
       }
+
+      process_client(events[i].data, now);
     }
+
+    if (idle_timeout > 0 && now != last_expire) {
+      expire_clients(reactor, now);
+      last_expire = now;
+    }
+
+    free_closed_clients(reactor);
   }
   return NULL;
 }
 
-static int server_bind_tcp(const char *address)
+static int server_bind_tcp(const char *address, bool reuse_port)
 {
   struct sockaddr_in sockaddr;
   struct hostent *host;
-  int port, value;
+  int sock, port, value;
   
   port = config_to_int("port");
   
-  master_sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (master_sock < 0) {
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
     musicd_perror(LOG_ERROR, "server", "can't open socket");
     return -1;
   }
   
   /* Reuse the address even if it is in TIME_WAIT state */
   value = 1;
-  setsockopt(master_sock, SOL_SOCKET, SO_REUSEADDR,
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
              (void *)&value, sizeof(value));
+
+#ifdef SO_REUSEPORT
+  /* Every reactor binds its own socket and the kernel balances connections */
+  if (reuse_port
+   && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                 (void *)&value, sizeof(value))) {
+    musicd_perror(LOG_WARNING, "server", "can't set SO_REUSEPORT");
+    close(sock);
+    return -1;
+  }
+#else
+  (void)reuse_port;
+#endif
   
   if (!address) {
+    bzero(&sockaddr, sizeof(sockaddr));
     sockaddr.sin_addr.s_addr = INADDR_ANY;
   } else {
     bzero(&sockaddr, sizeof(sockaddr));
     host = gethostbyname(address);
     if (!host) {
       musicd_log(LOG_ERROR, "server", "can't resolve address %s", address);
-      close(master_sock);
-      master_sock = -1;
+      close(sock);
       return -1;
     }
     bcopy((char *)host->h_addr_list[0], (char *)&sockaddr.sin_addr.s_addr,
@@ -159,24 +306,22 @@ static int server_bind_tcp(const char *address)
   sockaddr.sin_family = AF_INET;
   sockaddr.sin_port = htons(port);
   
-  if (bind(master_sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
+  if (bind(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
     musicd_perror(LOG_ERROR, "server", "can't bind socket");
-    close(master_sock);
-    master_sock = -1;
+    close(sock);
     return -1;
   }
-  
-  musicd_log(LOG_VERBOSE, "server", "listening on %s:%d", address ? address : "", port);
 
-  return 0;
+  return sock;
 }
 
 static int server_bind_unix(const char *path)
 {
   struct sockaddr_un sockaddr;
+  int sock;
   
-  master_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (master_sock < 0) {
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
     musicd_perror(LOG_ERROR, "server", "can't open socket");
     return -1;
   }
@@ -186,21 +331,32 @@ static int server_bind_unix(const char *path)
   
   unlink(sockaddr.sun_path);
   
-  if (bind(master_sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
+  if (bind(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
     musicd_perror(LOG_ERROR, "server", "can't bind socket");
-    close(master_sock);
-    master_sock = -1;
+    close(sock);
     return -1;
   }
-  
-  musicd_log(LOG_VERBOSE, "server", "listening on %s", path);
 
-  return 0;
+  return sock;
 }
 
-static int server_bind()
+/**
+ * @returns true if 'bind' refers to a TCP address instead of a unix socket
+ */
+static bool bind_is_tcp()
+{
+  const char *bind = config_get("bind");
+  return !strcmp(bind, "any") || (bind[0] >= '0' && bind[0] <= '9');
+}
+
+/**
+ * Binds, listens and sets nonblocking mode on a new socket.
+ * @returns the socket or -1 on error
+ */
+static int server_listen(bool reuse_port)
 {
   const char *bind;
+  int sock;
   
   bind = config_get("bind");
   if (strlen(bind) == 0) {
@@ -209,94 +365,127 @@ static int server_bind()
   }
   
   if (!strcmp(bind, "any")) {
-    return server_bind_tcp(NULL);
-  }
-  
-  if (bind[0] >= '0' && bind[0] <= '9') {
-    return server_bind_tcp(bind);
+    sock = server_bind_tcp(NULL, reuse_port);
+  } else if (bind_is_tcp()) {
+    sock = server_bind_tcp(bind, reuse_port);
+  } else {
+    /* It is not 'any', and does not begin with a number, assume it is a unix
+     * socket path. */
+    sock = server_bind_unix(config_to_path("bind"));
   }
-  
-  /* It is not 'any', and does not begin with a number, assume it is a unix
-   * socket path. */
-  bind = config_to_path("bind");
-  return server_bind_unix(bind);
-}
 
-int server_start()
-{
-  int result;
-  
-  result = server_bind();
-  if (result) {
-    return result;
-  }
-  
-  TAILQ_INIT(&clients);
-  build_pollfds();
-  
-  if (listen(master_sock, SOMAXCONN)) {
-    musicd_perror(LOG_ERROR, "server", "listen: ");
-    close(master_sock);
-    master_sock = -1;
+  if (sock < 0) {
     return -1;
   }
-  
-  if (pthread_create(&thread, NULL, thread_func, NULL)) {
-    musicd_perror(LOG_ERROR, "server", "can't create thread");
-    close(master_sock);
-    master_sock = -1;
+
+  if (listen(sock, SOMAXCONN)) {
+    musicd_perror(LOG_ERROR, "server", "listen: ");
+    close(sock);
     return -1;
   }
-  
-  return 0;
+
+  /* Accept is done until it would block, so the socket must not block */
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+  return sock;
 }
 
-client_t *server_accept()
+int server_start()
 {
-  int fd, flags;
-  struct sockaddr_in cli_addr;
-  socklen_t clilen = sizeof(struct sockaddr_in);
-  client_t *client;
+  int i, shared_fd;
+  bool reuse_port = false;
+  reactor_t *reactor;
 
-  fd = accept(master_sock, (struct sockaddr *)&cli_addr, &clilen);
-  if (fd < 0) {
-    musicd_perror(LOG_ERROR, "server", "can't accept incoming connection");
-    abort();
-    return NULL;
+  max_clients = config_to_int("max-clients");
+  idle_timeout = config_to_int("keep-alive-timeout");
+  nb_reactors = config_to_int("server-threads");
+  if (nb_reactors < 1) {
+    nb_reactors = 1;
   }
 
-  if (nb_clients + 1 > MAX_CLIENTS) {
-    musicd_log(LOG_VERBOSE, "server",
-               "MAX_CLIENTS reached (%d > %d), terminating new client",
-               nb_clients + 1, MAX_CLIENTS);
-    close(fd);
-    return NULL;
+#ifdef SO_REUSEPORT
+  reuse_port = nb_reactors > 1 && bind_is_tcp();
+#endif
+
+  shared_fd = server_listen(reuse_port);
+  if (shared_fd < 0 && reuse_port) {
+    musicd_log(LOG_WARNING, "server",
+               "SO_REUSEPORT unavailable, sharing one listening socket");
+    reuse_port = false;
+    shared_fd = server_listen(false);
+  }
+  if (shared_fd < 0) {
+    return -1;
   }
 
-  flags = fcntl(fd, F_GETFL, 0);
-  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  reactors = calloc(nb_reactors, sizeof(reactor_t));
 
-  client = client_new(fd);
-  client->address = malloc(INET6_ADDRSTRLEN);
-  client->address[0] = '\0';
-  inet_ntop(cli_addr.sin_family, &(cli_addr.sin_addr), client->address,
-            INET6_ADDRSTRLEN);
-  server_add_client(client);
-  return client;
+  for (i = 0; i < nb_reactors; ++i) {
+    reactor = &reactors[i];
+    reactor->id = i;
+    TAILQ_INIT(&reactor->clients);
+    TAILQ_INIT(&reactor->closed_clients);
+
+    reactor->listen_fd = shared_fd;
+    if (i > 0 && reuse_port) {
+      reactor->listen_fd = server_listen(true);
+      if (reactor->listen_fd < 0) {
+        reactor->listen_fd = shared_fd;
+      }
+    }
+
+    reactor->loop = event_loop_new();
+    if (!reactor->loop
+     || task_notify_init(&reactor->tasks)
+     || event_add(reactor->loop, reactor->listen_fd, EVENT_IN, reactor)
+     || event_add(reactor->loop, task_notify_fd(&reactor->tasks), EVENT_IN,
+                  &reactor->tasks)) {
+      musicd_log(LOG_ERROR, "server", "can't initialize event loop");
+      return -1;
+    }
+
+    if (pthread_create(&reactor->thread, NULL, thread_func, reactor)) {
+      musicd_perror(LOG_ERROR, "server", "can't create thread");
+      return -1;
+    }
+  }
+
+  if (bind_is_tcp()) {
+    musicd_log(LOG_VERBOSE, "server", "listening on %s:%d",
+               config_get("bind"), config_to_int("port"));
+  } else {
+    musicd_log(LOG_VERBOSE, "server", "listening on %s",
+               config_to_path("bind"));
+  }
+  musicd_log(LOG_VERBOSE, "server",
+             "%d thread(s) using %s event backend%s, max %d clients",
+             nb_reactors, event_backend(),
+             reuse_port ? " and SO_REUSEPORT" : "", max_clients);
+  
+  return 0;
 }
 
 void server_add_client(client_t *client)
 {
-  TAILQ_INSERT_TAIL(&clients, client, clients);
-  ++nb_clients;
-  build_pollfds();
+  reactor_t *reactor = client->reactor;
+
+  TAILQ_INSERT_TAIL(&reactor->clients, client, clients);
+  ++reactor->nb_clients;
+  client->task_notify = &reactor->tasks;
+  client->poll_fd = -1;
+  client->last_active = time(NULL);
+  update_client(client);
 }
 
 void server_del_client(client_t *client)
 { 
-  TAILQ_REMOVE(&clients, client, clients);
-  client_close(client);
-  --nb_clients;
-  build_pollfds();
-}
+  reactor_t *reactor = client->reactor;
 
+  unregister_client(client);
+  TAILQ_REMOVE(&reactor->clients, client, clients);
+  client->disconnected = true;
+  TAILQ_INSERT_TAIL(&reactor->closed_clients, client, clients);
+  --reactor->nb_clients;
+  __sync_sub_and_fetch(&total_clients, 1);
+  metrics_gauge_add(METRICS_CLIENTS, -1);
+}
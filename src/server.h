@@ -20,11 +20,21 @@
 
 #include "client.h"
 
+/**
+ * Binds the listening socket(s) and starts server-threads event loop threads.
+ */
 int server_start();
 int server_stop();
 
-client_t *server_accept();
+/**
+ * Adds @p client to the event loop of client->reactor. Must be called from
+ * that reactor's thread.
+ */
 void server_add_client(client_t *client);
+/**
+ * Unregisters @p client, it is freed after the current event batch. Must be
+ * called from the reactor's own thread.
+ */
 void server_del_client(client_t *client);
 
 #endif
@@ -15,59 +15,248 @@
  * You should have received a copy of the GNU General Public License
  * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include "session.h"
 
+#include "config.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
 
-#include <inttypes.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+/*
+ * Sessions are split in shards by id, each with its own lock, hash table,
+ * least recently used list and expiry wheel. A request only locks the shard
+ * of its own session.
+ *
+ * The wheel has a slot per tick, and each session sits in the slot of the
+ * tick it expires on. Expired sessions are collected by walking the slots
+ * that have passed since the last request to the shard.
+ */
+
+#define SHARDS 16
+#define SHARD_SESSIONS (MAX_SESSIONS / SHARDS)
+#define BUCKETS 1024
+#define WHEEL_SLOTS 64
+
+typedef struct shard {
+  pthread_mutex_t mutex;
+  session_t *buckets[BUCKETS];
+  /* Most recently used first */
+  session_t *first, *last;
+  session_t *wheel[WHEEL_SLOTS];
+  /* Next tick to expire */
+  int64_t tick;
+  int n;
+} shard_t;
 
-static session_t *sessions = NULL;
-static int n_sessions = 0;
-static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shard_t shards[SHARDS];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+/* Seconds, 0 if sessions don't expire */
+static time_t timeout;
+static time_t tick_length;
+static int random_fd = -1;
 
-static session_t *get_session(const char *id)
+static void init()
 {
-  session_t *session;
+  int i;
+  time_t now = time(NULL);
 
-  if (!sessions) {
-    return NULL;
+  timeout = (time_t)config_to_int("session-timeout") * 3600;
+  if (timeout > 0) {
+    /* A session expires at most WHEEL_SLOTS - 1 ticks from now */
+    tick_length = (timeout + WHEEL_SLOTS - 3) / (WHEEL_SLOTS - 2);
+  }
+
+  for (i = 0; i < SHARDS; ++i) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+    if (timeout > 0) {
+      shards[i].tick = now / tick_length;
+    }
+  }
+
+  random_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (random_fd < 0) {
+    musicd_perror(LOG_FATAL, "session", "can't open /dev/urandom");
+    abort();
+  }
+}
+
+static session_t **get_bucket(shard_t *shard, uint32_t hash)
+{
+  return &shard->buckets[(hash / SHARDS) % BUCKETS];
+}
+
+static void generate_session_id(char *id)
+{
+  unsigned char bytes[SESSION_ID_LENGTH / 2];
+  size_t done = 0;
+  ssize_t n;
+  int i;
+
+  while (done < sizeof(bytes)) {
+    n = read(random_fd, bytes + done, sizeof(bytes) - done);
+    if (n <= 0) {
+      musicd_perror(LOG_FATAL, "session", "can't read /dev/urandom");
+      abort();
+    }
+    done += n;
   }
 
-  for (session = sessions; session != NULL; session = session->next) {
+  for (i = 0; i < (int)sizeof(bytes); ++i) {
+    sprintf(id + i * 2, "%02x", bytes[i]);
+  }
+}
+
+static void lru_unlink(shard_t *shard, session_t *session)
+{
+  if (session->prev) {
+    session->prev->next = session->next;
+  } else {
+    shard->first = session->next;
+  }
+  if (session->next) {
+    session->next->prev = session->prev;
+  } else {
+    shard->last = session->prev;
+  }
+  session->prev = session->next = NULL;
+}
+
+static void lru_push(shard_t *shard, session_t *session)
+{
+  session->prev = NULL;
+  session->next = shard->first;
+  if (shard->first) {
+    shard->first->prev = session;
+  } else {
+    shard->last = session;
+  }
+  shard->first = session;
+}
+
+static void wheel_unlink(shard_t *shard, session_t *session)
+{
+  if (session->wheel_prev) {
+    session->wheel_prev->wheel_next = session->wheel_next;
+  } else {
+    shard->wheel[session->slot] = session->wheel_next;
+  }
+  if (session->wheel_next) {
+    session->wheel_next->wheel_prev = session->wheel_prev;
+  }
+  session->wheel_prev = session->wheel_next = NULL;
+}
+
+static void wheel_insert(shard_t *shard, session_t *session, int64_t tick)
+{
+  session->slot = tick % WHEEL_SLOTS;
+  session->wheel_prev = NULL;
+  session->wheel_next = shard->wheel[session->slot];
+  if (session->wheel_next) {
+    session->wheel_next->wheel_prev = session;
+  }
+  shard->wheel[session->slot] = session;
+}
+
+static session_t *find_session(shard_t *shard, const char *id, uint32_t hash)
+{
+  session_t *session;
+
+  for (session = *get_bucket(shard, hash); session;
+       session = session->hash_next) {
     if (!strcmp(session->id, id)) {
-      session->last_request = time(NULL);
       return session;
     }
   }
   return NULL;
 }
 
-static char *generate_session_id()
+static void touch_session(shard_t *shard, session_t *session, time_t now)
 {
-  char *id = NULL;
-
-  do {
-    free(id);
-    id = stringf("%" PRIx64 "%x", (int64_t)time(NULL), rand());
-  } while (get_session(id));
- 
-  return id;
+  session->last_request = now;
+
+  if (shard->first != session) {
+    lru_unlink(shard, session);
+    lru_push(shard, session);
+  }
+
+  if (timeout > 0
+   && session->slot != ((now + timeout) / tick_length) % WHEEL_SLOTS) {
+    wheel_unlink(shard, session);
+    wheel_insert(shard, session, (now + timeout) / tick_length);
+  }
+}
+
+static void remove_session(shard_t *shard, session_t *session)
+{
+  session_t **ptr;
+
+  for (ptr = get_bucket(shard, strhash(session->id)); *ptr;
+       ptr = &(*ptr)->hash_next) {
+    if (*ptr == session) {
+      *ptr = session->hash_next;
+      break;
+    }
+  }
+  lru_unlink(shard, session);
+  if (timeout > 0) {
+    wheel_unlink(shard, session);
+  }
+
+  free(session->user);
+  free(session);
+
+  --shard->n;
+  metrics_gauge_add(METRICS_SESSIONS, -1);
 }
 
-static int purge_oldest_session()
+/**
+ * Removes sessions of the ticks passed since the last call. Expired sessions
+ * that are still in use are looked at again on the next tick.
+ */
+static void expire_sessions(shard_t *shard, time_t now)
 {
-  session_t *p, *oldest = NULL;
-  for (p = sessions; p; p = p->next) {
-    if (!oldest || (p->last_request < oldest->last_request && p->refs == 0)) {
-      oldest = p;
+  int64_t tick = now / tick_length;
+  session_t *session, *next;
+  int i;
+
+  if (timeout <= 0) {
+    return;
+  }
+
+  for (i = 0; shard->tick < tick && i < WHEEL_SLOTS; ++shard->tick, ++i) {
+    for (session = shard->wheel[shard->tick % WHEEL_SLOTS]; session;
+         session = next) {
+      next = session->wheel_next;
+      if (session->last_request + timeout > now) {
+        continue;
+      }
+      if (session->refs > 0) {
+        wheel_unlink(shard, session);
+        wheel_insert(shard, session, tick + 1);
+        continue;
+      }
+      musicd_log(LOG_DEBUG, "session", "session %s expired", session->id);
+      remove_session(shard, session);
     }
   }
+  shard->tick = tick;
+}
+
+static int purge_oldest_session(shard_t *shard)
+{
+  session_t *oldest;
+
+  for (oldest = shard->last; oldest && oldest->refs > 0;
+       oldest = oldest->prev) { }
 
   if (!oldest) {
     /* This block shouldn't execute without a bug related to dereferencing */
@@ -79,69 +268,98 @@ static int purge_oldest_session()
   musicd_log(LOG_DEBUG, "session", "MAX_SESSIONS reached, purging %s",
              oldest->id);
 
-  if (oldest->prev) {
-    oldest->prev->next = oldest->next;
-  }
-  if (oldest->next) {
-    oldest->next->prev = oldest->prev;
-  }
-  if (sessions == oldest) {
-    sessions = oldest->next;
-  }
-
-  free(oldest->id);
-  free(oldest);
-
-  --n_sessions;
+  remove_session(shard, oldest);
   return 0;
 }
 
 session_t *session_new()
 {
-  pthread_mutex_lock(&session_mutex);
+  session_t *session = malloc(sizeof(session_t));
+  session_t **bucket;
+  shard_t *shard;
+  uint32_t hash;
+  time_t now = time(NULL);
 
-  while (n_sessions >= MAX_SESSIONS && !purge_oldest_session()) { }
+  pthread_once(&init_once, init);
 
-  session_t *session = malloc(sizeof(session_t));
   memset(session, 0, sizeof(session_t));
-
-  session->id = generate_session_id();
   session->refs = 1;
+  session->last_request = now;
+
+  while (1) {
+    generate_session_id(session->id);
+    hash = strhash(session->id);
+    session->shard = hash % SHARDS;
+    shard = &shards[session->shard];
+
+    pthread_mutex_lock(&shard->mutex);
+    if (!find_session(shard, session->id, hash)) {
+      break;
+    }
+    /* 128 random bits colliding, not going to happen */
+    pthread_mutex_unlock(&shard->mutex);
+  }
+
+  expire_sessions(shard, now);
+  if (shard->n >= SHARD_SESSIONS) {
+    purge_oldest_session(shard);
+  }
 
   musicd_log(LOG_DEBUG, "session", "new session %s", session->id);
 
-  if (sessions) {
-    session->next = sessions;
-    sessions->prev = session;
+  bucket = get_bucket(shard, hash);
+  session->hash_next = *bucket;
+  *bucket = session;
+  lru_push(shard, session);
+  if (timeout > 0) {
+    wheel_insert(shard, session, (now + timeout) / tick_length);
   }
-  sessions = session;
 
-  ++n_sessions;
+  ++shard->n;
+  metrics_gauge_add(METRICS_SESSIONS, 1);
 
-  pthread_mutex_unlock(&session_mutex);
+  pthread_mutex_unlock(&shard->mutex);
   return session;
 }
 
 session_t *session_get(const char *id)
 {  
   session_t *session;
+  shard_t *shard;
+  uint32_t hash;
+  time_t now;
 
-  pthread_mutex_lock(&session_mutex);
-  session = get_session(id);
+  if (strlen(id) != SESSION_ID_LENGTH) {
+    return NULL;
+  }
+
+  pthread_once(&init_once, init);
+
+  now = time(NULL);
+  hash = strhash(id);
+  shard = &shards[hash % SHARDS];
+
+  pthread_mutex_lock(&shard->mutex);
+  expire_sessions(shard, now);
+  session = find_session(shard, id, hash);
   if (session) {
+    touch_session(shard, session, now);
     ++session->refs;
   }
-  pthread_mutex_unlock(&session_mutex);
+  pthread_mutex_unlock(&shard->mutex);
 
   return session;
 }
 
 void session_deref(session_t *session)
 {
+  shard_t *shard;
+
   if (!session) {
     return;
   }
-  pthread_mutex_lock(&session_mutex);
+  shard = &shards[session->shard];
+  pthread_mutex_lock(&shard->mutex);
   --session->refs;
-  pthread_mutex_unlock(&session_mutex);
+  pthread_mutex_unlock(&shard->mutex);
 }
@@ -23,8 +23,11 @@
 
 #define MAX_SESSIONS 10000
 
+/** Hex digits of 128 random bits */
+#define SESSION_ID_LENGTH 32
+
 typedef struct session {
-  char *id;
+  char id[SESSION_ID_LENGTH + 1];
   time_t last_request;
 
   /** User or NULL if share */
@@ -32,7 +35,13 @@ typedef struct session {
 
   int refs;
 
+  /* Private */
+  int shard;
+  int slot;
+  /* Least recently used order, hash bucket and expiry wheel slot */
   struct session *prev, *next;
+  struct session *hash_next;
+  struct session *wheel_prev, *wheel_next;
 } session_t;
 
 
@@ -17,9 +17,19 @@
  */
 #include "stream.h"
 
+#include "codec_pool.h"
+#include "config.h"
+#include "gain.h"
+#include "library.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
 
+#include <math.h>
+
+/** Muxer output buffer, large enough that packets arrive in one write */
+#define STREAM_IOBUF_SIZE (32 * 1024)
+
 static double dict_to_double(AVDictionary *dict, const char *key)
 {
   AVDictionaryEntry *entry;
@@ -55,25 +65,26 @@ void stream_close(stream_t *stream)
   }
 
   track_free(stream->track);
+  free(stream->seek_index);
 
   av_free_packet(&stream->src_packet);
   av_free_packet(&stream->encode_packet);
 
-  av_frame_free(&stream->decode_frame);
-  av_frame_free(&stream->resample_frame);
-  av_frame_free(&stream->encode_frame);
+  codec_pool_frame_release(stream->decode_frame);
+  codec_pool_frame_release(stream->resample_frame);
+  codec_pool_frame_release(stream->encode_frame);
 
-  av_audio_fifo_free(stream->src_buf);
+  if (stream->encoder) {
+    codec_pool_fifo_release(stream->src_buf, stream->encoder->sample_fmt,
+                            stream->encoder->channels);
+  }
 
-  resampler_free(&stream->resampler);
+  codec_pool_resampler_release(stream->resampler);
   
   if (stream->decoder) {
     avcodec_close(stream->decoder);
   }
-  if (stream->encoder) {
-    avcodec_close(stream->encoder);
-    av_free(stream->encoder);
-  }
+  codec_pool_encoder_release(stream->encoder);
 
   av_free(stream->dst_iobuf);
   av_free(stream->dst_ioctx);
@@ -143,12 +154,24 @@ bool stream_open(stream_t *stream, track_t* track)
     stream->src_codec_type = CODEC_TYPE_MP3;
   } else if (stream->src_codec->id == AV_CODEC_ID_VORBIS) {
     stream->src_codec_type = CODEC_TYPE_OGG_VORBIS;
+  } else if (stream->src_codec->id == AV_CODEC_ID_FLAC) {
+    stream->src_codec_type = CODEC_TYPE_FLAC;
+  } else if (stream->src_codec->id == AV_CODEC_ID_AAC) {
+    stream->src_codec_type = CODEC_TYPE_AAC;
+  } else if (stream->src_codec->id == AV_CODEC_ID_OPUS) {
+    stream->src_codec_type = CODEC_TYPE_OPUS;
   } else {
     stream->src_codec_type = CODEC_TYPE_OTHER;
   }
 
   format_from_av(stream->src_ctx->streams[0]->codec, &stream->format);
 
+  if (track->fileid > 0) {
+    stream->seek_index = library_seek_index(track->fileid,
+                                            &stream->seek_interval,
+                                            &stream->seek_index_size);
+  }
+
   /* Replay gain: test container metadata, then stream metadata. */
   find_replay_gain(stream, stream->src_ctx->metadata);
   if (stream->replay_track_gain == 0.0 && stream->replay_track_gain == 0.0) {
@@ -166,6 +189,55 @@ bool stream_open(stream_t *stream, track_t* track)
   return true;
 }
 
+/**
+ * @returns linear gain for the configured replaygain mode, or 0 if disabled
+ * or the stream has no gain information
+ */
+static float replaygain_factor(stream_t *stream)
+{
+  const char *mode = config_get("replaygain");
+  double gain, peak, factor;
+
+  if (!strcmp(mode, "album") && stream->replay_album_gain != 0.0) {
+    gain = stream->replay_album_gain;
+    peak = stream->replay_album_peak;
+  } else if (!strcmp(mode, "track") || !strcmp(mode, "album")) {
+    gain = stream->replay_track_gain;
+    peak = stream->replay_track_peak;
+  } else {
+    return 0;
+  }
+  if (gain == 0.0) {
+    return 0;
+  }
+
+  factor = pow(10, (gain + config_to_double("replaygain-preamp")) / 20);
+  if (peak > 0 && factor * peak > 1.0) {
+    /* Clipping prevention */
+    factor = 1.0 / peak;
+  }
+  return factor;
+}
+
+static void apply_gain(stream_t *stream, uint8_t **data, int nb_samples,
+                       enum AVSampleFormat fmt, int channels)
+{
+  int i, planes = 1, n = nb_samples * channels;
+
+  if (av_sample_fmt_is_planar(fmt)) {
+    planes = channels;
+    n = nb_samples;
+  }
+
+  for (i = 0; i < planes; ++i) {
+    if (fmt == AV_SAMPLE_FMT_FLT || fmt == AV_SAMPLE_FMT_FLTP) {
+      gain_apply_float((float *)data[i], n, stream->gain);
+    } else if (fmt == AV_SAMPLE_FMT_S16 || fmt == AV_SAMPLE_FMT_S16P) {
+      gain_apply_s16((int16_t *)data[i], n, stream->gain);
+    }
+  }
+}
+
 static
 enum AVSampleFormat
 find_common_sample_fmt(const enum AVSampleFormat *fmts1,
@@ -237,6 +309,7 @@ bool stream_transcode(stream_t *stream, codec_type_t codec_type, int bitrate)
   enum AVSampleFormat dst_sample_fmt;
   int dst_sample_rate;
   resampler_t *resampler = NULL;
+  codec_params_t src_params, dst_params;
 
   if (codec_type == CODEC_TYPE_MP3) {
     dst_codec_id = AV_CODEC_ID_MP3;
@@ -287,17 +360,22 @@ bool stream_transcode(stream_t *stream, codec_type_t codec_type, int bitrate)
     decoder->channel_layout = av_get_default_channel_layout(decoder->channels);
   }
 
-  encoder = avcodec_alloc_context3(dst_codec);
-  encoder->sample_rate = dst_sample_rate;
-  encoder->channels = decoder->channels;
-  encoder->sample_fmt = dst_sample_fmt;
-  encoder->channel_layout = decoder->channel_layout;
-  encoder->bit_rate = bitrate;
+  memset(&src_params, 0, sizeof(codec_params_t));
+  src_params.sample_rate = decoder->sample_rate;
+  src_params.channels = decoder->channels;
+  src_params.channel_layout = decoder->channel_layout;
+  src_params.sample_fmt = decoder->sample_fmt;
 
-  result = avcodec_open2(encoder, dst_codec, NULL);
-  if (result < 0) {
-    musicd_log(LOG_ERROR, "stream", "can't open encoder: %s",
-               strerror(AVUNERROR(result)));
+  memset(&dst_params, 0, sizeof(codec_params_t));
+  dst_params.codec_id = dst_codec_id;
+  dst_params.sample_rate = dst_sample_rate;
+  dst_params.channels = decoder->channels;
+  dst_params.channel_layout = decoder->channel_layout;
+  dst_params.sample_fmt = dst_sample_fmt;
+  dst_params.bit_rate = bitrate;
+
+  encoder = codec_pool_encoder(dst_codec, &dst_params);
+  if (!encoder) {
     goto fail;
   }
 
@@ -305,18 +383,8 @@ bool stream_transcode(stream_t *stream, codec_type_t codec_type, int bitrate)
       decoder->sample_fmt != encoder->sample_fmt ||
       decoder->sample_rate != encoder->sample_rate) {
 
-    resampler = resampler_alloc();
-    av_opt_set_int(resampler, "in_channel_layout", decoder->channel_layout, 0);
-    av_opt_set_int(resampler, "out_channel_layout", encoder->channel_layout, 0);
-    av_opt_set_int(resampler, "in_sample_rate", decoder->sample_rate, 0);
-    av_opt_set_int(resampler, "out_sample_rate", encoder->sample_rate, 0);
-    av_opt_set_int(resampler, "in_sample_fmt", decoder->sample_fmt, 0);
-    av_opt_set_int(resampler, "out_sample_fmt", encoder->sample_fmt, 0);
-
-    result = resampler_init(resampler);
-    if (result < 0) {
-      musicd_log(LOG_ERROR, "stream", "can't open resampler: %s",
-               strerror(AVUNERROR(result)));
+    resampler = codec_pool_resampler(&src_params, &dst_params);
+    if (!resampler) {
       goto fail;
     }
     musicd_log(LOG_DEBUG, "stream",
@@ -334,20 +402,26 @@ bool stream_transcode(stream_t *stream, codec_type_t codec_type, int bitrate)
   stream->resampler = resampler;
   format_from_av(encoder, &stream->format);
 
-  stream->src_buf = av_audio_fifo_alloc(encoder->sample_fmt, encoder->channels, encoder->frame_size);
+  stream->gain = replaygain_factor(stream);
+  if (stream->gain) {
+    musicd_log(LOG_DEBUG, "stream", "gain %f (%s)", stream->gain, gain_simd());
+  }
+
+  stream->src_buf = codec_pool_fifo(encoder->sample_fmt, encoder->channels,
+                                    encoder->frame_size);
 
-  stream->decode_frame = av_frame_alloc();
+  stream->decode_frame = codec_pool_frame();
 
   if (stream->resampler) {
     /* The buffer will be allocated dynamically */
-    stream->resample_frame = av_frame_alloc();
+    stream->resample_frame = codec_pool_frame();
   }
 
   int buf_size = av_samples_get_buffer_size(NULL, stream->encoder->channels,
                                                   stream->encoder->frame_size,
                                                   stream->encoder->sample_fmt, 0);
   stream->encode_buf = av_mallocz(buf_size);
-  stream->encode_frame = av_frame_alloc();
+  stream->encode_frame = codec_pool_frame();
   stream->encode_frame->nb_samples = stream->encoder->frame_size;
   avcodec_fill_audio_frame(stream->encode_frame,
                            stream->encoder->channels,
@@ -359,16 +433,42 @@ fail:
   if (decoder) {
     avcodec_close(decoder);
   }
-  if (encoder) {
-    avcodec_close(encoder);
-    av_free(encoder);
-  }
+  codec_pool_encoder_release(encoder);
   if (resampler) {
     resampler_free(&resampler);
   }
   return false;
 }
 
+bool stream_copy(stream_t *stream, codec_type_t codec_type, int bitrate)
+{
+  AVCodecContext *src = stream->src_ctx->streams[0]->codec;
+  int64_t src_bitrate = src->bit_rate ? src->bit_rate
+                                      : stream->src_ctx->bit_rate;
+
+  if (stream->src_codec_type != codec_type) {
+    return false;
+  }
+
+  if (replaygain_factor(stream)) {
+    /* Gain can only be applied to decoded samples */
+    return false;
+  }
+
+  if (codec_type != CODEC_TYPE_FLAC
+   && (src_bitrate <= 0 || src_bitrate > bitrate)) {
+    /* Unknown or too high, transcode to be sure */
+    return false;
+  }
+
+  musicd_log(LOG_DEBUG, "stream", "copying %" PRId64 " bps source",
+             src_bitrate);
+
+  stream->copy = true;
+  stream->dst_codec_type = codec_type;
+  return true;
+}
+
 bool stream_remux(stream_t *stream,
                    int (*write)(void *opaque, uint8_t *buf, int buf_size),
                    void *opaque)
@@ -416,11 +516,18 @@ bool stream_remux(stream_t *stream,
   av_dict_set(&dst_ctx->metadata, "artist", stream->track->artist, 0);
   av_dict_set(&dst_ctx->metadata, "album", stream->track->album, 0);
   
-  avcodec_copy_context(dst_stream->codec, stream->encoder);
+  if (stream->copy) {
+    avcodec_copy_context(dst_stream->codec,
+                         stream->src_ctx->streams[0]->codec);
+    dst_stream->codec->codec_tag = 0;
+  } else {
+    avcodec_copy_context(dst_stream->codec, stream->encoder);
+  }
 
-  dst_iobuf = av_mallocz(4096);
+  dst_iobuf = av_mallocz(STREAM_IOBUF_SIZE);
   dst_ioctx =
-    avio_alloc_context(dst_iobuf, 4096, 1, opaque, NULL, write, NULL);
+    avio_alloc_context(dst_iobuf, STREAM_IOBUF_SIZE, 1, opaque, NULL, write,
+                       NULL);
   if (!dst_ioctx) {
     musicd_log(LOG_ERROR, "stream", "avio_alloc_context failed");
     av_free(dst_iobuf);
@@ -447,11 +554,14 @@ int stream_start(stream_t *stream)
 static int read_next(stream_t *stream)
 {
   int result;
+  int64_t start;
   
   while (1) {
     av_free_packet(&stream->src_packet);
 
+    start = metrics_now();
     result = av_read_frame(stream->src_ctx, &stream->src_packet);
+    metrics_time(METRICS_STREAM_READ, start);
     if (result < 0) {
       if (result == AVERROR_EOF) {
         /* end of file */
@@ -465,9 +575,26 @@ static int read_next(stream_t *stream)
     if (stream->src_packet.stream_index != 0) {
       continue;
     }
+
+    if (stream->seek_skip > 0) {
+      /* Dropping packets up to the exact seek position */
+      if (stream->src_packet.pts != AV_NOPTS_VALUE
+       && stream->src_packet.pts
+          * av_q2d(stream->src_ctx->streams[0]->time_base)
+          < stream->seek_skip) {
+        continue;
+      }
+      stream->seek_skip = 0;
+    }
     break;
   }
 
+  if (stream->src_packet.pts != AV_NOPTS_VALUE) {
+    stream->pts =
+      (stream->src_packet.pts * av_q2d(stream->src_ctx->streams[0]->time_base)
+       - stream->track->start) * AV_TIME_BASE;
+  }
+
   if (stream->src_packet.pts * av_q2d(stream->src_ctx->streams[0]->time_base) >
       stream->track->start + stream->track->duration) {
     if (stream->track->cuefile) {
@@ -484,6 +611,7 @@ static int read_next(stream_t *stream)
 static int decode_next(stream_t *stream)
 {
   int result, got_frame;
+  int64_t start;
   AVFrame *frame = stream->decode_frame;
 
   result = read_next(stream);
@@ -493,8 +621,10 @@ static int decode_next(stream_t *stream)
 
   av_frame_unref(frame);
 
+  start = metrics_now();
   result = avcodec_decode_audio4(stream->decoder, frame,
                                  &got_frame, &stream->src_packet);
+  metrics_time(METRICS_STREAM_DECODE, start);
 
   if (result < 0) {
     /* Decoding right after seeking, especially with mp3, might fail because
@@ -537,16 +667,27 @@ static int decode_next(stream_t *stream)
                                         stream->encoder->sample_fmt,
                                         stream->resample_buf, buf_size, 0);
     }
+    start = metrics_now();
     result = resampler_convert(stream->resampler,
                                stream->resample_frame->extended_data,
                                stream->resample_frame->nb_samples,
                                (const uint8_t **)frame->extended_data,
                                frame->nb_samples);
+    metrics_time(METRICS_STREAM_RESAMPLE, start);
+
+    if (stream->gain) {
+      apply_gain(stream, stream->resample_frame->extended_data, result,
+                 stream->encoder->sample_fmt, stream->encoder->channels);
+    }
 
     av_audio_fifo_write(stream->src_buf,
                         (void **)stream->resample_frame->extended_data,
                         result);
   } else {
+    if (stream->gain) {
+      apply_gain(stream, frame->extended_data, frame->nb_samples,
+                 stream->decoder->sample_fmt, stream->decoder->channels);
+    }
     av_audio_fifo_write(stream->src_buf,
                         (void **)frame->extended_data,
                         frame->nb_samples);
@@ -558,6 +699,7 @@ static int decode_next(stream_t *stream)
 static int encode_next(stream_t *stream)
 {
   int result, got_packet;
+  int64_t start;
   AVFrame *frame = stream->encode_frame;
   AVPacket *packet = &stream->encode_packet;
 
@@ -574,7 +716,9 @@ static int encode_next(stream_t *stream)
 
   av_free_packet(packet);
 
+  start = metrics_now();
   result = avcodec_encode_audio2(stream->encoder, packet, frame, &got_packet);
+  metrics_time(METRICS_STREAM_ENCODE, start);
 
   if (result < 0) {
     musicd_log(LOG_ERROR, "stream", "can't encode: %s",
@@ -595,7 +739,7 @@ static int encode_next(stream_t *stream)
 static int get_next(stream_t *stream)
 {
   int result;
-  if (stream->dst_codec_type) {
+  if (stream->encoder) {
     do {
       result = encode_next(stream);
       if (result <= 0) {
@@ -617,6 +761,7 @@ static int get_next(stream_t *stream)
 static int mux_next(stream_t *stream)
 {
   int result;
+  int64_t start;
   AVPacket packet;
 
   do {
@@ -624,15 +769,28 @@ static int mux_next(stream_t *stream)
     if (result <= 0) {
       return result;
     }
-  } while (stream->dst_size == 0);
+  } while (stream->size == 0);
 
   av_init_packet(&packet);
-  packet.data = stream->dst_data;
-  packet.size = stream->dst_size;
+  packet.data = stream->data;
+  packet.size = stream->size;
   /*packet.pts = stream->pts;*/ /* FIXME: proper PTS/DTS handling */
   packet.stream_index = 0;
 
+  if (stream->copy) {
+    /* Source timestamps are relative to the file, not the track */
+    packet.pts = av_rescale_q(stream->pts, AV_TIME_BASE_Q,
+                              stream->dst_ctx->streams[0]->time_base);
+    packet.dts = packet.pts;
+    packet.duration =
+      av_rescale_q(stream->src_packet.duration,
+                   stream->src_ctx->streams[0]->time_base,
+                   stream->dst_ctx->streams[0]->time_base);
+  }
+
+  start = metrics_now();
   result = av_interleaved_write_frame(stream->dst_ctx, &packet);
+  metrics_time(METRICS_STREAM_MUX, start);
   if (result < 0) {
     musicd_log(LOG_ERROR, "stream",
                "av_interleaved_write_frame failed: %s",
@@ -655,13 +813,98 @@ bool stream_seek(stream_t *stream, double position)
 {
   bool result;
   int64_t seek_pos;
-  
-  seek_pos = (position + stream->track->start) /
-    av_q2d(stream->src_ctx->streams[0]->time_base);
-  
-  result = av_seek_frame(stream->src_ctx, 0, seek_pos, 0);
+  int i;
+  double file_position = position + stream->track->start;
+
+  i = stream->seek_interval > 0 ? file_position / stream->seek_interval : -1;
+  if (i >= 0 && i < stream->seek_index_size) {
+    /* Jump to the indexed packet before the position and drop the rest */
+    result = av_seek_frame(stream->src_ctx, 0, stream->seek_index[i],
+                           AVSEEK_FLAG_BYTE);
+    stream->seek_skip = file_position;
+  } else {
+    seek_pos = file_position / av_q2d(stream->src_ctx->streams[0]->time_base);
+    result = av_seek_frame(stream->src_ctx, 0, seek_pos, 0);
+  }
   
   stream->pts = position * AV_TIME_BASE;
+  /* Pacing starts over from the new position */
+  stream->pace_clock = 0;
 
   return result >= 0 ? true : false;
 }
+
+void stream_set_pacing(stream_t *stream, double readahead, double rate)
+{
+  stream->pace_readahead = readahead;
+  stream->pace_rate = rate > 1.0 ? rate : 1.0;
+  stream->pace_clock = 0;
+}
+
+int64_t *stream_build_seek_index(const char *path, double interval,
+                                 int *count)
+{
+  AVFormatContext *ctx = NULL;
+  AVPacket packet;
+  int64_t *positions = NULL;
+  int size = 0, max_size = 0;
+  double time_base, position;
+
+  if (avformat_open_input(&ctx, path, NULL, NULL) < 0) {
+    return NULL;
+  }
+  if (avformat_find_stream_info(ctx, NULL) < 0 || ctx->nb_streams < 1) {
+    avformat_close_input(&ctx);
+    return NULL;
+  }
+
+  time_base = av_q2d(ctx->streams[0]->time_base);
+
+  av_init_packet(&packet);
+  while (av_read_frame(ctx, &packet) >= 0) {
+    if (packet.stream_index == 0 && packet.pts != AV_NOPTS_VALUE
+     && packet.pos >= 0) {
+      position = packet.pts * time_base;
+      /* Every slot up to this packet points to it */
+      while (size * interval <= position) {
+        if (size == max_size) {
+          max_size = max_size ? max_size * 2 : 256;
+          positions = realloc(positions, max_size * sizeof(int64_t));
+        }
+        positions[size++] = packet.pos;
+      }
+    }
+    av_free_packet(&packet);
+  }
+
+  avformat_close_input(&ctx);
+
+  *count = size;
+  return positions;
+}
+
+int64_t stream_pace_delay(stream_t *stream)
+{
+  int64_t now, allowed;
+
+  if (stream->pace_readahead <= 0) {
+    return 0;
+  }
+
+  now = metrics_now();
+  if (!stream->pace_clock) {
+    stream->pace_clock = now;
+    stream->pace_pts = stream->pts;
+    return 0;
+  }
+
+  /* Media time the stream is allowed to be at, relative to pace_pts */
+  allowed = stream->pace_readahead * AV_TIME_BASE
+          + (now - stream->pace_clock) * stream->pace_rate
+            * (AV_TIME_BASE / 1000000.0);
+  if (stream->pts - stream->pace_pts <= allowed) {
+    return 0;
+  }
+  return (stream->pts - stream->pace_pts - allowed)
+         / stream->pace_rate / (AV_TIME_BASE / 1000000.0);
+}
@@ -59,6 +59,9 @@ typedef struct stream {
 
   AVPacket encode_packet;
 
+  /* copy: source packets are remuxed as they are, see stream_copy */
+  bool copy;
+
 
   /*** result packet */
   uint8_t *dst_data;
@@ -77,12 +80,30 @@ typedef struct stream {
   double replay_album_gain;
   double replay_track_peak;
   double replay_album_peak;
+  /* Linear gain applied to decoded samples when transcoding, 0 for none */
+  float gain;
 
   /* ready packet after successful stream_next */
   uint8_t *data;
   int size;
+  /** Position of the last read packet in AV_TIME_BASE units from track start */
   int64_t pts;
 
+  /*** seeking ***/
+  /* Byte positions at every seek_interval seconds in the file, if indexed */
+  int64_t *seek_index;
+  int seek_index_size;
+  double seek_interval;
+  /* Packets before this file position in seconds are dropped after seeking */
+  double seek_skip;
+
+  /*** pacing, see stream_set_pacing ***/
+  double pace_readahead;
+  double pace_rate;
+  /* Monotonic clock and pts when pacing (re)started, clock 0 if not yet */
+  int64_t pace_clock;
+  int64_t pace_pts;
+
 } stream_t;
 
 stream_t *stream_new();
@@ -96,6 +117,13 @@ bool stream_open(stream_t *stream, track_t *track);
  * Starts transcoding to @p codec at @p bitrate bps
  */
 bool stream_transcode(stream_t *stream, codec_type_t codec, int bitrate);
+/**
+ * Starts passing source packets through without transcoding, if the source
+ * already is @p codec at most at @p bitrate bps. FLAC is copied regardless of
+ * bitrate.
+ * @returns true if copying, false if the stream must be transcoded instead
+ */
+bool stream_copy(stream_t *stream, codec_type_t codec, int bitrate);
 /**
  * Starts remuxing @p stream
  * @p write callback function that processes data written
@@ -117,8 +145,31 @@ int stream_next(stream_t *stream);
 
 
 /**
- * Seeks to absolute @p position seconds
+ * Seeks to absolute @p position seconds. If the file has a seek index, it is
+ * used to jump to the right byte position directly.
  */
 bool stream_seek(stream_t *stream, double position);
 
+/**
+ * Demuxes @p path and records the byte position of the packet at every
+ * @p interval seconds, for storing with library_seek_index_set.
+ * @returns positions which must be freed storing their number to @p count, or
+ * NULL on failure
+ */
+int64_t *stream_build_seek_index(const char *path, double interval,
+                                 int *count);
+
+/**
+ * Limits production to @p readahead seconds ahead of real time playback
+ * starting from the first packet, after which the stream is produced at
+ * @p rate times real time. @p readahead 0 disables pacing.
+ */
+void stream_set_pacing(stream_t *stream, double readahead, double rate);
+
+/**
+ * @returns microseconds to wait before the next stream_next to stay within
+ * the pacing limits, 0 if it can be called right away
+ */
+int64_t stream_pace_delay(stream_t *stream);
+
 #endif
@@ -28,11 +28,24 @@
 
 string_t *string_new()
 {
-  string_t *string = malloc(sizeof(string_t));
-  string->string = malloc(64 + 1);
+  return string_new_in(NULL);
+}
+
+string_t *string_new_in(arena_t *arena)
+{
+  string_t *string;
+
+  if (arena) {
+    string = arena_alloc(arena, sizeof(string_t));
+    string->string = arena_alloc(arena, 64 + 1);
+  } else {
+    string = malloc(sizeof(string_t));
+    string->string = malloc(64 + 1);
+  }
   string->string[0] = '\0';
   string->size = 0;
   string->max_size = 64;
+  string->arena = arena;
   return string;
 }
 
@@ -42,6 +55,7 @@ string_t *string_of(char *string2)
   string->string = string2;
   string->size = strlen(string2);
   string->max_size = string->size;
+  string->arena = NULL;
   return string;
 }
 
@@ -51,24 +65,32 @@ string_t *string_from(const char *string2)
   string->string = strcopy(string2);
   string->size = strlen(string->string);
   string->max_size = string->size;
+  string->arena = NULL;
   return string;
 }
 
 char *string_release(string_t *string)
 {
   char *result = string->string;
-  free(string);
+  if (!string->arena) {
+    free(string);
+  }
   return result;
 }
 
 void string_free(string_t *string)
 {
+  if (string->arena) {
+    return;
+  }
   free(string->string);
   free(string);
 }
 
 void string_ensure_space(string_t *string, size_t size)
 {
+  size_t old_size = string->max_size;
+
   if (string->max_size >= size) {
     return;
   }
@@ -78,7 +100,12 @@ void string_ensure_space(string_t *string, size_t size)
     string->max_size *= 2;
   }
   
-  string->string = realloc(string->string, string->max_size + 1);
+  if (string->arena) {
+    string->string = arena_realloc(string->arena, string->string,
+                                   old_size + 1, string->max_size + 1);
+  } else {
+    string->string = realloc(string->string, string->max_size + 1);
+  }
 }
 
 const char *string_string(string_t *string)
@@ -98,31 +125,27 @@ void string_append(string_t *string, const char *string2)
 
 void string_appendf(string_t *string, const char *format, ...)
 {
-  int n, size = 128;
-  char *buf;
+  size_t space = 128;
+  int n;
   va_list va_args;
 
-  buf = malloc(size);
-
+  /* Formatted straight to the end of the string, again with enough space if
+   * it didn't fit */
   while (1) {
     va_start(va_args, format);
-    n = vsnprintf(buf, size, format, va_args);
+    n = vsnprintf(string_reserve(string, space), space + 1, format, va_args);
     va_end(va_args);
 
-    if (n > -1 && n < size) {
-      break;
+    if (n < 0) {
+      string->string[string->size] = '\0';
+      return;
     }
-
-    if (n > -1) {
-      size = n + 1;
-    } else {
-      size *= 2;
+    if ((size_t)n <= space) {
+      break;
     }
-
-    buf = realloc(buf, size);
+    space = n;
   }
-  string_nappend(string, buf, n);
-  free(buf);
+  string_commit(string, n);
 }
 
 void string_nappend(string_t *string, const char *string2, size_t addlen)
@@ -140,6 +163,18 @@ void string_nappend(string_t *string, const char *string2, size_t addlen)
   string->string[string->size] = '\0';
 }
 
+char *string_reserve(string_t *string, size_t n)
+{
+  string_ensure_space(string, string->size + n);
+  return string->string + string->size;
+}
+
+void string_commit(string_t *string, size_t n)
+{
+  string->size += n;
+  string->string[string->size] = '\0';
+}
+
 void string_push_back(string_t *string, char c)
 {
   string_ensure_space(string, string->size + 1);
@@ -186,35 +221,64 @@ string_t *string_iconv(string_t *string, const char *to, const char *from)
   return result;
 }
 
-char *stringf(const char *format, ...)
+static char *vstringf_in(arena_t *arena, const char *format, va_list va_args)
 {
-  int n, size = 128;
+  int n, size = 128, old_size;
   char *buf;
-  va_list va_args;
+  va_list copy;
 
-  buf = malloc(size);
+  buf = arena ? arena_alloc(arena, size) : malloc(size);
   
   while (1) {
-    va_start(va_args, format);
-    n = vsnprintf(buf, size, format, va_args);
-    va_end(va_args);
+    va_copy(copy, va_args);
+    n = vsnprintf(buf, size, format, copy);
+    va_end(copy);
     
     if (n > -1 && n < size) {
       break;
     }
     
+    old_size = size;
     if (n > -1) {
       size = n + 1;
     } else {
       size *= 2;
     }
     
-    buf = realloc(buf, size);
+    buf = arena ? arena_realloc(arena, buf, old_size, size)
+                : realloc(buf, size);
   }
   return buf;
 }
 
+char *stringf(const char *format, ...)
+{
+  char *result;
+  va_list va_args;
+
+  va_start(va_args, format);
+  result = vstringf_in(NULL, format, va_args);
+  va_end(va_args);
+  return result;
+}
+
+char *stringf_in(arena_t *arena, const char *format, ...)
+{
+  char *result;
+  va_list va_args;
+
+  va_start(va_args, format);
+  result = vstringf_in(arena, format, va_args);
+  va_end(va_args);
+  return result;
+}
+
 char *strcopy(const char *src)
+{
+  return strcopy_in(NULL, src);
+}
+
+char *strcopy_in(arena_t *arena, const char *src)
 {
   if (!src) {
     return NULL;
@@ -224,7 +288,7 @@ char *strcopy(const char *src)
   char *result;
 
   len = strlen(src);
-  result = malloc(len + 1);
+  result = arena ? arena_alloc(arena, len + 1) : malloc(len + 1);
   memcpy(result, src, len);
   result[len] = '\0';
 
@@ -280,6 +344,11 @@ int strbeginswith(const char *string, const char *what)
 
 
 char *strextract(const char *begin, const char *end)
+{
+  return strextract_in(NULL, begin, end);
+}
+
+char *strextract_in(arena_t *arena, const char *begin, const char *end)
 {
   size_t size;
   char *result;
@@ -297,8 +366,17 @@ char *strextract(const char *begin, const char *end)
 
   size = end - begin;
 
-  result = malloc(size + 1);
+  result = arena ? arena_alloc(arena, size + 1) : malloc(size + 1);
   memcpy(result, begin, size);
   result[size] = '\0';
   return result;
 }
+
+unsigned strhash(const char *string)
+{
+  unsigned hash = 5381;
+  for (; *string; ++string) {
+    hash = hash * 33 + (unsigned char)*string;
+  }
+  return hash;
+}
@@ -18,6 +18,8 @@
 #ifndef MUSICD_STRINGS_H
 #define MUSICD_STRINGS_H
 
+#include "arena.h"
+
 #include <string.h>
 
 /**
@@ -29,10 +31,18 @@ typedef struct string {
   char *string;
   size_t size;
   size_t max_size;
+  /** Arena the string lives in, or NULL if allocated with malloc */
+  arena_t *arena;
 } string_t;
 
 string_t *string_new();
 
+/**
+ * Like string_new, but the string and its buffer are allocated from @p arena
+ * if it is not NULL. Freeing and releasing such a string frees nothing.
+ */
+string_t *string_new_in(arena_t *arena);
+
 /**
  * Starts using @p string as data. @p string is no longer valid after calling
  */
@@ -60,6 +70,13 @@ void string_nappend(string_t *string, const char *string2, size_t n);
 
 void string_push_back(string_t *string, char c);
 
+/**
+ * @returns pointer to at least @p n writable bytes at the end of @p string.
+ * Bytes actually written are added with string_commit.
+ */
+char *string_reserve(string_t *string, size_t n);
+void string_commit(string_t *string, size_t n);
+
 void string_remove_front(string_t *string, size_t n);
 
 string_t *string_iconv(string_t *string, const char *to, const char *from);
@@ -71,6 +88,14 @@ char *stringf(const char *format, ...);
 /** Essentially strdup, except checks for NULL @p src */
 char *strcopy(const char *src);
 
+/*
+ * Variants of stringf, strcopy and strextract allocating from @p arena, or
+ * with malloc if it is NULL.
+ */
+char *stringf_in(arena_t *arena, const char *format, ...);
+char *strcopy_in(arena_t *arena, const char *src);
+char *strextract_in(arena_t *arena, const char *begin, const char *end);
+
 /** Case-insensitive strstr. */
 const char *strcasestr(const char *haystack, const char *needle);
 
@@ -88,4 +113,7 @@ int strbeginswith(const char *string, const char *what);
 /** @returns new string with content starting from @p begin to @p end. */
 char *strextract(const char *begin, const char *end);
 
+/** @returns djb2 hash of @p string for hash tables. */
+unsigned strhash(const char *string);
+
 #endif
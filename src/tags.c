@@ -0,0 +1,823 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tags.h"
+
+#include "strings.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+/** Largest metadata block, frame or packet read for tags. Bigger ones are
+ * most likely embedded pictures, and the file is left for libav. */
+#define TAGS_MAX_BLOCK (4 * 1024 * 1024)
+
+/** Bytes searched for the first MP3 frame after the ID3v2 tag */
+#define MP3_SYNC_SEARCH 16384
+
+/** Bytes searched for the last Ogg page from the end of the file */
+#define OGG_END_SEARCH (65536 + 27 + 255)
+
+typedef struct tags {
+  char *title;
+  char *artist;
+  char *album;
+  char *albumartist;
+  char *track;
+  double duration;
+} tags_t;
+
+static void tags_clear(tags_t *tags)
+{
+  free(tags->title);
+  free(tags->artist);
+  free(tags->album);
+  free(tags->albumartist);
+  free(tags->track);
+  memset(tags, 0, sizeof(tags_t));
+}
+
+/**
+ * Moves fields of @p src missing from @p dst to @p dst.
+ */
+static void tags_merge(tags_t *dst, tags_t *src)
+{
+  char **d[] = { &dst->title, &dst->artist, &dst->album, &dst->albumartist,
+                 &dst->track };
+  char **s[] = { &src->title, &src->artist, &src->album, &src->albumartist,
+                 &src->track };
+  unsigned int i;
+
+  for (i = 0; i < sizeof(d) / sizeof(d[0]); ++i) {
+    if (!*d[i]) {
+      *d[i] = *s[i];
+      *s[i] = NULL;
+    }
+  }
+}
+
+/**
+ * Stores @p value of @p len bytes to @p field unless it is already set.
+ */
+static void set_tag(char **field, const char *value, size_t len)
+{
+  if (*field || len == 0) {
+    return;
+  }
+  *field = strextract(value, value + len);
+}
+
+static uint32_t be24(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8
+    | p[3];
+}
+
+static uint32_t le16(const unsigned char *p)
+{
+  return (uint32_t)p[1] << 8 | p[0];
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+  return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8
+    | p[0];
+}
+
+static uint64_t le64(const unsigned char *p)
+{
+  return (uint64_t)le32(p + 4) << 32 | le32(p);
+}
+
+/** ID3v2 sizes have 7 bits per byte */
+static uint32_t syncsafe32(const unsigned char *p)
+{
+  return (uint32_t)(p[0] & 0x7f) << 21 | (uint32_t)(p[1] & 0x7f) << 14
+    | (uint32_t)(p[2] & 0x7f) << 7 | (p[3] & 0x7f);
+}
+
+/**
+ * @returns @p size bytes read from current position of @p file, which must be
+ * freed, or NULL.
+ */
+static unsigned char *read_block(FILE *file, size_t size)
+{
+  unsigned char *block;
+
+  if (size > TAGS_MAX_BLOCK) {
+    return NULL;
+  }
+
+  block = malloc(size + 1);
+  if (fread(block, 1, size, file) != size) {
+    free(block);
+    return NULL;
+  }
+  return block;
+}
+
+
+/*
+ * Vorbis comments, as found in FLAC, Vorbis and Opus
+ */
+
+static bool key_is(const char *key, size_t len, const char *name)
+{
+  return strlen(name) == len && !strncasecmp(key, name, len);
+}
+
+static void vorbis_comment_field(tags_t *tags, const char *comment,
+                                 size_t len)
+{
+  const char *value = memchr(comment, '=', len);
+  size_t key_len, value_len;
+
+  if (!value) {
+    return;
+  }
+  key_len = value - comment;
+  ++value;
+  value_len = len - key_len - 1;
+
+  if (key_is(comment, key_len, "TITLE")) {
+    set_tag(&tags->title, value, value_len);
+  } else if (key_is(comment, key_len, "ARTIST")) {
+    set_tag(&tags->artist, value, value_len);
+  } else if (key_is(comment, key_len, "ALBUM")) {
+    set_tag(&tags->album, value, value_len);
+  } else if (key_is(comment, key_len, "ALBUMARTIST")
+          || key_is(comment, key_len, "ALBUM ARTIST")) {
+    set_tag(&tags->albumartist, value, value_len);
+  } else if (key_is(comment, key_len, "TRACKNUMBER")) {
+    set_tag(&tags->track, value, value_len);
+  }
+}
+
+/**
+ * Parses vorbis comment of @p size bytes at @p data.
+ */
+static void parse_vorbis_comment(tags_t *tags, const unsigned char *data,
+                                 size_t size)
+{
+  const unsigned char *p = data, *end = data + size;
+  uint32_t len, count;
+
+  /* Vendor string */
+  if (end - p < 4) {
+    return;
+  }
+  len = le32(p);
+  p += 4;
+  if (len > (size_t)(end - p)) {
+    return;
+  }
+  p += len;
+
+  if (end - p < 4) {
+    return;
+  }
+  count = le32(p);
+  p += 4;
+
+  for (; count > 0 && end - p >= 4; --count) {
+    len = le32(p);
+    p += 4;
+    if (len > (size_t)(end - p)) {
+      return;
+    }
+    vorbis_comment_field(tags, (const char *)p, len);
+    p += len;
+  }
+}
+
+
+/*
+ * FLAC
+ */
+
+#define FLAC_STREAMINFO 0
+#define FLAC_VORBIS_COMMENT 4
+
+/**
+ * Reads metadata blocks following "fLaC" at the current position.
+ */
+static bool read_flac(FILE *file, tags_t *tags)
+{
+  unsigned char header[4], *block;
+  uint32_t size, sample_rate = 0;
+  uint64_t samples = 0;
+  int type;
+  bool last = false;
+
+  while (!last) {
+    if (fread(header, 4, 1, file) != 1) {
+      return false;
+    }
+    last = header[0] & 0x80;
+    type = header[0] & 0x7f;
+    size = be24(header + 1);
+
+    if (type != FLAC_STREAMINFO && type != FLAC_VORBIS_COMMENT) {
+      if (fseeko(file, size, SEEK_CUR)) {
+        return false;
+      }
+      continue;
+    }
+
+    block = read_block(file, size);
+    if (!block) {
+      return false;
+    }
+    if (type == FLAC_STREAMINFO && size >= 18) {
+      /* 20 bits of sample rate, 3 of channels, 5 of bits per sample and
+       * 36 of total samples */
+      sample_rate = be24(block + 10) >> 4;
+      samples = (uint64_t)(block[13] & 0x0f) << 32 | be32(block + 14);
+    } else if (type == FLAC_VORBIS_COMMENT) {
+      parse_vorbis_comment(tags, block, size);
+    }
+    free(block);
+  }
+
+  if (sample_rate == 0 || samples == 0) {
+    return false;
+  }
+  tags->duration = samples / (double)sample_rate;
+  return true;
+}
+
+
+/*
+ * ID3
+ */
+
+/**
+ * @returns text of @p size bytes at @p data in ID3 @p encoding converted to
+ * UTF-8, up to the first terminator, or NULL if empty.
+ */
+static char *id3_decode(const unsigned char *data, size_t size, int encoding)
+{
+  static const char *encodings[] = {
+    "ISO-8859-1", "UTF-16", "UTF-16BE", NULL
+  };
+  string_t *string, *result;
+  size_t len;
+  char *text;
+
+  if (encoding < 0 || encoding > 3) {
+    return NULL;
+  }
+
+  if (encoding == 1 || encoding == 2) {
+    for (len = 0; len + 1 < size && (data[len] || data[len + 1]); len += 2) { }
+  } else {
+    for (len = 0; len < size && data[len]; ++len) { }
+  }
+  if (len == 0) {
+    return NULL;
+  }
+
+  if (!encodings[encoding]) {
+    return strextract((const char *)data, (const char *)data + len);
+  }
+
+  string = string_new();
+  string_nappend(string, (const char *)data, len);
+  result = string_iconv(string, "UTF-8", encodings[encoding]);
+  string_free(string);
+
+  text = string_release(result);
+  if (!*text) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/**
+ * @returns field of @p tags the ID3v2 text frame @p id is for, or NULL.
+ */
+static char **id3_field(tags_t *tags, const unsigned char *id)
+{
+  if (!memcmp(id, "TIT2", 4)) {
+    return &tags->title;
+  } else if (!memcmp(id, "TPE1", 4)) {
+    return &tags->artist;
+  } else if (!memcmp(id, "TALB", 4)) {
+    return &tags->album;
+  } else if (!memcmp(id, "TPE2", 4)) {
+    return &tags->albumartist;
+  } else if (!memcmp(id, "TRCK", 4)) {
+    return &tags->track;
+  }
+  return NULL;
+}
+
+/**
+ * Reads frames of ID3v2 tag at the current position, @p header being its
+ * first 10 bytes. Only version 2.3 and 2.4 tags without unsynchronisation are
+ * read.
+ * @returns true if the tag was read.
+ */
+static bool read_id3v2(FILE *file, const unsigned char *header, tags_t *tags)
+{
+  unsigned char frame[10], *data;
+  int version = header[3], flags = header[5];
+  uint32_t size = syncsafe32(header + 6), pos = 0, frame_size;
+  char **field;
+  bool skip;
+
+  if ((version != 3 && version != 4) || (flags & 0x80)) {
+    return false;
+  }
+
+  if (flags & 0x40) {
+    /* Extended header, its size includes itself only in 2.4 */
+    if (fread(frame, 4, 1, file) != 1) {
+      return false;
+    }
+    pos = version == 4 ? syncsafe32(frame) : be32(frame) + 4;
+    if (pos < 4 || pos > size || fseeko(file, pos - 4, SEEK_CUR)) {
+      return false;
+    }
+  }
+
+  while (pos + 10 <= size) {
+    if (fread(frame, 10, 1, file) != 1) {
+      return false;
+    }
+    if (frame[0] == 0) {
+      /* Padding */
+      break;
+    }
+
+    frame_size = version == 4 ? syncsafe32(frame + 4) : be32(frame + 4);
+    if (frame_size > size - pos - 10) {
+      break;
+    }
+    pos += 10 + frame_size;
+
+    /* Compressed, encrypted and otherwise encoded frames */
+    skip = version == 4 ? (frame[9] & 0x4f) : (frame[9] & 0xe0);
+
+    field = id3_field(tags, frame);
+    if (!field || *field || skip || frame_size < 2) {
+      if (fseeko(file, frame_size, SEEK_CUR)) {
+        return false;
+      }
+      continue;
+    }
+
+    data = read_block(file, frame_size);
+    if (!data) {
+      return false;
+    }
+    *field = id3_decode(data + 1, frame_size - 1, data[0]);
+    free(data);
+  }
+  return true;
+}
+
+static void id3v1_field(char **field, const unsigned char *data, size_t size)
+{
+  /* Padded with spaces or zeros */
+  while (size > 0 && (data[size - 1] == ' ' || data[size - 1] == '\0')) {
+    --size;
+  }
+  if (!*field) {
+    *field = id3_decode(data, size, 0);
+  }
+}
+
+/**
+ * Reads ID3v1 tag from the last 128 bytes of @p file.
+ * @returns true if there was a tag.
+ */
+static bool read_id3v1(FILE *file, off_t file_size, tags_t *tags)
+{
+  unsigned char tag[128];
+
+  if (file_size < 128 || fseeko(file, file_size - 128, SEEK_SET)
+   || fread(tag, 128, 1, file) != 1 || memcmp(tag, "TAG", 3)) {
+    return false;
+  }
+
+  id3v1_field(&tags->title, tag + 3, 30);
+  id3v1_field(&tags->artist, tag + 33, 30);
+  id3v1_field(&tags->album, tag + 63, 30);
+  if (tag[125] == 0 && tag[126] != 0 && !tags->track) {
+    /* ID3v1.1 track number in place of the last comment byte */
+    tags->track = stringf("%d", tag[126]);
+  }
+  return true;
+}
+
+
+/*
+ * MP3
+ */
+
+typedef struct mp3_frame {
+  /** 3 for MPEG-1, 2 for MPEG-2 and 0 for MPEG-2.5 */
+  int version;
+  int layer;
+  int bitrate;
+  int sample_rate;
+  int samples;
+  int length;
+  bool mono;
+} mp3_frame_t;
+
+static bool parse_mp3_frame(const unsigned char *h, mp3_frame_t *frame)
+{
+  static const int bitrates[2][3][15] = {
+    { /* MPEG-1 */
+      { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+      { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+    },
+    { /* MPEG-2 and 2.5 */
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+    }
+  };
+  static const int sample_rates[3] = { 44100, 48000, 32000 };
+  int bitrate_index, rate_index, padding;
+
+  if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0) {
+    return false;
+  }
+
+  frame->version = (h[1] >> 3) & 3;
+  frame->layer = 4 - ((h[1] >> 1) & 3);
+  bitrate_index = h[2] >> 4;
+  rate_index = (h[2] >> 2) & 3;
+  padding = (h[2] >> 1) & 1;
+
+  /* Reserved values, and free format which is not supported */
+  if (frame->version == 1 || frame->layer == 4 || bitrate_index == 0
+   || bitrate_index == 15 || rate_index == 3) {
+    return false;
+  }
+
+  frame->sample_rate = sample_rates[rate_index]
+    >> (frame->version == 3 ? 0 : frame->version == 2 ? 1 : 2);
+  frame->bitrate =
+    bitrates[frame->version == 3 ? 0 : 1][frame->layer - 1][bitrate_index]
+    * 1000;
+  frame->mono = (h[3] >> 6) == 3;
+
+  if (frame->layer == 1) {
+    frame->samples = 384;
+    frame->length =
+      (12 * frame->bitrate / frame->sample_rate + padding) * 4;
+  } else {
+    frame->samples =
+      frame->layer == 3 && frame->version != 3 ? 576 : 1152;
+    frame->length =
+      frame->samples / 8 * frame->bitrate / frame->sample_rate + padding;
+  }
+  return true;
+}
+
+/**
+ * Finds the duration of MP3 stream starting at @p offset, from its Xing, Info
+ * or VBRI header or by its bitrate if there is none. A frame is only accepted
+ * if another one follows it.
+ */
+static bool read_mp3(FILE *file, off_t offset, off_t file_size,
+                     bool id3v1, tags_t *tags)
+{
+  unsigned char buf[MP3_SYNC_SEARCH + 64], next[4];
+  mp3_frame_t frame, next_frame;
+  size_t len, i;
+  int side_info;
+  uint32_t frames = 0;
+  off_t audio_size;
+
+  if (fseeko(file, offset, SEEK_SET)) {
+    return false;
+  }
+  len = fread(buf, 1, sizeof(buf), file);
+  if (len < 64) {
+    return false;
+  }
+
+  for (i = 0; i < len - 64 && i < MP3_SYNC_SEARCH; ++i) {
+    if (!parse_mp3_frame(buf + i, &frame)) {
+      continue;
+    }
+
+    if (i + frame.length + 4 <= len) {
+      memcpy(next, buf + i + frame.length, 4);
+    } else if (fseeko(file, offset + i + frame.length, SEEK_SET)
+            || fread(next, 4, 1, file) != 1) {
+      continue;
+    }
+    if (parse_mp3_frame(next, &next_frame)
+     && next_frame.version == frame.version
+     && next_frame.layer == frame.layer
+     && next_frame.sample_rate == frame.sample_rate) {
+      break;
+    }
+  }
+  if (i >= len - 64 || i >= MP3_SYNC_SEARCH) {
+    return false;
+  }
+
+  /* Xing and Info are after the side information, VBRI after 32 bytes */
+  if (frame.version == 3) {
+    side_info = frame.mono ? 17 : 32;
+  } else {
+    side_info = frame.mono ? 9 : 17;
+  }
+  if ((!memcmp(buf + i + 4 + side_info, "Xing", 4)
+    || !memcmp(buf + i + 4 + side_info, "Info", 4))
+   && (be32(buf + i + 4 + side_info + 4) & 1)) {
+    frames = be32(buf + i + 4 + side_info + 8);
+  } else if (!memcmp(buf + i + 4 + 32, "VBRI", 4)) {
+    frames = be32(buf + i + 4 + 32 + 14);
+  }
+
+  if (frames > 0) {
+    tags->duration = frames * (double)frame.samples / frame.sample_rate;
+  } else {
+    audio_size = file_size - offset - i - (id3v1 ? 128 : 0);
+    tags->duration = audio_size * 8.0 / frame.bitrate;
+  }
+  return tags->duration > 0;
+}
+
+
+/*
+ * Ogg Vorbis and Opus
+ */
+
+typedef struct ogg_reader {
+  FILE *file;
+  uint32_t serial;
+  int nb_segments;
+  int segment;
+  unsigned char lacing[255];
+} ogg_reader_t;
+
+/**
+ * Reads the next page header of the logical stream of @p ogg, skipping pages
+ * of other streams.
+ */
+static bool ogg_next_page(ogg_reader_t *ogg)
+{
+  unsigned char header[27];
+  uint32_t skip;
+  int i;
+
+  while (1) {
+    if (fread(header, 27, 1, ogg->file) != 1 || memcmp(header, "OggS", 4)
+     || header[4] != 0) {
+      return false;
+    }
+    ogg->nb_segments = header[26];
+    ogg->segment = 0;
+    if (fread(ogg->lacing, 1, ogg->nb_segments, ogg->file)
+        != (size_t)ogg->nb_segments) {
+      return false;
+    }
+
+    if (le32(header + 14) == ogg->serial) {
+      return true;
+    }
+
+    for (i = 0, skip = 0; i < ogg->nb_segments; ++i) {
+      skip += ogg->lacing[i];
+    }
+    if (fseeko(ogg->file, skip, SEEK_CUR)) {
+      return false;
+    }
+  }
+}
+
+/**
+ * @returns next packet of @p ogg which must be freed, storing its size to
+ * @p size, or NULL.
+ */
+static unsigned char *ogg_packet(ogg_reader_t *ogg, size_t *size)
+{
+  unsigned char *packet = NULL;
+  size_t len = 0, max_len = 0;
+  int lace;
+
+  while (1) {
+    if (ogg->segment >= ogg->nb_segments && !ogg_next_page(ogg)) {
+      break;
+    }
+    if (ogg->segment >= ogg->nb_segments) {
+      continue;
+    }
+
+    lace = ogg->lacing[ogg->segment++];
+    if (len + lace > max_len) {
+      if (len + lace > TAGS_MAX_BLOCK) {
+        break;
+      }
+      max_len = max_len ? max_len * 2 : 4096;
+      packet = realloc(packet, max_len);
+    }
+    if (fread(packet + len, 1, lace, ogg->file) != (size_t)lace) {
+      break;
+    }
+    len += lace;
+
+    if (lace < 255) {
+      *size = len;
+      return packet;
+    }
+  }
+
+  free(packet);
+  return NULL;
+}
+
+/**
+ * @returns granule position of the last page of stream @p serial, or -1.
+ */
+static int64_t ogg_last_granule(FILE *file, off_t file_size, uint32_t serial)
+{
+  unsigned char *buf;
+  size_t len;
+  off_t start;
+  int64_t granule = -1;
+  int i;
+
+  start = file_size > OGG_END_SEARCH ? file_size - OGG_END_SEARCH : 0;
+  if (fseeko(file, start, SEEK_SET)) {
+    return -1;
+  }
+
+  buf = malloc(OGG_END_SEARCH);
+  len = fread(buf, 1, OGG_END_SEARCH, file);
+
+  for (i = (int)len - 27; i >= 0; --i) {
+    if (!memcmp(buf + i, "OggS", 4) && buf[i + 4] == 0
+     && le32(buf + i + 14) == serial
+     && le64(buf + i + 6) != UINT64_MAX) {
+      granule = (int64_t)le64(buf + i + 6);
+      break;
+    }
+  }
+
+  free(buf);
+  return granule;
+}
+
+static bool read_ogg(FILE *file, off_t file_size, tags_t *tags)
+{
+  unsigned char header[27], *packet;
+  ogg_reader_t ogg;
+  size_t size;
+  int64_t granule, pre_skip = 0;
+  uint32_t sample_rate = 0;
+  bool opus = false;
+
+  /* The first page tells the stream whose headers follow */
+  if (fseeko(file, 0, SEEK_SET) || fread(header, 27, 1, file) != 1) {
+    return false;
+  }
+  memset(&ogg, 0, sizeof(ogg_reader_t));
+  ogg.file = file;
+  ogg.serial = le32(header + 14);
+  if (fseeko(file, 0, SEEK_SET)) {
+    return false;
+  }
+
+  /* Identification header */
+  packet = ogg_packet(&ogg, &size);
+  if (!packet) {
+    return false;
+  }
+  if (size >= 30 && !memcmp(packet, "\x01vorbis", 7)) {
+    sample_rate = le32(packet + 12);
+  } else if (size >= 19 && !memcmp(packet, "OpusHead", 8)) {
+    /* Granule positions of Opus are always at 48 kHz */
+    opus = true;
+    pre_skip = le16(packet + 10);
+    sample_rate = 48000;
+  }
+  free(packet);
+  if (sample_rate == 0) {
+    return false;
+  }
+
+  /* Comment header */
+  packet = ogg_packet(&ogg, &size);
+  if (!packet) {
+    return false;
+  }
+  if (!opus && size >= 7 && !memcmp(packet, "\x03vorbis", 7)) {
+    parse_vorbis_comment(tags, packet + 7, size - 7);
+  } else if (opus && size >= 8 && !memcmp(packet, "OpusTags", 8)) {
+    parse_vorbis_comment(tags, packet + 8, size - 8);
+  }
+  free(packet);
+
+  granule = ogg_last_granule(file, file_size, ogg.serial);
+  if (granule <= pre_skip) {
+    return false;
+  }
+  tags->duration = (granule - pre_skip) / (double)sample_rate;
+  return true;
+}
+
+
+track_t *tags_read(const char *path)
+{
+  FILE *file;
+  unsigned char header[10];
+  tags_t tags, id3;
+  off_t file_size, offset = 0;
+  bool found = false, id3v1;
+  track_t *track = NULL;
+
+  if (!(file = fopen(path, "rb"))) {
+    return NULL;
+  }
+
+  memset(&tags, 0, sizeof(tags_t));
+  memset(&id3, 0, sizeof(tags_t));
+
+  if (fseeko(file, 0, SEEK_END) || (file_size = ftello(file)) < 0
+   || fseeko(file, 0, SEEK_SET) || fread(header, 10, 1, file) != 1) {
+    goto exit;
+  }
+
+  if (!memcmp(header, "ID3", 3)) {
+    if (!read_id3v2(file, header, &id3)) {
+      goto exit;
+    }
+    offset = 10 + syncsafe32(header + 6) + (header[5] & 0x10 ? 10 : 0);
+    if (fseeko(file, offset, SEEK_SET) || fread(header, 10, 1, file) != 1) {
+      goto exit;
+    }
+  }
+
+  if (!memcmp(header, "fLaC", 4)) {
+    if (fseeko(file, offset + 4, SEEK_SET)) {
+      goto exit;
+    }
+    found = read_flac(file, &tags);
+  } else if (!memcmp(header, "OggS", 4) && offset == 0) {
+    found = read_ogg(file, file_size, &tags);
+  } else if (offset > 0 || (header[0] == 0xff && (header[1] & 0xe0) == 0xe0)) {
+    /* Only fills in what ID3v2 didn't have */
+    id3v1 = read_id3v1(file, file_size, &id3);
+    found = read_mp3(file, offset, file_size, id3v1, &tags);
+  }
+  if (!found) {
+    goto exit;
+  }
+
+  /* Vorbis comments of FLAC take precedence over possible ID3v2 */
+  tags_merge(&tags, &id3);
+
+  track = track_new();
+  track->file = strcopy(path);
+  track->title = tags.title;
+  track->artist = tags.artist;
+  track->album = tags.album;
+  track->albumartist = tags.albumartist;
+  if (tags.track) {
+    sscanf(tags.track, "%d", &track->track);
+  }
+  track->duration = tags.duration;
+  tags.title = tags.artist = tags.album = tags.albumartist = NULL;
+
+exit:
+  tags_clear(&tags);
+  tags_clear(&id3);
+  fclose(file);
+  return track;
+}
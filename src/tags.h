@@ -0,0 +1,37 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_TAGS_H
+#define MUSICD_TAGS_H
+
+#include "track.h"
+
+/*
+ * Reads tags and duration of common formats straight from their headers,
+ * which is much cheaper than having libav probe the file. Formats read are
+ * FLAC, MP3 with ID3v2 or ID3v1 tags, and Ogg Vorbis and Opus.
+ */
+
+/**
+ * @returns track of @p path with file, title, artist, album, albumartist,
+ * track number and duration set as found, or NULL if the format is not
+ * supported or the duration can't be told from the headers, in which case the
+ * file should be probed with libav instead.
+ */
+track_t *tags_read(const char *path);
+
+#endif
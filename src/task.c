@@ -17,7 +17,10 @@
  */
 #include "task.h"
 
+#include "config.h"
 #include "log.h"
+#include "metrics.h"
+#include "strings.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -25,11 +28,9 @@
 #include <pthread.h>
 
 /*
- * thread = any thread running tasks
- * worker = task that is marked as a worker
- *
- * In total MAX_ACTIVE_THREADS can be running simultaneously, but only
- * MAX_ACTIVE_WORKERS of those can be running worker tasks.
+ * Tasks are run by long-lived pools, one per task class. Each pool has a
+ * queue per priority, and threads always take the oldest task of the highest
+ * priority.
  *
  * This means that too many CPU intensive tasks (like image scaling) can't be
  * running simultaneously locking up the system, but tasks that are mostly
@@ -37,110 +38,291 @@
  * tasks that actually need resources.
  */
 
-#define MAX_ACTIVE_WORKERS 4
-#define MAX_ACTIVE_THREADS 32
+#define DEFAULT_IO_THREADS 8
+
+#define TASK_QUEUED 0
+#define TASK_RUNNING 1
+#define TASK_FINISHED 2
+
+#define FLIGHT_BUCKETS 64
+
+typedef struct task_pool {
+  const char *name;
+  int threads;
+  pthread_cond_t cond;
+  task_list_t queues[TASK_PRIORITY_COUNT];
+} task_pool_t;
 
+/* Protects pools, task states and notify queues */
 static pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
-static task_t *next_task = NULL, *last_task = NULL;
-static int active_workers = 0, active_threads = 0;
+static task_pool_t pools[TASK_CLASS_COUNT] = {
+  { .name = "cpu", .cond = PTHREAD_COND_INITIALIZER },
+  { .name = "io", .cond = PTHREAD_COND_INITIALIZER }
+};
+static int pools_started = 0;
+/* Keyed tasks that are queued or running */
+static task_t *flights[FLIGHT_BUCKETS];
 
-static void *thread_func(void *data)
+static void list_push(task_list_t *list, task_t *task)
 {
-  (void)data;
-  task_t *task;
+  task->next = NULL;
+  task->prev = list->last;
+  if (list->last) {
+    list->last->next = task;
+  } else {
+    list->first = task;
+  }
+  list->last = task;
+}
 
-  while (1) {
-    pthread_mutex_lock(&task_mutex);
+static task_t *list_pop(task_list_t *list)
+{
+  task_t *task = list->first;
+  if (!task) {
+    return NULL;
+  }
+  list->first = task->next;
+  if (list->first) {
+    list->first->prev = NULL;
+  } else {
+    list->last = NULL;
+  }
+  task->next = task->prev = NULL;
+  return task;
+}
 
-    for (task = next_task; task; task = task->next) {
-      if (!task->worker || active_workers < MAX_ACTIVE_WORKERS) {
-        /* Task is not worker or worker limit not reached */
-        break;
-      }
-    }
+static void list_remove(task_list_t *list, task_t *task)
+{
+  if (task->prev) {
+    task->prev->next = task->next;
+  } else {
+    list->first = task->next;
+  }
+  if (task->next) {
+    task->next->prev = task->prev;
+  } else {
+    list->last = task->prev;
+  }
+  task->next = task->prev = NULL;
+}
 
-    if (!task) {
-      --active_threads;
-      musicd_log(LOG_DEBUG, "task",
-                 "quitting thread (%d/%d workers of %d/%d remaining)",
-                 active_workers, MAX_ACTIVE_WORKERS,
-                 active_threads, MAX_ACTIVE_THREADS);
-      pthread_mutex_unlock(&task_mutex);
-      return NULL;
-    }
+static task_t **flight_bucket(const char *key)
+{
+  return &flights[strhash(key) % FLIGHT_BUCKETS];
+}
 
-    if (task->prev) {
-      task->prev->next = task->next;
+static task_t *flight_find(const char *key)
+{
+  task_t *task;
+
+  for (task = *flight_bucket(key); task; task = task->flight_next) {
+    if (!strcmp(task->key, key)) {
+      return task;
     }
-    if (task->next) {
-      task->next->prev = task->prev;
+  }
+  return NULL;
+}
+
+static void flight_remove(task_t *task)
+{
+  task_t **ptr;
+
+  for (ptr = flight_bucket(task->key); *ptr; ptr = &(*ptr)->flight_next) {
+    if (*ptr == task) {
+      *ptr = task->flight_next;
+      task->flight_next = NULL;
+      return;
     }
-    if (task == next_task) {
-      next_task = task->next;
+  }
+}
+
+/**
+ * Makes @p task wait for @p leader instead of running. A waiting task of
+ * higher priority bumps a queued leader up.
+ */
+static void join(task_t *leader, task_t *task)
+{
+  task_pool_t *pool = &pools[leader->class];
+
+  musicd_log(LOG_DEBUG, "task", "%p joins %p (%s)", task, leader, task->key);
+
+  free(task->data);
+  task->data = NULL;
+  task->state = TASK_QUEUED;
+  list_push(&leader->joined, task);
+  metrics_count(METRICS_TASKS_JOINED, 1);
+
+  if (leader->state == TASK_QUEUED && task->priority < leader->priority) {
+    list_remove(&pool->queues[leader->priority], leader);
+    leader->priority = task->priority;
+    list_push(&pool->queues[leader->priority], leader);
+  }
+}
+
+static task_t *pool_next(task_pool_t *pool)
+{
+  task_t *task;
+  int i;
+
+  for (i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+    if ((task = list_pop(&pool->queues[i]))) {
+      return task;
     }
-    if (task == last_task) {
-      last_task = task->prev;
+  }
+  return NULL;
+}
+
+static void finish(task_t *task)
+{
+  task_list_t *list;
+  task_t *joined;
+  int was_empty;
+
+  task->state = TASK_FINISHED;
+
+  if (task->key) {
+    flight_remove(task);
+    while ((joined = list_pop(&task->joined))) {
+      finish(joined);
     }
+  }
 
-    if (task->worker) {
-      ++active_workers;
-      musicd_log(LOG_DEBUG, "task", "%p starting worker %d/%d", task,
-                 active_workers, MAX_ACTIVE_WORKERS);
-    } else {
-      musicd_log(LOG_DEBUG, "task", "%p starting", task);
+  if (task->abandoned || !task->notify) {
+    task_free(task);
+    return;
+  }
+
+  list = &task->notify->finished;
+  was_empty = !list->first;
+  list_push(list, task);
+  if (was_empty) {
+    event_signal_raise(&task->notify->signal);
+  }
+}
+
+static void *thread_func(void *data)
+{
+  task_pool_t *pool = data;
+  task_t *task;
+
+  pthread_mutex_lock(&task_mutex);
+
+  while (1) {
+    task = pool_next(pool);
+    if (!task) {
+      pthread_cond_wait(&pool->cond, &task_mutex);
+      continue;
     }
 
+    task->state = TASK_RUNNING;
+    metrics_gauge_add(METRICS_TASKS_QUEUED, -1);
+    metrics_time(METRICS_TASK_WAIT, task->queued);
+    musicd_log(LOG_DEBUG, "task", "%p starting in %s pool", task, pool->name);
+
     pthread_mutex_unlock(&task_mutex);
     task->func(task->data);
     pthread_mutex_lock(&task_mutex);
 
-    if (task->worker) {
-      --active_workers;
-      musicd_log(LOG_DEBUG, "task", "%p finished worker (%d/%d remain)", task,
-                 active_workers, MAX_ACTIVE_WORKERS);
-    } else {
-      musicd_log(LOG_DEBUG, "task", "%p finished", task);
+    musicd_log(LOG_DEBUG, "task", "%p finished", task);
+    finish(task);
+  }
+
+  return NULL;
+}
+
+/**
+ * Starts the pool threads on first use. task_mutex must be held.
+ */
+static void start_pools()
+{
+  pthread_t thread;
+  int i, j;
+
+  pools_started = 1;
+
+  pools[TASK_CLASS_CPU].threads = config_to_int("task-cpu-threads");
+  if (pools[TASK_CLASS_CPU].threads < 1) {
+    pools[TASK_CLASS_CPU].threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  pools[TASK_CLASS_IO].threads = config_to_int("task-io-threads");
+  if (pools[TASK_CLASS_IO].threads < 1) {
+    pools[TASK_CLASS_IO].threads = DEFAULT_IO_THREADS;
+  }
+
+  for (i = 0; i < TASK_CLASS_COUNT; ++i) {
+    if (pools[i].threads < 1) {
+      pools[i].threads = 1;
     }
 
-    pthread_mutex_unlock(&task_mutex);
+    musicd_log(LOG_VERBOSE, "task", "starting %d thread(s) in %s pool",
+               pools[i].threads, pools[i].name);
 
-    if (!task->detached) {
-      write(task->pipe[1], "\0", 1);
-    } else {
-      task_free(task);
+    for (j = 0; j < pools[i].threads; ++j) {
+      if (pthread_create(&thread, NULL, thread_func, &pools[i])) {
+        musicd_perror(LOG_FATAL, "task", "pthread_create: ");
+        abort();
+      }
+      pthread_detach(thread);
     }
   }
-
 }
 
-
 static void start(task_t *task)
 {
-  pthread_t thread;
+  task_pool_t *pool = &pools[task->class];
+  task_t *leader, **bucket;
 
-  if (!last_task) {
-    next_task = last_task = task;
-  } else {
-    last_task->next = task;
-    task->prev = last_task;
-    last_task = task;
+  if (task->key) {
+    if ((leader = flight_find(task->key))) {
+      join(leader, task);
+      return;
+    }
+    bucket = flight_bucket(task->key);
+    task->flight_next = *bucket;
+    *bucket = task;
   }
 
-  if (active_threads < MAX_ACTIVE_THREADS
-   && active_workers < MAX_ACTIVE_WORKERS) {
-    musicd_log(LOG_DEBUG, "task", "%p spawning thread %d/%d", task,
-             active_threads + 1, MAX_ACTIVE_THREADS);
+  if (!pools_started) {
+    start_pools();
+  }
 
-    if (pthread_create(&thread, NULL, thread_func, NULL)) {
-      musicd_perror(LOG_FATAL, "task", "pthread_create: ");
-      abort();
-    }
-    pthread_detach(thread);
+  task->state = TASK_QUEUED;
+  task->queued = metrics_now();
+  metrics_gauge_add(METRICS_TASKS_QUEUED, 1);
+  list_push(&pool->queues[task->priority], task);
+  pthread_cond_signal(&pool->cond);
+}
 
-    ++active_threads;
-  } else {
-    musicd_log(LOG_DEBUG, "task", "%p queued");
+
+int task_notify_init(task_notify_t *notify)
+{
+  memset(notify, 0, sizeof(task_notify_t));
+  return event_signal_init(&notify->signal);
+}
+
+int task_notify_fd(task_notify_t *notify)
+{
+  return event_signal_fd(&notify->signal);
+}
+
+task_t *task_notify_next(task_notify_t *notify)
+{
+  task_t *task;
+
+  pthread_mutex_lock(&task_mutex);
+  while ((task = list_pop(&notify->finished))) {
+    if (!task->abandoned) {
+      task->notify = NULL;
+      break;
+    }
+    task_free(task);
+  }
+  if (!task) {
+    event_signal_clear(&notify->signal);
   }
+  pthread_mutex_unlock(&task_mutex);
+
+  return task;
 }
 
 
@@ -148,35 +330,54 @@ task_t *task_new()
 {
   task_t *task = malloc(sizeof(task_t));
   memset(task, 0, sizeof(task_t));
-  pipe(task->pipe);
+  task->class = TASK_CLASS_IO;
+  task->priority = TASK_PRIORITY_NORMAL;
 
   return task;
 }
 
-void task_start(task_t *task)
+void task_start(task_t *task, task_notify_t *notify)
 {
   pthread_mutex_lock(&task_mutex);
+  task->notify = notify;
   start(task);
   pthread_mutex_unlock(&task_mutex);
 }
 
+int task_finished(task_t *task)
+{
+  int result;
 
-int task_pollfd(task_t *task)
+  pthread_mutex_lock(&task_mutex);
+  result = task->state == TASK_FINISHED;
+  pthread_mutex_unlock(&task_mutex);
+
+  return result;
+}
+
+void task_abandon(task_t *task)
 {
-  return task->pipe[0];
+  pthread_mutex_lock(&task_mutex);
+  if (task->state == TASK_FINISHED && !task->notify) {
+    /* Already collected */
+    task_free(task);
+  } else {
+    /* Freed by the pool thread or task_notify_next */
+    task->abandoned = 1;
+  }
+  pthread_mutex_unlock(&task_mutex);
 }
 
 void task_free(task_t* task)
 {
-  close(task->pipe[0]);
-  close(task->pipe[1]);
+  free(task->key);
   free(task);
 }
 
 void task_launch(task_t *task)
 {
   pthread_mutex_lock(&task_mutex);
-  task->detached = 1;
+  task->notify = NULL;
   start(task);
   pthread_mutex_unlock(&task_mutex);
 }
@@ -18,24 +18,87 @@
 #ifndef MUSICD_TASK_H
 #define MUSICD_TASK_H
 
+#include "event.h"
+
 #include <pthread.h>
+#include <stdint.h>
+
+/** Which pool runs the task */
+typedef enum task_class {
+  /** CPU intensive, like image scaling, at most task-cpu-threads at once */
+  TASK_CLASS_CPU = 0,
+  /** Mostly waiting, like lyrics fetching, at most task-io-threads at once */
+  TASK_CLASS_IO,
+  TASK_CLASS_COUNT
+} task_class_t;
+
+/** Queued tasks of higher priority are always run first */
+typedef enum task_priority {
+  /** A client is waiting for the result */
+  TASK_PRIORITY_INTERACTIVE = 0,
+  TASK_PRIORITY_NORMAL,
+  /** Background work, prefetching and such */
+  TASK_PRIORITY_BACKGROUND,
+  TASK_PRIORITY_COUNT
+} task_priority_t;
+
+struct task_notify;
 
 typedef struct task {
   /* Set before starting/launching */
   void *(*func)(void *);
   void *data;
-  int worker; /**< Is this CPU intensive tasks */
+  task_class_t class;
+  task_priority_t priority;
+  /**
+   * Optional identity of the work, freed with the task. While a task with the
+   * same key is queued or running, starting another one only waits for it:
+   * func is not called and data is freed with free().
+   */
+  char *key;
+
+  /** Free for the owner of the task, returned with task_notify_next */
+  void *owner;
 
   /* Private */
-  int pipe[2];
-  int running;
-  int detached; /* Launched with task_launch */
+  int state;
+  int abandoned;
+  int64_t queued;
+  struct task_notify *notify;
   struct task *prev, *next;
+  /** Tasks waiting for this one, and the next one in the same key bucket */
+  struct task_list {
+    struct task *first, *last;
+  } joined;
+  struct task *flight_next;
 } task_t;
 
+typedef struct task_list task_list_t;
+
+/**
+ * Completion queue for finished tasks, usually one per event loop. Its fd is
+ * readable while there are finished tasks to collect.
+ */
+typedef struct task_notify {
+  event_signal_t signal;
+  task_list_t finished;
+} task_notify_t;
+
+int task_notify_init(task_notify_t *notify);
+int task_notify_fd(task_notify_t *notify);
+
+/**
+ * @returns next finished task, or NULL if there is none
+ */
+task_t *task_notify_next(task_notify_t *notify);
+
+
 task_t *task_new();
 
-void task_start(task_t *task);
+/**
+ * Starts @p task. Once finished, it is pushed to @p notify.
+ */
+void task_start(task_t *task, task_notify_t *notify);
 
 /**
  * Starts task and automatically frees resources when it finishes.
@@ -44,15 +107,19 @@ void task_start(task_t *task);
 void task_launch(task_t *task);
 
 /**
- * @returns file descriptor which will trigger POLLIN event once the task is
- * finished
+ * @returns nonzero if started @p task has finished
+ */
+int task_finished(task_t *task);
+
+/**
+ * Gives up waiting for a started task: it is freed as soon as it finishes,
+ * or right away if it already has. @p task is not valid after calling.
  */
-int task_pollfd(task_t *task);
+void task_abandon(task_t *task);
 
 /**
- * Frees resources allocated by task_start
- * @warning If called before the task is actually finished bad things will
- * happen
+ * Frees resources of a task collected with task_notify_next, or one that was
+ * never started.
  */
 void task_free(task_t *task);
 
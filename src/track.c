@@ -17,9 +17,18 @@
  */
 #include "track.h"
 
+#include "config.h"
 #include "libav.h"
 #include "log.h"
 #include "strings.h"
+#include "tags.h"
+
+#include <stdbool.h>
+
+/** Probe limits for the first attempt at finding stream parameters, the
+ * whole file is probed only if that didn't tell the duration */
+#define QUICK_PROBESIZE "65536"
+#define QUICK_ANALYZEDURATION "500000"
 
 /* First try container-level metadata. If no value is found, try
  * stream-specific metadata.
@@ -71,6 +80,65 @@ static int is_valid_audio_file(AVFormatContext *avctx)
   return 1;
 }
 
+static AVFormatContext *open_file(const char *path, bool quick)
+{
+  AVFormatContext *avctx = NULL;
+  AVDictionary *options = NULL;
+
+  if (quick) {
+    av_dict_set(&options, "probesize", QUICK_PROBESIZE, 0);
+    av_dict_set(&options, "analyzeduration", QUICK_ANALYZEDURATION, 0);
+  }
+
+  if (avformat_open_input(&avctx, path, NULL, &options)) {
+    avctx = NULL;
+  }
+  av_dict_free(&options);
+  return avctx;
+}
+
+/**
+ * Opens @p path with libav if it is an audio file. Only the start of the file
+ * is probed at first.
+ */
+static AVFormatContext *open_audio_file(const char *path)
+{
+  AVFormatContext *avctx;
+
+  if (!(avctx = open_file(path, true)) || !is_valid_audio_file(avctx)) {
+    return NULL;
+  }
+
+  if (avctx->duration < 1 && avctx->streams[0]->duration < 1) {
+    avformat_close_input(&avctx);
+    if (!(avctx = open_file(path, false)) || !is_valid_audio_file(avctx)) {
+      return NULL;
+    }
+  }
+  return avctx;
+}
+
+/**
+ * Fills in what tags_read leaves to track_create.
+ */
+static track_t *track_from_tags(track_t *track, int track_index)
+{
+  char *tmp;
+
+  if (!track->title) {
+    for (tmp = track->file + strlen(track->file);
+        tmp > track->file && *(tmp - 1) != '/';
+        --tmp) { }
+    track->title = strcopy(tmp);
+  }
+
+  track->trackindex = track_index;
+  if (!track->track) {
+    track->track = track_index;
+  }
+  return track;
+}
+
 void tracks_free(track_t **tracks)
 {
   int i;
@@ -138,20 +206,26 @@ track_t **tracks_from_path(const char *path)
 {
   AVFormatContext *avctx = NULL;
   track_t **tracks; /* NULL terminated */
+  track_t *track;
   int track_count;
   int i;
   char *tmp;
 
-  if (avformat_open_input(&avctx, path, NULL, NULL)) {
-    return NULL;
+  /* Formats with multiple tracks per file are not read by tags_read */
+  if (config_to_bool("scan-fast-probe") && (track = tags_read(path))) {
+    tracks = calloc(2, sizeof(track_t *));
+    tracks[0] = track_from_tags(track, 0);
+    return tracks;
   }
-  if (!is_valid_audio_file(avctx)) {
+
+  if (!(avctx = open_audio_file(path))) {
     return NULL;
   }
 
   tmp = copy_metadata(avctx, "tracks");
   if (tmp) {
     sscanf(tmp, "%d", &track_count);
+    free(tmp);
   } else {
     track_count = 1;
   }
@@ -168,13 +242,14 @@ track_t **tracks_from_path(const char *path)
 
 track_t *track_from_path(const char *path)
 {
-  AVFormatContext *avctx = NULL;
+  AVFormatContext *avctx;
   track_t *track;
-  
-  if (avformat_open_input(&avctx, path, NULL, NULL)) {
-    return NULL;
+
+  if (config_to_bool("scan-fast-probe") && (track = tags_read(path))) {
+    return track_from_tags(track, -1);
   }
-  if (!is_valid_audio_file(avctx)) {
+  
+  if (!(avctx = open_audio_file(path))) {
     return NULL;
   }
   
@@ -0,0 +1,917 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "transcoder.h"
+
+#include "cache.h"
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "metrics.h"
+#include "strings.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Production is paused when every reader has this many bytes unread */
+#define BUFFER_LIMIT (256 * 1024)
+/** ...and resumed once it is brought down to this */
+#define BUFFER_RESUME (BUFFER_LIMIT / 2)
+/** Output is kept from the start up to this size so that readers can join,
+ * and readers further behind than this continue from the cache file */
+#define REPLAY_LIMIT (1024 * 1024)
+/** Packets produced before giving other streams a turn */
+#define SLICE_PACKETS 64
+
+typedef enum job_state {
+  /** Buffer full, waiting for the readers */
+  JOB_PAUSED = 0,
+  /** Ahead of the pacing limit, waiting in the sleep queue */
+  JOB_SLEEPING,
+  /** In the run queue */
+  JOB_QUEUED,
+  /** Being run by a pool thread */
+  JOB_RUNNING,
+  /** Stream ended or failed */
+  JOB_DONE
+} job_state_t;
+
+/**
+ * A stream being produced, read by one or more transcoders.
+ */
+typedef struct job {
+  stream_t *stream;
+
+  /* Protects everything below */
+  pthread_mutex_t mutex;
+
+  /* Output from byte offset base on, trimmed to what the readers of the
+   * buffer still need once it has grown past REPLAY_LIMIT */
+  uint8_t *buf;
+  size_t size, len;
+  int64_t base;
+
+  /** Readers, the job is closed when the last one goes */
+  transcoder_t *readers;
+
+  job_state_t state;
+  /* Result of the last stream_next */
+  int result;
+  bool closed;
+
+  /* Wakeup batching, see wake_readers */
+  size_t feed_size;
+  int64_t feed_time;
+
+  /** Monotonic time to wake up at when sleeping */
+  int64_t wake;
+
+  /* Output copy being written to the cache, cache_fd -1 if not caching */
+  char *cache_name;
+  char *cache_tmp;
+  int cache_fd;
+  /** Output written to the cache file so far */
+  int64_t cached;
+
+  /** Key to join with, NULL if not shared */
+  char *key;
+  struct job *shared_next;
+
+  struct job *next;
+} job_t;
+
+struct transcoder {
+  job_t *job;
+  /** Absolute offset of the next byte to read */
+  int64_t offset;
+  event_signal_t signal;
+  /** Has read everything and waits for the signal */
+  bool waiting;
+  /** Monotonic time since when there has been something to read */
+  int64_t pending_since;
+  /** Copy of the cache fd read from once behind the buffer, otherwise -1 */
+  int file_fd;
+  /** Fell behind the buffer with no cache file to continue from */
+  bool lost;
+  struct transcoder *next;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static job_t *queue_first = NULL, *queue_last = NULL;
+/** Paced jobs, ordered by wake time */
+static job_t *sleep_first = NULL;
+static bool pool_started = false;
+
+/** Protects shared_first, locked before any job mutex */
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static job_t *shared_first = NULL;
+
+/** Held transcoders are closed if not taken in this many seconds */
+#define HOLD_TIMEOUT 60
+
+/** A transcoder kept for transcoder_take */
+typedef struct hold {
+  char *owner;
+  char *key;
+  transcoder_t *transcoder;
+  time_t expires;
+  struct hold *next;
+} hold_t;
+
+static pthread_mutex_t hold_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hold_t *holds = NULL;
+
+/**
+ * @returns unread bytes of the reader furthest ahead, so that a paused or
+ * held reader doesn't stop the stream for the others. Job mutex must be held.
+ */
+static size_t backlog(job_t *job)
+{
+  transcoder_t *reader;
+  int64_t max = -1;
+
+  for (reader = job->readers; reader; reader = reader->next) {
+    if (!reader->lost && reader->offset > max) {
+      max = reader->offset;
+    }
+  }
+  return max < 0 ? 0 : job->base + job->len - max;
+}
+
+/**
+ * @returns offset of the slowest reader of the buffer, or the end of the
+ * output if there is none. Job mutex must be held.
+ */
+static int64_t buffer_tail(job_t *job)
+{
+  transcoder_t *reader;
+  int64_t min = job->base + job->len;
+
+  for (reader = job->readers; reader; reader = reader->next) {
+    if (reader->file_fd < 0 && !reader->lost && reader->offset < min) {
+      min = reader->offset;
+    }
+  }
+  return min;
+}
+
+/**
+ * Moves readers more than REPLAY_LIMIT behind to the cache file, or drops
+ * them if the output isn't fully cached, so that the buffer stays bounded.
+ * Job mutex must be held.
+ */
+static void detach_readers(job_t *job)
+{
+  transcoder_t *reader;
+  int64_t end = job->base + job->len;
+
+  for (reader = job->readers; reader; reader = reader->next) {
+    if (reader->file_fd >= 0 || reader->lost
+     || end - reader->offset <= REPLAY_LIMIT) {
+      continue;
+    }
+
+    if (job->cache_fd >= 0 && job->cached == end) {
+      reader->file_fd = dup(job->cache_fd);
+    }
+    if (reader->file_fd < 0) {
+      musicd_log(LOG_WARNING, "transcoder", "%p: dropping reader %p, too "
+                 "far behind", job, reader);
+      reader->lost = true;
+      reader->waiting = false;
+      event_signal_raise(&reader->signal);
+    } else {
+      musicd_log(LOG_DEBUG, "transcoder", "%p: reader %p continues from cache",
+                 job, reader);
+    }
+  }
+}
+
+/**
+ * Raises the signal of waiting readers once they have stream-feed-size
+ * bytes to read, or have had something for stream-feed-time, so that each
+ * wakeup moves a batch of packets instead of one. With @p force, every
+ * waiting reader is woken. Job mutex must be held.
+ */
+static void wake_readers(job_t *job, bool force)
+{
+  transcoder_t *reader;
+  int64_t now = metrics_now();
+  size_t pending;
+
+  for (reader = job->readers; reader; reader = reader->next) {
+    if (!reader->waiting) {
+      continue;
+    }
+
+    pending = job->base + job->len - reader->offset;
+    if (pending > 0 && !reader->pending_since) {
+      reader->pending_since = now;
+    }
+
+    if (force || pending >= job->feed_size
+     || (pending > 0 && now - reader->pending_since >= job->feed_time)) {
+      reader->waiting = false;
+      event_signal_raise(&reader->signal);
+    }
+  }
+}
+
+/**
+ * Finishes the cache copy, keeping it only if @p commit is true.
+ */
+static void end_cache(job_t *job, bool commit)
+{
+  int64_t limit;
+
+  if (job->cache_fd < 0) {
+    return;
+  }
+
+  cache_end_file(job->cache_name, job->cache_fd, job->cache_tmp, commit);
+  job->cache_fd = -1;
+
+  if (commit) {
+    musicd_log(LOG_DEBUG, "transcoder", "%p: cached %s", job,
+               job->cache_name);
+    limit = config_to_int("stream-cache-size");
+    cache_trim(TRANSCODER_CACHE_DIR, limit * 1024 * 1024);
+  }
+}
+
+static void job_free(job_t *job)
+{
+  end_cache(job, false);
+  free(job->cache_name);
+  free(job->key);
+  stream_close(job->stream);
+  pthread_mutex_destroy(&job->mutex);
+  free(job->buf);
+  free(job);
+  metrics_gauge_add(METRICS_STREAMS, -1);
+}
+
+/**
+ * Removes @p job from the shared list. Shared mutex must be held.
+ */
+static void unshare(job_t *job)
+{
+  job_t **prev;
+
+  for (prev = &shared_first; *prev; prev = &(*prev)->shared_next) {
+    if (*prev == job) {
+      *prev = job->shared_next;
+      return;
+    }
+  }
+}
+
+/**
+ * Adds @p job to the run queue. Job mutex must be held.
+ */
+static void enqueue(job_t *job)
+{
+  job->state = JOB_QUEUED;
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (queue_last) {
+    queue_last->next = job;
+  } else {
+    queue_first = job;
+  }
+  queue_last = job;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * Puts @p job to sleep for @p delay microseconds. Job mutex must be held.
+ */
+static void sleep_for(job_t *job, int64_t delay)
+{
+  job_t **prev;
+
+  job->state = JOB_SLEEPING;
+  job->wake = metrics_now() + delay;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (prev = &sleep_first; *prev && (*prev)->wake <= job->wake;
+       prev = &(*prev)->next) { }
+  job->next = *prev;
+  *prev = job;
+  /* A waiting thread might need to wake up earlier */
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * Removes @p job from the sleep queue. Pool mutex must be held.
+ * @returns true if it was sleeping, false if it has already been woken up
+ */
+static bool unsleep(job_t *job)
+{
+  job_t **prev;
+
+  for (prev = &sleep_first; *prev; prev = &(*prev)->next) {
+    if (*prev == job) {
+      *prev = job->next;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Moves sleepers whose time has come to the run queue. Pool mutex must be
+ * held.
+ * @returns wake time of the next sleeper, or 0 if there are none
+ */
+static int64_t wake_sleepers()
+{
+  job_t *job;
+  int64_t now = metrics_now();
+
+  while (sleep_first && sleep_first->wake <= now) {
+    job = sleep_first;
+    sleep_first = job->next;
+
+    /* State stays SLEEPING until a pool thread picks it up */
+    job->next = NULL;
+    if (queue_last) {
+      queue_last->next = job;
+    } else {
+      queue_first = job;
+    }
+    queue_last = job;
+  }
+
+  return sleep_first ? sleep_first->wake : 0;
+}
+
+static job_t *dequeue()
+{
+  job_t *job;
+  struct timespec ts;
+  int64_t wake;
+
+  pthread_mutex_lock(&pool_mutex);
+  while (1) {
+    wake = wake_sleepers();
+    if (queue_first) {
+      break;
+    }
+    if (wake) {
+      /* pthread_cond_timedwait takes realtime, convert the remaining time */
+      wake -= metrics_now();
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += wake / 1000000;
+      ts.tv_nsec += (wake % 1000000) * 1000;
+      if (ts.tv_nsec >= 1000000000) {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&pool_cond, &pool_mutex, &ts);
+    } else {
+      pthread_cond_wait(&pool_cond, &pool_mutex);
+    }
+  }
+  job = queue_first;
+  queue_first = job->next;
+  if (!queue_first) {
+    queue_last = NULL;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  return job;
+}
+
+static void run(job_t *job)
+{
+  int i, result = 1;
+  int64_t delay = 0;
+  bool full;
+
+  for (i = 0; i < SLICE_PACKETS; ++i) {
+    pthread_mutex_lock(&job->mutex);
+    full = backlog(job) >= BUFFER_LIMIT || job->closed;
+    pthread_mutex_unlock(&job->mutex);
+    if (full) {
+      break;
+    }
+
+    delay = stream_pace_delay(job->stream);
+    if (delay > 0) {
+      break;
+    }
+
+    result = stream_next(job->stream);
+    if (result <= 0) {
+      break;
+    }
+  }
+
+  if (result <= 0) {
+    /* Only complete streams are cached */
+    end_cache(job, result == 0);
+  }
+
+  pthread_mutex_lock(&job->mutex);
+
+  if (job->closed) {
+    pthread_mutex_unlock(&job->mutex);
+    job_free(job);
+    return;
+  }
+
+  job->result = result;
+
+  if (result <= 0) {
+    if (result < 0) {
+      musicd_log(LOG_ERROR, "transcoder", "%p: stream failed", job);
+    }
+    job->state = JOB_DONE;
+    wake_readers(job, true);
+  } else if (backlog(job) >= BUFFER_LIMIT) {
+    job->state = JOB_PAUSED;
+    wake_readers(job, true);
+  } else if (delay > 0) {
+    /* Nothing more is coming for a while */
+    wake_readers(job, delay >= job->feed_time);
+    sleep_for(job, delay);
+  } else {
+    enqueue(job);
+  }
+
+  pthread_mutex_unlock(&job->mutex);
+}
+
+static void *thread_func(void *data)
+{
+  job_t *job;
+
+  (void)data;
+
+  while (1) {
+    job = dequeue();
+
+    pthread_mutex_lock(&job->mutex);
+    if (job->closed) {
+      pthread_mutex_unlock(&job->mutex);
+      job_free(job);
+      continue;
+    }
+    job->state = JOB_RUNNING;
+    pthread_mutex_unlock(&job->mutex);
+
+    run(job);
+  }
+
+  return NULL;
+}
+
+/**
+ * Unlinks expired holds and those of @p owner if not NULL. Hold mutex must be
+ * held.
+ * @returns the unlinked holds, to be freed with free_holds
+ */
+static hold_t *unlink_holds(const char *owner)
+{
+  hold_t *hold, **prev, *unlinked = NULL;
+  time_t now = time(NULL);
+
+  for (prev = &holds; *prev;) {
+    hold = *prev;
+    if (hold->expires <= now || (owner && !strcmp(hold->owner, owner))) {
+      *prev = hold->next;
+      hold->next = unlinked;
+      unlinked = hold;
+    } else {
+      prev = &hold->next;
+    }
+  }
+  return unlinked;
+}
+
+/**
+ * Closes the transcoders of @p list and frees it. Called without the hold
+ * mutex, as closing takes the job locks.
+ */
+static void free_holds(hold_t *list)
+{
+  hold_t *hold;
+
+  while (list) {
+    hold = list;
+    list = hold->next;
+    transcoder_close(hold->transcoder);
+    free(hold->owner);
+    free(hold->key);
+    free(hold);
+  }
+}
+
+static void start_pool()
+{
+  pthread_t thread;
+  int i, threads;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (pool_started) {
+    pthread_mutex_unlock(&pool_mutex);
+    return;
+  }
+  pool_started = true;
+  pthread_mutex_unlock(&pool_mutex);
+
+  threads = config_to_int("transcoder-threads");
+  if (threads < 1) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) {
+      threads = 1;
+    }
+  }
+
+  musicd_log(LOG_VERBOSE, "transcoder", "starting %d thread(s)", threads);
+
+  for (i = 0; i < threads; ++i) {
+    if (pthread_create(&thread, NULL, thread_func, NULL)) {
+      musicd_perror(LOG_FATAL, "transcoder", "pthread_create: ");
+      abort();
+    }
+    pthread_detach(thread);
+  }
+}
+
+/**
+ * Creates a reader for @p job at the start of the output. Job mutex must be
+ * held.
+ */
+static transcoder_t *reader_new(job_t *job)
+{
+  transcoder_t *transcoder = malloc(sizeof(transcoder_t));
+  memset(transcoder, 0, sizeof(transcoder_t));
+
+  if (event_signal_init(&transcoder->signal)) {
+    free(transcoder);
+    return NULL;
+  }
+
+  transcoder->job = job;
+  transcoder->offset = job->base;
+  transcoder->file_fd = -1;
+  transcoder->next = job->readers;
+  job->readers = transcoder;
+
+  if (job->len > 0 || job->state == JOB_DONE) {
+    event_signal_raise(&transcoder->signal);
+  } else {
+    transcoder->waiting = true;
+  }
+
+  return transcoder;
+}
+
+/**
+ * Write callback for stream_remux, appends to the job buffer.
+ */
+static int job_write(void *opaque, uint8_t *buf, int buf_size)
+{
+  job_t *job = (job_t *)opaque;
+  size_t drop;
+
+  if (buf_size <= 0) {
+    return 0;
+  }
+
+  if (job->cache_fd >= 0 && write(job->cache_fd, buf, buf_size) != buf_size) {
+    musicd_perror(LOG_WARNING, "transcoder", "%p: can't write cache", job);
+    end_cache(job, false);
+  }
+
+  pthread_mutex_lock(&job->mutex);
+
+  if (job->len + buf_size > job->size) {
+    /* Drop what the buffer readers have read, once joining is no longer
+     * possible */
+    if (job->base + job->len > REPLAY_LIMIT) {
+      detach_readers(job);
+      drop = buffer_tail(job) - job->base;
+      memmove(job->buf, job->buf + drop, job->len - drop);
+      job->base += drop;
+      job->len -= drop;
+    }
+
+    if (job->len + buf_size > job->size) {
+      size_t size = job->size ? job->size : BUFFER_LIMIT;
+      while (size < job->len + buf_size) {
+        size *= 2;
+      }
+      job->buf = realloc(job->buf, size);
+      job->size = size;
+    }
+  }
+
+  memcpy(job->buf + job->len, buf, buf_size);
+  job->len += buf_size;
+  if (job->cache_fd >= 0) {
+    job->cached += buf_size;
+  }
+
+  wake_readers(job, false);
+
+  pthread_mutex_unlock(&job->mutex);
+  return buf_size;
+}
+
+
+transcoder_t *transcoder_new(stream_t *stream)
+{
+  transcoder_t *transcoder;
+  job_t *job = malloc(sizeof(job_t));
+  memset(job, 0, sizeof(job_t));
+
+  job->stream = stream;
+  job->result = 1;
+  job->cache_fd = -1;
+  job->feed_size = config_to_int("stream-feed-size") * 1024;
+  job->feed_time = config_to_int("stream-feed-time") * 1000;
+  pthread_mutex_init(&job->mutex, NULL);
+
+  transcoder = reader_new(job);
+  if (!transcoder) {
+    pthread_mutex_destroy(&job->mutex);
+    free(job);
+    return NULL;
+  }
+
+  metrics_gauge_add(METRICS_STREAMS, 1);
+  return transcoder;
+}
+
+bool transcoder_remux(transcoder_t *transcoder)
+{
+  return stream_remux(transcoder->job->stream, job_write, transcoder->job);
+}
+
+void transcoder_cache(transcoder_t *transcoder, const char *name)
+{
+  job_t *job = transcoder->job;
+
+  job->cache_fd = cache_begin_file(name, &job->cache_tmp);
+  if (job->cache_fd >= 0) {
+    job->cache_name = strcopy(name);
+  }
+}
+
+void transcoder_share(transcoder_t *transcoder, const char *key)
+{
+  job_t *job = transcoder->job;
+
+  pthread_mutex_lock(&shared_mutex);
+  if (!job->key) {
+    job->key = strcopy(key);
+    job->shared_next = shared_first;
+    shared_first = job;
+  }
+  pthread_mutex_unlock(&shared_mutex);
+}
+
+transcoder_t *transcoder_join(const char *key)
+{
+  job_t *job;
+  transcoder_t *transcoder = NULL;
+
+  pthread_mutex_lock(&shared_mutex);
+  for (job = shared_first; job && !transcoder; job = job->shared_next) {
+    if (strcmp(job->key, key)) {
+      continue;
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    /* The whole output must still be there and not have failed */
+    if (job->base == 0 && job->base + job->len <= REPLAY_LIMIT
+     && job->result >= 0) {
+      transcoder = reader_new(job);
+    }
+    pthread_mutex_unlock(&job->mutex);
+  }
+  pthread_mutex_unlock(&shared_mutex);
+
+  if (transcoder) {
+    musicd_log(LOG_DEBUG, "transcoder", "%p: joined %s", transcoder->job, key);
+  }
+  return transcoder;
+}
+
+void transcoder_hold(transcoder_t *transcoder, const char *owner,
+                     const char *key)
+{
+  hold_t *hold, *expired;
+
+  hold = malloc(sizeof(hold_t));
+  hold->owner = strcopy(owner);
+  hold->key = strcopy(key);
+  hold->transcoder = transcoder;
+  hold->expires = time(NULL) + HOLD_TIMEOUT;
+
+  pthread_mutex_lock(&hold_mutex);
+  /* Only the latest one of each owner is kept */
+  expired = unlink_holds(owner);
+  hold->next = holds;
+  holds = hold;
+  pthread_mutex_unlock(&hold_mutex);
+
+  free_holds(expired);
+}
+
+transcoder_t *transcoder_take(const char *owner, const char *key)
+{
+  hold_t *hold = NULL, *expired, **prev;
+  transcoder_t *transcoder = NULL;
+  bool lost;
+
+  pthread_mutex_lock(&hold_mutex);
+  for (prev = &holds; *prev; prev = &(*prev)->next) {
+    if (!strcmp((*prev)->owner, owner) && !strcmp((*prev)->key, key)) {
+      hold = *prev;
+      *prev = hold->next;
+      break;
+    }
+  }
+  expired = unlink_holds(NULL);
+  pthread_mutex_unlock(&hold_mutex);
+
+  free_holds(expired);
+
+  if (hold) {
+    transcoder = hold->transcoder;
+    free(hold->owner);
+    free(hold->key);
+    free(hold);
+
+    /* Left behind by the other readers with nothing to continue from */
+    pthread_mutex_lock(&transcoder->job->mutex);
+    lost = transcoder->lost;
+    pthread_mutex_unlock(&transcoder->job->mutex);
+    if (lost) {
+      transcoder_close(transcoder);
+      transcoder = NULL;
+    }
+  }
+  return transcoder;
+}
+
+void transcoder_start(transcoder_t *transcoder)
+{
+  job_t *job = transcoder->job;
+
+  start_pool();
+
+  pthread_mutex_lock(&job->mutex);
+  enqueue(job);
+  pthread_mutex_unlock(&job->mutex);
+}
+
+int transcoder_read(transcoder_t *transcoder, outqueue_t *dst, int max)
+{
+  job_t *job = transcoder->job;
+  size_t n = 0, start;
+  int result, fd;
+
+  pthread_mutex_lock(&job->mutex);
+
+  event_signal_clear(&transcoder->signal);
+
+  if (transcoder->file_fd >= 0 && transcoder->offset >= job->base) {
+    /* Caught up with the buffer */
+    close(transcoder->file_fd);
+    transcoder->file_fd = -1;
+  }
+
+  if (transcoder->lost) {
+    n = 0;
+  } else if (transcoder->file_fd >= 0) {
+    n = job->cached - transcoder->offset;
+    if (n > (size_t)max) {
+      n = max;
+    }
+    if (n > 0 && (fd = dup(transcoder->file_fd)) >= 0) {
+      outqueue_append_file(dst, fd, transcoder->offset, n);
+      transcoder->offset += n;
+    } else if (n > 0 || transcoder->offset < job->base) {
+      /* Caching stopped before the buffer */
+      musicd_log(LOG_WARNING, "transcoder", "%p: dropping reader %p, cache "
+                 "incomplete", job, transcoder);
+      transcoder->lost = true;
+      n = 0;
+    }
+  } else {
+    start = transcoder->offset - job->base;
+    n = job->len - start;
+    if (n > (size_t)max) {
+      n = max;
+    }
+    if (n > 0) {
+      outqueue_append(dst, (char *)job->buf + start, n);
+      transcoder->offset += n;
+    }
+  }
+
+  if (job->state == JOB_PAUSED && backlog(job) <= BUFFER_RESUME) {
+    enqueue(job);
+  }
+
+  if (n > 0) {
+    result = n;
+  } else if (job->state == JOB_DONE || transcoder->lost) {
+    result = -1;
+  } else {
+    /* Woken up by wake_readers */
+    transcoder->waiting = true;
+    transcoder->pending_since = 0;
+    result = 0;
+  }
+
+  pthread_mutex_unlock(&job->mutex);
+  return result;
+}
+
+int transcoder_pollfd(transcoder_t *transcoder)
+{
+  return event_signal_fd(&transcoder->signal);
+}
+
+void transcoder_close(transcoder_t *transcoder)
+{
+  job_t *job;
+  transcoder_t **prev;
+
+  if (!transcoder) {
+    return;
+  }
+
+  job = transcoder->job;
+
+  pthread_mutex_lock(&shared_mutex);
+  pthread_mutex_lock(&job->mutex);
+
+  for (prev = &job->readers; *prev != transcoder; prev = &(*prev)->next) { }
+  *prev = transcoder->next;
+  event_signal_free(&transcoder->signal);
+  if (transcoder->file_fd >= 0) {
+    close(transcoder->file_fd);
+  }
+  free(transcoder);
+
+  if (job->readers) {
+    /* The reader furthest ahead might have been holding the others back */
+    if (job->state == JOB_PAUSED && backlog(job) <= BUFFER_RESUME) {
+      enqueue(job);
+    }
+    pthread_mutex_unlock(&job->mutex);
+    pthread_mutex_unlock(&shared_mutex);
+    return;
+  }
+
+  unshare(job);
+  pthread_mutex_unlock(&shared_mutex);
+
+  job->closed = true;
+  if (job->state == JOB_SLEEPING) {
+    pthread_mutex_lock(&pool_mutex);
+    if (!unsleep(job)) {
+      /* Already moved to the run queue, the pool thread frees it */
+      pthread_mutex_unlock(&pool_mutex);
+      pthread_mutex_unlock(&job->mutex);
+      return;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+  } else if (job->state == JOB_QUEUED || job->state == JOB_RUNNING) {
+    /* The pool thread frees it */
+    pthread_mutex_unlock(&job->mutex);
+    return;
+  }
+  pthread_mutex_unlock(&job->mutex);
+
+  job_free(job);
+}
@@ -0,0 +1,119 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_TRANSCODER_H
+#define MUSICD_TRANSCODER_H
+
+#include "stream.h"
+#include "outqueue.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Runs stream_next for a stream on a shared pool of transcoder threads and
+ * buffers the output in a bounded ring, so that server threads only copy
+ * ready bytes.
+ *
+ * Each stream is produced until every reader has a full buffer to read and
+ * is then paused until one of them has consumed enough of it. Readers that
+ * fall far behind the others continue from the cache file, or are dropped if
+ * the stream isn't cached. Paced streams (see stream_set_pacing) sleep in
+ * between instead of occupying a thread.
+ *
+ * A transcoder is one reader of a stream. Streams can be shared with
+ * transcoder_share, so that later transcoder_join calls read the same output
+ * from the start instead of transcoding again.
+ */
+typedef struct transcoder transcoder_t;
+
+/**
+ * Creates a transcoder for @p stream, which is owned by the transcoder from
+ * now on.
+ */
+transcoder_t *transcoder_new(stream_t *stream);
+
+/**
+ * Calls stream_remux for the stream, writing into the transcoder buffer.
+ */
+bool transcoder_remux(transcoder_t *transcoder);
+
+/** Cache subdirectory for transcoded streams, see transcoder_cache */
+#define TRANSCODER_CACHE_DIR "streams"
+
+/**
+ * Also writes the output to cache as @p name, which is kept only if the
+ * stream is transcoded to the end. Must be called before stream_start.
+ * The cache is trimmed to stream-cache-size megabytes.
+ */
+void transcoder_cache(transcoder_t *transcoder, const char *name);
+
+/**
+ * Makes the stream joinable as @p key, until its output has grown past what
+ * is kept for replaying.
+ */
+void transcoder_share(transcoder_t *transcoder, const char *key);
+
+/**
+ * @returns new transcoder reading from the start of a stream shared as
+ * @p key, or NULL if there is none that can still be joined
+ */
+transcoder_t *transcoder_join(const char *key);
+
+/**
+ * Keeps @p transcoder for transcoder_take by @p owner with @p key, replacing
+ * what @p owner held before. Not taken transcoders are closed after a minute.
+ * Alone, a held transcoder buffers the start of the stream until production
+ * pauses. It doesn't hold back other readers of a shared stream, and once
+ * they are far enough ahead it continues from the cache file when taken.
+ */
+void transcoder_hold(transcoder_t *transcoder, const char *owner,
+                     const char *key);
+
+/**
+ * @returns transcoder held by @p owner with @p key, or NULL if there is none
+ * or it can no longer be read from the start
+ */
+transcoder_t *transcoder_take(const char *owner, const char *key);
+
+/**
+ * Queues the transcoder for running. stream_start must have been called.
+ * Joined transcoders are already running.
+ */
+void transcoder_start(transcoder_t *transcoder);
+
+/**
+ * Copies at most @p max ready bytes to the end of @p dst.
+ * @returns number of bytes moved, 0 if nothing is available yet or <0 if the
+ * stream has ended and everything has been read
+ */
+int transcoder_read(transcoder_t *transcoder, outqueue_t *dst, int max);
+
+/**
+ * @returns fd which becomes readable once transcoder_read has something new
+ * to return
+ */
+int transcoder_pollfd(transcoder_t *transcoder);
+
+/**
+ * Frees the transcoder, and stops and frees its stream if it was the last
+ * reader. Safe to call at any time, the stream is freed by the pool thread if
+ * it is running.
+ */
+void transcoder_close(transcoder_t *transcoder);
+
+#endif
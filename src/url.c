@@ -17,15 +17,54 @@
  */
 #include "url.h"
 
+#include "config.h"
+#include "event.h"
 #include "log.h"
 #include "strings.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <curl/curl.h>
 
 
+/*
+ * All fetches are driven by one thread through a curl multi handle, so
+ * connections and DNS lookups are cached and reused between fetches, and
+ * fetch-host-connections limits how many go to one host at a time. Requests
+ * over the limit wait in curl's queue.
+ */
+
+typedef struct request {
+  CURL *curl;
+  string_t *buf;
+  char *url;
+  char errorbuf[CURL_ERROR_SIZE];
+
+  url_callback_t callback;
+  void *opaque;
+
+  struct request *next;
+} request_t;
+
+/** Waited on by url_fetch */
+struct fetch {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool done;
+  char *page;
+};
+
+/* Protects pending */
+static pthread_mutex_t url_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t url_once = PTHREAD_ONCE_INIT;
+static request_t *pending = NULL;
+static event_signal_t wakeup;
+static CURLM *multi;
+
+
 static size_t
 write_memory_function(void *data, size_t size, size_t nmemb, void *opaque)
 {
@@ -37,32 +76,166 @@ write_memory_function(void *data, size_t size, size_t nmemb, void *opaque)
   return realsize;
 }
 
-char *url_fetch(const char *url)
+static void finish_request(request_t *request, CURLcode result)
 {
-  string_t *buf = string_new();
-  CURL *curl;
-  char errorbuf[CURL_ERROR_SIZE];
-  CURLcode result;
+  char *page = NULL;
 
-  curl = curl_easy_init();
-  
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_memory_function);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, buf);
+  curl_multi_remove_handle(multi, request->curl);
+  curl_easy_cleanup(request->curl);
+
+  if (result) {
+    musicd_log(LOG_ERROR, "url", "fetching '%s' failed: %s", request->url,
+               request->errorbuf[0] ? request->errorbuf
+                                    : curl_easy_strerror(result));
+    string_free(request->buf);
+  } else {
+    page = string_release(request->buf);
+  }
+
+  request->callback(page, request->opaque);
+  free(request->url);
+  free(request);
+}
+
+static void add_pending()
+{
+  request_t *request, *next;
+
+  pthread_mutex_lock(&url_mutex);
+  request = pending;
+  pending = NULL;
+  pthread_mutex_unlock(&url_mutex);
+
+  for (; request; request = next) {
+    next = request->next;
+    if (curl_multi_add_handle(multi, request->curl)) {
+      finish_request(request, CURLE_FAILED_INIT);
+    }
+  }
+}
+
+static void *thread_func(void *data)
+{
+  struct curl_waitfd wait_fd;
+  CURLMsg *msg;
+  int running, left;
+
+  (void)data;
+
+  wait_fd.fd = event_signal_fd(&wakeup);
+  wait_fd.events = CURL_WAIT_POLLIN;
+
+  while (1) {
+    add_pending();
+
+    curl_multi_perform(multi, &running);
+    while ((msg = curl_multi_info_read(multi, &left))) {
+      if (msg->msg == CURLMSG_DONE) {
+        request_t *request;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &request);
+        finish_request(request, msg->data.result);
+      }
+    }
+
+    wait_fd.revents = 0;
+    curl_multi_wait(multi, &wait_fd, 1, 1000, NULL);
+    if (wait_fd.revents) {
+      /* Pending is looked at right after, so nothing raised is missed */
+      event_signal_clear(&wakeup);
+    }
+  }
+
+  return NULL;
+}
+
+static void start_thread()
+{
+  pthread_t thread;
+  int connections;
+
+  multi = curl_multi_init();
+  connections = config_to_int("fetch-host-connections");
+  if (connections > 0) {
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)connections);
+  }
+
+  if (event_signal_init(&wakeup)
+   || pthread_create(&thread, NULL, thread_func, NULL)) {
+    musicd_perror(LOG_FATAL, "url", "can't start fetch thread");
+    abort();
+  }
+  pthread_detach(thread);
+}
+
+void url_init()
+{
+  curl_global_init(CURL_GLOBAL_ALL);
+}
+
+void url_fetch_async(const char *url, url_callback_t callback, void *opaque)
+{
+  request_t *request = malloc(sizeof(request_t));
+  bool was_empty;
+
+  pthread_once(&url_once, start_thread);
+
+  memset(request, 0, sizeof(request_t));
+  request->url = strcopy(url);
+  request->buf = string_new();
+  request->callback = callback;
+  request->opaque = opaque;
+  request->curl = curl_easy_init();
+
+  curl_easy_setopt(request->curl, CURLOPT_URL, url);
+  curl_easy_setopt(request->curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(request->curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(request->curl, CURLOPT_ERRORBUFFER, request->errorbuf);
+  curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION,
+                   write_memory_function);
+  curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, request->buf);
+  curl_easy_setopt(request->curl, CURLOPT_PRIVATE, request);
 
   musicd_log(LOG_DEBUG, "url", "fetching '%s'", url);
 
-  result = curl_easy_perform(curl);
-  if (result) {
-    musicd_log(LOG_ERROR, "url", "fetching '%s' failed: %s", url, errorbuf);
-    string_free(buf);
-    buf = NULL;
+  pthread_mutex_lock(&url_mutex);
+  was_empty = !pending;
+  request->next = pending;
+  pending = request;
+  pthread_mutex_unlock(&url_mutex);
+
+  if (was_empty) {
+    event_signal_raise(&wakeup);
   }
-  
-  curl_easy_cleanup(curl);
-  return buf ? string_release(buf) : NULL;
+}
+
+static void fetch_done(char *page, struct fetch *fetch)
+{
+  pthread_mutex_lock(&fetch->mutex);
+  fetch->page = page;
+  fetch->done = true;
+  pthread_cond_signal(&fetch->cond);
+  pthread_mutex_unlock(&fetch->mutex);
+}
+
+char *url_fetch(const char *url)
+{
+  struct fetch fetch;
+
+  memset(&fetch, 0, sizeof(fetch));
+  pthread_mutex_init(&fetch.mutex, NULL);
+  pthread_cond_init(&fetch.cond, NULL);
+
+  url_fetch_async(url, (url_callback_t)fetch_done, &fetch);
+
+  pthread_mutex_lock(&fetch.mutex);
+  while (!fetch.done) {
+    pthread_cond_wait(&fetch.cond, &fetch.mutex);
+  }
+  pthread_mutex_unlock(&fetch.mutex);
+
+  pthread_mutex_destroy(&fetch.mutex);
+  pthread_cond_destroy(&fetch.cond);
+  return fetch.page;
 }
 
 char *url_escape(const char *string)
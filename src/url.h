@@ -20,6 +20,22 @@
 
 /* Convenience functions on top of curl. */
 
+/**
+ * Initializes curl globally. Must be called before any threads are started.
+ */
+void url_init();
+
+/**
+ * Called from the fetch thread with the fetched page, or NULL on failure. The
+ * page must be freed by the callback.
+ */
+typedef void (*url_callback_t)(char *page, void *opaque);
+
+/**
+ * Queues @p url to be fetched in the background.
+ */
+void url_fetch_async(const char *url, url_callback_t callback, void *opaque);
+
 /**
  * Fetch @p url blockingly. Return value must be freed later.
  */
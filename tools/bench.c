@@ -0,0 +1,338 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Transcoder benchmark: runs every audio file under the given paths through
+ * stream_open/stream_transcode/stream_remux/stream_next, each in its own
+ * process so that CPU time and peak RSS are per stream, and reports the
+ * real time factor, time per stage and allocation rate.
+ */
+
+#include "config.h"
+#include "format.h"
+#include "libav.h"
+#include "log.h"
+#include "metrics.h"
+#include "stream.h"
+#include "track.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct result {
+  bool success;
+  double duration;
+  double wall;
+  int64_t stages[5];
+  int64_t allocs;
+  int64_t bytes;
+};
+
+static const metrics_timer_t stages[5] = {
+  METRICS_STREAM_READ, METRICS_STREAM_DECODE, METRICS_STREAM_RESAMPLE,
+  METRICS_STREAM_ENCODE, METRICS_STREAM_MUX
+};
+
+static codec_type_t codec = CODEC_TYPE_MP3;
+static int bitrate = 192000;
+static bool copy = false;
+
+static double totals_duration = 0, totals_wall = 0, totals_cpu = 0;
+static int nb_files = 0, nb_failed = 0;
+
+
+#ifdef __GLIBC__
+/* Count allocations by interposing the allocator, libav included */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static int64_t allocs = 0;
+
+void *malloc(size_t size)
+{
+  ++allocs;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  ++allocs;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  ++allocs;
+  return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+  ++allocs;
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr ? 0 : ENOMEM;
+}
+#else
+static int64_t allocs = -1;
+#endif
+
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int64_t written = 0;
+
+static int write_func(void *opaque, uint8_t *buf, int buf_size)
+{
+  (void)opaque;
+  (void)buf;
+  written += buf_size;
+  return buf_size;
+}
+
+static void run(const char *path, struct result *result)
+{
+  track_t *track;
+  stream_t *stream;
+  double start;
+  int i;
+
+  memset(result, 0, sizeof(struct result));
+
+  track = track_from_path(path);
+  if (!track) {
+    return;
+  }
+  result->duration = track->duration;
+
+  stream = stream_new();
+  if (!stream_open(stream, track)) {
+    track_free(track);
+    stream_close(stream);
+    return;
+  }
+  if ((!copy || !stream_copy(stream, codec, bitrate))
+   && !stream_transcode(stream, codec, bitrate)) {
+    stream_close(stream);
+    return;
+  }
+  if (!stream_remux(stream, write_func, NULL)) {
+    stream_close(stream);
+    return;
+  }
+
+  if (allocs >= 0) {
+    allocs = 0;
+  }
+  start = now();
+  stream_start(stream);
+  while ((i = stream_next(stream)) > 0) { }
+  result->wall = now() - start;
+  result->allocs = allocs;
+  result->success = i == 0;
+  result->bytes = written;
+
+  for (i = 0; i < 5; ++i) {
+    result->stages[i] = metrics_timer_total(stages[i]);
+  }
+
+  stream_close(stream);
+}
+
+static void bench_file(const char *path)
+{
+  int fds[2], status;
+  pid_t pid;
+  struct result result;
+  struct rusage usage;
+  double cpu;
+  const char *name;
+
+  if (pipe(fds)) {
+    perror("pipe");
+    exit(1);
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    run(path, &result);
+    if (write(fds[1], &result, sizeof(result)) != sizeof(result)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+    result.success = false;
+    result.duration = 0;
+  }
+  close(fds[0]);
+  wait4(pid, &status, 0, &usage);
+
+  if (result.duration <= 0) {
+    /* Not an audio file */
+    return;
+  }
+
+  ++nb_files;
+  name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+  if (!result.success || result.wall <= 0) {
+    ++nb_failed;
+    printf("%-32.32s failed\n", name);
+    return;
+  }
+
+  cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0
+      + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+
+  totals_duration += result.duration;
+  totals_wall += result.wall;
+  totals_cpu += cpu;
+
+  printf("%-32.32s %7.1fx %8.0f %7.0f %7.0f %7.0f %7.0f %7.0f ",
+         name, result.duration / result.wall, cpu * 1000,
+         result.stages[0] / 1000.0, result.stages[1] / 1000.0,
+         result.stages[2] / 1000.0, result.stages[3] / 1000.0,
+         result.stages[4] / 1000.0);
+  if (result.allocs >= 0) {
+    printf("%9.0f ", result.allocs / result.wall);
+  } else {
+    printf("%9s ", "-");
+  }
+  printf("%8ld %8" PRId64 "\n", usage.ru_maxrss, result.bytes / 1024);
+  fflush(stdout);
+}
+
+static void bench_path(const char *path)
+{
+  struct stat status;
+  DIR *dir;
+  struct dirent *entry;
+  char *sub;
+
+  if (stat(path, &status)) {
+    perror(path);
+    return;
+  }
+
+  if (!S_ISDIR(status.st_mode)) {
+    bench_file(path);
+    return;
+  }
+
+  dir = opendir(path);
+  if (!dir) {
+    perror(path);
+    return;
+  }
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    sub = malloc(strlen(path) + strlen(entry->d_name) + 2);
+    sprintf(sub, "%s/%s", path, entry->d_name);
+    bench_path(sub);
+    free(sub);
+  }
+  closedir(dir);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-c codec] [-b kbps] [-C] PATH...\n"
+          "  -c codec   target codec (default mp3)\n"
+          "  -b kbps    target bitrate (default 192)\n"
+          "  -C         copy streams already in the target codec\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:b:C")) != -1) {
+    switch (opt) {
+    case 'c':
+      codec = codec_type_from_string(optarg);
+      break;
+    case 'b':
+      bitrate = atoi(optarg) * 1000;
+      break;
+    case 'C':
+      copy = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind >= argc || codec <= CODEC_TYPE_NONE) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  config_init();
+  config_set_hook("log-level", log_level_changed);
+  config_set("log-level", "error");
+
+  av_register_all();
+  avcodec_register_all();
+  av_lockmgr_register(&musicd_av_lockmgr);
+  av_log_set_level(AV_LOG_QUIET);
+
+  printf("%-32s %8s %8s %7s %7s %7s %7s %7s %9s %8s %8s\n",
+         "file", "realtime", "cpu ms", "read", "decode", "resamp", "encode",
+         "mux", "allocs/s", "rss KB", "out KB");
+
+  for (; optind < argc; ++optind) {
+    bench_path(argv[optind]);
+  }
+
+  if (totals_wall > 0) {
+    printf("\n%d files, %d failed, %.1fx realtime, %.1f s audio per cpu s\n",
+           nb_files, nb_failed, totals_duration / totals_wall,
+           totals_duration / totals_cpu);
+  }
+  return nb_failed ? 1 : 0;
+}
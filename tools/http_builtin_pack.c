@@ -21,6 +21,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <zlib.h>
 
 char *join_path(char *a, char *b) {
   char *result = malloc(strlen(a) + strlen(b) + 2);
@@ -33,8 +34,45 @@ char *join_path(char *a, char *b) {
   return result;
 }
 
+void print_data(const unsigned char *data, size_t length) {
+  size_t i;
+  for (i = 0; i < length; i++)
+    printf("\\x%02x", data[i]);
+}
+
+/* Compresses data to gzip, returns the compressed length or 0 if it doesn't
+ * get any smaller. */
+size_t gzip_data(const unsigned char *data, size_t length,
+                 unsigned char **result) {
+  z_stream stream;
+  size_t bound;
+
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "deflateInit2 failed\n");
+    exit(1);
+  }
+
+  bound = deflateBound(&stream, length);
+  *result = malloc(bound);
+
+  stream.next_in = (unsigned char *)data;
+  stream.avail_in = length;
+  stream.next_out = *result;
+  stream.avail_out = bound;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    fprintf(stderr, "deflate failed\n");
+    exit(1);
+  }
+  deflateEnd(&stream);
+
+  return stream.total_out < length ? stream.total_out : 0;
+}
+
 void process_file(char *path, char *url) {
-  static char buf[4096];
+  unsigned char *data, *gzip;
+  size_t gzip_length;
   
   FILE *file = fopen(path, "rb");
   if (!file) {
@@ -46,18 +84,29 @@ void process_file(char *path, char *url) {
   fseek(file, 0, SEEK_END);
   int length = ftell(file);
   fseek(file, 0, SEEK_SET);
+
+  data = malloc(length + 1);
+  if (fread(data, 1, length, file) != (size_t)length) {
+    fprintf(stderr, "error reading file '%s'\n", path);
+    exit(1);
+  }
   
   printf("  { .url = \"%s\", .length = %d, .data = \"", url, length);
-  
-  int len;
-  while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
-    char *p;
-    for (p = buf; len; len--, p++)
-      printf("\\x%02hhx", *p);
+  print_data(data, length);
+  printf("\"");
+
+  /* Variant served to clients accepting gzip, if it helps */
+  gzip_length = gzip_data(data, length, &gzip);
+  if (gzip_length > 0) {
+    printf(",\n    .gzip_length = %d, .gzip_data = \"", (int)gzip_length);
+    print_data(gzip, gzip_length);
+    printf("\"");
   }
   
-  printf("\" },\n");
+  printf(" },\n");
   
+  free(gzip);
+  free(data);
   fclose(file);
 }
 
@@ -99,6 +148,8 @@ struct file_entry {\n\
   char *url;\n\
   int length;\n\
   char *data;\n\
+  int gzip_length;\n\
+  char *gzip_data;\n\
 };\n\
 \n\
 static const struct file_entry entries[] = {\n\
@@ -121,6 +172,22 @@ int http_builtin_file(char *url, char **data, int *length) {\n\
   }\n\
   \n\
   return 0;\n\
+}\n\
+\n\
+int http_builtin_file_gzip(char *url, char **data, int *length) {\n\
+  const struct file_entry *entry;\n\
+  \n\
+  for (entry = entries; entry->url; entry++) {\n\
+    if (!strcmp(entry->url, url)) {\n\
+      if (!entry->gzip_data)\n\
+        return 0;\n\
+      *data = entry->gzip_data;\n\
+      *length = entry->gzip_length;\n\
+      return 1;\n\
+    }\n\
+  }\n\
+  \n\
+  return 0;\n\
 }\n");
   
   return 0;
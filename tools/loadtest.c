@@ -0,0 +1,908 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ * 
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator: runs listeners streaming tracks with /open at mixed
+ * bitrates and users browsing /tracks pages, /albums, image grids,
+ * /track/index and searches against a running server, optionally starting a
+ * rescan in the middle. Reports latency percentiles per endpoint, time to
+ * first byte and underruns of the streams, and CPU time and RSS of the
+ * server process if its pid is given.
+ *
+ * Only needs a socket API, so it can run on another machine than the server.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Seconds of audio a listener buffers before it starts playing */
+#define PREBUFFER 2.0
+/* Seconds a request may stall before it is given up */
+#define REQUEST_TIMEOUT 30.0
+#define MAX_IDS 1000
+#define MAX_WORDS 200
+#define GRID_SIZE 24
+
+typedef enum endpoint_id {
+  EP_TRACKS = 0,
+  EP_TRACKS_PAGE,
+  EP_SEARCH,
+  EP_TRACK_INDEX,
+  EP_ALBUMS,
+  EP_IMAGE,
+  EP_IMAGES,
+  EP_OPEN,
+  EP_RESCAN,
+  EP_COUNT
+} endpoint_id_t;
+
+/** Latency samples of one endpoint, in seconds */
+struct endpoint {
+  const char *name;
+  pthread_mutex_t mutex;
+  double *samples;
+  size_t nb_samples, max_samples;
+  int errors;
+};
+
+static struct endpoint endpoints[EP_COUNT] = {
+  [EP_TRACKS] = { .name = "/tracks" },
+  [EP_TRACKS_PAGE] = { .name = "/tracks cursor" },
+  [EP_SEARCH] = { .name = "/tracks search" },
+  [EP_TRACK_INDEX] = { .name = "/track/index" },
+  [EP_ALBUMS] = { .name = "/albums" },
+  [EP_IMAGE] = { .name = "/image" },
+  [EP_IMAGES] = { .name = "/images" },
+  [EP_OPEN] = { .name = "/open first byte" },
+  [EP_RESCAN] = { .name = "/rescan" },
+};
+
+/** Buffered connection to the server */
+struct conn {
+  int fd;
+  char buf[16384];
+  size_t pos, len;
+};
+
+/** Response body, if it is kept */
+struct body {
+  char *data;
+  size_t size, max_size;
+};
+
+static const char *host = "127.0.0.1";
+static const char *port = "6800";
+/* Set by main before the worker threads start, read-only after that */
+static char cookie[128] = "";
+static bool cookie_fixed = false;
+static int nb_listeners = 4;
+static int nb_users = 8;
+static int duration = 30;
+static int think_ms = 500;
+static int rescan_at = -1;
+static pid_t server_pid = 0;
+
+static const int bitrates[] = { 96000, 128000, 192000, 256000, 320000 };
+
+static int64_t track_ids[MAX_IDS], image_ids[MAX_IDS];
+static int nb_tracks = 0, nb_images = 0;
+static char *words[MAX_WORDS];
+static int nb_words = 0;
+
+static volatile int stop = 0;
+
+/* Stream totals, protected by stream_mutex */
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int streams_opened = 0, streams_failed = 0, underruns = 0;
+static int64_t stream_bytes = 0;
+
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void record(endpoint_id_t id, double seconds, bool success)
+{
+  struct endpoint *endpoint = &endpoints[id];
+
+  pthread_mutex_lock(&endpoint->mutex);
+  if (!success) {
+    ++endpoint->errors;
+  } else {
+    if (endpoint->nb_samples == endpoint->max_samples) {
+      endpoint->max_samples = endpoint->max_samples ? endpoint->max_samples * 2
+                                                    : 1024;
+      endpoint->samples = realloc(endpoint->samples,
+                                  sizeof(double) * endpoint->max_samples);
+    }
+    endpoint->samples[endpoint->nb_samples++] = seconds;
+  }
+  pthread_mutex_unlock(&endpoint->mutex);
+}
+
+
+static int conn_open(struct conn *conn)
+{
+  struct addrinfo hints, *info, *p;
+  struct timeval timeout = { 1, 0 };
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &info)) {
+    return -1;
+  }
+
+  conn->fd = -1;
+  for (p = info; p; p = p->ai_next) {
+    conn->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (conn->fd < 0) {
+      continue;
+    }
+    if (!connect(conn->fd, p->ai_addr, p->ai_addrlen)) {
+      break;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  freeaddrinfo(info);
+
+  if (conn->fd < 0) {
+    return -1;
+  }
+
+  /* Reads wake up now and then to notice the end of the run */
+  setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  conn->pos = conn->len = 0;
+  return 0;
+}
+
+static void conn_close(struct conn *conn)
+{
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+/**
+ * Reads more into the buffer.
+ * @returns bytes read, 0 on end of file, -1 on error or when stopping
+ */
+static int conn_fill(struct conn *conn)
+{
+  double start = now();
+  ssize_t n;
+
+  if (conn->pos == conn->len) {
+    conn->pos = conn->len = 0;
+  }
+
+  while (1) {
+    n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+    if (n >= 0) {
+      conn->len += n;
+      return n;
+    }
+    if ((errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || stop
+     || now() - start > REQUEST_TIMEOUT) {
+      return -1;
+    }
+  }
+}
+
+/** @returns next line without CRLF, or NULL */
+static char *conn_line(struct conn *conn)
+{
+  char *line, *end;
+
+  while (1) {
+    end = memchr(conn->buf + conn->pos, '\n', conn->len - conn->pos);
+    if (end) {
+      line = conn->buf + conn->pos;
+      conn->pos = end - conn->buf + 1;
+      *end = '\0';
+      if (end > line && *(end - 1) == '\r') {
+        *(end - 1) = '\0';
+      }
+      return line;
+    }
+    if (conn->pos > 0) {
+      memmove(conn->buf, conn->buf + conn->pos, conn->len - conn->pos);
+      conn->len -= conn->pos;
+      conn->pos = 0;
+    }
+    if (conn->len == sizeof(conn->buf) || conn_fill(conn) <= 0) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Moves up to @p size bytes of body to @p body, or discards them if it is
+ * NULL.
+ * @returns bytes moved, 0 on end of file, -1 on error
+ */
+static int conn_read(struct conn *conn, struct body *body, size_t size)
+{
+  size_t n;
+  int result;
+
+  if (conn->pos == conn->len && (result = conn_fill(conn)) <= 0) {
+    return result;
+  }
+
+  n = conn->len - conn->pos;
+  if (n > size) {
+    n = size;
+  }
+  if (body) {
+    if (body->size + n + 1 > body->max_size) {
+      body->max_size = (body->size + n + 1) * 2;
+      body->data = realloc(body->data, body->max_size);
+    }
+    memcpy(body->data + body->size, conn->buf + conn->pos, n);
+    body->size += n;
+    body->data[body->size] = '\0';
+  }
+  conn->pos += n;
+  return n;
+}
+
+static int send_request(struct conn *conn, const char *path)
+{
+  char request[4096];
+  int n;
+
+  n = snprintf(request, sizeof(request),
+               "GET %s HTTP/1.1\r\n"
+               "Host: %s\r\n"
+               "%s%s%s"
+               "\r\n",
+               path, host,
+               cookie[0] ? "Cookie: musicd-session=" : "", cookie,
+               cookie[0] ? "\r\n" : "");
+  if (n >= (int)sizeof(request)) {
+    return -1;
+  }
+  return write(conn->fd, request, n) == n ? 0 : -1;
+}
+
+/**
+ * Reads the status line and headers of a response.
+ * @returns status code, or -1 on error
+ */
+static int read_headers(struct conn *conn, int64_t *length, bool *chunked,
+                        bool *keep_alive)
+{
+  char *line, *p;
+  int status;
+
+  *length = -1;
+  *chunked = false;
+  *keep_alive = true;
+
+  line = conn_line(conn);
+  if (!line || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+    return -1;
+  }
+  if (!strncmp(line, "HTTP/1.0", 8)) {
+    *keep_alive = false;
+  }
+
+  while ((line = conn_line(conn)) && line[0] != '\0') {
+    if (!strncasecmp(line, "Content-Length:", 15)) {
+      *length = strtoll(line + 15, NULL, 10);
+    } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+      *chunked = strstr(line, "chunked") != NULL;
+    } else if (!strncasecmp(line, "Connection:", 11)) {
+      *keep_alive = !strstr(line, "close");
+    } else if (!cookie_fixed
+            && !strncasecmp(line, "Set-Cookie: musicd-session=", 27)) {
+      p = line + 27;
+      snprintf(cookie, sizeof(cookie), "%.*s", (int)strcspn(p, ";"), p);
+    }
+  }
+  return line ? status : -1;
+}
+
+/**
+ * Makes a request over @p conn, reconnecting if needed, and records its
+ * latency to @p endpoint.
+ * @returns status code, or -1 on error
+ */
+static int request(struct conn *conn, endpoint_id_t endpoint,
+                   const char *path, struct body *body)
+{
+  double start = now();
+  int64_t length, chunk;
+  bool chunked, keep_alive;
+  int status, n;
+  char *line;
+
+  if (body) {
+    body->size = 0;
+  }
+
+  if ((conn->fd < 0 && conn_open(conn)) || send_request(conn, path)) {
+    /* The server may have closed a kept-alive connection, try once more */
+    conn_close(conn);
+    if (conn_open(conn) || send_request(conn, path)) {
+      goto error;
+    }
+  }
+
+  status = read_headers(conn, &length, &chunked, &keep_alive);
+  if (status < 0) {
+    goto error;
+  }
+
+  if (chunked) {
+    while (1) {
+      line = conn_line(conn);
+      if (!line) {
+        goto error;
+      }
+      chunk = strtoll(line, NULL, 16);
+      if (chunk == 0) {
+        /* Final CRLF */
+        conn_line(conn);
+        break;
+      }
+      for (; chunk > 0; chunk -= n) {
+        if ((n = conn_read(conn, body, chunk)) <= 0) {
+          goto error;
+        }
+      }
+      conn_line(conn);
+    }
+  } else if (length >= 0) {
+    for (; length > 0; length -= n) {
+      if ((n = conn_read(conn, body, length)) <= 0) {
+        goto error;
+      }
+    }
+  } else {
+    while ((n = conn_read(conn, body, SIZE_MAX)) > 0) { }
+    keep_alive = false;
+  }
+
+  if (!keep_alive) {
+    conn_close(conn);
+  }
+  record(endpoint, now() - start, status < 400);
+  return status;
+
+error:
+  conn_close(conn);
+  if (!stop) {
+    record(endpoint, now() - start, false);
+  }
+  return -1;
+}
+
+
+/**
+ * Collects the numbers following @p key in @p json to @p ids.
+ * @returns number of ids found
+ */
+static int find_ids(const char *json, const char *key, int64_t *ids, int max)
+{
+  const char *p = json;
+  size_t key_len = strlen(key);
+  int n = 0;
+  int64_t id;
+
+  while (n < max && (p = strstr(p, key))) {
+    p += key_len;
+    id = strtoll(p, NULL, 10);
+    if (id > 0) {
+      ids[n++] = id;
+    }
+  }
+  return n;
+}
+
+/** @returns value of string @p key in @p json or NULL, must be freed */
+static char *find_string(const char *json, const char *key)
+{
+  const char *p = strstr(json, key), *end;
+  char *result;
+
+  if (!p) {
+    return NULL;
+  }
+  p += strlen(key);
+  end = strchr(p, '"');
+  if (!end) {
+    return NULL;
+  }
+  result = malloc(end - p + 1);
+  memcpy(result, p, end - p);
+  result[end - p] = '\0';
+  return result;
+}
+
+/** @returns @p text percent-encoded for a query string, must be freed */
+static char *encode(const char *text)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char *result = malloc(strlen(text) * 3 + 1), *p = result;
+
+  for (; *text != '\0'; ++text) {
+    if ((*text >= 'a' && *text <= 'z') || (*text >= 'A' && *text <= 'Z')
+     || (*text >= '0' && *text <= '9')) {
+      *p++ = *text;
+    } else {
+      *p++ = '%';
+      *p++ = hex[(unsigned char)*text >> 4];
+      *p++ = hex[(unsigned char)*text & 0xf];
+    }
+  }
+  *p = '\0';
+  return result;
+}
+
+/**
+ * Fetches random tracks and albums to pick ids and search words from.
+ */
+static int discover(struct conn *conn)
+{
+  struct body body = { NULL, 0, 0 };
+  char path[256];
+  const char *p;
+  char *title;
+  size_t len;
+
+  snprintf(path, sizeof(path), "/tracks?sort=random&seed=%ld&limit=%d",
+           (long)time(NULL), MAX_IDS);
+  if (request(conn, EP_TRACKS, path, &body) != 200) {
+    fprintf(stderr, "can't fetch tracks from %s:%s\n", host, port);
+    free(body.data);
+    return -1;
+  }
+  nb_tracks = find_ids(body.data, "\"id\":", track_ids, MAX_IDS);
+
+  /* First word of titles for searches */
+  for (p = body.data; nb_words < MAX_WORDS
+       && (title = find_string(p, "\"title\":\"")); ) {
+    len = strcspn(title, " \\");
+    if (len >= 3) {
+      title[len] = '\0';
+      words[nb_words++] = encode(title);
+    }
+    free(title);
+    p = strstr(p, "\"title\":\"") + 9;
+  }
+
+  snprintf(path, sizeof(path), "/albums?limit=%d", MAX_IDS);
+  if (request(conn, EP_ALBUMS, path, &body) == 200) {
+    nb_images = find_ids(body.data, "\"image\":", image_ids, MAX_IDS);
+  }
+
+  free(body.data);
+  return 0;
+}
+
+
+/**
+ * Listener playing one stream after another. The stream is played in real
+ * time once PREBUFFER seconds of it have been received, and running out of
+ * received data while playing is an underrun.
+ */
+static void *listener_func(void *data)
+{
+  struct conn conn = { .fd = -1 };
+  unsigned int seed = (uintptr_t)data;
+  char path[128];
+  double start, rate, play_start = 0, played, played_base = 0;
+  int64_t length, received;
+  bool chunked, keep_alive, playing;
+  int bitrate, n;
+
+  while (!stop) {
+    bitrate = bitrates[rand_r(&seed) % (sizeof(bitrates) / sizeof(int))];
+    rate = bitrate / 8.0;
+    snprintf(path, sizeof(path), "/open?id=%" PRId64 "&bitrate=%d",
+             track_ids[rand_r(&seed) % nb_tracks], bitrate);
+
+    start = now();
+    if (conn_open(&conn) || send_request(&conn, path)
+     || read_headers(&conn, &length, &chunked, &keep_alive) != 200) {
+      conn_close(&conn);
+      if (stop) {
+        break;
+      }
+      record(EP_OPEN, 0, false);
+      pthread_mutex_lock(&stream_mutex);
+      ++streams_failed;
+      pthread_mutex_unlock(&stream_mutex);
+      sleep(1);
+      continue;
+    }
+
+    pthread_mutex_lock(&stream_mutex);
+    ++streams_opened;
+    pthread_mutex_unlock(&stream_mutex);
+
+    /* Chunk framing is counted as audio, close enough for buffering */
+    received = 0;
+    playing = false;
+    while (!stop && (n = conn_read(&conn, NULL, SIZE_MAX)) > 0) {
+      if (received == 0) {
+        record(EP_OPEN, now() - start, true);
+      }
+
+      if (playing) {
+        played = played_base + (now() - play_start) * rate;
+        if (played > received) {
+          /* Ran dry before this data arrived */
+          pthread_mutex_lock(&stream_mutex);
+          ++underruns;
+          pthread_mutex_unlock(&stream_mutex);
+          playing = false;
+          played_base = received;
+        }
+      }
+
+      received += n;
+      if (!playing && received - played_base >= rate * PREBUFFER) {
+        playing = true;
+        play_start = now();
+      }
+    }
+
+    pthread_mutex_lock(&stream_mutex);
+    stream_bytes += received;
+    pthread_mutex_unlock(&stream_mutex);
+
+    conn_close(&conn);
+    played_base = 0;
+  }
+
+  return NULL;
+}
+
+static void browse_tracks(struct conn *conn, struct body *body,
+                          unsigned int *seed)
+{
+  static const char *sorts[] = {
+    "artist,album,track", "title", "-duration", "album,track", "random"
+  };
+  char path[2048], *cursor;
+  int pages = 1 + rand_r(seed) % 4;
+
+  snprintf(path, sizeof(path), "/tracks?limit=50&sort=%s&seed=%u",
+           sorts[rand_r(seed) % (sizeof(sorts) / sizeof(char *))], *seed);
+  if (request(conn, EP_TRACKS, path, body) != 200) {
+    return;
+  }
+
+  /* Scrolling down follows the cursor */
+  while (--pages > 0 && (cursor = find_string(body->data, "\"cursor\":\""))) {
+    snprintf(path + strlen(path), sizeof(path) - strlen(path) - 1,
+             "&cursor=%s", cursor);
+    free(cursor);
+    request(conn, EP_TRACKS_PAGE, path, body);
+    /* Reuse the base path for the next page */
+    *strstr(path, "&cursor=") = '\0';
+  }
+}
+
+static void browse_images(struct conn *conn, unsigned int *seed)
+{
+  char path[4096];
+  size_t len;
+  int i;
+
+  if (nb_images == 0) {
+    return;
+  }
+
+  if (rand_r(seed) % 2) {
+    /* A grid of single requests like a browser would make */
+    for (i = 0; i < GRID_SIZE && !stop; ++i) {
+      snprintf(path, sizeof(path), "/image?id=%" PRId64 "&size=128",
+               image_ids[rand_r(seed) % nb_images]);
+      request(conn, EP_IMAGE, path, NULL);
+    }
+    return;
+  }
+
+  len = snprintf(path, sizeof(path), "/images?size=128&id=");
+  for (i = 0; i < GRID_SIZE; ++i) {
+    len += snprintf(path + len, sizeof(path) - len, "%s%" PRId64,
+                    i > 0 ? "," : "", image_ids[rand_r(seed) % nb_images]);
+  }
+  request(conn, EP_IMAGES, path, NULL);
+}
+
+static void *user_func(void *data)
+{
+  struct conn conn = { .fd = -1 };
+  struct body body = { NULL, 0, 0 };
+  unsigned int seed = (uintptr_t)data;
+  char path[256];
+  int action;
+
+  while (!stop) {
+    action = rand_r(&seed) % 100;
+    if (action < 30) {
+      browse_tracks(&conn, &body, &seed);
+    } else if (action < 45) {
+      request(&conn, EP_ALBUMS, "/albums?limit=100", &body);
+    } else if (action < 65) {
+      browse_images(&conn, &seed);
+    } else if (action < 80) {
+      snprintf(path, sizeof(path), "/track/index?id=%" PRId64 "&sort=title",
+               track_ids[rand_r(&seed) % nb_tracks]);
+      request(&conn, EP_TRACK_INDEX, path, &body);
+    } else if (nb_words > 0) {
+      snprintf(path, sizeof(path), "/tracks?%s=%s&limit=50",
+               rand_r(&seed) % 2 ? "text" : "search",
+               words[rand_r(&seed) % nb_words]);
+      request(&conn, EP_SEARCH, path, &body);
+    }
+
+    if (think_ms > 0) {
+      usleep((think_ms / 2 + rand_r(&seed) % (think_ms + 1)) * 1000);
+    }
+  }
+
+  conn_close(&conn);
+  free(body.data);
+  return NULL;
+}
+
+
+/** @returns CPU seconds used by @p pid so far, or -1 */
+static double process_cpu(pid_t pid)
+{
+  char path[64], buf[1024], *p;
+  unsigned long utime, stime;
+  FILE *file;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  p = fgets(buf, sizeof(buf), file);
+  fclose(file);
+
+  /* Skip past the command, which may contain spaces */
+  if (!p || !(p = strrchr(buf, ')'))
+   || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime, &stime) != 2) {
+    return -1;
+  }
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/** @returns resident set size of @p pid in kB, or -1 */
+static long process_rss(pid_t pid)
+{
+  char path[64], line[256];
+  long rss = -1;
+  FILE *file;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    if (!strncmp(line, "VmRSS:", 6)) {
+      rss = strtol(line + 6, NULL, 10);
+      break;
+    }
+  }
+  fclose(file);
+  return rss;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct endpoint *endpoint, double p)
+{
+  size_t i = p * (endpoint->nb_samples - 1) + 0.5;
+  return endpoint->samples[i] * 1000;
+}
+
+static void report(double wall)
+{
+  struct endpoint *endpoint;
+  int i;
+
+  printf("\n%-18s %8s %7s %8s %8s %8s %8s\n",
+         "endpoint", "requests", "errors", "req/s", "p50 ms", "p99 ms",
+         "max ms");
+
+  for (i = 0; i < EP_COUNT; ++i) {
+    endpoint = &endpoints[i];
+    if (endpoint->nb_samples == 0 && endpoint->errors == 0) {
+      continue;
+    }
+    printf("%-18s %8zu %7d %8.1f ", endpoint->name, endpoint->nb_samples,
+           endpoint->errors, endpoint->nb_samples / wall);
+    if (endpoint->nb_samples == 0) {
+      printf("%8s %8s %8s\n", "-", "-", "-");
+      continue;
+    }
+    qsort(endpoint->samples, endpoint->nb_samples, sizeof(double),
+          compare_doubles);
+    printf("%8.1f %8.1f %8.1f\n", percentile(endpoint, 0.5),
+           percentile(endpoint, 0.99), percentile(endpoint, 1));
+  }
+
+  if (nb_listeners > 0) {
+    printf("\nstreams: %d opened, %d failed, %d underruns, %.1f MB received\n",
+           streams_opened, streams_failed, underruns,
+           stream_bytes / (1024.0 * 1024.0));
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -h host    server host (default 127.0.0.1)\n"
+          "  -p port    server port (default 6800)\n"
+          "  -U user    user name to log in with\n"
+          "  -P pass    password to log in with\n"
+          "  -n N       concurrent listeners streaming with /open (default 4)\n"
+          "  -m M       users browsing (default 8)\n"
+          "  -d secs    duration of the run (default 30)\n"
+          "  -t ms      average think time between browse actions (default "
+          "500)\n"
+          "  -r secs    start a rescan this far into the run\n"
+          "  -x pid     server process to measure CPU time and RSS of\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  struct conn conn = { .fd = -1 };
+  const char *user = NULL, *password = NULL;
+  pthread_t *threads;
+  char path[512];
+  double start, cpu_start = -1, cpu_end;
+  long rss, rss_start = -1, rss_peak = -1;
+  int opt, i, nb_threads = 0;
+
+  while ((opt = getopt(argc, argv, "h:p:U:P:n:m:d:t:r:x:")) != -1) {
+    switch (opt) {
+    case 'h': host = optarg; break;
+    case 'p': port = optarg; break;
+    case 'U': user = optarg; break;
+    case 'P': password = optarg; break;
+    case 'n': nb_listeners = atoi(optarg); break;
+    case 'm': nb_users = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    case 't': think_ms = atoi(optarg); break;
+    case 'r': rescan_at = atoi(optarg); break;
+    case 'x': server_pid = atoi(optarg); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  for (i = 0; i < EP_COUNT; ++i) {
+    pthread_mutex_init(&endpoints[i].mutex, NULL);
+  }
+
+  if (user && password) {
+    snprintf(path, sizeof(path), "/auth?user=%s&password=%s", user, password);
+    if (request(&conn, EP_TRACKS, path, NULL) != 200 || !cookie[0]) {
+      fprintf(stderr, "can't log in as %s\n", user);
+      return 1;
+    }
+  }
+
+  if (discover(&conn)) {
+    return 1;
+  }
+  conn_close(&conn);
+  if (nb_tracks == 0) {
+    fprintf(stderr, "the library has no tracks\n");
+    return 1;
+  }
+
+  printf("%d listeners, %d users for %d s against %s:%s, %d tracks and %d "
+         "images to pick from\n",
+         nb_listeners, nb_users, duration, host, port, nb_tracks, nb_images);
+
+  /* Discovery isn't part of the results */
+  for (i = 0; i < EP_COUNT; ++i) {
+    endpoints[i].nb_samples = 0;
+    endpoints[i].errors = 0;
+  }
+
+  if (server_pid > 0) {
+    cpu_start = process_cpu(server_pid);
+    rss_start = rss_peak = process_rss(server_pid);
+    if (cpu_start < 0) {
+      fprintf(stderr, "can't read /proc of process %d\n", (int)server_pid);
+    }
+  }
+
+  /* Threads share the session from discovery and only read it */
+  cookie_fixed = true;
+  threads = malloc(sizeof(pthread_t) * (nb_listeners + nb_users));
+  start = now();
+  for (i = 0; i < nb_listeners; ++i) {
+    pthread_create(&threads[nb_threads++], NULL, listener_func,
+                   (void *)(uintptr_t)(i * 7919 + start));
+  }
+  for (i = 0; i < nb_users; ++i) {
+    pthread_create(&threads[nb_threads++], NULL, user_func,
+                   (void *)(uintptr_t)(i * 104729 + start));
+  }
+
+  for (i = 0; i < duration; ++i) {
+    sleep(1);
+    if (i + 1 == rescan_at) {
+      printf("starting rescan\n");
+      request(&conn, EP_RESCAN, "/rescan", NULL);
+      conn_close(&conn);
+    }
+    if (server_pid > 0 && (rss = process_rss(server_pid)) > rss_peak) {
+      rss_peak = rss;
+    }
+  }
+
+  stop = 1;
+  for (i = 0; i < nb_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  report(now() - start);
+
+  if (cpu_start >= 0 && (cpu_end = process_cpu(server_pid)) >= 0) {
+    printf("server: %.1f cpu s, %.0f%% of one cpu, rss %ld kB at start, "
+           "%ld kB peak\n",
+           cpu_end - cpu_start, (cpu_end - cpu_start) / (now() - start) * 100,
+           rss_start, rss_peak);
+  }
+
+  for (i = 0; i < nb_words; ++i) {
+    free(words[i]);
+  }
+  return 0;
+}